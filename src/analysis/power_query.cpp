@@ -88,15 +88,18 @@ bool PowerQuery::LoadQueryResultToWorksheet(const std::string& queryName, std::s
         return false;
     }
 
-    // Write the query result data to the worksheet starting from startCell
-    CellReference currentCell = startCell;
-    for (const auto& row : result.GetData()) {
-        for (const auto& cellValue : row) {
-            worksheet->SetCellValue(currentCell, cellValue);
-            currentCell = currentCell.OffsetColumn(1);
+    // Write the query result data to the worksheet starting from startCell,
+    // as one batch so dependent formulas are recalculated once at the end
+    m_dataManager->ExecuteBatch([&]() {
+        CellReference currentCell = startCell;
+        for (const auto& row : result.GetData()) {
+            for (const auto& cellValue : row) {
+                m_dataManager->SetCellValue(worksheet, currentCell, cellValue);
+                currentCell = currentCell.OffsetColumn(1);
+            }
+            currentCell = CellReference(currentCell.GetRow() + 1, startCell.GetColumn());
         }
-        currentCell = CellReference(currentCell.GetRow() + 1, startCell.GetColumn());
-    }
+    });
 
     // Apply any formatting specified in the query result
     // (This step would require additional implementation details)
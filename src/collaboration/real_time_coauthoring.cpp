@@ -129,16 +129,17 @@ std::string GenerateSessionId() {
 }
 
 void ApplyChanges(std::shared_ptr<Workbook> workbook, const std::vector<Change>& changes) {
-    for (const auto& change : changes) {
-        // Identify the affected cell or range
-        CellReference cellRef = change.getCellReference();
-        
-        // Apply the change using DataManager
-        m_dataManager->UpdateCell(workbook, cellRef, change.getNewValue());
-        
-        // Update any dependent cells or formulas
-        m_dataManager->UpdateDependentCells(workbook, cellRef);
-    }
+    // Apply all changes as one batch; dependent cells and formulas are
+    // updated once when the batch commits
+    m_dataManager->ExecuteBatch([&]() {
+        for (const auto& change : changes) {
+            // Identify the affected cell or range
+            CellReference cellRef = change.getCellReference();
+
+            // Apply the change using DataManager
+            m_dataManager->UpdateCell(workbook, cellRef, change.getNewValue());
+        }
+    });
 
     // Notify the UI to refresh the affected areas
     // This is a placeholder and should be implemented based on your specific UI framework
@@ -180,15 +180,15 @@ void ApplyChangeSet(std::shared_ptr<Workbook> workbook, const ChangeSet& changeS
     // Clear the current content of the workbook
     workbook->Clear();
 
-    // Iterate through the changes in the ChangeSet
-    for (const auto& [cellRef, cellValue] : changeSet.GetChanges()) {
-        // For each change, apply it to the corresponding cell
-        m_dataManager->UpdateCell(workbook, cellRef, cellValue);
-    }
+    // Apply the changes as one batch; formulas affected by any of them are
+    // recalculated once when the batch commits
+    m_dataManager->ExecuteBatch([&]() {
+        for (const auto& [cellRef, cellValue] : changeSet.GetChanges()) {
+            // For each change, apply it to the corresponding cell
+            m_dataManager->UpdateCell(workbook, cellRef, cellValue);
+        }
+    });
 
     // Update workbook-level properties and settings
     workbook->SetProperties(changeSet.GetWorkbookProperties());
-
-    // Recalculate any formulas affected by the changes
-    workbook->RecalculateFormulas();
 }
\ No newline at end of file
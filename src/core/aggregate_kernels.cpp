@@ -0,0 +1,294 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include "aggregate_kernels.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EXCEL_AGGREGATE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// Functions compiled for AVX2 regardless of the baseline target; they are only
+// called after runtime detection confirms the CPU and OS support AVX2
+#if defined(__GNUC__) || defined(__clang__)
+#define EXCEL_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define EXCEL_TARGET_AVX2
+#endif
+
+// Global constants
+const double POSITIVE_INFINITY = std::numeric_limits<double>::infinity();
+const double NEGATIVE_INFINITY = -std::numeric_limits<double>::infinity();
+
+// Contiguous numeric view of a range argument. values holds one double per
+// cell in column-major order, as CellStore::ForEachInRange visits them, so
+// spans of equally shaped ranges pair up element by element; valid[i] is 1
+// where the cell held a number and 0 where it held text, a boolean or
+// nothing, in which case values[i] is 0.0.
+struct NumericSpan {
+    const double* values;
+    const uint8_t* valid;
+    size_t count;
+};
+
+// Kernel set selected once per process. min and max return +inf and -inf
+// respectively when no element is valid.
+struct AggregateKernels {
+    const char* name;
+    double (*sum)(const double* values, size_t count);
+    size_t (*count)(const uint8_t* valid, size_t count);
+    double (*min)(const double* values, const uint8_t* valid, size_t count);
+    double (*max)(const double* values, const uint8_t* valid, size_t count);
+    double (*dot)(const double* a, const double* b, size_t count);
+};
+
+// Portable kernels, also used for the tails of the vector kernels
+namespace scalar_kernels {
+
+double Sum(const double* values, size_t count) {
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        total += values[i];
+    }
+    return total;
+}
+
+size_t Count(const uint8_t* valid, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += valid[i];
+    }
+    return total;
+}
+
+double Min(const double* values, const uint8_t* valid, size_t count) {
+    double result = POSITIVE_INFINITY;
+    for (size_t i = 0; i < count; ++i) {
+        if (valid[i] && values[i] < result) {
+            result = values[i];
+        }
+    }
+    return result;
+}
+
+double Max(const double* values, const uint8_t* valid, size_t count) {
+    double result = NEGATIVE_INFINITY;
+    for (size_t i = 0; i < count; ++i) {
+        if (valid[i] && values[i] > result) {
+            result = values[i];
+        }
+    }
+    return result;
+}
+
+double Dot(const double* a, const double* b, size_t count) {
+    double total = 0.0;
+    for (size_t i = 0; i < count; ++i) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+} // namespace scalar_kernels
+
+#ifdef EXCEL_AGGREGATE_X86
+
+// SSE2 kernels; SSE2 is part of the x86-64 baseline so these need no detection
+namespace sse2_kernels {
+
+// Expands two validity bytes into a lane mask
+inline __m128d LoadMask2(const uint8_t* valid) {
+    return _mm_castsi128_pd(_mm_set_epi64x(-static_cast<int64_t>(valid[1] != 0), -static_cast<int64_t>(valid[0] != 0)));
+}
+
+inline double HorizontalSum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+double Sum(const double* values, size_t count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+    }
+    return HorizontalSum(_mm_add_pd(acc0, acc1)) + scalar_kernels::Sum(values + i, count - i);
+}
+
+size_t Count(const uint8_t* valid, size_t count) {
+    // Validity bytes are 0 or 1, so a sum of absolute differences against zero counts them
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(valid + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    return static_cast<size_t>(lanes[0] + lanes[1]) + scalar_kernels::Count(valid + i, count - i);
+}
+
+double Min(const double* values, const uint8_t* valid, size_t count) {
+    const __m128d fill = _mm_set1_pd(POSITIVE_INFINITY);
+    __m128d acc = fill;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d mask = LoadMask2(valid + i);
+        __m128d v = _mm_or_pd(_mm_and_pd(mask, _mm_loadu_pd(values + i)), _mm_andnot_pd(mask, fill));
+        acc = _mm_min_pd(acc, v);
+    }
+    double result = std::min(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    return std::min(result, scalar_kernels::Min(values + i, valid + i, count - i));
+}
+
+double Max(const double* values, const uint8_t* valid, size_t count) {
+    const __m128d fill = _mm_set1_pd(NEGATIVE_INFINITY);
+    __m128d acc = fill;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d mask = LoadMask2(valid + i);
+        __m128d v = _mm_or_pd(_mm_and_pd(mask, _mm_loadu_pd(values + i)), _mm_andnot_pd(mask, fill));
+        acc = _mm_max_pd(acc, v);
+    }
+    double result = std::max(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    return std::max(result, scalar_kernels::Max(values + i, valid + i, count - i));
+}
+
+double Dot(const double* a, const double* b, size_t count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    return HorizontalSum(_mm_add_pd(acc0, acc1)) + scalar_kernels::Dot(a + i, b + i, count - i);
+}
+
+} // namespace sse2_kernels
+
+// AVX2 kernels: four doubles per register, two accumulators to hide add latency
+namespace avx2_kernels {
+
+// Expands four validity bytes into a lane mask
+EXCEL_TARGET_AVX2 inline __m256d LoadMask4(const uint8_t* valid) {
+    int32_t bytes;
+    std::memcpy(&bytes, valid, sizeof(bytes));
+    __m256i wide = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+    return _mm256_castsi256_pd(_mm256_cmpgt_epi64(wide, _mm256_setzero_si256()));
+}
+
+EXCEL_TARGET_AVX2 inline double HorizontalSum(__m256d v) {
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+EXCEL_TARGET_AVX2 double Sum(const double* values, size_t count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+    }
+    return HorizontalSum(_mm256_add_pd(acc0, acc1)) + scalar_kernels::Sum(values + i, count - i);
+}
+
+EXCEL_TARGET_AVX2 size_t Count(const uint8_t* valid, size_t count) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(valid + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    return static_cast<size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + scalar_kernels::Count(valid + i, count - i);
+}
+
+EXCEL_TARGET_AVX2 double Min(const double* values, const uint8_t* valid, size_t count) {
+    const __m256d fill = _mm256_set1_pd(POSITIVE_INFINITY);
+    __m256d acc = fill;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc = _mm256_min_pd(acc, _mm256_blendv_pd(fill, _mm256_loadu_pd(values + i), LoadMask4(valid + i)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double result = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    return std::min(result, scalar_kernels::Min(values + i, valid + i, count - i));
+}
+
+EXCEL_TARGET_AVX2 double Max(const double* values, const uint8_t* valid, size_t count) {
+    const __m256d fill = _mm256_set1_pd(NEGATIVE_INFINITY);
+    __m256d acc = fill;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc = _mm256_max_pd(acc, _mm256_blendv_pd(fill, _mm256_loadu_pd(values + i), LoadMask4(valid + i)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    return std::max(result, scalar_kernels::Max(values + i, valid + i, count - i));
+}
+
+EXCEL_TARGET_AVX2 double Dot(const double* a, const double* b, size_t count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    return HorizontalSum(_mm256_add_pd(acc0, acc1)) + scalar_kernels::Dot(a + i, b + i, count - i);
+}
+
+} // namespace avx2_kernels
+
+// Checks that the CPU implements AVX2 and that the OS saves YMM state
+static bool CpuSupportsAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // EXCEL_AGGREGATE_X86
+
+// Returns the fastest kernel set supported by the running CPU
+const AggregateKernels& GetAggregateKernels() {
+    static const AggregateKernels kernels = []() -> AggregateKernels {
+#ifdef EXCEL_AGGREGATE_X86
+        if (CpuSupportsAvx2()) {
+            return {"avx2", avx2_kernels::Sum, avx2_kernels::Count, avx2_kernels::Min, avx2_kernels::Max, avx2_kernels::Dot};
+        }
+        return {"sse2", sse2_kernels::Sum, sse2_kernels::Count, sse2_kernels::Min, sse2_kernels::Max, sse2_kernels::Dot};
+#else
+        return {"scalar", scalar_kernels::Sum, scalar_kernels::Count, scalar_kernels::Min, scalar_kernels::Max, scalar_kernels::Dot};
+#endif
+    }();
+    return kernels;
+}
+
+// Returns the portable kernel set, used to cross-check the vector kernels
+const AggregateKernels& GetScalarAggregateKernels() {
+    static const AggregateKernels kernels = {
+        "scalar", scalar_kernels::Sum, scalar_kernels::Count, scalar_kernels::Min, scalar_kernels::Max, scalar_kernels::Dot};
+    return kernels;
+}
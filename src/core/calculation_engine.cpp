@@ -1,137 +1,3360 @@
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
 #include "excel_types.h"
+#include "cell_value.h"
+#include "cell_store.h"
 #include "function_library.h"
 #include "dependency_graph.h"
+#include "formula_compiler.h"
+#include "thread_pool.h"
+#include "aggregate_kernels.h"
+#include "lookup_index.h"
+#include "criteria_index.h"
+#include "recalc_profiler.h"
 
 // Global constants
 const int MAX_ITERATION_COUNT = 1000;
 const double EPSILON = 1e-10;
+const size_t DEFAULT_CALCULATION_THREADS = 8;      // performance.max_threads in app_config.json
+const size_t PARALLEL_RECALC_THRESHOLD = 1024;     // smaller recalcs stay on the calling thread
+const size_t PARALLEL_RECALC_GRAIN_SIZE = 256;
+const size_t MIN_VECTORIZED_BLOCK_SIZE = 8;        // shorter template runs use the scalar interpreter
+const size_t MAX_LOOKUP_INDEXES = 256;             // the lookup-index cache is flushed beyond this
+const size_t MAX_CRITERIA_INDEXES = 32;            // likewise for criteria indexes
+const size_t BACKGROUND_CLOCK_CHECK_INTERVAL = 64; // cells evaluated between time-budget checks
+const int32_t MAX_SPILL_ROW = 1048576;
+const int32_t MAX_SPILL_COLUMN = 16384;
+const size_t MAX_ARRAY_ELEMENTS = 1u << 26;        // larger intermediate arrays evaluate to #NUM!
+const uint32_t CALC_CHAIN_MAGIC = 0x4E484343;      // "CCHN"
+const uint32_t CALC_CHAIN_VERSION = 1;
+const uint64_t SUBEXPRESSION_MEMO_MIN_CELLS = 256; // calls reading fewer cells are cheaper to repeat
+const size_t MAX_SUBEXPRESSION_MEMO_ENTRIES = 65536;
+
+// Automatic recalculates every dependent as part of each edit. Lazy only
+// marks dependents dirty; they are computed when read, when they scroll into
+// view, or by the idle-time background pass.
+enum class CalculationMode {
+    Automatic,
+    Lazy
+};
+
+// Thrown when a recalculation reaches a circular reference while iterative
+// calculation is disabled. GetCells lists every cell of the cycle.
+class CircularReferenceException : public std::runtime_error {
+private:
+    std::vector<CellReference> m_cells;
+
+public:
+    explicit CircularReferenceException(std::vector<CellReference> cells)
+        : std::runtime_error(FormatMessage(cells)), m_cells(std::move(cells)) {}
+
+    const std::vector<CellReference>& GetCells() const {
+        return m_cells;
+    }
+
+private:
+    static std::string FormatMessage(const std::vector<CellReference>& cells) {
+        std::string message = "Circular reference detected between ";
+        for (size_t i = 0; i < cells.size(); ++i) {
+            message += (i > 0 ? ", " : "") + cells[i].ToString();
+        }
+        return message;
+    }
+};
+
+// Counters of the per-pass subexpression memo, cumulative since the engine
+// was created. Only calls eligible for the memo are counted.
+struct SubexpressionMemoStatistics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+struct CellRectListHash {
+    size_t operator()(const std::vector<CellRect>& rects) const {
+        size_t hash = rects.size();
+        for (const auto& rect : rects) {
+            hash = hash * 0x100000001B3ULL ^ CellRectHash()(rect);
+        }
+        return hash;
+    }
+};
 
 class CalculationEngine {
 private:
     FunctionLibrary m_functionLibrary;
     DependencyGraph m_dependencyGraph;
-    std::unordered_map<CellReference, CellValue> m_cellValues;
+    std::shared_ptr<CellStore> m_cellValues;
+    FormulaCache m_formulaCache;
+    std::unordered_map<CellReference, const CompiledFormula*> m_cellPrograms;
+
+    std::unique_ptr<ThreadPool> m_threadPool;
+    bool m_multithreadedCalculation;
+
+    // When set, cycles are converged by repeated evaluation instead of
+    // raising CircularReferenceException
+    bool m_iterativeCalculation;
+
+    // Lazy mode: formula cells whose value is out of date, and the snapshot of
+    // them the background pass is working through
+    CalculationMode m_calculationMode;
+    std::unordered_set<CellReference> m_dirtyCells;
+    std::vector<CellReference> m_backgroundQueue;
+
+    // Cooperative interruption. CancelCalculation may set m_cancelRequested
+    // from any thread; recalculation checks it, and the time slice given to
+    // automatic recalculations, between units of work. Cells left unfinished
+    // join m_dirtyCells and are resumed like lazy-mode work.
+    std::atomic<bool> m_cancelRequested;
+    std::chrono::steady_clock::duration m_recalculationTimeSlice;
+
+    // Batch updates: nesting depth and the distinct cells written since the
+    // outermost BeginBatch, in first-write order
+    size_t m_batchDepth;
+    std::vector<CellReference> m_batchChanges;
+    std::unordered_set<CellReference> m_batchChangedCells;
+
+    // Lookup indexes keyed by the row or column they index. m_lookupRanges maps
+    // changed cells back to the indexes covering them; m_lookupIndexMutex
+    // guards lazy builds from parallel recalculation.
+    struct LookupIndexEntry {
+        uint32_t id;
+        std::shared_ptr<const LookupIndex> index;
+    };
+    std::unordered_map<CellRect, LookupIndexEntry, CellRectHash> m_lookupIndexes;
+    std::vector<CellRect> m_lookupIndexRects;
+    RangeIndex m_lookupRanges;
+    std::mutex m_lookupIndexMutex;
+
+    // Criteria indexes for SUMIFS, COUNTIFS and AVERAGEIFS keyed by their
+    // criteria ranges in sheet order. Unlike lookup indexes they are updated
+    // in place as cells change; m_criteriaIndexMutex guards lazy builds.
+    std::unordered_map<std::vector<CellRect>, std::shared_ptr<CriteriaIndex>, CellRectListHash> m_criteriaIndexes;
+    std::mutex m_criteriaIndexMutex;
+
+    // Dynamic array anchors whose spill range is blocked by other content;
+    // their intended range stays registered in the dependency graph
+    std::unordered_set<CellReference> m_blockedSpills;
+
+    // Calc chain restored by RestoreCalcChain and not yet checked against the
+    // formulas; empty once VerifyCalcChain has run
+    std::vector<CellReference> m_restoredCalcOrder;
+    uint64_t m_restoredCalcChainChecksum;
+
+    // Results of function calls over large ranges, keyed by the function and
+    // its evaluated arguments (see BuildMemoKey), so that the same
+    // subexpression written in many formulas is computed once per pass. Only
+    // filled while m_subexpressionMemoActive, i.e. inside a SubexpressionMemoPass,
+    // and cleared at its end.
+    bool m_subexpressionMemoActive;
+    std::unordered_map<std::string, CellValue> m_subexpressionMemo;
+    std::mutex m_subexpressionMemoMutex;
+    std::atomic<uint64_t> m_subexpressionMemoHits;
+    std::atomic<uint64_t> m_subexpressionMemoMisses;
+
+    // Opt-in profiling, see EnableProfiling. m_activeProfiler is only set
+    // while a profiled recalculation runs, so that evaluation tests a single
+    // pointer and costs nothing extra when profiling is off.
+    std::shared_ptr<RecalcProfiler> m_profiler;
+    std::string m_profiledSheetName;
+    RecalcProfiler* m_activeProfiler;
+
+    // Intermediate or final dynamic array, column-major like positional
+    // spans. Arrays of numbers are kept as plain doubles so that array
+    // arithmetic runs as tight loops; any other array keeps CellValues.
+    struct ArrayValue {
+        int32_t rows = 0;
+        int32_t columns = 0;
+        bool numeric = true;
+        std::vector<double> numbers;
+        std::vector<CellValue> values;
+
+        size_t Size() const {
+            return static_cast<size_t>(rows) * columns;
+        }
+
+        CellValue At(size_t index) const {
+            return numeric ? CellValue(numbers[index]) : values[index];
+        }
+
+        CellValue At(int32_t row, int32_t column) const {
+            return At(static_cast<size_t>(column) * rows + row);
+        }
+
+        void Reset(int32_t rowCount, int32_t columnCount, bool isNumeric) {
+            rows = rowCount;
+            columns = columnCount;
+            numeric = isNumeric;
+            numbers.clear();
+            values.clear();
+            if (numeric) {
+                numbers.resize(Size());
+            } else {
+                values.resize(Size());
+            }
+        }
+    };
+
+    // Operand stack entry for the bytecode interpreter; range is set for
+    // PushRange operands and array for array results, whose value is #VALUE!
+    // for consumers that only accept scalars
+    struct EvalSlot {
+        CellValue value;
+        const RangeOperand* range = nullptr;
+        const ArrayValue* array = nullptr;
+        bool fromReference = false;     // value was read from a single cell reference, as in SUM(A1)
+    };
+
+    // Per-thread interpreter buffers, reused across evaluations
+    struct EvalScratch {
+        std::vector<EvalSlot> stack;
+        std::vector<CellValue> arguments;
+        std::vector<std::vector<double>> lanes;
+        std::vector<uint8_t> fallback;
+        std::vector<double> spanValues;
+        std::vector<uint8_t> spanValid;
+        std::vector<double> productValues;
+        std::vector<std::unique_ptr<ArrayValue>> arrays;   // reused across evaluations
+        size_t arraysInUse = 0;
+        std::string memoKey;
+    };
+
+    // Aggregates evaluated directly on numeric spans instead of through FunctionLibrary
+    enum class AggregateFunction {
+        None,
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+        SumProduct
+    };
+
+    static EvalScratch& GetEvalScratch() {
+        thread_local EvalScratch scratch;
+        return scratch;
+    }
+
+    // Turns the subexpression memo on, or off when enabled is false, for the
+    // lifetime of the scope. The memo starts empty and is cleared again on
+    // exit, so entries never outlive the pass that computed them.
+    class SubexpressionMemoPass {
+    private:
+        CalculationEngine& m_engine;
+        bool m_previous;
+
+    public:
+        SubexpressionMemoPass(CalculationEngine& engine, bool enabled)
+            : m_engine(engine), m_previous(engine.m_subexpressionMemoActive) {
+            m_engine.ClearSubexpressionMemo();
+            m_engine.m_subexpressionMemoActive = enabled;
+        }
+
+        ~SubexpressionMemoPass() {
+            m_engine.ClearSubexpressionMemo();
+            m_engine.m_subexpressionMemoActive = m_previous;
+        }
+
+        SubexpressionMemoPass(const SubexpressionMemoPass&) = delete;
+        SubexpressionMemoPass& operator=(const SubexpressionMemoPass&) = delete;
+    };
+
+    // Profiles one call of a public entry point that recalculates, when
+    // profiling is enabled. Entry points reached from another one belong to
+    // the outer profile.
+    class ProfiledRecalc {
+    private:
+        CalculationEngine& m_engine;
+        bool m_outermost;
+
+    public:
+        explicit ProfiledRecalc(CalculationEngine& engine)
+            : m_engine(engine), m_outermost(engine.m_profiler && !engine.m_activeProfiler) {
+            if (m_outermost) {
+                m_engine.m_profiler->BeginRecalc(m_engine.m_profiledSheetName);
+                m_engine.m_activeProfiler = m_engine.m_profiler.get();
+            }
+        }
+
+        ~ProfiledRecalc() {
+            if (m_outermost) {
+                m_engine.m_activeProfiler = nullptr;
+                m_engine.m_profiler->EndRecalc();
+            }
+        }
+
+        ProfiledRecalc(const ProfiledRecalc&) = delete;
+        ProfiledRecalc& operator=(const ProfiledRecalc&) = delete;
+    };
+
+    // Adds the lifetime of the scope to a phase of the running profile
+    class ProfiledPhase {
+    private:
+        RecalcProfiler* m_profiler;
+        RecalcPhase m_phase;
+        uint64_t m_start;
+
+    public:
+        ProfiledPhase(const CalculationEngine& engine, RecalcPhase phase)
+            : m_profiler(engine.m_activeProfiler), m_phase(phase), m_start(m_profiler ? RecalcProfiler::Now() : 0) {}
+
+        ~ProfiledPhase() {
+            if (m_profiler) {
+                m_profiler->AddPhaseTicks(m_phase, RecalcProfiler::Now() - m_start);
+            }
+        }
+
+        ProfiledPhase(const ProfiledPhase&) = delete;
+        ProfiledPhase& operator=(const ProfiledPhase&) = delete;
+    };
 
 public:
-    // Constructor: Initializes the CalculationEngine with default function library
-    CalculationEngine() {
+    // Constructor: Initializes the CalculationEngine with default function library.
+    // maxThreads sizes the recalculation thread pool; 1 disables multithreaded calc.
+    // cellStore is the worksheet's value store, shared with Worksheet; a new
+    // store is created if none is given.
+    explicit CalculationEngine(size_t maxThreads = DEFAULT_CALCULATION_THREADS,
+                               std::shared_ptr<CellStore> cellStore = nullptr)
+        : m_cellValues(cellStore ? std::move(cellStore) : std::make_shared<CellStore>()),
+          m_multithreadedCalculation(maxThreads > 1), m_iterativeCalculation(false), m_calculationMode(CalculationMode::Automatic),
+          m_cancelRequested(false), m_recalculationTimeSlice(std::chrono::steady_clock::duration::max()), m_batchDepth(0),
+          m_restoredCalcChainChecksum(0), m_subexpressionMemoActive(false), m_subexpressionMemoHits(0),
+          m_subexpressionMemoMisses(0), m_activeProfiler(nullptr) {
         // Initialize m_functionLibrary with default Excel functions
         m_functionLibrary.RegisterDefaultFunctions();
 
         // Initialize m_dependencyGraph as an empty graph
         m_dependencyGraph = DependencyGraph();
 
-        // Initialize m_cellValues as an empty map
-        m_cellValues.clear();
+        // Create the worker pool used for multithreaded recalculation
+        if (maxThreads > 1) {
+            m_threadPool = std::make_unique<ThreadPool>(maxThreads);
+        }
+    }
+
+    // Enables or disables multithreaded recalculation
+    void SetMultithreadedCalculation(bool enabled) {
+        m_multithreadedCalculation = enabled && m_threadPool != nullptr;
+    }
+
+    // Switches the calculation mode; leaving lazy mode finishes all pending work
+    void SetCalculationMode(CalculationMode mode) {
+        m_calculationMode = mode;
+        if (mode == CalculationMode::Automatic) {
+            RecalculatePending(std::chrono::steady_clock::duration::max());
+        }
+    }
+
+    CalculationMode GetCalculationMode() const {
+        return m_calculationMode;
+    }
+
+    // Enables iterative calculation: each cycle is re-evaluated until no
+    // value changes by more than EPSILON, at most MAX_ITERATION_COUNT times
+    void SetIterativeCalculation(bool enabled) {
+        m_iterativeCalculation = enabled;
+    }
+
+    bool IsIterativeCalculationEnabled() const {
+        return m_iterativeCalculation;
+    }
+
+    // Limits how long one automatic recalculation may run before returning
+    // to the caller. Cells it does not reach are left pending, to be finished
+    // by RecalculatePending or computed on demand when read. Unlimited by default.
+    void SetRecalculationTimeSlice(std::chrono::steady_clock::duration slice) {
+        m_recalculationTimeSlice = slice;
+    }
+
+    // Asks the running recalculation to stop at its next unit of work; the
+    // rest of it stays pending. May be called from any thread, but the caller
+    // must wait for the interrupted call to return before editing cells.
+    void CancelCalculation() {
+        m_cancelRequested.store(true, std::memory_order_relaxed);
     }
 
     // Evaluates a given formula and returns the result
     CellValue EvaluateFormula(const Formula& formula, const CellReference& context) {
-        // Tokenize the formula string into individual tokens
-        std::vector<Token> tokens = TokenizeFormula(formula.GetFormulaString());
+        VerifyCalcChain();
+        ProfiledRecalc profile(*this);
+
+        // Fetch the compiled program, tokenizing and parsing only on a cache miss
+        const CompiledFormula* program;
+        {
+            ProfiledPhase phase(*this, RecalcPhase::Parse);
+            program = m_formulaCache.GetOrCompile(formula.GetFormulaString(), context);
+        }
+
+        // Update the dependency graph only when the cell's program changed
+        auto& cellProgram = m_cellPrograms[context];
+        bool programChanged = cellProgram != program;
+        if (programChanged) {
+            ProfiledPhase phase(*this, RecalcPhase::Dependencies);
+            m_dependencyGraph.UpdateDependencies(context, program->GetDependencies(context));
+            m_dependencyGraph.SetVolatile(context, program->isVolatile);
+            cellProgram = program;
+        }
+
+        // Inside a batch the cell's dependents are recalculated at commit
+        if (m_batchDepth > 0) {
+            RecordBatchChange(context);
+        }
+
+        // In lazy mode, or while an interrupted recalculation is pending, bring
+        // dirty precedents up to date first and leave dependents dirty
+        if (m_calculationMode == CalculationMode::Lazy || !m_dirtyCells.empty()) {
+            m_dirtyCells.insert(context);
+            CalculateOnDemand(context);
+            MarkDependentsDirty(context);
+            return GetValue(context);
+        }
 
-        // Parse the tokens into an abstract syntax tree (AST)
-        std::shared_ptr<ASTNode> ast = ParseTokens(tokens);
+        // A new program may close a cycle through the cell's dependents
+        if (programChanged) {
+            std::vector<CellReference> cycle;
+            {
+                ProfiledPhase phase(*this, RecalcPhase::Dependencies);
+                cycle = FindCycleThrough(context);
+            }
+            if (!cycle.empty()) {
+                IterateCycle(cycle);
+                return GetValue(context);
+            }
+        }
 
-        // Evaluate the AST to get the final result
-        CellValue result = EvaluateExpression(ast, context);
+        // Dynamic array formulas write their whole result into the spill range
+        if (program->isArrayFormula) {
+            CalculateArrayFormula(context, *program);
+            return GetValue(context);
+        }
+        ClearSpill(context);
 
-        // Update the dependency graph with the current cell and its dependencies
-        m_dependencyGraph.UpdateDependencies(context, ast->GetDependencies());
+        // Run the program on the stack machine to get the final result
+        CellValue result = ExecuteProgram(*program, context);
 
         // Store the result in m_cellValues
-        m_cellValues[context] = result;
+        m_cellValues->Set(context, result);
+        InvalidateLookupIndexes(context);
 
         // Return the calculated result
         return result;
     }
 
+    // Returns hit/miss counters for the compiled-formula cache
+    FormulaCacheStatistics GetFormulaCacheStatistics() const {
+        return m_formulaCache.GetStatistics();
+    }
+
+    // Returns hit/miss counters for the per-pass subexpression memo
+    SubexpressionMemoStatistics GetSubexpressionMemoStatistics() const {
+        SubexpressionMemoStatistics stats;
+        stats.hits = m_subexpressionMemoHits.load(std::memory_order_relaxed);
+        stats.misses = m_subexpressionMemoMisses.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    // Records a profile of every recalculation into profiler from now on,
+    // attributed to sheetName: time per formula cell, per function and in
+    // parsing, dependency updates and evaluation. The engines of a workbook
+    // may share one profiler; see RecalcProfiler for the JSON and
+    // folded-stack exports.
+    void EnableProfiling(std::shared_ptr<RecalcProfiler> profiler, const std::string& sheetName) {
+        m_profiler = std::move(profiler);
+        m_profiledSheetName = sheetName;
+    }
+
+    void DisableProfiling() {
+        m_profiler.reset();
+    }
+
+    // Returns the memory held by compiled formulas
+    FormulaArenaMemoryUsage GetFormulaMemoryUsage() const {
+        return m_formulaCache.GetMemoryUsage();
+    }
+
+    // Calls visit(cell, source) for every formula cell, where source is the
+    // shared-formula template the cell's program was compiled from; cells
+    // sharing a template get the same source object
+    template <typename Visitor>
+    void ForEachFormulaCell(Visitor visit) const {
+        for (const auto& entry : m_cellPrograms) {
+            const FormulaTemplateSource* source = m_formulaCache.GetTemplateSource(entry.second);
+            if (!source) {
+                throw std::runtime_error("Formula program has no template source");
+            }
+            visit(entry.first, *source);
+        }
+    }
+
+    // Installs formula cells from their templates when no usable calc chain
+    // was saved: each template is compiled once, dependencies are derived
+    // from the programs and every cell is marked dirty and queued for
+    // background recalculation. The saved results stay readable meanwhile.
+    void RestoreFormulas(const std::vector<FormulaTemplateSource>& templates,
+                         const std::vector<std::pair<CellReference, uint32_t>>& cells) {
+        std::vector<const CompiledFormula*> programs;
+        programs.reserve(templates.size());
+        for (const auto& source : templates) {
+            programs.push_back(m_formulaCache.GetOrCompile(source.formula, source.context));
+        }
+        for (const auto& cell : cells) {
+            const CompiledFormula* program = programs.at(cell.second);
+            m_cellPrograms[cell.first] = program;
+            m_dependencyGraph.UpdateDependencies(cell.first, program->GetDependencies(cell.first));
+            m_dependencyGraph.SetVolatile(cell.first, program->isVolatile);
+            m_dirtyCells.insert(cell.first);
+            m_backgroundQueue.push_back(cell.first);
+        }
+    }
+
+    // Appends the calc chain to buffer: the formula templates, every formula
+    // cell in calculation order (precedents first) with the cells and ranges
+    // it reads, and the spill ranges of dynamic array formulas. Saved next to
+    // the cell values, it lets RestoreCalcChain resume incremental
+    // recalculation after opening a file without evaluating anything.
+    void SerializeCalcChain(std::vector<uint8_t>& buffer) {
+        VerifyCalcChain();
+        std::vector<uint8_t> payload;
+        WriteCalcChainPayload(payload, CalculationOrder(), [&](const CellReference& cell) {
+            const FormulaDependencies* precedents = m_dependencyGraph.GetPrecedents(cell);
+            return precedents ? *precedents : FormulaDependencies();
+        });
+
+        AppendPod(buffer, CALC_CHAIN_MAGIC);
+        AppendPod(buffer, CALC_CHAIN_VERSION);
+        AppendPod(buffer, HashBytes(payload.data(), payload.size()));
+        AppendPod(buffer, static_cast<uint64_t>(payload.size()));
+        buffer.insert(buffer.end(), payload.begin(), payload.end());
+    }
+
+    // Installs the formula cells, dependencies and spill ranges of a calc
+    // chain written by SerializeCalcChain. Nothing is evaluated: the values
+    // are expected to be in the cell store already. Whether the recorded
+    // dependencies still match the formulas is verified lazily, before the
+    // first recalculation relies on them. Returns false, changing nothing,
+    // if the chain is damaged, truncated or of another version.
+    bool RestoreCalcChain(const uint8_t* data, size_t size) {
+        ByteReader reader{data, data + size};
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint64_t checksum = 0;
+        uint64_t payloadSize = 0;
+        if (!reader.Read(magic) || magic != CALC_CHAIN_MAGIC || !reader.Read(version) || version != CALC_CHAIN_VERSION ||
+            !reader.Read(checksum) || !reader.Read(payloadSize) || payloadSize != reader.Remaining() ||
+            HashBytes(reader.pos, reader.Remaining()) != checksum) {
+            return false;
+        }
+
+        // Parse the whole chain before touching any state
+        struct RestoredCell {
+            CellReference cell;
+            const CompiledFormula* program;
+            FormulaDependencies dependencies;
+        };
+        struct RestoredSpill {
+            CellReference anchor;
+            CellRect rect;
+            uint8_t blocked;
+        };
+        std::vector<const CompiledFormula*> templates;
+        std::vector<RestoredCell> cells;
+        std::vector<RestoredSpill> spills;
+
+        uint32_t count = 0;
+        if (!reader.Read(count) || count > reader.Remaining()) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            CellReference context;
+            uint32_t length = 0;
+            if (!reader.ReadCell(context) || !reader.Read(length) || length > reader.Remaining()) {
+                return false;
+            }
+            std::string formula(reinterpret_cast<const char*>(reader.pos), length);
+            reader.pos += length;
+            try {
+                templates.push_back(m_formulaCache.GetOrCompile(formula, context));
+            } catch (const std::exception&) {
+                return false;
+            }
+        }
+
+        if (!reader.Read(count) || count > reader.Remaining()) {
+            return false;
+        }
+        cells.resize(count);
+        for (auto& record : cells) {
+            uint32_t templateIndex = 0;
+            uint32_t precedentCount = 0;
+            if (!reader.ReadCell(record.cell) || !reader.Read(templateIndex) || templateIndex >= templates.size() ||
+                !reader.Read(precedentCount) || precedentCount > reader.Remaining()) {
+                return false;
+            }
+            record.program = templates[templateIndex];
+            record.dependencies.cells.resize(precedentCount);
+            for (auto& precedent : record.dependencies.cells) {
+                if (!reader.ReadCell(precedent)) {
+                    return false;
+                }
+            }
+            if (!reader.Read(precedentCount) || precedentCount > reader.Remaining()) {
+                return false;
+            }
+            record.dependencies.ranges.resize(precedentCount);
+            for (auto& rect : record.dependencies.ranges) {
+                if (!reader.ReadRect(rect)) {
+                    return false;
+                }
+            }
+        }
+
+        if (!reader.Read(count) || count > reader.Remaining()) {
+            return false;
+        }
+        spills.resize(count);
+        for (auto& spill : spills) {
+            if (!reader.ReadCell(spill.anchor) || !reader.ReadRect(spill.rect) || !reader.Read(spill.blocked)) {
+                return false;
+            }
+        }
+        if (reader.Remaining() != 0) {
+            return false;
+        }
+
+        // Install the chain as recorded; VerifyCalcChain checks it later
+        std::vector<CellReference> order;
+        order.reserve(cells.size());
+        for (const auto& record : cells) {
+            m_cellPrograms[record.cell] = record.program;
+            m_dependencyGraph.UpdateDependencies(record.cell, record.dependencies);
+            m_dependencyGraph.SetVolatile(record.cell, record.program->isVolatile);
+            order.push_back(record.cell);
+        }
+        for (const auto& spill : spills) {
+            m_dependencyGraph.SetSpillRange(spill.anchor, spill.rect);
+            if (spill.blocked) {
+                m_blockedSpills.insert(spill.anchor);
+            }
+        }
+        m_restoredCalcOrder = std::move(order);
+        m_restoredCalcChainChecksum = checksum;
+        return true;
+    }
+
+    // Releases all calculation state of the workbook in bulk when it closes,
+    // including any open batch, leaving the engine ready for another workbook
+    void ReleaseWorkbook() {
+        m_batchDepth = 0;
+        m_cellPrograms.clear();
+        m_cellValues->Clear();
+        m_dependencyGraph = DependencyGraph();
+        m_formulaCache.Clear();
+        ClearSubexpressionMemo();
+        ClearLookupIndexes();
+        m_criteriaIndexes.clear();
+        m_dirtyCells.clear();
+        m_backgroundQueue.clear();
+        m_batchChanges.clear();
+        m_batchChangedCells.clear();
+        m_blockedSpills.clear();
+        m_restoredCalcOrder.clear();
+    }
+
+    // Returns the value store shared with the worksheet
+    std::shared_ptr<CellStore> GetCellStore() const {
+        return m_cellValues;
+    }
+
+    // Returns the current value of a cell, computing it first if it is dirty
+    // or lies in the spill range of a dirty dynamic array formula
+    CellValue GetCellValue(const CellReference& cell) {
+        if (m_dirtyCells.empty()) {
+            return GetValue(cell);
+        }
+        ProfiledRecalc profile(*this);
+        CalculateOnDemand(cell);
+        CalculateDirtySpillsIn({cell.GetRow(), cell.GetColumn(), cell.GetRow(), cell.GetColumn()});
+        return GetValue(cell);
+    }
+
+    // Returns the range a dynamic array formula spills into, including the
+    // anchor cell itself, or false if the cell has no spill range
+    bool GetSpillRange(const CellReference& anchor, CellRect& range) const {
+        const CellRect* rect = m_dependencyGraph.GetSpillRange(anchor);
+        if (!rect || m_blockedSpills.count(anchor)) {
+            return false;
+        }
+        range = *rect;
+        return true;
+    }
+
+    // Returns true if the cell holds a formula
+    bool IsFormulaCell(const CellReference& cell) const {
+        return m_cellPrograms.count(cell) > 0;
+    }
+
+    // Computes every dirty cell in a rectangle, e.g. the visible viewport,
+    // together with the dirty cells they depend on
+    void CalculateRange(const CellReference& topLeft, const CellReference& bottomRight) {
+        if (m_dirtyCells.empty()) {
+            return;
+        }
+        ProfiledRecalc profile(*this);
+        CellRect rect{topLeft.GetRow(), topLeft.GetColumn(), bottomRight.GetRow(), bottomRight.GetColumn()};
+        std::vector<CellReference> visible;
+        ForEachDirtyCellIn(rect, [&](const CellReference& cell) { visible.push_back(cell); });
+        for (const auto& cell : visible) {
+            CalculateOnDemand(cell);
+        }
+        CalculateDirtySpillsIn(rect);
+    }
+
+    // Computes dirty cells until none remain, the time budget is spent or
+    // CancelCalculation is called. Intended to run in idle time between UI
+    // events; returns true when done.
+    bool RecalculatePending(std::chrono::steady_clock::duration budget) {
+        VerifyCalcChain();
+        ProfiledRecalc profile(*this);
+        auto deadline = DeadlineAfter(budget);
+        size_t evaluated = 0;
+        SubexpressionMemoPass memoPass(*this, true);
+        while (!m_dirtyCells.empty()) {
+            if (m_cancelRequested.exchange(false, std::memory_order_relaxed)) {
+                break;
+            }
+
+            // Snapshot the dirty set; cells computed on demand meanwhile are skipped
+            if (m_backgroundQueue.empty()) {
+                m_backgroundQueue.assign(m_dirtyCells.begin(), m_dirtyCells.end());
+            }
+            CellReference cell = m_backgroundQueue.back();
+            m_backgroundQueue.pop_back();
+            CalculateOnDemand(cell);
+
+            if (++evaluated % BACKGROUND_CLOCK_CHECK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+        }
+        if (m_dirtyCells.empty()) {
+            m_backgroundQueue.clear();
+        }
+        return m_dirtyCells.empty();
+    }
+
+    // Returns the number of formula cells awaiting recalculation, in lazy mode
+    // or after an interrupted recalculation
+    size_t GetPendingCellCount() const {
+        return m_dirtyCells.size();
+    }
+
+    // Returns the number of cached lookup indexes
+    size_t GetLookupIndexCount() const {
+        return m_lookupIndexes.size();
+    }
+
+    // Returns the number of cached criteria indexes
+    size_t GetCriteriaIndexCount() const {
+        return m_criteriaIndexes.size();
+    }
+
     // Updates a cell value and recalculates dependent cells
     void UpdateCell(const CellReference& cell, const CellValue& value) {
-        // Update the cell value in m_cellValues
-        m_cellValues[cell] = value;
+        // A calc chain restored from a file is checked before an edit relies on it
+        VerifyCalcChain();
 
-        // Get all cells dependent on the updated cell from m_dependencyGraph
-        std::vector<CellReference> dependentCells = m_dependencyGraph.GetDependentCells(cell);
+        // Update the cell value in m_cellValues; a constant replaces any formula
+        // the cell held, along with the values it spilled
+        if (m_cellPrograms.erase(cell) > 0) {
+            m_dependencyGraph.UpdateDependencies(cell, {});
+            m_dependencyGraph.SetVolatile(cell, false);
+            m_dirtyCells.erase(cell);
+            ClearSpilledValues(cell);
+        }
+        m_cellValues->Set(cell, value);
+        InvalidateLookupIndexes(cell);
 
-        // For each dependent cell, re-evaluate its formula
-        for (const auto& dependentCell : dependentCells) {
-            Formula formula = GetCellFormula(dependentCell); // Assume this function exists
-            CellValue newValue = EvaluateFormula(formula, dependentCell);
+        // Writing into a spill range blocks it or may unblock it
+        std::vector<CellReference> changes{cell};
+        UpdateSpillsAt(cell, value, changes);
 
-            // Recursively update dependent cells if their values change
-            if (newValue != m_cellValues[dependentCell]) {
-                UpdateCell(dependentCell, newValue);
+        // Inside a batch recalculation is deferred to CommitBatch
+        if (m_batchDepth > 0) {
+            for (const auto& change : changes) {
+                RecordBatchChange(change);
             }
+            return;
+        }
+
+        ProfiledRecalc profile(*this);
+        RecalculateChanges(changes);
+    }
+
+    // Starts buffering cell updates. Batches nest; only the outermost
+    // CommitBatch recalculates.
+    void BeginBatch() {
+        ++m_batchDepth;
+    }
+
+    // Ends a batch. When the outermost batch ends, the dependents of every
+    // cell written in it are recalculated in one dependency-ordered pass, or
+    // just marked dirty in lazy mode.
+    void CommitBatch() {
+        if (m_batchDepth == 0) {
+            throw std::runtime_error("CommitBatch called without a matching BeginBatch");
+        }
+        if (--m_batchDepth > 0) {
+            return;
+        }
+
+        std::vector<CellReference> changes;
+        changes.swap(m_batchChanges);
+        m_batchChangedCells.clear();
+        if (changes.empty()) {
+            return;
+        }
+
+        ProfiledRecalc profile(*this);
+        RecalculateChanges(changes);
+    }
+
+    // Recalculates only the volatile cells (NOW, RAND, OFFSET, ...) and
+    // their transitive dependents, e.g. on a timer or an explicit calculate
+    // request. Costs nothing on sheets without volatile formulas.
+    void RecalculateVolatileCells() {
+        VerifyCalcChain();
+        if (m_dependencyGraph.GetVolatileCells().empty()) {
+            return;
         }
+        ProfiledRecalc profile(*this);
+        RecalculateChanges({});
+    }
+
+    // Returns the number of formula cells calling volatile functions
+    size_t GetVolatileCellCount() const {
+        return m_dependencyGraph.GetVolatileCells().size();
+    }
+
+    bool IsInBatch() const {
+        return m_batchDepth > 0;
     }
 
 private:
-    // Tokenizes a formula string into individual tokens
-    std::vector<Token> TokenizeFormula(const std::string& formulaStr) {
-        std::vector<Token> tokens;
-        // TODO: Implement tokenization logic
-        // - Initialize an empty vector of tokens
-        // - Iterate through the formula string
-        // - Identify and create tokens for numbers, operators, functions, and cell references
-        // - Handle special cases like string literals and parentheses
-        // - Return the vector of tokens
-        return tokens;
-    }
-
-    // Parses tokens into an abstract syntax tree (AST)
-    std::shared_ptr<ASTNode> ParseTokens(const std::vector<Token>& tokens) {
-        // TODO: Implement parsing logic
-        // - Initialize a stack for operators and a stack for operands
-        // - Iterate through the tokens
-        // - Handle numbers and cell references by pushing them onto the operand stack
-        // - Handle operators based on their precedence
-        // - Handle functions and their arguments
-        // - Construct the AST using the operator and operand stacks
-        // - Return the root node of the AST
-        return std::make_shared<ASTNode>(); // Placeholder
-    }
-
-    // Evaluates an AST node and returns the result
-    CellValue EvaluateExpression(const std::shared_ptr<ASTNode>& node, const CellReference& context) {
-        // TODO: Implement expression evaluation logic
-        // - If the node is a literal value, return it
-        // - If the node is a cell reference, return its value from m_cellValues
-        // - If the node is an operator, evaluate its operands and apply the operator
-        // - If the node is a function, call EvaluateFunction
-        // - Return the evaluated result
-        return CellValue(); // Placeholder
-    }
-
-    // Evaluates a function with its arguments
-    CellValue EvaluateFunction(const std::string& functionName, const std::vector<std::shared_ptr<ASTNode>>& args, const CellReference& context) {
-        // Look up the function in m_functionLibrary
-        auto function = m_functionLibrary.GetFunction(functionName);
-        if (!function) {
-            throw std::runtime_error("Unknown function: " + functionName);
+    void RecordBatchChange(const CellReference& cell) {
+        if (m_batchChangedCells.insert(cell).second) {
+            m_batchChanges.push_back(cell);
         }
+    }
+
+    static std::chrono::steady_clock::time_point DeadlineAfter(std::chrono::steady_clock::duration budget) {
+        return budget == std::chrono::steady_clock::duration::max()
+                   ? std::chrono::steady_clock::time_point::max()
+                   : std::chrono::steady_clock::now() + budget;
+    }
 
-        // Evaluate each argument using EvaluateExpression
-        std::vector<CellValue> evaluatedArgs;
-        for (const auto& arg : args) {
-            evaluatedArgs.push_back(EvaluateExpression(arg, context));
+    // Returns true once the running recalculation should stop: it has been
+    // cancelled or its deadline has passed. Safe to call from pool workers.
+    bool ShouldInterrupt(std::chrono::steady_clock::time_point deadline) const {
+        if (m_cancelRequested.load(std::memory_order_relaxed)) {
+            return true;
         }
+        return deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= deadline;
+    }
 
-        // Call the function with the evaluated arguments
-        return function(evaluatedArgs);
+    // Recalculates after the given cells changed; with no cells, only the
+    // volatile cells and their dependents. In automatic mode the dependents
+    // are planned and evaluated in dependency order. In lazy mode, or while an
+    // interrupted recalculation is pending, the changes only join the dirty
+    // set, so that cells both edits affect are computed once; automatic mode
+    // then resumes the pending work for one time slice.
+    void RecalculateChanges(const std::vector<CellReference>& changes) {
+        // A new edit supersedes any cancellation aimed at the previous one
+        m_cancelRequested.store(false, std::memory_order_relaxed);
+        bool automatic = m_calculationMode == CalculationMode::Automatic;
+        bool resume = automatic;
+
+        if (automatic && m_dirtyCells.empty()) {
+            // Mark every transitive dependent of the changes and of the
+            // volatile cells dirty and order the affected subgraph
+            auto deadline = DeadlineAfter(m_recalculationTimeSlice);
+            RecalcPlan plan = BuildRecalcPlan(WithVolatileCells(changes), deadline);
+            if (!plan.interrupted) {
+                for (const auto& cell : changes) {
+                    ReleaseSpillRange(cell);
+                }
+
+                // Evaluate each dirty formula once, after all of its precedents
+                RecalculatePlan(plan, changes, deadline);
+                return;
+            }
+
+            // Interrupted while planning: keep everything for a later pass
+            m_cancelRequested.store(false, std::memory_order_relaxed);
+            resume = false;
+        }
+
+        // Spill readers are found through the old spill ranges, so those are
+        // released only after marking
+        for (const auto& cell : changes) {
+            MarkDependentsDirty(cell);
+        }
+        MarkVolatileCellsDirty();
+        for (const auto& cell : changes) {
+            ReleaseSpillRange(cell);
+        }
+        if (resume) {
+            RecalculatePending(m_recalculationTimeSlice);
+        }
+    }
+
+    // Leaves formula cells for a later pass: each joins the dirty set along
+    // with its transitive dependents
+    void DeferCells(const std::vector<CellReference>& cells) {
+        for (const auto& cell : cells) {
+            if (m_cellPrograms.count(cell) && m_dirtyCells.insert(cell).second) {
+                MarkDependentsDirty(cell);
+            }
+        }
+    }
+
+    // Marks the transitive dependents of a cell dirty. Marking stops at cells
+    // that are already dirty, since their dependents are dirty too, so repeated
+    // edits to the same area cost little.
+    void MarkDependentsDirty(const CellReference& cell) {
+        ProfiledPhase phase(*this, RecalcPhase::Dependencies);
+        std::vector<CellReference> pending;
+        auto markDirty = [&](const CellReference& dependent) {
+            if (m_dirtyCells.insert(dependent).second) {
+                pending.push_back(dependent);
+            }
+        };
+        m_dependencyGraph.ForEachDependent(cell, markDirty);
+        while (!pending.empty()) {
+            CellReference current = pending.back();
+            pending.pop_back();
+            m_dependencyGraph.ForEachDependent(current, markDirty);
+        }
+    }
+
+    // Marks every volatile cell and its transitive dependents dirty
+    void MarkVolatileCellsDirty() {
+        for (const auto& cell : m_dependencyGraph.GetVolatileCells()) {
+            if (m_dirtyCells.insert(cell).second) {
+                MarkDependentsDirty(cell);
+            }
+        }
+    }
+
+    // Returns roots extended with the volatile cells, which every
+    // recalculation evaluates whether or not their precedents changed
+    std::vector<CellReference> WithVolatileCells(std::vector<CellReference> roots) const {
+        const auto& volatileCells = m_dependencyGraph.GetVolatileCells();
+        roots.insert(roots.end(), volatileCells.begin(), volatileCells.end());
+        return roots;
+    }
+
+    // Calls visit for every dirty cell inside rect, scanning whichever of the
+    // rectangle and the dirty set is smaller
+    template <typename Visitor>
+    void ForEachDirtyCellIn(const CellRect& rect, Visitor visit) const {
+        uint64_t area = static_cast<uint64_t>(rect.lastRow - rect.firstRow + 1) * (rect.lastColumn - rect.firstColumn + 1);
+        if (area > m_dirtyCells.size()) {
+            for (const auto& cell : m_dirtyCells) {
+                if (rect.Contains(cell.GetRow(), cell.GetColumn())) {
+                    visit(cell);
+                }
+            }
+            return;
+        }
+        for (int32_t row = rect.firstRow; row <= rect.lastRow; ++row) {
+            for (int32_t col = rect.firstColumn; col <= rect.lastColumn; ++col) {
+                CellReference cell(row, col);
+                if (m_dirtyCells.count(cell)) {
+                    visit(cell);
+                }
+            }
+        }
+    }
+
+    // Brings a dirty cell up to date by first computing its dirty precedents.
+    // Strongly connected components of the dirty precedent subgraph arrive
+    // precedents first, so each is evaluated as soon as it is found; a
+    // component with more than one cell is a cycle.
+    void CalculateOnDemand(const CellReference& root) {
+        if (!m_dirtyCells.count(root)) {
+            return;
+        }
+
+        auto forEachDirtyPrecedent = [&](const CellReference& cell, auto push) {
+            const FormulaDependencies* precedents = m_dependencyGraph.GetPrecedents(cell);
+            if (!precedents) {
+                return;
+            }
+            // Spilled values are only current once their dirty anchor is
+            auto pushDirtyAnchor = [&](const CellReference& anchor) {
+                if (m_dirtyCells.count(anchor)) {
+                    push(anchor);
+                }
+            };
+            for (const auto& precedent : precedents->cells) {
+                if (m_dirtyCells.count(precedent)) {
+                    push(precedent);
+                }
+                m_dependencyGraph.ForEachSpillAnchor({precedent.GetRow(), precedent.GetColumn(), precedent.GetRow(), precedent.GetColumn()},
+                                                     pushDirtyAnchor);
+            }
+            for (const auto& rect : precedents->ranges) {
+                ForEachDirtyCellIn(rect, push);
+                m_dependencyGraph.ForEachSpillAnchor(rect, pushDirtyAnchor);
+            }
+        };
+
+        ForEachStronglyConnectedComponent({root}, forEachDirtyPrecedent,
+                                          [&](const std::vector<CellReference>& component, bool cyclic) {
+            if (cyclic) {
+                // The cycle's cells leave the dirty set even when it throws, so
+                // the background pass does not keep retrying them
+                for (const auto& cell : component) {
+                    m_dirtyCells.erase(cell);
+                }
+                IterateCycle(SortedCells(component));
+                return;
+            }
+
+            const CellReference& cell = component.front();
+            CalculateCell(cell, *m_cellPrograms.at(cell));
+            m_dirtyCells.erase(cell);
+        });
+    }
+
+    // Computes the dirty dynamic array formulas spilling into rect
+    void CalculateDirtySpillsIn(const CellRect& rect) {
+        if (m_dirtyCells.empty()) {
+            return;
+        }
+        std::vector<CellReference> anchors;
+        m_dependencyGraph.ForEachSpillAnchor(rect, [&](const CellReference& anchor) {
+            if (m_dirtyCells.count(anchor)) {
+                anchors.push_back(anchor);
+            }
+        });
+        for (const auto& anchor : anchors) {
+            CalculateOnDemand(anchor);
+        }
+    }
+
+    // Evaluates a formula cell and stores its result, spilling array results.
+    // Returns true if any stored value changed.
+    bool CalculateCell(const CellReference& cell, const CompiledFormula& program) {
+        if (program.isArrayFormula) {
+            // A resized spill may cover cells read by formulas not yet marked dirty
+            bool resized = false;
+            bool changed = CalculateArrayFormula(cell, program, &resized);
+            if (resized) {
+                MarkDependentsDirty(cell);
+            }
+            return changed;
+        }
+        CellValue result = ExecuteProgram(program, cell);
+        if (result == m_cellValues->Get(cell)) {
+            return false;
+        }
+        m_cellValues->Set(cell, result);
+        InvalidateLookupIndexes(cell);
+        return true;
+    }
+
+    // Evaluates a dynamic array formula and writes its result into the spill
+    // range below and to the right of the anchor. If any cell of that range
+    // already holds other content the anchor shows #SPILL! instead.
+    // Returns true if any stored value changed; resized reports whether the
+    // spill range changed shape, which can give the anchor new readers.
+    bool CalculateArrayFormula(const CellReference& anchor, const CompiledFormula& program, bool* resized = nullptr) {
+        if (resized) {
+            const CellRect* before = m_dependencyGraph.GetSpillRange(anchor);
+            CellRect previous = before ? *before : CellRect{0, 0, 0, 0};
+            bool changed = CalculateArrayFormula(anchor, program);
+            const CellRect* after = m_dependencyGraph.GetSpillRange(anchor);
+            *resized = (before == nullptr) != (after == nullptr) || (after && !(*after == previous));
+            if (*resized) {
+                // Results memoized over ranges the spill now reaches are stale
+                ClearSubexpressionMemo();
+            }
+            return changed;
+        }
+
+        RunProgram(program, anchor);
+        const EvalSlot& top = GetEvalScratch().stack.back();
+        if (!top.range && !top.array) {
+            bool changed = ClearSpill(anchor);
+            return StoreValue(anchor, top.value) || changed;
+        }
+        const ArrayValue* result = MaterializeArray(top, anchor);
+        if (!result) {
+            bool changed = ClearSpill(anchor);
+            return StoreValue(anchor, CellValue(CellErrorType::Number)) || changed;
+        }
+        return SpillArray(anchor, *result);
+    }
+
+    bool SpillArray(const CellReference& anchor, const ArrayValue& array) {
+        CellRect rect{anchor.GetRow(), anchor.GetColumn(), anchor.GetRow() + array.rows - 1, anchor.GetColumn() + array.columns - 1};
+        const CellRect* previousRect = m_dependencyGraph.GetSpillRange(anchor);
+        bool ownsPrevious = previousRect && !m_blockedSpills.count(anchor);
+        CellRect previous = previousRect ? *previousRect : rect;
+
+        // Any value in the range other than this anchor's own spill blocks it
+        bool blocked = rect.lastRow > MAX_SPILL_ROW || rect.lastColumn > MAX_SPILL_COLUMN;
+        if (!blocked) {
+            m_cellValues->ForEachInRange(rect, [&](int32_t row, int32_t column, const CellValue&) {
+                bool isAnchor = row == anchor.GetRow() && column == anchor.GetColumn();
+                if (!isAnchor && !(ownsPrevious && previous.Contains(row, column))) {
+                    blocked = true;
+                }
+            });
+        }
+
+        // Erase previously spilled values the new result no longer covers
+        bool changed = false;
+        if (ownsPrevious) {
+            std::vector<CellReference> released;
+            m_cellValues->ForEachInRange(previous, [&](int32_t row, int32_t column, const CellValue&) {
+                bool isAnchor = row == anchor.GetRow() && column == anchor.GetColumn();
+                if (!isAnchor && (blocked || !rect.Contains(row, column))) {
+                    released.emplace_back(row, column);
+                }
+            });
+            for (const auto& cell : released) {
+                m_cellValues->Set(cell, CellValue());
+            }
+            if (!released.empty()) {
+                InvalidateLookupIndexes(previous);
+                changed = true;
+            }
+        }
+
+        // A blocked spill keeps its intended range so that clearing it re-evaluates the anchor
+        if (blocked) {
+            m_blockedSpills.insert(anchor);
+            m_dependencyGraph.SetSpillRange(anchor, rect);
+            return StoreValue(anchor, CellValue(CellErrorType::Spill)) || changed;
+        }
+        m_blockedSpills.erase(anchor);
+        if (array.Size() == 1) {
+            m_dependencyGraph.ClearSpillRange(anchor);
+        } else if (!previousRect || !(previous == rect)) {
+            m_dependencyGraph.SetSpillRange(anchor, rect);
+        }
+
+        // Write the result column by column; blanks spill as zero like Excel
+        bool valuesChanged = false;
+        for (int32_t column = 0; column < array.columns; ++column) {
+            for (int32_t row = 0; row < array.rows; ++row) {
+                CellValue value = array.At(row, column);
+                if (value.IsEmpty()) {
+                    value = CellValue(0.0);
+                }
+                CellReference cell(rect.firstRow + row, rect.firstColumn + column);
+                if (value != m_cellValues->Get(cell)) {
+                    m_cellValues->Set(cell, value);
+                    valuesChanged = true;
+                }
+            }
+        }
+        if (valuesChanged) {
+            InvalidateLookupIndexes(rect);
+        }
+        return changed || valuesChanged;
+    }
+
+    // Stores a single value; returns true if it differs from the stored one
+    bool StoreValue(const CellReference& cell, const CellValue& value) {
+        if (value == m_cellValues->Get(cell)) {
+            return false;
+        }
+        m_cellValues->Set(cell, value);
+        InvalidateLookupIndexes(cell);
+        return true;
+    }
+
+    // Erases the values an anchor spilled, leaving the anchor and its spill
+    // node, so that readers of the range are still found as its dependents
+    bool ClearSpilledValues(const CellReference& anchor) {
+        const CellRect* rect = m_dependencyGraph.GetSpillRange(anchor);
+        if (!rect || m_blockedSpills.count(anchor)) {
+            return false;
+        }
+        CellRect range = *rect;
+        std::vector<CellReference> released;
+        m_cellValues->ForEachInRange(range, [&](int32_t row, int32_t column, const CellValue&) {
+            if (row != anchor.GetRow() || column != anchor.GetColumn()) {
+                released.emplace_back(row, column);
+            }
+        });
+        for (const auto& cell : released) {
+            m_cellValues->Set(cell, CellValue());
+        }
+        InvalidateLookupIndexes(range);
+        return !released.empty();
+    }
+
+    // Removes the spill node of a cell that no longer holds a formula, once
+    // the readers of its former spill range have been scheduled
+    void ReleaseSpillRange(const CellReference& cell) {
+        if (!m_cellPrograms.count(cell)) {
+            m_dependencyGraph.ClearSpillRange(cell);
+            m_blockedSpills.erase(cell);
+        }
+    }
+
+    // Erases an anchor's spilled values and its spill node
+    bool ClearSpill(const CellReference& anchor) {
+        if (!m_dependencyGraph.GetSpillRange(anchor)) {
+            return false;
+        }
+        bool changed = ClearSpilledValues(anchor);
+        m_dependencyGraph.ClearSpillRange(anchor);
+        m_blockedSpills.erase(anchor);
+        return changed;
+    }
+
+    // Handles an edit inside other anchors' spill ranges. Writing a value into
+    // a live spill blocks it at once; clearing a spilled cell, or editing a
+    // blocked range, re-evaluates the anchor (lazily in lazy mode or while
+    // other work is pending). Anchors whose value may change are appended to
+    // changes.
+    void UpdateSpillsAt(const CellReference& cell, const CellValue& value, std::vector<CellReference>& changes) {
+        std::vector<CellReference> anchors;
+        m_dependencyGraph.ForEachSpillAnchor({cell.GetRow(), cell.GetColumn(), cell.GetRow(), cell.GetColumn()},
+                                             [&](const CellReference& anchor) {
+            if (anchor != cell) {
+                anchors.push_back(anchor);
+            }
+        });
+
+        for (const auto& anchor : anchors) {
+            auto programIt = m_cellPrograms.find(anchor);
+            if (programIt == m_cellPrograms.end()) {
+                continue;
+            }
+            if (!value.IsEmpty() && !m_blockedSpills.count(anchor)) {
+                ClearSpilledValues(anchor);
+                m_cellValues->Set(cell, value);
+                m_blockedSpills.insert(anchor);
+                StoreValue(anchor, CellValue(CellErrorType::Spill));
+            } else if (m_calculationMode == CalculationMode::Lazy || !m_dirtyCells.empty()) {
+                m_dirtyCells.insert(anchor);
+            } else {
+                CalculateArrayFormula(anchor, *programIt->second);
+            }
+            changes.push_back(anchor);
+        }
+    }
+
+    // Returns the cells of the cycle containing cell, in sheet order, or an
+    // empty vector if cell is not part of one
+    std::vector<CellReference> FindCycleThrough(const CellReference& cell) {
+        std::vector<CellReference> cycle;
+        auto forEachDependent = [&](const CellReference& current, auto push) {
+            m_dependencyGraph.ForEachDependent(current, push);
+        };
+        ForEachStronglyConnectedComponent({cell}, forEachDependent,
+                                          [&](const std::vector<CellReference>& component, bool cyclic) {
+            if (cyclic && std::find(component.begin(), component.end(), cell) != component.end()) {
+                cycle = SortedCells(component);
+            }
+        });
+        return cycle;
+    }
+
+    // Evaluates the cells of a cycle in turn, Gauss-Seidel style, until no
+    // numeric value moves by more than EPSILON and no other value changes, or
+    // MAX_ITERATION_COUNT sweeps have run. Throws if iterative calculation is
+    // disabled. Returns the cells whose value differs from before.
+    std::vector<CellReference> IterateCycle(const std::vector<CellReference>& cells) {
+        if (!m_iterativeCalculation) {
+            throw CircularReferenceException(cells);
+        }
+
+        // Values change from one sweep to the next, so no call result is shared
+        SubexpressionMemoPass suspendMemo(*this, false);
+
+        std::vector<CellValue> initial;
+        initial.reserve(cells.size());
+        for (const auto& cell : cells) {
+            initial.push_back(m_cellValues->Get(cell));
+        }
+
+        for (int iteration = 0; iteration < MAX_ITERATION_COUNT; ++iteration) {
+            double maxChange = 0.0;
+            bool converged = true;
+            for (const auto& cell : cells) {
+                const CompiledFormula& program = *m_cellPrograms.at(cell);
+                if (program.isArrayFormula) {
+                    converged &= !CalculateArrayFormula(cell, program);
+                    continue;
+                }
+                CellValue result = ExecuteProgram(program, cell);
+                const CellValue& previous = m_cellValues->Get(cell);
+                if (result == previous) {
+                    continue;
+                }
+                if (result.IsNumeric() && previous.IsNumeric()) {
+                    maxChange = std::max(maxChange, std::fabs(result.GetNumeric() - previous.GetNumeric()));
+                } else {
+                    converged = false;
+                }
+                m_cellValues->Set(cell, result);
+                InvalidateLookupIndexes(cell);
+            }
+            if (converged && maxChange <= EPSILON) {
+                break;
+            }
+        }
+
+        std::vector<CellReference> changed;
+        for (size_t i = 0; i < cells.size(); ++i) {
+            if (m_cellValues->Get(cells[i]) != initial[i]) {
+                changed.push_back(cells[i]);
+            }
+        }
+        return changed;
+    }
+
+    static std::vector<CellReference> SortedCells(std::vector<CellReference> cells) {
+        std::sort(cells.begin(), cells.end(), [](const CellReference& a, const CellReference& b) {
+            if (a.GetRow() != b.GetRow()) return a.GetRow() < b.GetRow();
+            return a.GetColumn() < b.GetColumn();
+        });
+        return cells;
+    }
+
+    // Every formula cell in calculation order: precedents first, with the
+    // cells of each cycle contiguous
+    std::vector<CellReference> CalculationOrder() {
+        std::vector<CellReference> roots;
+        roots.reserve(m_cellPrograms.size());
+        for (const auto& entry : m_cellPrograms) {
+            roots.push_back(entry.first);
+        }
+
+        // Components arrive dependents first; reversing gives evaluation order
+        std::vector<CellReference> order;
+        order.reserve(roots.size());
+        auto forEachDependent = [&](const CellReference& cell, auto push) {
+            m_dependencyGraph.ForEachDependent(cell, push);
+        };
+        ForEachStronglyConnectedComponent(SortedCells(std::move(roots)), forEachDependent,
+                                          [&](const std::vector<CellReference>& component, bool) {
+            std::vector<CellReference> cells = SortedCells(component);
+            order.insert(order.end(), cells.rbegin(), cells.rend());
+        });
+        std::reverse(order.begin(), order.end());
+        return order;
+    }
+
+    // Writes the calc chain payload for the formula cells in order: the
+    // template table, then one record per cell with the precedents given by
+    // dependenciesOf(cell), then the spill ranges in sheet order. Templates
+    // are numbered by first use, so equal inputs give identical bytes.
+    template <typename DependenciesOf>
+    void WriteCalcChainPayload(std::vector<uint8_t>& payload, const std::vector<CellReference>& order,
+                               DependenciesOf dependenciesOf) const {
+        std::unordered_map<const CompiledFormula*, uint32_t> templateIds;
+        std::vector<const CompiledFormula*> templates;
+        std::vector<uint8_t> records;
+
+        AppendPod(records, static_cast<uint32_t>(order.size()));
+        for (const auto& cell : order) {
+            const CompiledFormula* program = m_cellPrograms.at(cell);
+            auto inserted = templateIds.emplace(program, static_cast<uint32_t>(templates.size()));
+            if (inserted.second) {
+                templates.push_back(program);
+            }
+            AppendCell(records, cell);
+            AppendPod(records, inserted.first->second);
+
+            FormulaDependencies dependencies = dependenciesOf(cell);
+            AppendPod(records, static_cast<uint32_t>(dependencies.cells.size()));
+            for (const auto& precedent : dependencies.cells) {
+                AppendCell(records, precedent);
+            }
+            AppendPod(records, static_cast<uint32_t>(dependencies.ranges.size()));
+            for (const auto& rect : dependencies.ranges) {
+                AppendRect(records, rect);
+            }
+        }
+
+        std::vector<CellReference> anchors = SortedCells(m_dependencyGraph.GetSpillAnchors());
+        AppendPod(records, static_cast<uint32_t>(anchors.size()));
+        for (const auto& anchor : anchors) {
+            AppendCell(records, anchor);
+            AppendRect(records, *m_dependencyGraph.GetSpillRange(anchor));
+            AppendPod(records, static_cast<uint8_t>(m_blockedSpills.count(anchor) ? 1 : 0));
+        }
+
+        AppendPod(payload, static_cast<uint32_t>(templates.size()));
+        for (const CompiledFormula* program : templates) {
+            const FormulaTemplateSource* source = m_formulaCache.GetTemplateSource(program);
+            if (!source) {
+                throw std::runtime_error("Formula program has no template source");
+            }
+            AppendCell(payload, source->context);
+            AppendPod(payload, static_cast<uint32_t>(source->formula.size()));
+            payload.insert(payload.end(), source->formula.begin(), source->formula.end());
+        }
+        payload.insert(payload.end(), records.begin(), records.end());
+    }
+
+    // Checks a restored calc chain, once, before the first recalculation
+    // relies on it: the chain is written again with every cell's precedents
+    // taken from its formula and the checksums are compared. A chain whose
+    // recorded dependencies differ from what its formulas compile to, e.g.
+    // one written by a build that derived them differently, is repaired by
+    // re-deriving the dependencies and recalculating every restored cell, in
+    // the restored order.
+    void VerifyCalcChain() {
+        if (m_restoredCalcOrder.empty()) {
+            return;
+        }
+        std::vector<CellReference> order;
+        order.swap(m_restoredCalcOrder);
+
+        std::vector<uint8_t> payload;
+        WriteCalcChainPayload(payload, order, [&](const CellReference& cell) {
+            return m_cellPrograms.at(cell)->GetDependencies(cell);
+        });
+        if (HashBytes(payload.data(), payload.size()) == m_restoredCalcChainChecksum) {
+            return;
+        }
+
+        for (const auto& cell : order) {
+            m_dependencyGraph.UpdateDependencies(cell, m_cellPrograms.at(cell)->GetDependencies(cell));
+            m_dirtyCells.insert(cell);
+        }
+        // The background pass pops from the back, so precedents come first
+        m_backgroundQueue.assign(order.rbegin(), order.rend());
+    }
+
+    template <typename T>
+    static void AppendPod(std::vector<uint8_t>& buffer, T value) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    static void AppendCell(std::vector<uint8_t>& buffer, const CellReference& cell) {
+        AppendPod(buffer, static_cast<int32_t>(cell.GetRow()));
+        AppendPod(buffer, static_cast<int32_t>(cell.GetColumn()));
+    }
+
+    static void AppendRect(std::vector<uint8_t>& buffer, const CellRect& rect) {
+        AppendPod(buffer, rect.firstRow);
+        AppendPod(buffer, rect.firstColumn);
+        AppendPod(buffer, rect.lastRow);
+        AppendPod(buffer, rect.lastColumn);
+    }
+
+    // Bounds-checked reader over a serialized calc chain
+    struct ByteReader {
+        const uint8_t* pos;
+        const uint8_t* end;
+
+        size_t Remaining() const {
+            return static_cast<size_t>(end - pos);
+        }
+
+        template <typename T>
+        bool Read(T& out) {
+            if (Remaining() < sizeof(T)) {
+                return false;
+            }
+            std::memcpy(&out, pos, sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+
+        bool ReadCell(CellReference& out) {
+            int32_t row = 0;
+            int32_t column = 0;
+            if (!Read(row) || !Read(column) || row < 1 || row > MAX_SPILL_ROW || column < 1 || column > MAX_SPILL_COLUMN) {
+                return false;
+            }
+            out = CellReference(row, column);
+            return true;
+        }
+
+        bool ReadRect(CellRect& out) {
+            return Read(out.firstRow) && Read(out.firstColumn) && Read(out.lastRow) && Read(out.lastColumn) &&
+                   out.firstRow <= out.lastRow && out.firstColumn <= out.lastColumn;
+        }
+    };
+
+    // 64-bit FNV-1a
+    static uint64_t HashBytes(const uint8_t* bytes, size_t size) {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+        }
+        return hash;
+    }
+
+    // Affected subgraph of a recalculation in topological order, with the
+    // dependents of each cell captured while it was collected. The cells of
+    // each cycle are contiguous in order and listed in cycles.
+    struct RecalcPlan {
+        std::vector<CellReference> order;
+        std::unordered_map<CellReference, std::vector<CellReference>> dependents;
+        std::vector<std::vector<CellReference>> cycles;
+        std::unordered_map<CellReference, size_t> cycleOf;
+        bool interrupted = false;
+    };
+
+    // Collects the transitive dependents of roots and orders their strongly
+    // connected components topologically. Throws CircularReferenceException
+    // for the first cycle found unless iterative calculation is enabled.
+    // Once cancelled or past the deadline the search stops expanding and the
+    // incomplete plan is flagged as interrupted.
+    RecalcPlan BuildRecalcPlan(const std::vector<CellReference>& roots,
+                               std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        ProfiledPhase phase(*this, RecalcPhase::Dependencies);
+        RecalcPlan plan;
+        size_t visited = 0;
+        auto forEachDependent = [&](const CellReference& cell, auto push) {
+            if (plan.interrupted ||
+                (++visited % BACKGROUND_CLOCK_CHECK_INTERVAL == 0 && ShouldInterrupt(deadline))) {
+                plan.interrupted = true;
+                return;
+            }
+            std::vector<CellReference>& dependents = plan.dependents[cell];
+            dependents = m_dependencyGraph.GetDependentCells(cell);
+            for (const auto& dependent : dependents) {
+                push(dependent);
+            }
+        };
+
+        // Components arrive dependents first; reversing gives evaluation order
+        ForEachStronglyConnectedComponent(roots, forEachDependent,
+                                          [&](const std::vector<CellReference>& component, bool cyclic) {
+            if (!cyclic) {
+                plan.order.push_back(component.front());
+                return;
+            }
+            if (!m_iterativeCalculation) {
+                throw CircularReferenceException(SortedCells(component));
+            }
+            std::vector<CellReference> cycle = SortedCells(component);
+            for (auto it = cycle.rbegin(); it != cycle.rend(); ++it) {
+                plan.cycleOf.emplace(*it, plan.cycles.size());
+                plan.order.push_back(*it);
+            }
+            plan.cycles.push_back(std::move(cycle));
+        });
+        std::reverse(plan.order.begin(), plan.order.end());
+
+        return plan;
+    }
+
+    // One formula cell scheduled for evaluation in the current level
+    struct WorkItem {
+        CellReference cell;
+        const CompiledFormula* program;
+        CellValue result;
+        bool evaluated = false;
+    };
+
+    // A unit of work within a level: either a run of cells sharing one numeric
+    // template in consecutive rows of a column, evaluated as a vector kernel,
+    // or a chunk of cells evaluated one at a time
+    struct WorkBlock {
+        size_t begin;
+        size_t count;
+        bool vectorized;
+    };
+
+    // Evaluates the plan level by level, skipping cells none of whose
+    // precedents changed. Cells within a level have no dependencies on each
+    // other, so each level is a ready-set: filled-down template runs are
+    // evaluated as vector kernels, and large levels are spread over the thread
+    // pool. Results are written back between levels, which keeps m_cellValues
+    // read-only while a level runs. Formulas calling thread-unsafe functions
+    // are evaluated on the calling thread.
+    //
+    // Work blocks, serial cells, dynamic arrays and cycles are units of work
+    // between which the pass checks for cancellation and its deadline. When
+    // interrupted it publishes what it finished, defers every stale cell it
+    // did not reach to the dirty set and returns false.
+    bool RecalculatePlan(const RecalcPlan& plan, const std::vector<CellReference>& changedCells,
+                         std::chrono::steady_clock::time_point deadline) {
+        // Planning may already have used up the time slice
+        if (ShouldInterrupt(deadline)) {
+            for (const auto& cell : changedCells) {
+                DeferCells(plan.dependents.at(cell));
+            }
+            const auto& volatileCells = m_dependencyGraph.GetVolatileCells();
+            DeferCells(std::vector<CellReference>(volatileCells.begin(), volatileCells.end()));
+            m_cancelRequested.store(false, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Every cell reads its precedents' final values, so equal calls
+        // anywhere in the pass give equal results
+        SubexpressionMemoPass memoPass(*this, true);
+        bool parallel = m_multithreadedCalculation && plan.order.size() >= PARALLEL_RECALC_THRESHOLD;
+        StringPool& stringPool = StringPool::Current();
+        std::vector<std::vector<CellReference>> levels;
+        {
+            ProfiledPhase phase(*this, RecalcPhase::Dependencies);
+            levels = PartitionIntoLevels(plan);
+        }
+
+        // Volatile cells are evaluated even though none of their precedents changed
+        std::unordered_set<CellReference> stale(m_dependencyGraph.GetVolatileCells());
+        for (const auto& cell : changedCells) {
+            const auto& dependents = plan.dependents.at(cell);
+            stale.insert(dependents.begin(), dependents.end());
+        }
+
+        std::vector<WorkItem> items;
+        std::vector<WorkItem> serialItems;
+        std::vector<WorkItem> arrayItems;
+        std::vector<CellReference> resizedSpills;
+        std::vector<WorkBlock> blocks;
+        std::vector<size_t> levelCycles;
+        std::atomic<bool> interrupted(false);
+        auto shouldStop = [&]() {
+            if (!interrupted.load(std::memory_order_relaxed) && ShouldInterrupt(deadline)) {
+                interrupted.store(true, std::memory_order_relaxed);
+            }
+            return interrupted.load(std::memory_order_relaxed);
+        };
+
+        size_t levelIndex = 0;
+        size_t cyclesDone = 0;
+        for (; levelIndex < levels.size(); ++levelIndex) {
+            items.clear();
+            serialItems.clear();
+            arrayItems.clear();
+            levelCycles.clear();
+            cyclesDone = 0;
+            if (shouldStop()) {
+                break;
+            }
+            for (const auto& cell : levels[levelIndex]) {
+                if (!stale.count(cell)) {
+                    continue;
+                }
+                auto cycleIt = plan.cycleOf.find(cell);
+                if (cycleIt != plan.cycleOf.end()) {
+                    if (std::find(levelCycles.begin(), levelCycles.end(), cycleIt->second) == levelCycles.end()) {
+                        levelCycles.push_back(cycleIt->second);
+                    }
+                    continue;
+                }
+                auto programIt = m_cellPrograms.find(cell);
+                if (programIt == m_cellPrograms.end()) {
+                    continue;
+                }
+                const CompiledFormula* program = programIt->second;
+                if (program->isArrayFormula) {
+                    arrayItems.push_back({cell, program, CellValue()});
+                    continue;
+                }
+                (program->requiresSerialEvaluation ? serialItems : items).push_back({cell, program, CellValue()});
+            }
+
+            BuildWorkBlocks(items, blocks);
+            auto evaluateBlocks = [&](size_t begin, size_t end) {
+                // Workers intern strings into the workbook's pool, not their own default
+                StringPoolScope scope(stringPool);
+                for (size_t b = begin; b < end && !shouldStop(); ++b) {
+                    EvaluateWorkBlock(blocks[b], items);
+                }
+            };
+            if (parallel && items.size() >= PARALLEL_RECALC_GRAIN_SIZE) {
+                m_threadPool->ParallelFor(blocks.size(), 1, evaluateBlocks);
+            } else {
+                evaluateBlocks(0, blocks.size());
+            }
+            for (auto& item : serialItems) {
+                if (shouldStop()) {
+                    break;
+                }
+                item.result = ExecuteProgram(*item.program, item.cell);
+                item.evaluated = true;
+            }
+
+            // Dynamic arrays are vectorized internally and write their spill
+            // ranges directly; nothing else in the level reads them
+            for (auto& item : arrayItems) {
+                if (shouldStop()) {
+                    break;
+                }
+                bool spillResized = false;
+                if (CalculateArrayFormula(item.cell, *item.program, &spillResized)) {
+                    const auto& dependents = plan.dependents.at(item.cell);
+                    stale.insert(dependents.begin(), dependents.end());
+                }
+                if (spillResized) {
+                    resizedSpills.push_back(item.cell);
+                }
+                item.evaluated = true;
+            }
+
+            // Cycles write their values as they iterate; nothing else in the
+            // level reads them
+            for (; cyclesDone < levelCycles.size() && !shouldStop(); ++cyclesDone) {
+                for (const auto& cell : IterateCycle(plan.cycles[levelCycles[cyclesDone]])) {
+                    const auto& dependents = plan.dependents.at(cell);
+                    stale.insert(dependents.begin(), dependents.end());
+                }
+            }
+
+            // Publish the level's results and mark dependents of changed cells
+            for (auto* levelItems : {&items, &serialItems}) {
+                for (auto& item : *levelItems) {
+                    if (item.evaluated && item.result != m_cellValues->Get(item.cell)) {
+                        m_cellValues->Set(item.cell, item.result);
+                        InvalidateLookupIndexes(item.cell);
+                        const auto& dependents = plan.dependents.at(item.cell);
+                        stale.insert(dependents.begin(), dependents.end());
+                    }
+                }
+            }
+            if (interrupted.load(std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        if (interrupted.load(std::memory_order_relaxed)) {
+            // Cells the interrupted level finished are up to date; every other
+            // stale cell from that level on is deferred
+            for (auto* levelItems : {&items, &serialItems, &arrayItems}) {
+                for (const auto& item : *levelItems) {
+                    if (item.evaluated) {
+                        stale.erase(item.cell);
+                    }
+                }
+            }
+            for (size_t i = 0; i < cyclesDone; ++i) {
+                for (const auto& cell : plan.cycles[levelCycles[i]]) {
+                    stale.erase(cell);
+                }
+            }
+            std::vector<CellReference> deferred;
+            for (; levelIndex < levels.size(); ++levelIndex) {
+                for (const auto& cell : levels[levelIndex]) {
+                    if (stale.count(cell)) {
+                        deferred.push_back(cell);
+                    }
+                }
+            }
+            DeferCells(deferred);
+            for (const auto& anchor : resizedSpills) {
+                MarkDependentsDirty(anchor);
+            }
+            m_cancelRequested.store(false, std::memory_order_relaxed);
+            return false;
+        }
+
+        // Spill ranges that changed shape may have readers outside this plan
+        if (!resizedSpills.empty()) {
+            RecalcPlan followUp = BuildRecalcPlan(resizedSpills, deadline);
+            if (followUp.interrupted) {
+                for (const auto& anchor : resizedSpills) {
+                    MarkDependentsDirty(anchor);
+                }
+                m_cancelRequested.store(false, std::memory_order_relaxed);
+                return false;
+            }
+            return RecalculatePlan(followUp, resizedSpills, deadline);
+        }
+        return true;
+    }
+
+    // Groups the plan's topological order into levels by longest path from a
+    // root. A cycle occupies a single level; edges inside it are ignored.
+    static std::vector<std::vector<CellReference>> PartitionIntoLevels(const RecalcPlan& plan) {
+        std::unordered_map<CellReference, size_t> levelOf;
+        levelOf.reserve(plan.order.size());
+        std::vector<std::vector<CellReference>> levels;
+        for (size_t i = 0; i < plan.order.size();) {
+            // A cycle's cells are contiguous in the order
+            auto cycleIt = plan.cycleOf.find(plan.order[i]);
+            size_t count = cycleIt != plan.cycleOf.end() ? plan.cycles[cycleIt->second].size() : 1;
+            size_t level = 0;
+            for (size_t j = i; j < i + count; ++j) {
+                level = std::max(level, levelOf[plan.order[j]]);
+            }
+            if (level >= levels.size()) {
+                levels.resize(level + 1);
+            }
+            for (size_t j = i; j < i + count; ++j) {
+                const CellReference& cell = plan.order[j];
+                levels[level].push_back(cell);
+                for (const auto& dependent : plan.dependents.at(cell)) {
+                    size_t& dependentLevel = levelOf[dependent];
+                    dependentLevel = std::max(dependentLevel, level + 1);
+                }
+            }
+            i += count;
+        }
+        return levels;
+    }
+
+    // Sorts a level's items by template, column and row and splits them into
+    // vectorizable template runs and fixed-size scalar chunks
+    static void BuildWorkBlocks(std::vector<WorkItem>& items, std::vector<WorkBlock>& blocks) {
+        blocks.clear();
+        std::sort(items.begin(), items.end(), [](const WorkItem& a, const WorkItem& b) {
+            if (a.program != b.program) return a.program < b.program;
+            if (a.cell.GetColumn() != b.cell.GetColumn()) return a.cell.GetColumn() < b.cell.GetColumn();
+            return a.cell.GetRow() < b.cell.GetRow();
+        });
+
+        size_t scalarBegin = 0;
+        size_t scalarCount = 0;
+        auto flushScalar = [&]() {
+            if (scalarCount > 0) {
+                blocks.push_back({scalarBegin, scalarCount, false});
+                scalarCount = 0;
+            }
+        };
+
+        size_t i = 0;
+        while (i < items.size()) {
+            size_t run = 1;
+            if (items[i].program->isNumericKernel) {
+                while (i + run < items.size() && items[i + run].program == items[i].program &&
+                       items[i + run].cell.GetColumn() == items[i].cell.GetColumn() &&
+                       items[i + run].cell.GetRow() == items[i].cell.GetRow() + static_cast<int>(run)) {
+                    ++run;
+                }
+            }
+
+            if (run >= MIN_VECTORIZED_BLOCK_SIZE) {
+                flushScalar();
+                blocks.push_back({i, run, true});
+            } else {
+                for (size_t j = i; j < i + run; ++j) {
+                    if (scalarCount == 0) {
+                        scalarBegin = j;
+                    }
+                    if (++scalarCount == PARALLEL_RECALC_GRAIN_SIZE) {
+                        flushScalar();
+                    }
+                }
+            }
+            i += run;
+        }
+        flushScalar();
+    }
+
+    void EvaluateWorkBlock(const WorkBlock& block, std::vector<WorkItem>& items) {
+        if (block.vectorized) {
+            ExecuteProgramBlock(*items[block.begin].program, &items[block.begin], block.count);
+        } else {
+            for (size_t i = block.begin; i < block.begin + block.count; ++i) {
+                items[i].result = ExecuteProgram(*items[i].program, items[i].cell);
+            }
+        }
+        for (size_t i = block.begin; i < block.begin + block.count; ++i) {
+            items[i].evaluated = true;
+        }
+    }
+
+    // Evaluates one numeric template over a run of consecutive rows in a column
+    // as whole-column arrays: each stack slot is an array with one lane per
+    // row, so every instruction becomes a single tight loop the compiler can
+    // vectorize. Rows whose inputs are not numeric, or whose result is not
+    // finite, are re-evaluated by the scalar interpreter so that errors match.
+    void ExecuteProgramBlock(const CompiledFormula& program, WorkItem* items, size_t count) {
+        const FormulaArena& arena = *program.arena;
+        const Instruction* code = arena.GetCode().data() + program.codeOffset;
+        int32_t column = items[0].cell.GetColumn();
+        int32_t firstRow = items[0].cell.GetRow();
+
+        EvalScratch& scratch = GetEvalScratch();
+        scratch.lanes.resize(std::max<size_t>(scratch.lanes.size(), program.maxStackDepth));
+        for (uint32_t i = 0; i < program.maxStackDepth; ++i) {
+            scratch.lanes[i].resize(count);
+        }
+        std::vector<uint8_t>& fallback = scratch.fallback;
+        fallback.assign(count, 0);
+        RecalcProfiler* profiler = m_activeProfiler;
+        uint64_t start = profiler ? RecalcProfiler::Now() : 0;
+
+        size_t depth = 0;
+        for (uint32_t pc = 0; pc < program.codeLength; ++pc) {
+            const Instruction& instruction = code[pc];
+            switch (instruction.op) {
+                case OpCode::PushConstant: {
+                    double* out = scratch.lanes[depth++].data();
+                    double value = arena.GetConstants()[instruction.operand].GetNumeric();
+                    std::fill(out, out + count, value);
+                    break;
+                }
+
+                case OpCode::PushReference: {
+                    double* out = scratch.lanes[depth++].data();
+                    const ReferenceOperand& reference = arena.GetReferences()[instruction.operand];
+                    int32_t sourceColumn = reference.columnAbsolute ? reference.column : column + reference.column;
+                    for (size_t i = 0; i < count; ++i) {
+                        int32_t row = reference.rowAbsolute ? reference.row : firstRow + static_cast<int32_t>(i) + reference.row;
+                        CellValue value = GetValue(CellReference(row, sourceColumn));
+                        if (value.IsError() || !ToNumber(value, out[i])) {
+                            fallback[i] = 1;
+                            out[i] = 0.0;
+                        }
+                    }
+                    break;
+                }
+
+                case OpCode::Negate: {
+                    double* a = scratch.lanes[depth - 1].data();
+                    for (size_t i = 0; i < count; ++i) a[i] = -a[i];
+                    break;
+                }
+
+                case OpCode::Percent: {
+                    double* a = scratch.lanes[depth - 1].data();
+                    for (size_t i = 0; i < count; ++i) a[i] = a[i] / 100.0;
+                    break;
+                }
+
+                default: {
+                    double* a = scratch.lanes[depth - 2].data();
+                    const double* b = scratch.lanes[depth - 1].data();
+                    switch (instruction.op) {
+                        case OpCode::Add:      for (size_t i = 0; i < count; ++i) a[i] += b[i]; break;
+                        case OpCode::Subtract: for (size_t i = 0; i < count; ++i) a[i] -= b[i]; break;
+                        case OpCode::Multiply: for (size_t i = 0; i < count; ++i) a[i] *= b[i]; break;
+                        // A lane dividing by zero, or raising to a power with no finite
+                        // result, is an error the scalar fallback reports; the lane value
+                        // itself cannot carry it, as 1/(1/0) would come back finite
+                        case OpCode::Divide:
+                            for (size_t i = 0; i < count; ++i) {
+                                fallback[i] |= b[i] == 0.0;
+                                a[i] /= b[i];
+                            }
+                            break;
+                        default:
+                            for (size_t i = 0; i < count; ++i) {
+                                a[i] = std::pow(a[i], b[i]);
+                                fallback[i] |= !std::isfinite(a[i]);
+                            }
+                            break;
+                    }
+                    --depth;
+                    break;
+                }
+            }
+        }
+
+        // The block's cells share its vector time evenly; fallback rows are
+        // profiled by the scalar interpreter instead
+        const double* result = scratch.lanes[0].data();
+        uint64_t share = profiler ? (RecalcProfiler::Now() - start) / count : 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (fallback[i] || !std::isfinite(result[i])) {
+                items[i].result = ExecuteProgram(program, items[i].cell);
+            } else {
+                items[i].result = CellValue(result[i]);
+                if (profiler) {
+                    profiler->RecordCell(items[i].cell, share);
+                }
+            }
+        }
+    }
+
+    // Runs a compiled program on the operand stack and returns the result
+    CellValue ExecuteProgram(const CompiledFormula& program, const CellReference& context) {
+        RunProgram(program, context);
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        if (stack.empty()) {
+            return CellValue();
+        }
+        const EvalSlot& result = stack.back();
+        if (!result.range && !result.array) {
+            return result.value;
+        }
+        const ArrayValue* array = MaterializeArray(result, context);
+        return array ? array->At(0) : CellValue(CellErrorType::Number);
+    }
+
+    // Runs a program, leaving its result on top of the scratch operand stack
+    void RunProgram(const CompiledFormula& program, const CellReference& context) {
+        const FormulaArena& arena = *program.arena;
+        const Instruction* code = arena.GetCode().data() + program.codeOffset;
+
+        EvalScratch& scratch = GetEvalScratch();
+        std::vector<EvalSlot>& stack = scratch.stack;
+        stack.clear();
+        stack.reserve(program.maxStackDepth);
+        scratch.arraysInUse = 0;
+        RecalcProfiler* profiler = m_activeProfiler;
+        uint64_t start = profiler ? RecalcProfiler::Now() : 0;
+
+        for (uint32_t pc = 0; pc < program.codeLength; ++pc) {
+            const Instruction& instruction = code[pc];
+            switch (instruction.op) {
+                case OpCode::PushConstant:
+                    stack.push_back({arena.GetConstants()[instruction.operand], nullptr});
+                    break;
+
+                case OpCode::PushReference:
+                    stack.push_back({GetValue(arena.GetReferences()[instruction.operand].Resolve(context)), nullptr, nullptr, true});
+                    break;
+
+                case OpCode::PushRange:
+                    stack.push_back({CellValue(), &arena.GetRanges()[instruction.operand]});
+                    break;
+
+                case OpCode::Negate:
+                case OpCode::Percent: {
+                    EvalSlot& operand = stack.back();
+                    if (operand.range || operand.array) {
+                        operand = ApplyArrayUnaryOperator(instruction.op, operand, context);
+                        break;
+                    }
+                    operand.value = ApplyUnaryOperator(instruction.op, operand);
+                    operand.fromReference = false;
+                    break;
+                }
+
+                case OpCode::Call: {
+                    uint64_t callStart = profiler ? RecalcProfiler::Now() : 0;
+                    size_t first = stack.size() - instruction.argumentCount;
+                    const std::string& functionName = arena.GetFunctionNames()[instruction.operand];
+                    EvalSlot result = IsArrayFunction(functionName)
+                                          ? EvaluateArrayFunction(functionName, first, context)
+                                          : EvalSlot{EvaluateFunctionMemoized(functionName, first, context)};
+                    stack.resize(first);
+                    stack.push_back(result);
+                    if (profiler) {
+                        profiler->RecordFunction(functionName, context, RecalcProfiler::Now() - callStart);
+                    }
+                    break;
+                }
+
+                default: {
+                    EvalSlot rhs = stack.back();
+                    stack.pop_back();
+                    EvalSlot& lhs = stack.back();
+                    if (lhs.range || lhs.array || rhs.range || rhs.array) {
+                        lhs = ApplyArrayBinaryOperator(instruction.op, lhs, rhs, context);
+                        break;
+                    }
+                    lhs.value = ApplyBinaryOperator(instruction.op, lhs, rhs);
+                    lhs.fromReference = false;
+                    break;
+                }
+            }
+        }
+        if (profiler) {
+            profiler->RecordCell(context, RecalcProfiler::Now() - start);
+        }
+    }
+
+    // Returns the current value of a cell, or an empty value if it has none
+    CellValue GetValue(const CellReference& cell) const {
+        return m_cellValues->Get(cell);
+    }
+
+    // Coerces a value to a number following Excel's implicit conversion rules
+    static bool ToNumber(const CellValue& value, double& out) {
+        if (value.IsNumeric()) {
+            out = value.GetNumeric();
+            return true;
+        }
+        if (value.IsBoolean()) {
+            out = value.GetBoolean() ? 1.0 : 0.0;
+            return true;
+        }
+        if (value.IsEmpty()) {
+            out = 0.0;
+            return true;
+        }
+        if (value.IsString()) {
+            const std::string& text = value.GetString();
+            char* end = nullptr;
+            out = std::strtod(text.c_str(), &end);
+            return !text.empty() && end == text.c_str() + text.size();
+        }
+        return false;
+    }
+
+    // Coerces a value to text for concatenation and string comparison
+    static std::string ToText(const CellValue& value) {
+        if (value.IsString()) {
+            return value.GetString();
+        }
+        if (value.IsBoolean()) {
+            return value.GetBoolean() ? "TRUE" : "FALSE";
+        }
+        if (value.IsNumeric()) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.15g", value.GetNumeric());
+            return buffer;
+        }
+        return std::string();
+    }
+
+    CellValue ApplyUnaryOperator(OpCode op, const EvalSlot& operand) {
+        if (operand.range) {
+            return CellValue(CellErrorType::Value);
+        }
+        if (operand.value.IsError()) {
+            return operand.value;
+        }
+        double number;
+        if (!ToNumber(operand.value, number)) {
+            return CellValue(CellErrorType::Value);
+        }
+        return CellValue(op == OpCode::Negate ? -number : number / 100.0);
+    }
+
+    CellValue ApplyBinaryOperator(OpCode op, const EvalSlot& lhs, const EvalSlot& rhs) {
+        if (lhs.range || rhs.range) {
+            return CellValue(CellErrorType::Value);
+        }
+        if (lhs.value.IsError()) {
+            return lhs.value;
+        }
+        if (rhs.value.IsError()) {
+            return rhs.value;
+        }
+
+        if (op == OpCode::Concatenate) {
+            return CellValue(ToText(lhs.value) + ToText(rhs.value));
+        }
+
+        double a;
+        double b;
+        bool numeric = ToNumber(lhs.value, a) && ToNumber(rhs.value, b);
+
+        if (op >= OpCode::Equal && op <= OpCode::GreaterEqual) {
+            int comparison;
+            if (numeric && !lhs.value.IsString() && !rhs.value.IsString()) {
+                comparison = (a < b) ? -1 : (a > b) ? 1 : 0;
+            } else {
+                comparison = CompareText(ToText(lhs.value), ToText(rhs.value));
+            }
+            switch (op) {
+                case OpCode::Equal: return CellValue(comparison == 0);
+                case OpCode::NotEqual: return CellValue(comparison != 0);
+                case OpCode::Less: return CellValue(comparison < 0);
+                case OpCode::LessEqual: return CellValue(comparison <= 0);
+                case OpCode::Greater: return CellValue(comparison > 0);
+                default: return CellValue(comparison >= 0);
+            }
+        }
+
+        if (!numeric) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        switch (op) {
+            case OpCode::Add: return CellValue(a + b);
+            case OpCode::Subtract: return CellValue(a - b);
+            case OpCode::Multiply: return CellValue(a * b);
+            case OpCode::Divide:
+                if (b == 0.0) {
+                    return CellValue(CellErrorType::DivisionByZero);
+                }
+                return CellValue(a / b);
+            case OpCode::Power: {
+                double result = std::pow(a, b);
+                if (!std::isfinite(result)) {
+                    return CellValue(CellErrorType::Number);
+                }
+                return CellValue(result);
+            }
+            default:
+                return CellValue(CellErrorType::Value);
+        }
+    }
+
+    // Case-insensitive text comparison, as used by Excel comparison operators
+    static int CompareText(const std::string& a, const std::string& b) {
+        size_t length = std::min(a.size(), b.size());
+        for (size_t i = 0; i < length; ++i) {
+            int ca = std::tolower(static_cast<unsigned char>(a[i]));
+            int cb = std::tolower(static_cast<unsigned char>(b[i]));
+            if (ca != cb) {
+                return ca < cb ? -1 : 1;
+            }
+        }
+        return (a.size() < b.size()) ? -1 : (a.size() > b.size()) ? 1 : 0;
+    }
+
+    // Returns a cleared array from the per-thread pool; pooled arrays live
+    // until the next program starts running on the thread
+    static ArrayValue& NewArray(int32_t rows, int32_t columns, bool numeric) {
+        EvalScratch& scratch = GetEvalScratch();
+        if (scratch.arraysInUse == scratch.arrays.size()) {
+            scratch.arrays.push_back(std::make_unique<ArrayValue>());
+        }
+        ArrayValue& array = *scratch.arrays[scratch.arraysInUse++];
+        array.Reset(rows, columns, numeric);
+        return array;
+    }
+
+    static EvalSlot ArraySlot(const ArrayValue& array) {
+        return {CellValue(CellErrorType::Value), nullptr, &array};
+    }
+
+    // Returns a slot's value as an array: ranges are read from the cell store
+    // and scalars become 1x1 arrays. Returns nullptr for ranges larger than
+    // MAX_ARRAY_ELEMENTS.
+    const ArrayValue* MaterializeArray(const EvalSlot& slot, const CellReference& context) const {
+        if (slot.array) {
+            return slot.array;
+        }
+        if (!slot.range) {
+            ArrayValue& array = NewArray(1, 1, slot.value.IsNumeric());
+            if (array.numeric) {
+                array.numbers[0] = slot.value.GetNumeric();
+            } else {
+                array.values[0] = slot.value;
+            }
+            return &array;
+        }
+
+        CellRect rect = ResolveRect(*slot.range, context);
+        int32_t rows = rect.lastRow - rect.firstRow + 1;
+        int32_t columns = rect.lastColumn - rect.firstColumn + 1;
+        if (static_cast<uint64_t>(rows) * columns > MAX_ARRAY_ELEMENTS) {
+            return nullptr;
+        }
+
+        // Read as numbers, with blanks as zero, unless a populated cell is not a number
+        ArrayValue& array = NewArray(rows, columns, true);
+        m_cellValues->ForEachInRange(rect, [&](int32_t row, int32_t column, const CellValue& value) {
+            if (!value.IsNumeric()) {
+                array.numeric = false;
+            } else if (array.numeric) {
+                array.numbers[static_cast<size_t>(column - rect.firstColumn) * rows + (row - rect.firstRow)] = value.GetNumeric();
+            }
+        });
+        if (!array.numeric) {
+            array.Reset(rows, columns, false);
+            m_cellValues->ForEachInRange(rect, [&](int32_t row, int32_t column, const CellValue& value) {
+                array.values[static_cast<size_t>(column - rect.firstColumn) * rows + (row - rect.firstRow)] = value;
+            });
+        }
+        return &array;
+    }
+
+    // Element (row, column) of an operand broadcast to a larger shape: a
+    // single row or column repeats, anything else outside the array is #N/A
+    static CellValue BroadcastElement(const ArrayValue& array, int32_t row, int32_t column) {
+        if ((array.rows > 1 && row >= array.rows) || (array.columns > 1 && column >= array.columns)) {
+            return CellValue(CellErrorType::NotAvailable);
+        }
+        return array.At(array.rows == 1 ? 0 : row, array.columns == 1 ? 0 : column);
+    }
+
+    static int32_t BroadcastSize(int32_t a, int32_t b) {
+        return a == 1 ? b : b == 1 ? a : std::max(a, b);
+    }
+
+    EvalSlot ApplyArrayUnaryOperator(OpCode op, const EvalSlot& operand, const CellReference& context) {
+        const ArrayValue* source = MaterializeArray(operand, context);
+        if (!source) {
+            return {CellValue(CellErrorType::Number)};
+        }
+
+        if (source->numeric) {
+            ArrayValue& result = NewArray(source->rows, source->columns, true);
+            double scale = op == OpCode::Negate ? -1.0 : 0.01;
+            for (size_t i = 0; i < result.Size(); ++i) {
+                result.numbers[i] = source->numbers[i] * scale;
+            }
+            return ArraySlot(result);
+        }
+
+        ArrayValue& result = NewArray(source->rows, source->columns, false);
+        for (size_t i = 0; i < result.Size(); ++i) {
+            result.values[i] = ApplyUnaryOperator(op, EvalSlot{source->values[i]});
+        }
+        return ArraySlot(result);
+    }
+
+    // Applies an operator element by element, broadcasting single rows,
+    // single columns and scalars. Arithmetic on two numeric arrays of
+    // compatible shape runs as a plain loop over doubles; everything else goes
+    // through the scalar operator per element.
+    EvalSlot ApplyArrayBinaryOperator(OpCode op, const EvalSlot& lhs, const EvalSlot& rhs, const CellReference& context) {
+        const ArrayValue* a = MaterializeArray(lhs, context);
+        const ArrayValue* b = a ? MaterializeArray(rhs, context) : nullptr;
+        if (!a || !b) {
+            return {CellValue(CellErrorType::Number)};
+        }
+        int32_t rows = BroadcastSize(a->rows, b->rows);
+        int32_t columns = BroadcastSize(a->columns, b->columns);
+        if (static_cast<uint64_t>(rows) * columns > MAX_ARRAY_ELEMENTS) {
+            return {CellValue(CellErrorType::Number)};
+        }
+
+        bool compatible = (a->rows == rows || a->rows == 1) && (b->rows == rows || b->rows == 1) &&
+                          (a->columns == columns || a->columns == 1) && (b->columns == columns || b->columns == 1);
+        bool arithmetic = op == OpCode::Add || op == OpCode::Subtract || op == OpCode::Multiply || op == OpCode::Divide;
+        if (a->numeric && b->numeric && compatible && arithmetic &&
+            (op != OpCode::Divide || std::find(b->numbers.begin(), b->numbers.end(), 0.0) == b->numbers.end())) {
+            ArrayValue& result = NewArray(rows, columns, true);
+            for (int32_t column = 0; column < columns; ++column) {
+                const double* x = a->numbers.data() + (a->columns == 1 ? 0 : static_cast<size_t>(column) * a->rows);
+                const double* y = b->numbers.data() + (b->columns == 1 ? 0 : static_cast<size_t>(column) * b->rows);
+                double* out = result.numbers.data() + static_cast<size_t>(column) * rows;
+                size_t xStep = a->rows == 1 ? 0 : 1;
+                size_t yStep = b->rows == 1 ? 0 : 1;
+                switch (op) {
+                    case OpCode::Add:
+                        for (int32_t row = 0; row < rows; ++row) out[row] = x[row * xStep] + y[row * yStep];
+                        break;
+                    case OpCode::Subtract:
+                        for (int32_t row = 0; row < rows; ++row) out[row] = x[row * xStep] - y[row * yStep];
+                        break;
+                    case OpCode::Multiply:
+                        for (int32_t row = 0; row < rows; ++row) out[row] = x[row * xStep] * y[row * yStep];
+                        break;
+                    default:
+                        for (int32_t row = 0; row < rows; ++row) out[row] = x[row * xStep] / y[row * yStep];
+                        break;
+                }
+            }
+            return ArraySlot(result);
+        }
+
+        ArrayValue& result = NewArray(rows, columns, false);
+        for (int32_t column = 0; column < columns; ++column) {
+            for (int32_t row = 0; row < rows; ++row) {
+                EvalSlot x{BroadcastElement(*a, row, column)};
+                EvalSlot y{BroadcastElement(*b, row, column)};
+                result.values[static_cast<size_t>(column) * rows + row] = ApplyBinaryOperator(op, x, y);
+            }
+        }
+        return ArraySlot(result);
+    }
+
+    // FILTER, SORT, UNIQUE and SEQUENCE; errors are returned as scalar slots
+    EvalSlot EvaluateArrayFunction(const std::string& functionName, size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        size_t argumentCount = stack.size() - firstArgument;
+        if (functionName == "SEQUENCE") {
+            return argumentCount >= 1 && argumentCount <= 4 ? EvaluateSequence(firstArgument) : EvalSlot{CellValue(CellErrorType::Value)};
+        }
+        if (argumentCount < 1) {
+            return {CellValue(CellErrorType::Value)};
+        }
+        const ArrayValue* source = MaterializeArray(stack[firstArgument], context);
+        if (!source) {
+            return {CellValue(CellErrorType::Number)};
+        }
+        if (functionName == "FILTER") {
+            return argumentCount >= 2 && argumentCount <= 3 ? EvaluateFilter(*source, firstArgument, context)
+                                                            : EvalSlot{CellValue(CellErrorType::Value)};
+        }
+        if (functionName == "SORT") {
+            return argumentCount <= 4 ? EvaluateSort(*source, firstArgument) : EvalSlot{CellValue(CellErrorType::Value)};
+        }
+        return argumentCount <= 3 ? EvaluateUnique(*source, firstArgument) : EvalSlot{CellValue(CellErrorType::Value)};
+    }
+
+    // SEQUENCE(rows, [columns], [start], [step]), numbered across each row first
+    EvalSlot EvaluateSequence(size_t firstArgument) {
+        double rows;
+        double columns;
+        double start;
+        double step;
+        if (!GetNumericArgument(firstArgument, 1.0, rows) || !GetNumericArgument(firstArgument + 1, 1.0, columns) ||
+            !GetNumericArgument(firstArgument + 2, 1.0, start) || !GetNumericArgument(firstArgument + 3, 1.0, step)) {
+            return {CellValue(CellErrorType::Value)};
+        }
+        if (rows < 1.0 || columns < 1.0) {
+            return {CellValue(CellErrorType::Calc)};
+        }
+        if (rows * columns > static_cast<double>(MAX_ARRAY_ELEMENTS)) {
+            return {CellValue(CellErrorType::Number)};
+        }
+
+        ArrayValue& result = NewArray(static_cast<int32_t>(rows), static_cast<int32_t>(columns), true);
+        for (int32_t column = 0; column < result.columns; ++column) {
+            double* out = result.numbers.data() + static_cast<size_t>(column) * result.rows;
+            for (int32_t row = 0; row < result.rows; ++row) {
+                out[row] = start + (static_cast<double>(row) * result.columns + column) * step;
+            }
+        }
+        return ArraySlot(result);
+    }
+
+    // FILTER(array, include, [if_empty]); include is a column selecting rows
+    // or a row selecting columns
+    EvalSlot EvaluateFilter(const ArrayValue& source, size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        const ArrayValue* include = MaterializeArray(stack[firstArgument + 1], context);
+        if (!include) {
+            return {CellValue(CellErrorType::Number)};
+        }
+        bool byRow = include->columns == 1 && include->rows == source.rows;
+        if (!byRow && !(include->rows == 1 && include->columns == source.columns)) {
+            return {CellValue(CellErrorType::Value)};
+        }
+
+        std::vector<int32_t> selected;
+        for (size_t i = 0; i < include->Size(); ++i) {
+            CellValue flag = include->At(i);
+            if (flag.IsError()) {
+                return {flag};
+            }
+            double number;
+            if (!flag.IsString() && ToNumber(flag, number)) {
+                if (number != 0.0) {
+                    selected.push_back(static_cast<int32_t>(i));
+                }
+            } else {
+                return {CellValue(CellErrorType::Value)};
+            }
+        }
+        if (selected.empty()) {
+            return stack.size() - firstArgument == 3 ? EvalSlot{stack[firstArgument + 2].value} : EvalSlot{CellValue(CellErrorType::Calc)};
+        }
+
+        int32_t rows = byRow ? static_cast<int32_t>(selected.size()) : source.rows;
+        int32_t columns = byRow ? source.columns : static_cast<int32_t>(selected.size());
+        ArrayValue& result = NewArray(rows, columns, source.numeric);
+        for (int32_t column = 0; column < columns; ++column) {
+            for (int32_t row = 0; row < rows; ++row) {
+                size_t from = byRow ? static_cast<size_t>(column) * source.rows + selected[row]
+                                    : static_cast<size_t>(selected[column]) * source.rows + row;
+                size_t to = static_cast<size_t>(column) * rows + row;
+                if (source.numeric) {
+                    result.numbers[to] = source.numbers[from];
+                } else {
+                    result.values[to] = source.values[from];
+                }
+            }
+        }
+        return ArraySlot(result);
+    }
+
+    // SORT(array, [sort_index], [sort_order], [by_col]); a stable sort of rows
+    // (or columns) by one key
+    EvalSlot EvaluateSort(const ArrayValue& source, size_t firstArgument) {
+        double sortIndex;
+        double sortOrder;
+        double byColumn;
+        if (!GetNumericArgument(firstArgument + 1, 1.0, sortIndex) || !GetNumericArgument(firstArgument + 2, 1.0, sortOrder) ||
+            !GetNumericArgument(firstArgument + 3, 0.0, byColumn)) {
+            return {CellValue(CellErrorType::Value)};
+        }
+        bool columns = byColumn != 0.0;
+        int32_t keyLine = static_cast<int32_t>(sortIndex) - 1;
+        int32_t lineCount = columns ? source.columns : source.rows;
+        if (keyLine < 0 || keyLine >= (columns ? source.rows : source.columns) || (sortOrder != 1.0 && sortOrder != -1.0)) {
+            return {CellValue(CellErrorType::Value)};
+        }
+
+        auto keyOf = [&](int32_t line) {
+            return columns ? source.At(keyLine, line) : source.At(line, keyLine);
+        };
+        std::vector<int32_t> order(lineCount);
+        for (int32_t i = 0; i < lineCount; ++i) {
+            order[i] = i;
+        }
+        if (source.numeric) {
+            const double* keys = source.numbers.data() + (columns ? keyLine : static_cast<size_t>(keyLine) * source.rows);
+            size_t stride = columns ? source.rows : 1;
+            std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+                return sortOrder > 0 ? keys[a * stride] < keys[b * stride] : keys[a * stride] > keys[b * stride];
+            });
+        } else {
+            std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+                return CompareForSort(keyOf(a), keyOf(b), sortOrder < 0) < 0;
+            });
+        }
+
+        ArrayValue& result = NewArray(source.rows, source.columns, source.numeric);
+        for (int32_t column = 0; column < source.columns; ++column) {
+            for (int32_t row = 0; row < source.rows; ++row) {
+                size_t from = columns ? static_cast<size_t>(order[column]) * source.rows + row
+                                      : static_cast<size_t>(column) * source.rows + order[row];
+                size_t to = static_cast<size_t>(column) * source.rows + row;
+                if (source.numeric) {
+                    result.numbers[to] = source.numbers[from];
+                } else {
+                    result.values[to] = source.values[from];
+                }
+            }
+        }
+        return ArraySlot(result);
+    }
+
+    // Excel sort order: numbers, text, booleans, errors, then blanks, which
+    // stay last in both directions
+    static int CompareForSort(const CellValue& a, const CellValue& b, bool descending) {
+        auto rank = [](const CellValue& value) {
+            if (value.IsNumeric()) return 0;
+            if (value.IsString()) return 1;
+            if (value.IsBoolean()) return 2;
+            if (value.IsError()) return 3;
+            return 4;
+        };
+        int rankA = rank(a);
+        int rankB = rank(b);
+        if (rankA == 4 || rankB == 4) {
+            return rankA - rankB;
+        }
+        int comparison = 0;
+        if (rankA != rankB) {
+            comparison = rankA - rankB;
+        } else if (rankA == 0) {
+            comparison = a.GetNumeric() < b.GetNumeric() ? -1 : a.GetNumeric() > b.GetNumeric() ? 1 : 0;
+        } else if (rankA == 1) {
+            comparison = CompareText(a.GetString(), b.GetString());
+        } else if (rankA == 2) {
+            comparison = static_cast<int>(a.GetBoolean()) - static_cast<int>(b.GetBoolean());
+        }
+        return descending ? -comparison : comparison;
+    }
+
+    // UNIQUE(array, [by_col], [exactly_once]); rows (or columns) compare
+    // case-insensitively and keep the order of their first occurrence
+    EvalSlot EvaluateUnique(const ArrayValue& source, size_t firstArgument) {
+        double byColumn;
+        double exactlyOnce;
+        if (!GetNumericArgument(firstArgument + 1, 0.0, byColumn) || !GetNumericArgument(firstArgument + 2, 0.0, exactlyOnce)) {
+            return {CellValue(CellErrorType::Value)};
+        }
+        bool columns = byColumn != 0.0;
+        int32_t lineCount = columns ? source.columns : source.rows;
+        int32_t lineLength = columns ? source.rows : source.columns;
+
+        // Key each line by its normalized elements
+        std::unordered_map<std::string, std::pair<int32_t, int32_t>> occurrences;   // key -> (first line, count)
+        std::vector<std::string> keys(lineCount);
+        LookupKey element;
+        for (int32_t line = 0; line < lineCount; ++line) {
+            std::string& key = keys[line];
+            for (int32_t i = 0; i < lineLength; ++i) {
+                CellValue value = columns ? source.At(i, line) : source.At(line, i);
+                if (LookupKey::FromValue(value, element)) {
+                    key += static_cast<char>('0' + static_cast<int>(element.type));
+                    key.append(reinterpret_cast<const char*>(&element.number), sizeof(element.number));
+                    key += element.text;
+                } else {
+                    key += value.IsError() ? 'E' : 'B';
+                    key += static_cast<char>(value.IsError() ? static_cast<int>(value.GetError()) : 0);
+                }
+                key += '\x1F';
+            }
+            auto inserted = occurrences.emplace(key, std::make_pair(line, 0));
+            ++inserted.first->second.second;
+        }
+
+        std::vector<int32_t> selected;
+        for (int32_t line = 0; line < lineCount; ++line) {
+            const auto& occurrence = occurrences.at(keys[line]);
+            if (occurrence.first == line && (exactlyOnce == 0.0 || occurrence.second == 1)) {
+                selected.push_back(line);
+            }
+        }
+        if (selected.empty()) {
+            return {CellValue(CellErrorType::Calc)};
+        }
+
+        int32_t rows = columns ? source.rows : static_cast<int32_t>(selected.size());
+        int32_t resultColumns = columns ? static_cast<int32_t>(selected.size()) : source.columns;
+        ArrayValue& result = NewArray(rows, resultColumns, source.numeric);
+        for (int32_t column = 0; column < resultColumns; ++column) {
+            for (int32_t row = 0; row < rows; ++row) {
+                size_t from = columns ? static_cast<size_t>(selected[column]) * source.rows + row
+                                      : static_cast<size_t>(column) * source.rows + selected[row];
+                size_t to = static_cast<size_t>(column) * rows + row;
+                if (source.numeric) {
+                    result.numbers[to] = source.numbers[from];
+                } else {
+                    result.values[to] = source.values[from];
+                }
+            }
+        }
+        return ArraySlot(result);
+    }
+
+    // Evaluates a function call through the subexpression memo when the memo
+    // is active and the call is eligible (see BuildMemoKey)
+    CellValue EvaluateFunctionMemoized(const std::string& functionName, size_t firstArgument, const CellReference& context) {
+        EvalScratch& scratch = GetEvalScratch();
+        if (!m_subexpressionMemoActive || !BuildMemoKey(functionName, firstArgument, context, scratch.memoKey)) {
+            return EvaluateFunction(functionName, firstArgument, context);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_subexpressionMemoMutex);
+            auto it = m_subexpressionMemo.find(scratch.memoKey);
+            if (it != m_subexpressionMemo.end()) {
+                m_subexpressionMemoHits.fetch_add(1, std::memory_order_relaxed);
+                return it->second;
+            }
+        }
+
+        // Computed outside the lock; threads racing on one key store equal results
+        m_subexpressionMemoMisses.fetch_add(1, std::memory_order_relaxed);
+        CellValue result = EvaluateFunction(functionName, firstArgument, context);
+        std::lock_guard<std::mutex> lock(m_subexpressionMemoMutex);
+        if (m_subexpressionMemo.size() < MAX_SUBEXPRESSION_MEMO_ENTRIES) {
+            m_subexpressionMemo.emplace(scratch.memoKey, result);
+        }
+        return result;
+    }
+
+    // Builds the memo key of a call: the function name followed by each
+    // argument, ranges as their resolved rectangle and scalars by value.
+    // Equal keys therefore mean the same function over the same inputs,
+    // however the arguments were written. Returns false for calls not worth
+    // or not safe to share: those reading fewer than SUBEXPRESSION_MEMO_MIN_CELLS
+    // cells, taking an intermediate array, or calling a volatile or
+    // thread-unsafe function.
+    bool BuildMemoKey(const std::string& functionName, size_t firstArgument, const CellReference& context,
+                      std::string& key) const {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        uint64_t cells = 0;
+        for (size_t i = firstArgument; i < stack.size(); ++i) {
+            if (stack[i].array) {
+                return false;
+            }
+            if (stack[i].range) {
+                CellRect rect = ResolveRect(*stack[i].range, context);
+                cells += static_cast<uint64_t>(rect.lastRow - rect.firstRow + 1) * (rect.lastColumn - rect.firstColumn + 1);
+            }
+        }
+        if (cells < SUBEXPRESSION_MEMO_MIN_CELLS || IsVolatileFunction(functionName) ||
+            IsThreadUnsafeFunction(functionName)) {
+            return false;
+        }
+
+        key.assign(functionName);
+        key.push_back('\0');
+        for (size_t i = firstArgument; i < stack.size(); ++i) {
+            const EvalSlot& slot = stack[i];
+            if (slot.range) {
+                CellRect rect = ResolveRect(*slot.range, context);
+                key.push_back('R');
+                key.append(reinterpret_cast<const char*>(&rect), sizeof(rect));
+                continue;
+            }
+            // SUM(A1) and SUM("text") treat the same text differently
+            const CellValue& value = slot.value;
+            if (slot.fromReference) {
+                key.push_back('C');
+            }
+            key.push_back(static_cast<char>('0' + static_cast<int>(value.GetType())));
+            if (value.IsNumeric()) {
+                double number = value.GetNumeric();
+                key.append(reinterpret_cast<const char*>(&number), sizeof(number));
+            } else if (value.IsBoolean()) {
+                key.push_back(value.GetBoolean() ? '1' : '0');
+            } else if (value.IsError()) {
+                key.push_back(static_cast<char>(value.GetError()));
+            } else if (value.IsString()) {
+                uint32_t length = static_cast<uint32_t>(value.GetString().size());
+                key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+                key.append(value.GetString());
+            }
+        }
+        return true;
+    }
+
+    void ClearSubexpressionMemo() {
+        std::lock_guard<std::mutex> lock(m_subexpressionMemoMutex);
+        m_subexpressionMemo.clear();
+    }
+
+    CellValue EvaluateFunction(const std::string& functionName, size_t firstArgument, const CellReference& context) {
+        // Aggregates run on typed spans with the vector kernels
+        AggregateFunction aggregate = ClassifyAggregate(functionName);
+        if (aggregate == AggregateFunction::SumProduct) {
+            return EvaluateSumProduct(firstArgument, context);
+        }
+        if (aggregate != AggregateFunction::None) {
+            return EvaluateAggregate(aggregate, firstArgument, context);
+        }
+
+        // Conditional aggregates answer equality criteria from a criteria index
+        AggregateFunction conditional = ClassifyConditionalAggregate(functionName);
+        if (conditional != AggregateFunction::None) {
+            return EvaluateConditionalAggregate(conditional, firstArgument, context);
+        }
+
+        // Lookups search a cached index of the lookup range
+        if (functionName == "VLOOKUP") {
+            return EvaluateVLookup(firstArgument, context);
+        }
+        if (functionName == "XLOOKUP") {
+            return EvaluateXLookup(firstArgument, context);
+        }
+        if (functionName == "MATCH") {
+            return EvaluateMatch(firstArgument, context);
+        }
+
+        // Look up the function in m_functionLibrary
+        auto function = m_functionLibrary.GetFunction(functionName);
+        if (!function) {
+            throw std::runtime_error("Unknown function: " + functionName);
+        }
+
+        // Gather the arguments, expanding range operands into their cell values
+        EvalScratch& scratch = GetEvalScratch();
+        std::vector<CellValue>& arguments = scratch.arguments;
+        arguments.clear();
+        for (size_t i = firstArgument; i < scratch.stack.size(); ++i) {
+            const EvalSlot& slot = scratch.stack[i];
+            if (slot.array) {
+                for (size_t j = 0; j < slot.array->Size(); ++j) {
+                    arguments.push_back(slot.array->At(j));
+                }
+                continue;
+            }
+            if (!slot.range) {
+                arguments.push_back(slot.value);
+                continue;
+            }
+            CellRect rect = ResolveRect(*slot.range, context);
+            for (int row = rect.firstRow; row <= rect.lastRow; ++row) {
+                for (int col = rect.firstColumn; col <= rect.lastColumn; ++col) {
+                    arguments.push_back(GetValue(CellReference(row, col)));
+                }
+            }
+        }
+
+        // Call the function with the evaluated arguments
+        return function(arguments);
+    }
+
+    static AggregateFunction ClassifyAggregate(const std::string& functionName) {
+        static const std::unordered_map<std::string, AggregateFunction> aggregates = {
+            {"SUM", AggregateFunction::Sum},
+            {"AVERAGE", AggregateFunction::Average},
+            {"MIN", AggregateFunction::Min},
+            {"MAX", AggregateFunction::Max},
+            {"COUNT", AggregateFunction::Count},
+            {"SUMPRODUCT", AggregateFunction::SumProduct},
+        };
+        auto it = aggregates.find(functionName);
+        return it != aggregates.end() ? it->second : AggregateFunction::None;
+    }
+
+    static AggregateFunction ClassifyConditionalAggregate(const std::string& functionName) {
+        static const std::unordered_map<std::string, AggregateFunction> aggregates = {
+            {"SUMIFS", AggregateFunction::Sum},
+            {"COUNTIFS", AggregateFunction::Count},
+            {"AVERAGEIFS", AggregateFunction::Average},
+        };
+        auto it = aggregates.find(functionName);
+        return it != aggregates.end() ? it->second : AggregateFunction::None;
+    }
+
+    // Copies a range into scratch as a numeric span by walking the populated
+    // cells of the cell store; the first error found is stored in firstError
+    // so that callers can decide whether it propagates. A positional span has
+    // one entry per cell, column-major, with non-numbers marked invalid and
+    // read as 0.0, so that equally shaped ranges line up element by element.
+    // Otherwise the span holds only the numeric cells, which keeps whole-column
+    // aggregates proportional to the populated cells.
+    NumericSpan GatherRange(const RangeOperand& range, const CellReference& context, bool positional,
+                            std::vector<double>& values, std::vector<uint8_t>& valid, CellValue& firstError) const {
+        CellRect rect = ResolveRect(range, context);
+        int32_t rows = rect.lastRow - rect.firstRow + 1;
+        if (positional) {
+            size_t count = static_cast<size_t>(rows) * (rect.lastColumn - rect.firstColumn + 1);
+            values.assign(count, 0.0);
+            valid.assign(count, 0);
+        } else {
+            values.clear();
+            valid.clear();
+        }
+
+        m_cellValues->ForEachInRange(rect, [&](int32_t row, int32_t col, const CellValue& value) {
+            if (value.IsError() && firstError.IsEmpty()) {
+                firstError = value;
+            }
+            if (!value.IsNumeric()) {
+                return;
+            }
+            if (positional) {
+                size_t i = static_cast<size_t>(col - rect.firstColumn) * rows + (row - rect.firstRow);
+                values[i] = value.GetNumeric();
+                valid[i] = 1;
+            } else {
+                values.push_back(value.GetNumeric());
+                valid.push_back(1);
+            }
+        });
+        return {values.data(), valid.data(), values.size()};
+    }
+
+    // Numeric span over an array with the same layout and error rules as
+    // GatherRange; numeric arrays are used in place
+    static NumericSpan GatherArray(const ArrayValue& array, bool positional, std::vector<double>& values,
+                                   std::vector<uint8_t>& valid, CellValue& firstError) {
+        if (array.numeric) {
+            valid.assign(array.Size(), 1);
+            return {array.numbers.data(), valid.data(), array.Size()};
+        }
+        values.clear();
+        valid.clear();
+        for (const auto& value : array.values) {
+            if (value.IsError() && firstError.IsEmpty()) {
+                firstError = value;
+            }
+            if (value.IsNumeric()) {
+                values.push_back(value.GetNumeric());
+                valid.push_back(1);
+            } else if (positional) {
+                values.push_back(0.0);
+                valid.push_back(0);
+            }
+        }
+        return {values.data(), valid.data(), values.size()};
+    }
+
+    // SUM, AVERAGE, MIN, MAX and COUNT. Range and array arguments ignore text, booleans
+    // and blanks; direct arguments are coerced to numbers. Errors propagate
+    // except for COUNT, which only counts numbers.
+    CellValue EvaluateAggregate(AggregateFunction aggregate, size_t firstArgument, const CellReference& context) {
+        const AggregateKernels& kernels = GetAggregateKernels();
+        EvalScratch& scratch = GetEvalScratch();
+        bool propagateErrors = aggregate != AggregateFunction::Count;
+
+        double sum = 0.0;
+        size_t count = 0;
+        double minimum = std::numeric_limits<double>::infinity();
+        double maximum = -std::numeric_limits<double>::infinity();
+
+        for (size_t i = firstArgument; i < scratch.stack.size(); ++i) {
+            const EvalSlot& slot = scratch.stack[i];
+            if (slot.range || slot.array) {
+                CellValue error;
+                NumericSpan span = slot.array ? GatherArray(*slot.array, false, scratch.spanValues, scratch.spanValid, error)
+                                              : GatherRange(*slot.range, context, false, scratch.spanValues, scratch.spanValid, error);
+                if (propagateErrors && !error.IsEmpty()) {
+                    return error;
+                }
+                switch (aggregate) {
+                    case AggregateFunction::Min:
+                        minimum = std::min(minimum, kernels.min(span.values, span.valid, span.count));
+                        break;
+                    case AggregateFunction::Max:
+                        maximum = std::max(maximum, kernels.max(span.values, span.valid, span.count));
+                        break;
+                    case AggregateFunction::Count:
+                        break;
+                    default:
+                        sum += kernels.sum(span.values, span.count);
+                        break;
+                }
+                count += kernels.count(span.valid, span.count);
+                continue;
+            }
+
+            // A single cell reference is read as a 1x1 range: text, booleans
+            // and empty cells are skipped, unlike the same values typed in
+            if (slot.value.IsEmpty() || (slot.fromReference && !slot.value.IsNumeric() && !slot.value.IsError())) {
+                continue;
+            }
+            if (slot.value.IsError()) {
+                if (propagateErrors) {
+                    return slot.value;
+                }
+                continue;
+            }
+            double number;
+            if (!ToNumber(slot.value, number)) {
+                if (propagateErrors) {
+                    return CellValue(CellErrorType::Value);
+                }
+                continue;
+            }
+            sum += number;
+            minimum = std::min(minimum, number);
+            maximum = std::max(maximum, number);
+            ++count;
+        }
+
+        switch (aggregate) {
+            case AggregateFunction::Average:
+                if (count == 0) {
+                    return CellValue(CellErrorType::DivisionByZero);
+                }
+                return CellValue(sum / count);
+            case AggregateFunction::Min:
+                return CellValue(count == 0 ? 0.0 : minimum);
+            case AggregateFunction::Max:
+                return CellValue(count == 0 ? 0.0 : maximum);
+            case AggregateFunction::Count:
+                return CellValue(static_cast<double>(count));
+            default:
+                return CellValue(sum);
+        }
+    }
+
+    // Returns the index over a single row or column, building it on first use
+    std::shared_ptr<const LookupIndex> GetLookupIndex(const CellRect& rect) {
+        std::lock_guard<std::mutex> lock(m_lookupIndexMutex);
+        auto it = m_lookupIndexes.find(rect);
+        if (it != m_lookupIndexes.end()) {
+            return it->second.index;
+        }
+
+        if (m_lookupIndexes.size() >= MAX_LOOKUP_INDEXES) {
+            ClearLookupIndexes();
+        }
+
+        // Lookup rectangles are a single row or column, so offsets are positions
+        std::vector<CellValue> values(static_cast<size_t>(rect.lastRow - rect.firstRow + 1) * (rect.lastColumn - rect.firstColumn + 1));
+        m_cellValues->ForEachInRange(rect, [&](int32_t row, int32_t col, const CellValue& value) {
+            values[(row - rect.firstRow) + (col - rect.firstColumn)] = value;
+        });
+
+        uint32_t id = static_cast<uint32_t>(m_lookupIndexRects.size());
+        auto index = std::make_shared<const LookupIndex>(values);
+        m_lookupIndexes.emplace(rect, LookupIndexEntry{id, index});
+        m_lookupIndexRects.push_back(rect);
+        m_lookupRanges.Insert(id, rect);
+        return index;
+    }
+
+    // Drops the lookup indexes covering a cell whose value changed; they are
+    // rebuilt by the next lookup that needs them. Criteria indexes covering
+    // it are updated in place instead.
+    void InvalidateLookupIndexes(const CellReference& cell) {
+        InvalidateLookupIndexes({cell.GetRow(), cell.GetColumn(), cell.GetRow(), cell.GetColumn()});
+    }
+
+    void InvalidateLookupIndexes(const CellRect& rect) {
+        if (!m_criteriaIndexes.empty()) {
+            UpdateCriteriaIndexes(rect);
+        }
+        if (m_lookupIndexes.empty()) {
+            return;
+        }
+        std::vector<uint32_t> stale;
+        m_lookupRanges.QueryIntersecting(rect, [&](uint32_t id) { stale.push_back(id); });
+        for (uint32_t id : stale) {
+            m_lookupIndexes.erase(m_lookupIndexRects[id]);
+            m_lookupRanges.Remove(id);
+        }
+    }
+
+    void ClearLookupIndexes() {
+        m_lookupIndexes.clear();
+        m_lookupIndexRects.clear();
+        m_lookupRanges = RangeIndex();
+    }
+
+    // Returns the criteria index over equally shaped ranges, building it on
+    // first use. Positions blank in the first range are never indexed, so
+    // only its populated cells are visited.
+    std::shared_ptr<CriteriaIndex> GetCriteriaIndex(const std::vector<CellRect>& ranges) {
+        std::lock_guard<std::mutex> lock(m_criteriaIndexMutex);
+        auto it = m_criteriaIndexes.find(ranges);
+        if (it != m_criteriaIndexes.end()) {
+            return it->second;
+        }
+
+        if (m_criteriaIndexes.size() >= MAX_CRITERIA_INDEXES) {
+            m_criteriaIndexes.clear();
+        }
+
+        const CellRect& first = ranges.front();
+        int32_t rows = first.lastRow - first.firstRow + 1;
+        auto index = std::make_shared<CriteriaIndex>(ranges.size(), static_cast<size_t>(rows) * (first.lastColumn - first.firstColumn + 1));
+        std::vector<CellValue> values(ranges.size());
+        m_cellValues->ForEachInRange(first, [&](int32_t row, int32_t column, const CellValue& value) {
+            int32_t rowOffset = row - first.firstRow;
+            int32_t columnOffset = column - first.firstColumn;
+            values[0] = value;
+            for (size_t i = 1; i < ranges.size(); ++i) {
+                values[i] = GetValue(CellReference(ranges[i].firstRow + rowOffset, ranges[i].firstColumn + columnOffset));
+            }
+            index->Update(static_cast<uint32_t>(columnOffset * rows + rowOffset), values.data());
+        });
+        m_criteriaIndexes.emplace(ranges, index);
+        return index;
+    }
+
+    // Refiles the positions of every criteria index that rect overlaps, after
+    // the cells of rect changed
+    void UpdateCriteriaIndexes(const CellRect& rect) {
+        std::vector<CellValue> values;
+        for (auto& entry : m_criteriaIndexes) {
+            const std::vector<CellRect>& ranges = entry.first;
+            values.resize(ranges.size());
+            for (const auto& range : ranges) {
+                CellRect overlap{std::max(rect.firstRow, range.firstRow), std::max(rect.firstColumn, range.firstColumn),
+                                 std::min(rect.lastRow, range.lastRow), std::min(rect.lastColumn, range.lastColumn)};
+                int32_t rows = range.lastRow - range.firstRow + 1;
+                for (int32_t column = overlap.firstColumn; column <= overlap.lastColumn; ++column) {
+                    for (int32_t row = overlap.firstRow; row <= overlap.lastRow; ++row) {
+                        int32_t rowOffset = row - range.firstRow;
+                        int32_t columnOffset = column - range.firstColumn;
+                        for (size_t i = 0; i < ranges.size(); ++i) {
+                            values[i] = GetValue(CellReference(ranges[i].firstRow + rowOffset, ranges[i].firstColumn + columnOffset));
+                        }
+                        entry.second->Update(static_cast<uint32_t>(columnOffset * rows + rowOffset), values.data());
+                    }
+                }
+            }
+        }
+    }
+
+    // Finds key in an index following an Excel match mode: 0 exact (with
+    // wildcards if allowed), -1 exact or next smaller, 1 exact or next larger
+    static uint32_t FindInLookupIndex(const LookupIndex& index, const LookupKey& key, int matchMode, bool wildcards, bool last) {
+        if (matchMode == 0 && wildcards && key.type == LookupKeyType::Text && HasWildcards(key.text)) {
+            return index.FindWildcard(key.text, last);
+        }
+        uint32_t position = index.FindExact(key, last);
+        if (position != LOOKUP_NOT_FOUND || matchMode == 0) {
+            return position;
+        }
+        return matchMode < 0 ? index.FindLessOrEqual(key) : index.FindGreaterOrEqual(key);
+    }
+
+    // Reads an optional numeric argument, or returns false if it is an error or not a number
+    bool GetNumericArgument(size_t index, double defaultValue, double& out) const {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        if (index >= stack.size()) {
+            out = defaultValue;
+            return true;
+        }
+        return !stack[index].range && !stack[index].value.IsError() && ToNumber(stack[index].value, out);
+    }
+
+    // Resolves the lookup value argument; errors and ranges produce an error result
+    static bool GetLookupKey(const EvalSlot& slot, LookupKey& key, CellValue& error) {
+        if (slot.range) {
+            error = CellValue(CellErrorType::Value);
+            return false;
+        }
+        if (slot.value.IsError()) {
+            error = slot.value;
+            return false;
+        }
+        if (!LookupKey::FromValue(slot.value, key)) {
+            error = CellValue(CellErrorType::NotAvailable);
+            return false;
+        }
+        return true;
+    }
+
+    // Resolves a range at context with its corners ordered, so that A10:A1
+    // reads the same cells as A1:A10, as FormulaCompiler dependencies do
+    CellRect ResolveRect(const RangeOperand& range, const CellReference& context) const {
+        CellReference start = range.start.Resolve(context);
+        CellReference end = range.end.Resolve(context);
+        return {std::min(start.GetRow(), end.GetRow()), std::min(start.GetColumn(), end.GetColumn()),
+                std::max(start.GetRow(), end.GetRow()), std::max(start.GetColumn(), end.GetColumn())};
+    }
+
+    // VLOOKUP(lookup_value, table_array, col_index_num, [range_lookup])
+    CellValue EvaluateVLookup(size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        size_t argumentCount = stack.size() - firstArgument;
+        if (argumentCount < 3 || argumentCount > 4 || !stack[firstArgument + 1].range) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        LookupKey key;
+        CellValue error;
+        if (!GetLookupKey(stack[firstArgument], key, error)) {
+            return error;
+        }
+
+        CellRect table = ResolveRect(*stack[firstArgument + 1].range, context);
+        double columnIndex;
+        double rangeLookup;
+        if (!GetNumericArgument(firstArgument + 2, 0.0, columnIndex) || !GetNumericArgument(firstArgument + 3, 1.0, rangeLookup)) {
+            return CellValue(CellErrorType::Value);
+        }
+        int32_t column = static_cast<int32_t>(columnIndex);
+        if (column < 1) {
+            return CellValue(CellErrorType::Value);
+        }
+        if (column > table.lastColumn - table.firstColumn + 1) {
+            return CellValue(CellErrorType::Reference);
+        }
+
+        // Approximate lookup returns the last row whose key is not greater than the lookup value
+        auto index = GetLookupIndex({table.firstRow, table.firstColumn, table.lastRow, table.firstColumn});
+        uint32_t position = FindInLookupIndex(*index, key, rangeLookup != 0.0 ? -1 : 0, true, false);
+        if (position == LOOKUP_NOT_FOUND) {
+            return CellValue(CellErrorType::NotAvailable);
+        }
+        return GetValue(CellReference(table.firstRow + static_cast<int32_t>(position), table.firstColumn + column - 1));
+    }
+
+    // XLOOKUP(lookup_value, lookup_array, return_array, [if_not_found], [match_mode], [search_mode])
+    CellValue EvaluateXLookup(size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        size_t argumentCount = stack.size() - firstArgument;
+        if (argumentCount < 3 || argumentCount > 6 || !stack[firstArgument + 1].range || !stack[firstArgument + 2].range) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        LookupKey key;
+        CellValue error;
+        if (!GetLookupKey(stack[firstArgument], key, error)) {
+            return error;
+        }
+
+        double matchMode;
+        double searchMode;
+        if (!GetNumericArgument(firstArgument + 4, 0.0, matchMode) || !GetNumericArgument(firstArgument + 5, 1.0, searchMode)) {
+            return CellValue(CellErrorType::Value);
+        }
+        if (matchMode < -1 || matchMode > 2 || searchMode == 0 || searchMode < -2 || searchMode > 2) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        // Both arrays must be a single row or column of the same length
+        CellRect lookup = ResolveRect(*stack[firstArgument + 1].range, context);
+        CellRect results = ResolveRect(*stack[firstArgument + 2].range, context);
+        bool vertical = lookup.firstColumn == lookup.lastColumn;
+        if (!vertical && lookup.firstRow != lookup.lastRow) {
+            return CellValue(CellErrorType::Value);
+        }
+        int32_t length = vertical ? lookup.lastRow - lookup.firstRow + 1 : lookup.lastColumn - lookup.firstColumn + 1;
+        int32_t resultLength = vertical ? results.lastRow - results.firstRow + 1 : results.lastColumn - results.firstColumn + 1;
+        bool singleResult = vertical ? results.firstColumn == results.lastColumn : results.firstRow == results.lastRow;
+        if (resultLength != length || !singleResult) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        // Binary search modes (+/-2) find the same element as linear ones on sorted data
+        int mode = static_cast<int>(matchMode);
+        auto index = GetLookupIndex(lookup);
+        uint32_t position = FindInLookupIndex(*index, key, mode == 2 ? 0 : mode, mode == 2, searchMode < 0);
+        if (position == LOOKUP_NOT_FOUND) {
+            return argumentCount >= 4 ? stack[firstArgument + 3].value : CellValue(CellErrorType::NotAvailable);
+        }
+        int32_t offset = static_cast<int32_t>(position);
+        return GetValue(vertical ? CellReference(results.firstRow + offset, results.firstColumn)
+                                 : CellReference(results.firstRow, results.firstColumn + offset));
+    }
+
+    // MATCH(lookup_value, lookup_array, [match_type])
+    CellValue EvaluateMatch(size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        size_t argumentCount = stack.size() - firstArgument;
+        if (argumentCount < 2 || argumentCount > 3 || !stack[firstArgument + 1].range) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        LookupKey key;
+        CellValue error;
+        if (!GetLookupKey(stack[firstArgument], key, error)) {
+            return error;
+        }
+
+        double matchType;
+        if (!GetNumericArgument(firstArgument + 2, 1.0, matchType)) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        CellRect lookup = ResolveRect(*stack[firstArgument + 1].range, context);
+        if (lookup.firstColumn != lookup.lastColumn && lookup.firstRow != lookup.lastRow) {
+            return CellValue(CellErrorType::NotAvailable);
+        }
+
+        // match_type 1 finds the largest value <= key, -1 the smallest value >= key
+        int mode = matchType > 0 ? -1 : matchType < 0 ? 1 : 0;
+        auto index = GetLookupIndex(lookup);
+        uint32_t position = FindInLookupIndex(*index, key, mode, true, false);
+        if (position == LOOKUP_NOT_FOUND) {
+            return CellValue(CellErrorType::NotAvailable);
+        }
+        return CellValue(static_cast<double>(position) + 1.0);
+    }
+
+    // SUMIFS(sum_range, criteria_range1, criteria1, ...), COUNTIFS(criteria_range1,
+    // criteria1, ...) and AVERAGEIFS(average_range, criteria_range1, criteria1, ...)
+    // over equally shaped ranges. The equality criteria are answered together
+    // from the criteria index of their ranges, which leaves only one group's
+    // positions to test against the other criteria; without an equality
+    // criterion every position is tested. SUMIFS and AVERAGEIFS ignore
+    // non-numeric values and return the first error among matched values.
+    CellValue EvaluateConditionalAggregate(AggregateFunction aggregate, size_t firstArgument, const CellReference& context) {
+        const std::vector<EvalSlot>& stack = GetEvalScratch().stack;
+        size_t firstCriterion = firstArgument + (aggregate == AggregateFunction::Count ? 0 : 1);
+        if (stack.size() <= firstCriterion || (stack.size() - firstCriterion) % 2 != 0) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        CellRect aggregated{};
+        if (aggregate != AggregateFunction::Count) {
+            if (!stack[firstArgument].range) {
+                return CellValue(CellErrorType::Value);
+            }
+            aggregated = ResolveRect(*stack[firstArgument].range, context);
+        }
+        std::vector<CellRect> ranges;
+        std::vector<CriteriaMatcher> matchers;
+        for (size_t i = firstCriterion; i < stack.size(); i += 2) {
+            if (!stack[i].range || stack[i + 1].range || stack[i + 1].array) {
+                return CellValue(CellErrorType::Value);
+            }
+            ranges.push_back(ResolveRect(*stack[i].range, context));
+            matchers.emplace_back(stack[i + 1].value);
+        }
+
+        // Every range must have the shape of the first criteria range
+        int32_t rows = ranges[0].lastRow - ranges[0].firstRow + 1;
+        int32_t columns = ranges[0].lastColumn - ranges[0].firstColumn + 1;
+        auto sameShape = [&](const CellRect& rect) {
+            return rect.lastRow - rect.firstRow + 1 == rows && rect.lastColumn - rect.firstColumn + 1 == columns;
+        };
+        if (!std::all_of(ranges.begin(), ranges.end(), sameShape) ||
+            (aggregate != AggregateFunction::Count && !sameShape(aggregated))) {
+            return CellValue(CellErrorType::Value);
+        }
+
+        // Equality criteria select a group of the index over their ranges,
+        // taken in sheet order so that argument order does not matter
+        std::vector<size_t> indexed;
+        std::vector<size_t> filtered;
+        for (size_t i = 0; i < matchers.size(); ++i) {
+            (matchers[i].IsIndexable() ? indexed : filtered).push_back(i);
+        }
+        std::sort(indexed.begin(), indexed.end(), [&](size_t a, size_t b) {
+            return std::make_tuple(ranges[a].firstColumn, ranges[a].firstRow, ranges[a].lastColumn, ranges[a].lastRow) <
+                   std::make_tuple(ranges[b].firstColumn, ranges[b].firstRow, ranges[b].lastColumn, ranges[b].lastRow);
+        });
+        std::shared_ptr<CriteriaIndex> index;
+        const std::vector<uint32_t>* candidates = nullptr;
+        if (!indexed.empty()) {
+            std::vector<CellRect> indexRanges;
+            std::vector<LookupKey> keys;
+            for (size_t i : indexed) {
+                indexRanges.push_back(ranges[i]);
+                keys.push_back(matchers[i].GetKey());
+            }
+            index = GetCriteriaIndex(indexRanges);
+            candidates = index->Find(keys);
+        }
+
+        double sum = 0.0;
+        size_t count = 0;
+        size_t positionCount = indexed.empty() ? static_cast<size_t>(rows) * columns : candidates ? candidates->size() : 0;
+        for (size_t k = 0; k < positionCount; ++k) {
+            uint32_t position = candidates ? (*candidates)[k] : static_cast<uint32_t>(k);
+            int32_t rowOffset = static_cast<int32_t>(position % rows);
+            int32_t columnOffset = static_cast<int32_t>(position / rows);
+            bool matched = std::all_of(filtered.begin(), filtered.end(), [&](size_t i) {
+                return matchers[i].Matches(GetValue(CellReference(ranges[i].firstRow + rowOffset, ranges[i].firstColumn + columnOffset)));
+            });
+            if (!matched) {
+                continue;
+            }
+            if (aggregate == AggregateFunction::Count) {
+                ++count;
+                continue;
+            }
+            const CellValue& value = GetValue(CellReference(aggregated.firstRow + rowOffset, aggregated.firstColumn + columnOffset));
+            if (value.IsError()) {
+                return value;
+            }
+            if (value.IsNumeric()) {
+                sum += value.GetNumeric();
+                ++count;
+            }
+        }
+
+        switch (aggregate) {
+            case AggregateFunction::Count:
+                return CellValue(static_cast<double>(count));
+            case AggregateFunction::Average:
+                return count == 0 ? CellValue(CellErrorType::DivisionByZero) : CellValue(sum / count);
+            default:
+                return CellValue(sum);
+        }
+    }
+
+    // SUMPRODUCT over equally sized ranges or arrays; non-numeric cells count as zero
+    CellValue EvaluateSumProduct(size_t firstArgument, const CellReference& context) {
+        const AggregateKernels& kernels = GetAggregateKernels();
+        EvalScratch& scratch = GetEvalScratch();
+        std::vector<double>& product = scratch.productValues;
+
+        int rows = 0;
+        int columns = 0;
+        for (size_t i = firstArgument; i < scratch.stack.size(); ++i) {
+            const EvalSlot& slot = scratch.stack[i];
+            if (!slot.range && !slot.array) {
+                if (slot.value.IsError()) {
+                    return slot.value;
+                }
+                return CellValue(CellErrorType::Value);
+            }
+
+            // Every array must have the same dimensions as the first
+            int argumentRows;
+            int argumentColumns;
+            if (slot.array) {
+                argumentRows = slot.array->rows;
+                argumentColumns = slot.array->columns;
+            } else {
+                CellRect rect = ResolveRect(*slot.range, context);
+                argumentRows = rect.lastRow - rect.firstRow + 1;
+                argumentColumns = rect.lastColumn - rect.firstColumn + 1;
+            }
+            if (i == firstArgument) {
+                rows = argumentRows;
+                columns = argumentColumns;
+            } else if (argumentRows != rows || argumentColumns != columns) {
+                return CellValue(CellErrorType::Value);
+            }
+
+            CellValue error;
+            NumericSpan span = slot.array ? GatherArray(*slot.array, true, scratch.spanValues, scratch.spanValid, error)
+                                          : GatherRange(*slot.range, context, true, scratch.spanValues, scratch.spanValid, error);
+            if (!error.IsEmpty()) {
+                return error;
+            }
+            // Two arrays reduce with the dot-product kernel; more are multiplied pairwise first
+            size_t remaining = scratch.stack.size() - i - 1;
+            if (i == firstArgument) {
+                if (remaining == 0) {
+                    return CellValue(kernels.sum(span.values, span.count));
+                }
+                product.assign(span.values, span.values + span.count);
+            } else if (remaining == 0) {
+                return CellValue(kernels.dot(product.data(), span.values, span.count));
+            } else {
+                for (size_t j = 0; j < span.count; ++j) {
+                    product[j] *= span.values[j];
+                }
+            }
+        }
+        return CellValue(CellErrorType::Value);
     }
 };
 
 // Human tasks:
-// 1. Implement the TokenizeFormula function to properly tokenize formula strings
-// 2. Implement the ParseTokens function to create an abstract syntax tree from tokens
-// 3. Implement the EvaluateExpression function to evaluate AST nodes
-// 4. Add error handling and validation throughout the code
-// 5. Optimize performance for large spreadsheets with many formulas
-// 6. Implement circular reference detection and handling
-// 7. Add support for array formulas and dynamic arrays
-// 8. Implement volatile functions (e.g., NOW(), RAND()) that need to be recalculated on every change
\ No newline at end of file
+// 1. Add error handling and validation throughout the code
+// 2. Optimize performance for large spreadsheets with many formulas
+// 3. Support sheet-qualified references (e.g. Sheet2!A1) in the formula compiler
\ No newline at end of file
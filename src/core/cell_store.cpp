@@ -0,0 +1,723 @@
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include "excel_types.h"
+#include "cell_value.h"
+#include "dependency_graph.h"
+#include "thread_pool.h"
+#include "cell_store.h"
+
+// Global constants
+const int32_t CELL_BLOCK_ROWS = 1024;                       // rows per block, a power of two
+const int32_t CELL_BLOCK_SHIFT = 10;
+const size_t SPARSE_BLOCK_LIMIT = 64;                      // a sparse block turns dense beyond this
+const size_t DENSE_BLOCK_MINIMUM = SPARSE_BLOCK_LIMIT / 4; // and back to sparse below this
+
+class CellStore;
+
+// Source of the column chunks registered with CellStore::AddDeferredChunk,
+// e.g. the sheet of a memory-mapped workbook file. LoadChunk fills the
+// chunk in through CellStore::FillChunk and CellStore::MapChunk. It runs on
+// whichever thread first touches the chunk, one chunk at a time per store,
+// except that CellStore::LoadDeferredChunks with a thread pool loads
+// different chunks concurrently. It throws std::runtime_error if the
+// chunk's data is damaged.
+class CellChunkLoader {
+public:
+    virtual ~CellChunkLoader() = default;
+    virtual void LoadChunk(uint32_t chunk, CellStore& store) = 0;
+};
+
+// Source of a store deferred as a whole with CellStore::DeferSheet.
+// AttachSheet registers the sheet's cells, typically as deferred chunks;
+// like LoadChunk, it runs on the first thread to touch the store.
+class CellSheetLoader {
+public:
+    virtual ~CellSheetLoader() = default;
+    virtual void AttachSheet(CellStore& store) = 0;
+};
+
+// Cell values of one worksheet, organized by column and then by blocks of
+// CELL_BLOCK_ROWS rows. A block with many populated cells is a dense array
+// indexed by row offset; a block with a few scattered cells is a short
+// sorted vector. Iterating a range therefore walks each column's blocks in
+// row order over contiguous memory. Empty values are never stored.
+//
+// Ranges of a column can also be deferred: they are loaded by a
+// CellChunkLoader the first time one of their cells is read or written. A
+// block loaded from numbers the loader keeps in memory, such as a file
+// mapping, refers to them in place until it is written to. A whole store
+// can be deferred too, so that an unused sheet costs nothing until touched
+// and can be released again later.
+//
+// Reads may run concurrently with each other, including reads that load
+// deferred chunks; writes must not overlap reads.
+class CellStore {
+private:
+    struct Block {
+        uint32_t count = 0;
+        std::vector<CellValue> dense;                        // CELL_BLOCK_ROWS entries when dense
+        std::vector<std::pair<uint16_t, CellValue>> sparse;  // sorted by row offset otherwise
+        const double* mapped = nullptr;                      // or numbers of rows mappedFirst to mappedFirst + count - 1
+        uint16_t mappedFirst = 0;
+
+        bool IsDense() const {
+            return !dense.empty();
+        }
+    };
+
+    struct Column {
+        std::vector<std::unique_ptr<Block>> blocks;
+        std::vector<uint32_t> pending;  // per block, 1 + index of its deferred chunk, or 0
+    };
+
+    struct DeferredChunk {
+        std::shared_ptr<CellChunkLoader> loader;    // also keeps mapped numbers alive
+        uint32_t id;
+        int32_t column;
+        int32_t firstRow;
+        int32_t lastRow;
+        size_t cellCount;
+        mutable std::atomic<bool> loaded;
+    };
+
+    // A chunk being filled in on the calling thread, and the cells its load
+    // has added so far. Loads count their cells here rather than in
+    // m_cellCount, so that concurrent loads share no state.
+    struct ChunkLoad {
+        const CellStore* store;
+        const DeferredChunk* chunk;
+        size_t cellCount;
+    };
+
+    std::vector<Column> m_columns;
+    size_t m_cellCount;
+    std::deque<DeferredChunk> m_deferredChunks;
+    mutable std::mutex m_loadMutex;
+
+    std::shared_ptr<CellSheetLoader> m_sheetLoader;    // set while the store is a deferred sheet
+    std::atomic<bool> m_sheetAttached;
+    size_t m_sheetCellCount;
+    uint64_t m_writeCount;                             // writes since DeferSheet
+    mutable std::mutex m_attachMutex;
+
+public:
+    CellStore() : m_cellCount(0), m_sheetAttached(true), m_sheetCellCount(0), m_writeCount(0) {}
+
+    CellStore(const CellStore&) = delete;
+    CellStore& operator=(const CellStore&) = delete;
+
+    // Returns the value at (row, column), both 1-based, or an empty value
+    CellValue Get(int32_t row, int32_t column) const {
+        const Block* block = FindBlock(row, column);
+        if (!block) {
+            return CellValue();
+        }
+        uint16_t offset = static_cast<uint16_t>((row - 1) & (CELL_BLOCK_ROWS - 1));
+        if (block->IsDense()) {
+            return block->dense[offset];
+        }
+        if (block->mapped) {
+            uint32_t index = static_cast<uint32_t>(offset - block->mappedFirst);
+            return index < block->count ? CellValue(block->mapped[index]) : CellValue();
+        }
+        auto it = LowerBound(block->sparse, offset);
+        return (it != block->sparse.end() && it->first == offset) ? it->second : CellValue();
+    }
+
+    CellValue Get(const CellReference& cell) const {
+        return Get(cell.GetRow(), cell.GetColumn());
+    }
+
+    // Stores a value; storing an empty value removes the cell
+    void Set(const CellReference& cell, const CellValue& value) {
+        AttachDeferredSheet();
+        ++m_writeCount;
+        if (value.IsEmpty()) {
+            Erase(cell.GetRow(), cell.GetColumn());
+            return;
+        }
+        size_t columnIndex = static_cast<size_t>(cell.GetColumn() - 1);
+        if (columnIndex < m_columns.size()) {
+            LoadDeferredBlock(m_columns[columnIndex], static_cast<size_t>((cell.GetRow() - 1) >> CELL_BLOCK_SHIFT));
+        }
+        Store(cell.GetRow(), cell.GetColumn(), value, m_cellCount);
+    }
+
+    // Stores count consecutive values of a column starting at firstRow, as
+    // when loading a file. Blocks that were empty and receive enough values
+    // are filled densely in one copy instead of growing cell by cell.
+    void SetColumn(int32_t column, int32_t firstRow, const CellValue* values, size_t count) {
+        AttachDeferredSheet();
+        ++m_writeCount;
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        if (columnIndex < m_columns.size() && count > 0) {
+            size_t lastBlock = static_cast<size_t>((firstRow - 1 + static_cast<int32_t>(count) - 1) >> CELL_BLOCK_SHIFT);
+            for (size_t blockIndex = static_cast<size_t>((firstRow - 1) >> CELL_BLOCK_SHIFT); blockIndex <= lastBlock; ++blockIndex) {
+                LoadDeferredBlock(m_columns[columnIndex], blockIndex);
+            }
+        }
+        StoreColumn(column, firstRow, values, count, m_cellCount);
+    }
+
+    // Registers rows firstRow to firstRow + rowCount - 1 of a column, holding
+    // cellCount cells, to be loaded by loader->LoadChunk(id, *this) when one
+    // of them is first read or written. The cells count towards
+    // GetCellCount right away. If the rows already hold cells, the chunk is
+    // loaded immediately and merged into them.
+    void AddDeferredChunk(int32_t column, int32_t firstRow, int32_t rowCount, size_t cellCount,
+                          std::shared_ptr<CellChunkLoader> loader, uint32_t id) {
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        if (columnIndex >= m_columns.size()) {
+            m_columns.resize(columnIndex + 1);
+        }
+        Column& target = m_columns[columnIndex];
+        size_t firstBlock = static_cast<size_t>((firstRow - 1) >> CELL_BLOCK_SHIFT);
+        size_t lastBlock = static_cast<size_t>((firstRow + rowCount - 2) >> CELL_BLOCK_SHIFT);
+        if (lastBlock >= target.blocks.size()) {
+            target.blocks.resize(lastBlock + 1);
+        }
+
+        // Earlier chunks sharing a block are loaded first so that this one
+        // merges into their cells
+        bool occupied = false;
+        for (size_t blockIndex = firstBlock; blockIndex <= lastBlock; ++blockIndex) {
+            LoadDeferredBlock(target, blockIndex);
+            occupied = occupied || target.blocks[blockIndex];
+        }
+
+        m_deferredChunks.emplace_back();
+        DeferredChunk& chunk = m_deferredChunks.back();
+        chunk.loader = std::move(loader);
+        chunk.id = id;
+        chunk.column = column;
+        chunk.firstRow = firstRow;
+        chunk.lastRow = firstRow + rowCount - 1;
+        chunk.cellCount = cellCount;
+        chunk.loaded.store(false, std::memory_order_relaxed);
+        m_cellCount += cellCount;
+        if (occupied) {
+            try {
+                LoadDeferredChunk(chunk);
+            } catch (...) {
+                m_cellCount -= cellCount;
+                m_deferredChunks.pop_back();
+                throw;
+            }
+            return;
+        }
+
+        if (lastBlock >= target.pending.size()) {
+            target.pending.resize(lastBlock + 1, 0);
+        }
+        for (size_t blockIndex = firstBlock; blockIndex <= lastBlock; ++blockIndex) {
+            target.pending[blockIndex] = static_cast<uint32_t>(m_deferredChunks.size());
+        }
+    }
+
+    // Defers the whole store: it is cleared and stays empty until a cell is
+    // first read or written, which has loader attach the sheet's cells.
+    // GetCellCount reports cellCount meanwhile.
+    void DeferSheet(std::shared_ptr<CellSheetLoader> loader, size_t cellCount) {
+        Clear();
+        m_sheetLoader = std::move(loader);
+        m_sheetCellCount = cellCount;
+        m_cellCount = cellCount;
+        m_sheetAttached.store(false, std::memory_order_release);
+    }
+
+    // False while the store is a deferred sheet that has not been touched
+    bool IsSheetAttached() const {
+        return m_sheetAttached.load(std::memory_order_acquire);
+    }
+
+    // Returns a deferred sheet that has not been written to since
+    // DeferSheet to its untouched state, releasing its memory; its cells
+    // are attached again when next touched. Returns false, leaving the store
+    // as it is, if it was modified or is not a deferred sheet.
+    bool ReleaseSheet() {
+        if (!m_sheetLoader || m_writeCount != 0) {
+            return false;
+        }
+        if (IsSheetAttached()) {
+            std::shared_ptr<CellSheetLoader> loader = m_sheetLoader;
+            DeferSheet(std::move(loader), m_sheetCellCount);
+        }
+        return true;
+    }
+
+    // Called by CellChunkLoader::LoadChunk: stores count consecutive values
+    // of the chunk's column starting at firstRow, which must lie in the chunk
+    void FillChunk(int32_t firstRow, const CellValue* values, size_t count) {
+        ChunkLoad& load = CheckLoadingRows(firstRow, count);
+        StoreColumn(load.chunk->column, firstRow, values, count, load.cellCount);
+    }
+
+    // Called by CellChunkLoader::LoadChunk: like FillChunk, but for numbers
+    // that the store reads in place. They must stay valid and unchanged for
+    // as long as the loader is alive.
+    void MapChunk(int32_t firstRow, const double* numbers, size_t count) {
+        ChunkLoad& load = CheckLoadingRows(firstRow, count);
+        int32_t column = load.chunk->column;
+        auto& blocks = m_columns[column - 1].blocks;
+        int32_t row = firstRow;
+        const double* end = numbers + count;
+        while (numbers < end) {
+            size_t blockIndex = static_cast<size_t>((row - 1) >> CELL_BLOCK_SHIFT);
+            int32_t offset = (row - 1) & (CELL_BLOCK_ROWS - 1);
+            size_t run = std::min<size_t>(static_cast<size_t>(CELL_BLOCK_ROWS - offset), static_cast<size_t>(end - numbers));
+            if (!blocks[blockIndex]) {
+                auto block = std::make_unique<Block>();
+                block->mapped = numbers;
+                block->mappedFirst = static_cast<uint16_t>(offset);
+                block->count = static_cast<uint32_t>(run);
+                load.cellCount += run;
+                blocks[blockIndex] = std::move(block);
+            } else {
+                for (size_t i = 0; i < run; ++i) {
+                    Store(row + static_cast<int32_t>(i), column, CellValue(numbers[i]), load.cellCount);
+                }
+            }
+            numbers += run;
+            row += static_cast<int32_t>(run);
+        }
+    }
+
+    // Loads every deferred chunk and copies numbers read in place into the
+    // store's own memory, so that the store no longer depends on its
+    // loaders, e.g. before the file they read from is overwritten
+    void LoadDeferredChunks() {
+        LoadDeferredChunks({this}, nullptr, true);
+    }
+
+    // Loads every deferred chunk of stores, including deferred sheets,
+    // decoding them concurrently on threads if given. Chunks fill in blocks
+    // no other chunk touches and count their cells separately, so they load
+    // without the load mutex; like a write, this must not overlap reads of
+    // the stores. With detach, numbers read in place are then copied as by
+    // LoadDeferredChunks(). Every chunk is tried before the first error is
+    // rethrown; chunks that failed stay deferred.
+    static void LoadDeferredChunks(const std::vector<CellStore*>& stores, ThreadPool* threads, bool detach) {
+        auto forEach = [threads](size_t count, const std::function<void(size_t, size_t)>& body) {
+            if (threads) {
+                threads->ParallelFor(count, 1, body);
+            } else {
+                body(0, count);
+            }
+        };
+        forEach(stores.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                stores[i]->AttachDeferredSheet();
+            }
+        });
+
+        struct ChunkTask {
+            CellStore* store;
+            const DeferredChunk* chunk;
+            int64_t cellDelta;
+            std::exception_ptr error;
+        };
+        std::vector<ChunkTask> tasks;
+        for (CellStore* store : stores) {
+            for (const auto& chunk : store->m_deferredChunks) {
+                if (!chunk.loaded.load(std::memory_order_acquire)) {
+                    tasks.push_back({store, &chunk, 0, nullptr});
+                }
+            }
+        }
+        forEach(tasks.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                tasks[i].cellDelta = tasks[i].store->LoadChunkContents(*tasks[i].chunk, tasks[i].error);
+            }
+        });
+
+        // Merge the cell counts on this thread
+        std::exception_ptr firstError;
+        for (const auto& task : tasks) {
+            task.store->m_cellCount += static_cast<size_t>(task.cellDelta);
+            if (task.error && !firstError) {
+                firstError = task.error;
+            }
+        }
+        if (firstError) {
+            std::rethrow_exception(firstError);
+        }
+        if (!detach) {
+            return;
+        }
+
+        std::vector<std::pair<CellStore*, size_t>> columns;
+        for (CellStore* store : stores) {
+            store->m_sheetLoader.reset();
+            for (size_t column = 0; column < store->m_columns.size(); ++column) {
+                columns.emplace_back(store, column);
+            }
+        }
+        forEach(columns.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                Column& column = columns[i].first->m_columns[columns[i].second];
+                for (auto& block : column.blocks) {
+                    if (block && block->mapped) {
+                        CopyMappedBlock(*block);
+                    }
+                }
+                std::vector<uint32_t>().swap(column.pending);
+            }
+        });
+        for (CellStore* store : stores) {
+            store->m_deferredChunks.clear();
+        }
+    }
+
+    // Calls visit(row, column, value) for every populated cell in rect,
+    // column by column and top to bottom within each column
+    template <typename Visitor>
+    void ForEachInRange(const CellRect& rect, Visitor visit) const {
+        AttachDeferredSheet();
+        int32_t lastColumn = std::min<int32_t>(rect.lastColumn, static_cast<int32_t>(m_columns.size()));
+        for (int32_t column = std::max(rect.firstColumn, 1); column <= lastColumn; ++column) {
+            const Column& cells = m_columns[column - 1];
+            const auto& blocks = cells.blocks;
+            int32_t firstBlock = (std::max(rect.firstRow, 1) - 1) >> CELL_BLOCK_SHIFT;
+            int32_t lastBlock = std::min<int32_t>((rect.lastRow - 1) >> CELL_BLOCK_SHIFT, static_cast<int32_t>(blocks.size()) - 1);
+            for (int32_t blockIndex = firstBlock; blockIndex <= lastBlock; ++blockIndex) {
+                LoadDeferredBlock(cells, static_cast<size_t>(blockIndex));
+                const Block* block = blocks[blockIndex].get();
+                if (!block) {
+                    continue;
+                }
+                int32_t baseRow = blockIndex * CELL_BLOCK_ROWS + 1;
+                int32_t first = std::max(rect.firstRow - baseRow, 0);
+                int32_t last = std::min(rect.lastRow - baseRow, CELL_BLOCK_ROWS - 1);
+                if (block->IsDense()) {
+                    for (int32_t offset = first; offset <= last; ++offset) {
+                        if (!block->dense[offset].IsEmpty()) {
+                            visit(baseRow + offset, column, block->dense[offset]);
+                        }
+                    }
+                    continue;
+                }
+                if (block->mapped) {
+                    int32_t end = std::min<int32_t>(last + 1, block->mappedFirst + static_cast<int32_t>(block->count));
+                    for (int32_t offset = std::max<int32_t>(first, block->mappedFirst); offset < end; ++offset) {
+                        visit(baseRow + offset, column, CellValue(block->mapped[offset - block->mappedFirst]));
+                    }
+                    continue;
+                }
+                for (auto it = LowerBound(block->sparse, static_cast<uint16_t>(first));
+                     it != block->sparse.end() && it->first <= last; ++it) {
+                    visit(baseRow + it->first, column, it->second);
+                }
+            }
+        }
+    }
+
+    size_t GetCellCount() const {
+        return m_cellCount;
+    }
+
+    // Approximate heap bytes held by the store, excluding interned strings
+    // and numbers read in place
+    size_t GetMemoryUsage() const {
+        size_t bytes = m_columns.capacity() * sizeof(Column) + m_deferredChunks.size() * sizeof(DeferredChunk);
+        for (const auto& column : m_columns) {
+            bytes += column.blocks.capacity() * sizeof(std::unique_ptr<Block>) + column.pending.capacity() * sizeof(uint32_t);
+            for (const auto& block : column.blocks) {
+                if (block) {
+                    bytes += sizeof(Block) + block->dense.capacity() * sizeof(CellValue) +
+                             block->sparse.capacity() * sizeof(std::pair<uint16_t, CellValue>);
+                }
+            }
+        }
+        return bytes;
+    }
+
+    void Clear() {
+        m_columns.clear();
+        m_deferredChunks.clear();
+        m_cellCount = 0;
+        m_sheetLoader.reset();
+        m_sheetAttached.store(true, std::memory_order_release);
+        m_writeCount = 0;
+    }
+
+private:
+    // Returns the block holding (row, column), loading it first if deferred
+    const Block* FindBlock(int32_t row, int32_t column) const {
+        AttachDeferredSheet();
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        if (columnIndex >= m_columns.size()) {
+            return nullptr;
+        }
+        const Column& cells = m_columns[columnIndex];
+        size_t blockIndex = static_cast<size_t>((row - 1) >> CELL_BLOCK_SHIFT);
+        if (blockIndex >= cells.blocks.size()) {
+            return nullptr;
+        }
+        LoadDeferredBlock(cells, blockIndex);
+        return cells.blocks[blockIndex].get();
+    }
+
+    void AttachDeferredSheet() const {
+        if (!m_sheetAttached.load(std::memory_order_acquire)) {
+            AttachSheetNow();
+        }
+    }
+
+    // Has the sheet loader attach a deferred sheet's cells; concurrent
+    // readers wait here as for chunk loads. If the loader throws, the store
+    // is left deferred.
+    void AttachSheetNow() const {
+        std::lock_guard<std::mutex> lock(m_attachMutex);
+        if (m_sheetAttached.load(std::memory_order_relaxed)) {
+            return;
+        }
+        CellStore& self = const_cast<CellStore&>(*this);
+        self.m_cellCount = 0;
+        try {
+            m_sheetLoader->AttachSheet(self);
+        } catch (...) {
+            self.m_columns.clear();
+            self.m_deferredChunks.clear();
+            self.m_cellCount = m_sheetCellCount;
+            throw;
+        }
+        self.m_sheetAttached.store(true, std::memory_order_release);
+    }
+
+    void LoadDeferredBlock(const Column& column, size_t blockIndex) const {
+        if (blockIndex < column.pending.size() && column.pending[blockIndex] != 0) {
+            const DeferredChunk& chunk = m_deferredChunks[column.pending[blockIndex] - 1];
+            if (!chunk.loaded.load(std::memory_order_acquire)) {
+                LoadDeferredChunk(chunk);
+            }
+        }
+    }
+
+    // Loads a deferred chunk under the load mutex. Loading only fills in
+    // cells that already count as present, so it is allowed from const
+    // readers; concurrent readers of the chunk wait here until it is done.
+    void LoadDeferredChunk(const DeferredChunk& chunk) const {
+        std::lock_guard<std::mutex> lock(m_loadMutex);
+        if (chunk.loaded.load(std::memory_order_relaxed)) {
+            return;
+        }
+        CellStore& self = const_cast<CellStore&>(*this);
+        std::exception_ptr error;
+        self.m_cellCount += static_cast<size_t>(self.LoadChunkContents(chunk, error));
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Has the chunk's loader fill it in on the calling thread and returns
+    // the change to apply to m_cellCount, which already counts the chunk.
+    // If the loader throws, the exception is stored in error, the partly
+    // filled rows are cleared and the chunk stays deferred.
+    int64_t LoadChunkContents(const DeferredChunk& chunk, std::exception_ptr& error) {
+        ChunkLoad load{this, &chunk, 0};
+        ChunkLoad* outer = CurrentChunkLoad();
+        CurrentChunkLoad() = &load;
+        try {
+            chunk.loader->LoadChunk(chunk.id, *this);
+        } catch (...) {
+            CurrentChunkLoad() = outer;
+            error = std::current_exception();
+            int64_t cellDelta = static_cast<int64_t>(load.cellCount);
+            auto& blocks = m_columns[chunk.column - 1].blocks;
+            for (int32_t blockIndex = (chunk.firstRow - 1) >> CELL_BLOCK_SHIFT; blockIndex <= (chunk.lastRow - 1) >> CELL_BLOCK_SHIFT; ++blockIndex) {
+                if (blocks[blockIndex]) {
+                    cellDelta -= blocks[blockIndex]->count;
+                    blocks[blockIndex].reset();
+                }
+            }
+            return cellDelta;
+        }
+        CurrentChunkLoad() = outer;
+        chunk.loaded.store(true, std::memory_order_release);
+        return static_cast<int64_t>(load.cellCount) - static_cast<int64_t>(chunk.cellCount);
+    }
+
+    static ChunkLoad*& CurrentChunkLoad() {
+        thread_local ChunkLoad* load = nullptr;
+        return load;
+    }
+
+    // Returns the load of this store running on the calling thread after
+    // checking that the rows lie in its chunk
+    ChunkLoad& CheckLoadingRows(int32_t firstRow, size_t count) const {
+        ChunkLoad* load = CurrentChunkLoad();
+        if (!load || load->store != this) {
+            throw std::runtime_error("No deferred chunk is being loaded");
+        }
+        if (count == 0 || firstRow < load->chunk->firstRow ||
+            static_cast<int64_t>(firstRow) + static_cast<int64_t>(count) - 1 > load->chunk->lastRow) {
+            throw std::runtime_error("Deferred chunk data lies outside its rows");
+        }
+        return *load;
+    }
+
+    // Replaces numbers read in place by a dense copy, before a write
+    static void CopyMappedBlock(Block& block) {
+        block.dense.assign(CELL_BLOCK_ROWS, CellValue());
+        for (uint32_t i = 0; i < block.count; ++i) {
+            block.dense[block.mappedFirst + i] = CellValue(block.mapped[i]);
+        }
+        block.mapped = nullptr;
+        block.mappedFirst = 0;
+    }
+
+    // Stores a value, counting a new cell in cellCount, which is
+    // m_cellCount or the count of a chunk load
+    void Store(int32_t row, int32_t column, const CellValue& value, size_t& cellCount) {
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        size_t blockIndex = static_cast<size_t>((row - 1) >> CELL_BLOCK_SHIFT);
+        if (columnIndex >= m_columns.size()) {
+            m_columns.resize(columnIndex + 1);
+        }
+        auto& blocks = m_columns[columnIndex].blocks;
+        if (blockIndex >= blocks.size()) {
+            blocks.resize(blockIndex + 1);
+        }
+        if (!blocks[blockIndex]) {
+            blocks[blockIndex] = std::make_unique<Block>();
+        }
+
+        Block& block = *blocks[blockIndex];
+        if (block.mapped) {
+            CopyMappedBlock(block);
+        }
+        uint16_t offset = static_cast<uint16_t>((row - 1) & (CELL_BLOCK_ROWS - 1));
+        if (block.IsDense()) {
+            if (block.dense[offset].IsEmpty()) {
+                ++block.count;
+                ++cellCount;
+            }
+            block.dense[offset] = value;
+            return;
+        }
+
+        auto it = LowerBound(block.sparse, offset);
+        if (it != block.sparse.end() && it->first == offset) {
+            it->second = value;
+            return;
+        }
+        block.sparse.insert(it, {offset, value});
+        ++block.count;
+        ++cellCount;
+
+        // Switch to a dense array once the block fills up
+        if (block.sparse.size() > SPARSE_BLOCK_LIMIT) {
+            block.dense.assign(CELL_BLOCK_ROWS, CellValue());
+            for (const auto& entry : block.sparse) {
+                block.dense[entry.first] = entry.second;
+            }
+            std::vector<std::pair<uint16_t, CellValue>>().swap(block.sparse);
+        }
+    }
+
+    void StoreColumn(int32_t column, int32_t firstRow, const CellValue* values, size_t count, size_t& cellCount) {
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        if (columnIndex >= m_columns.size()) {
+            m_columns.resize(columnIndex + 1);
+        }
+        auto& blocks = m_columns[columnIndex].blocks;
+
+        int32_t row = firstRow;
+        const CellValue* end = values + count;
+        while (values < end) {
+            size_t blockIndex = static_cast<size_t>((row - 1) >> CELL_BLOCK_SHIFT);
+            int32_t offset = (row - 1) & (CELL_BLOCK_ROWS - 1);
+            size_t run = std::min<size_t>(static_cast<size_t>(CELL_BLOCK_ROWS - offset), static_cast<size_t>(end - values));
+            if (blockIndex >= blocks.size()) {
+                blocks.resize(blockIndex + 1);
+            }
+
+            if (!blocks[blockIndex] && run > SPARSE_BLOCK_LIMIT) {
+                auto block = std::make_unique<Block>();
+                block->dense.assign(CELL_BLOCK_ROWS, CellValue());
+                for (size_t i = 0; i < run; ++i) {
+                    if (!values[i].IsEmpty()) {
+                        block->dense[offset + i] = values[i];
+                        ++block->count;
+                    }
+                }
+                cellCount += block->count;
+                blocks[blockIndex] = block->count > 0 ? std::move(block) : nullptr;
+            } else {
+                for (size_t i = 0; i < run; ++i) {
+                    if (values[i].IsEmpty()) {
+                        EraseLoaded(row + static_cast<int32_t>(i), column, cellCount);
+                    } else {
+                        Store(row + static_cast<int32_t>(i), column, values[i], cellCount);
+                    }
+                }
+            }
+            values += run;
+            row += static_cast<int32_t>(run);
+        }
+    }
+
+    void Erase(int32_t row, int32_t column) {
+        if (FindBlock(row, column)) {
+            EraseLoaded(row, column, m_cellCount);
+        }
+    }
+
+    // Removes a cell from a block that is not deferred
+    void EraseLoaded(int32_t row, int32_t column, size_t& cellCount) {
+        size_t columnIndex = static_cast<size_t>(column - 1);
+        size_t blockIndex = static_cast<size_t>((row - 1) >> CELL_BLOCK_SHIFT);
+        if (columnIndex >= m_columns.size() || blockIndex >= m_columns[columnIndex].blocks.size()) {
+            return;
+        }
+        Block* block = m_columns[columnIndex].blocks[blockIndex].get();
+        if (!block) {
+            return;
+        }
+        if (block->mapped) {
+            CopyMappedBlock(*block);
+        }
+
+        uint16_t offset = static_cast<uint16_t>((row - 1) & (CELL_BLOCK_ROWS - 1));
+        if (block->IsDense()) {
+            if (block->dense[offset].IsEmpty()) {
+                return;
+            }
+            block->dense[offset] = CellValue();
+        } else {
+            auto it = LowerBound(block->sparse, offset);
+            if (it == block->sparse.end() || it->first != offset) {
+                return;
+            }
+            block->sparse.erase(it);
+        }
+        --block->count;
+        --cellCount;
+
+        // Release empty blocks and return thinned-out dense blocks to sparse form
+        if (block->count == 0) {
+            m_columns[columnIndex].blocks[blockIndex].reset();
+        } else if (block->IsDense() && block->count < DENSE_BLOCK_MINIMUM) {
+            for (int32_t i = 0; i < CELL_BLOCK_ROWS; ++i) {
+                if (!block->dense[i].IsEmpty()) {
+                    block->sparse.emplace_back(static_cast<uint16_t>(i), block->dense[i]);
+                }
+            }
+            std::vector<CellValue>().swap(block->dense);
+        }
+    }
+
+    template <typename Entries>
+    static auto LowerBound(Entries& entries, uint16_t offset) -> decltype(entries.begin()) {
+        return std::lower_bound(entries.begin(), entries.end(), offset,
+                                [](const std::pair<uint16_t, CellValue>& entry, uint16_t value) { return entry.first < value; });
+    }
+};
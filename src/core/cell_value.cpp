@@ -0,0 +1,323 @@
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include "excel_types.h"
+#include "cell_value.h"
+
+// Global constants
+const uint32_t STRING_POOL_CHUNK_SIZE = 4096;
+const uint32_t STRING_POOL_TABLE_SIZE = 256;        // chunks per lazily allocated chunk table
+const uint32_t STRING_POOL_MAX_TABLES = 256;
+const uint32_t STRING_POOL_MAX_CHUNKS = STRING_POOL_TABLE_SIZE * STRING_POOL_MAX_TABLES;    // 268M distinct strings per pool
+const uint32_t MAX_STRING_POOLS = 4096;
+const uint32_t STRING_POOL_SLOT_BITS = 12;          // log2(MAX_STRING_POOLS)
+const uint32_t MAX_STRING_POOL_GENERATION = UINT32_MAX >> STRING_POOL_SLOT_BITS;
+const uint32_t DEFAULT_STRING_POOL_ID = 0;
+
+class StringPool;
+
+// Process-wide table mapping pool ids to live pools, so that a 16-byte
+// CellValue can carry a (pool, index) handle instead of a pointer. An id is
+// a registry slot plus the generation of the slot's current pool; slots are
+// reused once their pool is destroyed, ids never are, so a handle to a
+// destroyed pool is detected instead of resolving into its successor.
+class StringPoolRegistry {
+private:
+    std::atomic<uint32_t> m_ids[MAX_STRING_POOLS];      // id of the live pool in each slot
+    std::atomic<StringPool*> m_pools[MAX_STRING_POOLS];
+    uint32_t m_generations[MAX_STRING_POOLS];
+    std::vector<uint32_t> m_freeSlots;
+    uint32_t m_nextSlot;
+    std::mutex m_mutex;
+
+public:
+    StringPoolRegistry() : m_nextSlot(DEFAULT_STRING_POOL_ID) {
+        for (uint32_t slot = 0; slot < MAX_STRING_POOLS; ++slot) {
+            m_ids[slot].store(UINT32_MAX, std::memory_order_relaxed);
+            m_pools[slot].store(nullptr, std::memory_order_relaxed);
+            m_generations[slot] = 0;
+        }
+    }
+
+    static StringPoolRegistry& Instance() {
+        static StringPoolRegistry registry;
+        return registry;
+    }
+
+    uint32_t Register(StringPool* pool) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t slot;
+        if (!m_freeSlots.empty()) {
+            slot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+        } else if (m_nextSlot < MAX_STRING_POOLS) {
+            slot = m_nextSlot++;
+        } else {
+            throw std::runtime_error("Too many open string pools");
+        }
+        uint32_t id = (m_generations[slot] << STRING_POOL_SLOT_BITS) | slot;
+        m_pools[slot].store(pool, std::memory_order_release);
+        m_ids[slot].store(id, std::memory_order_release);
+        return id;
+    }
+
+    void Unregister(uint32_t id) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t slot = id & (MAX_STRING_POOLS - 1);
+        m_ids[slot].store(UINT32_MAX, std::memory_order_release);
+        m_pools[slot].store(nullptr, std::memory_order_release);
+
+        // A slot whose generations are used up is retired
+        if (m_generations[slot] < MAX_STRING_POOL_GENERATION) {
+            ++m_generations[slot];
+            m_freeSlots.push_back(slot);
+        }
+    }
+
+    // Returns the pool with the given id, or nullptr if it was destroyed
+    StringPool* Find(uint32_t id) const {
+        uint32_t slot = id & (MAX_STRING_POOLS - 1);
+        if (m_ids[slot].load(std::memory_order_acquire) != id) {
+            return nullptr;
+        }
+        return m_pools[slot].load(std::memory_order_acquire);
+    }
+};
+
+// Interned, append-only string storage owned by one workbook, or by a
+// FormulaArena for formula constants. Equal strings share one index, so
+// string cells cost a 4-byte handle each and compare by index. Strings are
+// stored in fixed-size chunks that never move, found through tables that are
+// allocated as the pool grows, so an empty pool costs about 2 KB. Both are
+// in place before an index is published, which lets readers resolve
+// published indexes without taking the lock. Strings are released together
+// when the pool is destroyed; reading a CellValue that outlived its pool
+// throws.
+class StringPool {
+private:
+    struct ChunkTable {
+        std::unique_ptr<std::string[]> chunks[STRING_POOL_TABLE_SIZE];
+    };
+
+    uint32_t m_id;
+    std::unique_ptr<ChunkTable> m_tables[STRING_POOL_MAX_TABLES];    // allocated as the pool grows
+    std::atomic<uint32_t> m_size;
+    std::unordered_map<std::string_view, uint32_t> m_indexes;
+    size_t m_characterBytes;
+    mutable std::mutex m_mutex;
+
+public:
+    StringPool()
+        : m_size(0),
+          m_characterBytes(0) {
+        m_id = StringPoolRegistry::Instance().Register(this);
+    }
+
+    ~StringPool() {
+        StringPoolRegistry::Instance().Unregister(m_id);
+    }
+
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    uint32_t GetId() const {
+        return m_id;
+    }
+
+    // Returns the index of text, adding it on first use
+    uint32_t Intern(std::string_view text) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_indexes.find(text);
+        if (it != m_indexes.end()) {
+            return it->second;
+        }
+
+        uint32_t index = m_size.load(std::memory_order_relaxed);
+        uint32_t chunk = index / STRING_POOL_CHUNK_SIZE;
+        if (chunk >= STRING_POOL_MAX_CHUNKS) {
+            throw std::runtime_error("String pool is full");
+        }
+        // Tables and chunks are allocated before the index is published below
+        std::unique_ptr<ChunkTable>& table = m_tables[chunk / STRING_POOL_TABLE_SIZE];
+        if (!table) {
+            table.reset(new ChunkTable());
+        }
+        std::unique_ptr<std::string[]>& strings = table->chunks[chunk % STRING_POOL_TABLE_SIZE];
+        if (!strings) {
+            strings.reset(new std::string[STRING_POOL_CHUNK_SIZE]);
+        }
+        std::string& stored = strings[index % STRING_POOL_CHUNK_SIZE];
+        stored.assign(text.data(), text.size());
+        m_indexes.emplace(std::string_view(stored), index);
+        m_characterBytes += stored.capacity();
+
+        // Publish the new string to lock-free readers
+        m_size.store(index + 1, std::memory_order_release);
+        return index;
+    }
+
+    const std::string& Get(uint32_t index) const {
+        uint32_t chunk = index / STRING_POOL_CHUNK_SIZE;
+        return m_tables[chunk / STRING_POOL_TABLE_SIZE]->chunks[chunk % STRING_POOL_TABLE_SIZE][index % STRING_POOL_CHUNK_SIZE];
+    }
+
+    size_t Size() const {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    // Approximate heap bytes held by the pool
+    size_t GetMemoryUsage() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t chunkCount = (m_size.load(std::memory_order_relaxed) + STRING_POOL_CHUNK_SIZE - 1) / STRING_POOL_CHUNK_SIZE;
+        size_t tableCount = (chunkCount + STRING_POOL_TABLE_SIZE - 1) / STRING_POOL_TABLE_SIZE;
+        return sizeof(m_tables) + tableCount * sizeof(ChunkTable) +
+               chunkCount * STRING_POOL_CHUNK_SIZE * sizeof(std::string) +
+               m_indexes.size() * (sizeof(std::string_view) + sizeof(uint32_t) + 2 * sizeof(void*)) +
+               m_characterBytes;
+    }
+
+    static StringPool* FromId(uint32_t id) {
+        return StringPoolRegistry::Instance().Find(id);
+    }
+
+    // Pool used by threads that have not selected a workbook's pool
+    static StringPool& Default() {
+        static StringPool pool;
+        return pool;
+    }
+
+    // Pool new strings are interned into on the calling thread
+    static StringPool& Current() {
+        StringPool* pool = CurrentSlot();
+        return pool ? *pool : Default();
+    }
+
+private:
+    friend class StringPoolScope;
+
+    static StringPool*& CurrentSlot() {
+        thread_local StringPool* pool = nullptr;
+        return pool;
+    }
+};
+
+// Selects the pool strings are interned into on this thread for the
+// lifetime of the scope, e.g. while editing or recalculating one workbook
+class StringPoolScope {
+private:
+    StringPool* m_previous;
+
+public:
+    explicit StringPoolScope(StringPool& pool) : m_previous(StringPool::CurrentSlot()) {
+        StringPool::CurrentSlot() = &pool;
+    }
+
+    ~StringPoolScope() {
+        StringPool::CurrentSlot() = m_previous;
+    }
+
+    StringPoolScope(const StringPoolScope&) = delete;
+    StringPoolScope& operator=(const StringPoolScope&) = delete;
+};
+
+// Tagged 16-byte cell value: an 8-byte payload holding a double, a boolean,
+// an error code or a (pool, index) string handle, plus a type tag. It is
+// trivially copyable, so copies are plain 16-byte moves with no allocation.
+class CellValue {
+public:
+    enum class Type : uint8_t {
+        Empty,
+        Number,
+        Boolean,
+        String,
+        Error
+    };
+
+private:
+    struct StringHandle {
+        uint32_t pool;
+        uint32_t index;
+    };
+
+    union {
+        double m_number;
+        bool m_boolean;
+        CellErrorType m_error;
+        StringHandle m_string;
+    };
+    Type m_type;
+
+public:
+    CellValue() : m_number(0.0), m_type(Type::Empty) {}
+    CellValue(double number) : m_number(number), m_type(Type::Number) {}
+    CellValue(int number) : m_number(static_cast<double>(number)), m_type(Type::Number) {}
+    CellValue(bool boolean) : m_number(0.0), m_type(Type::Boolean) { m_boolean = boolean; }
+    CellValue(CellErrorType error) : m_number(0.0), m_type(Type::Error) { m_error = error; }
+
+    // Strings are interned into the calling thread's current pool
+    CellValue(std::string_view text) : CellValue(text, StringPool::Current()) {}
+    CellValue(const std::string& text) : CellValue(std::string_view(text)) {}
+    CellValue(const char* text) : CellValue(std::string_view(text)) {}
+
+    CellValue(std::string_view text, StringPool& pool) : m_number(0.0), m_type(Type::String) {
+        m_string.pool = pool.GetId();
+        m_string.index = pool.Intern(text);
+    }
+
+    Type GetType() const { return m_type; }
+    bool IsEmpty() const { return m_type == Type::Empty; }
+    bool IsNumeric() const { return m_type == Type::Number; }
+    bool IsBoolean() const { return m_type == Type::Boolean; }
+    bool IsString() const { return m_type == Type::String; }
+    bool IsError() const { return m_type == Type::Error; }
+
+    double GetNumeric() const { return m_number; }
+    bool GetBoolean() const { return m_boolean; }
+    CellErrorType GetError() const { return m_error; }
+
+    const std::string& GetString() const {
+        const StringPool* pool = StringPool::FromId(m_string.pool);
+        if (!pool) {
+            throw std::runtime_error("String value refers to a released string pool");
+        }
+        return pool->Get(m_string.index);
+    }
+
+    bool operator==(const CellValue& other) const {
+        if (m_type != other.m_type) {
+            return false;
+        }
+        switch (m_type) {
+            case Type::Empty:
+                return true;
+            case Type::Number:
+                return m_number == other.m_number;
+            case Type::Boolean:
+                return m_boolean == other.m_boolean;
+            case Type::Error:
+                return m_error == other.m_error;
+            case Type::String:
+                // Interned strings in the same pool are equal exactly when their indexes are
+                if (m_string.pool == other.m_string.pool) {
+                    return m_string.index == other.m_string.index;
+                }
+                return GetString() == other.GetString();
+        }
+        return false;
+    }
+
+    bool operator!=(const CellValue& other) const {
+        return !(*this == other);
+    }
+};
+
+static_assert(sizeof(CellValue) == 16, "CellValue must stay 16 bytes");
+static_assert(std::is_trivially_copyable<CellValue>::value, "CellValue copies must not allocate");
@@ -0,0 +1,214 @@
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include "excel_types.h"
+#include "lookup_index.h"
+#include "criteria_index.h"
+
+// Global constants
+const uint32_t CRITERIA_NO_GROUP = UINT32_MAX;
+
+// Comparison a SUMIFS-style criterion applies to each cell
+enum class CriteriaOperator : uint8_t {
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual
+};
+
+// One parsed criterion of SUMIFS, COUNTIFS or AVERAGEIFS, e.g. 5, "apple",
+// ">=10", "<>" or "a*". Text compares case-insensitively and = and <> text
+// may use wildcards. A criterion written as a number, or as text that reads
+// as one, matches numeric cells; an empty criterion matches blank cells.
+class CriteriaMatcher {
+private:
+    CriteriaOperator m_op;
+    LookupKey m_key;
+    bool m_hasKey;          // false for blank and error criteria
+    bool m_wildcard;
+    CellValue m_error;      // set for error criteria such as #N/A
+
+public:
+    explicit CriteriaMatcher(const CellValue& criterion)
+        : m_op(CriteriaOperator::Equal), m_hasKey(false), m_wildcard(false) {
+        if (criterion.IsError()) {
+            m_error = criterion;
+            return;
+        }
+        if (!criterion.IsString()) {
+            m_hasKey = LookupKey::FromValue(criterion, m_key);
+            return;
+        }
+
+        // Split a leading comparison operator off the operand text
+        const std::string& text = criterion.GetString();
+        size_t operandStart = 0;
+        if (text.compare(0, 2, "<>") == 0) {
+            m_op = CriteriaOperator::NotEqual;
+            operandStart = 2;
+        } else if (text.compare(0, 2, "<=") == 0) {
+            m_op = CriteriaOperator::LessEqual;
+            operandStart = 2;
+        } else if (text.compare(0, 2, ">=") == 0) {
+            m_op = CriteriaOperator::GreaterEqual;
+            operandStart = 2;
+        } else if (!text.empty() && (text[0] == '<' || text[0] == '>' || text[0] == '=')) {
+            m_op = text[0] == '<' ? CriteriaOperator::Less : text[0] == '>' ? CriteriaOperator::Greater : CriteriaOperator::Equal;
+            operandStart = 1;
+        }
+        std::string operand = text.substr(operandStart);
+        if (operand.empty()) {
+            return;
+        }
+
+        // The operand is a number or boolean when it reads as one, otherwise text
+        char* end = nullptr;
+        double number = std::strtod(operand.c_str(), &end);
+        std::string upper = operand;
+        for (auto& ch : upper) {
+            ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+        }
+        if (end == operand.c_str() + operand.size()) {
+            m_key.type = LookupKeyType::Number;
+            m_key.number = number == 0.0 ? 0.0 : number;
+        } else if (upper == "TRUE" || upper == "FALSE") {
+            m_key.type = LookupKeyType::Boolean;
+            m_key.number = upper == "TRUE" ? 1.0 : 0.0;
+        } else {
+            m_key.type = LookupKeyType::Text;
+            m_key.number = 0.0;
+            m_key.text = upper;
+            m_wildcard = (m_op == CriteriaOperator::Equal || m_op == CriteriaOperator::NotEqual) && HasWildcards(upper);
+        }
+        m_hasKey = true;
+    }
+
+    // True for a plain equality on a value, which a CriteriaIndex answers
+    bool IsIndexable() const {
+        return m_op == CriteriaOperator::Equal && m_hasKey && !m_wildcard;
+    }
+
+    const LookupKey& GetKey() const {
+        return m_key;
+    }
+
+    bool Matches(const CellValue& value) const {
+        if (m_op == CriteriaOperator::Equal || m_op == CriteriaOperator::NotEqual) {
+            return IsEqual(value) == (m_op == CriteriaOperator::Equal);
+        }
+
+        // Ordered comparisons only match cells of the operand's type
+        LookupKey key;
+        if (!m_hasKey || !LookupKey::FromValue(value, key) || key.type != m_key.type) {
+            return false;
+        }
+        int comparison = key.type == LookupKeyType::Text ? key.text.compare(m_key.text)
+                                                         : (key.number < m_key.number ? -1 : key.number > m_key.number ? 1 : 0);
+        switch (m_op) {
+            case CriteriaOperator::Less:      return comparison < 0;
+            case CriteriaOperator::LessEqual: return comparison <= 0;
+            case CriteriaOperator::Greater:   return comparison > 0;
+            default:                          return comparison >= 0;
+        }
+    }
+
+private:
+    bool IsEqual(const CellValue& value) const {
+        if (!m_error.IsEmpty()) {
+            return value == m_error;
+        }
+        if (!m_hasKey) {
+            return value.IsEmpty() || (value.IsString() && value.GetString().empty());
+        }
+        LookupKey key;
+        if (!LookupKey::FromValue(value, key) || key.type != m_key.type) {
+            return false;
+        }
+        return m_wildcard ? WildcardMatch(m_key.text, key.text) : key == m_key;
+    }
+};
+
+struct LookupKeyTupleHash {
+    size_t operator()(const std::vector<LookupKey>& keys) const {
+        size_t hash = keys.size();
+        for (const auto& key : keys) {
+            hash = hash * 0x100000001B3ULL ^ LookupKeyHash()(key);
+        }
+        return hash;
+    }
+};
+
+// Group-by index over one or more equally shaped criteria ranges, addressed
+// by position within the ranges (column-major). Every position whose
+// criteria cells all hold a number, text or boolean belongs to the group of
+// its key tuple, and each group lists its positions in ascending order. An
+// equality-only SUMIFS is then answered by visiting one group instead of
+// scanning every range. Update moves a single position between groups when
+// one of its criteria cells changes, so the index never has to be rebuilt.
+class CriteriaIndex {
+private:
+    struct Group {
+        std::vector<uint32_t> positions;
+    };
+
+    size_t m_rangeCount;
+    std::unordered_map<std::vector<LookupKey>, uint32_t, LookupKeyTupleHash> m_groupIds;
+    std::vector<Group> m_groups;
+    std::vector<uint32_t> m_positionGroups;     // CRITERIA_NO_GROUP when not indexed
+    std::vector<LookupKey> m_keys;              // scratch tuple for Update
+
+public:
+    CriteriaIndex(size_t rangeCount, size_t positionCount)
+        : m_rangeCount(rangeCount), m_positionGroups(positionCount, CRITERIA_NO_GROUP), m_keys(rangeCount) {}
+
+    CriteriaIndex(const CriteriaIndex&) = delete;
+    CriteriaIndex& operator=(const CriteriaIndex&) = delete;
+
+    // Files a position under the key tuple of values, one value per criteria
+    // range; a blank or error value leaves the position out of every group
+    void Update(uint32_t position, const CellValue* values) {
+        bool indexed = true;
+        for (size_t i = 0; i < m_rangeCount && indexed; ++i) {
+            indexed = LookupKey::FromValue(values[i], m_keys[i]);
+        }
+
+        uint32_t group = CRITERIA_NO_GROUP;
+        if (indexed) {
+            auto inserted = m_groupIds.emplace(m_keys, static_cast<uint32_t>(m_groups.size()));
+            if (inserted.second) {
+                m_groups.emplace_back();
+            }
+            group = inserted.first->second;
+        }
+
+        uint32_t previous = m_positionGroups[position];
+        if (previous == group) {
+            return;
+        }
+        if (previous != CRITERIA_NO_GROUP) {
+            auto& positions = m_groups[previous].positions;
+            positions.erase(std::lower_bound(positions.begin(), positions.end(), position));
+        }
+        if (group != CRITERIA_NO_GROUP) {
+            auto& positions = m_groups[group].positions;
+            positions.insert(std::lower_bound(positions.begin(), positions.end(), position), position);
+        }
+        m_positionGroups[position] = group;
+    }
+
+    // Positions whose criteria cells equal keys, in ascending order, or nullptr if none
+    const std::vector<uint32_t>* Find(const std::vector<LookupKey>& keys) const {
+        auto it = m_groupIds.find(keys);
+        return it != m_groupIds.end() ? &m_groups[it->second].positions : nullptr;
+    }
+
+    size_t GetPositionCount() const {
+        return m_positionGroups.size();
+    }
+};
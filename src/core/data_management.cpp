@@ -2,8 +2,22 @@
 #include <unordered_map>
 #include <string>
 #include <memory>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
 #include "excel_types.h"
+#include "cell_value.h"
+#include "cell_store.h"
 #include "calculation_engine.h"
+#include "workbook_format.h"
+#include "xlsx_format.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "file_system.h"
 #include "cloud_storage.h"
 
@@ -11,7 +25,19 @@
 constexpr int MAX_WORKSHEETS = 1024;
 constexpr int MAX_ROWS = 1048576;
 constexpr int MAX_COLUMNS = 16384;
-
+constexpr std::chrono::milliseconds BACKGROUND_CALCULATION_SLICE(8);   // half of a 60 Hz frame
+constexpr uint32_t CALC_CHAIN_SECTION = 0x434C4143;                    // "CALC"
+constexpr bool ENABLE_LAZY_LOADING = true;                              // performance.enable_lazy_loading in app_config.json
+constexpr size_t WORKSHEET_CACHE_BYTES = size_t(512) << 20;             // performance.cache_size_mb in app_config.json
+constexpr size_t LOAD_WORKER_COUNT = 8;                                  // performance.max_threads in app_config.json
+constexpr size_t CALCULATION_WORKER_COUNT = 8;                           // performance.max_threads in app_config.json
+const std::string XLSX_FILE_EXTENSION = ".xlsx";
+const std::string DEFAULT_WORKSHEET_NAME = "Sheet1";
+
+// Each open workbook is evaluated by a calculation engine of its own, whose
+// cell store backs the workbook's active sheet. The engine given to the
+// constructor serves the first workbook created or opened, and the next
+// one after that workbook closes; further workbooks get new engines.
 class DataManager {
 public:
     DataManager(std::shared_ptr<CalculationEngine> calculationEngine,
@@ -19,8 +45,15 @@ public:
                 std::shared_ptr<CloudStorage> cloudStorage)
         : m_calculationEngine(calculationEngine),
           m_fileSystem(fileSystem),
-          m_cloudStorage(cloudStorage) {
+          m_cloudStorage(cloudStorage),
+          m_accessClock(0),
+          m_spillCount(0),
+          m_batchDepth(0) {
         // Initialize m_workbooks as an empty map
+
+        // Edits only mark dependents dirty; results are computed when read,
+        // when they become visible, or by RunBackgroundCalculation
+        m_calculationEngine->SetCalculationMode(CalculationMode::Lazy);
     }
 
     std::shared_ptr<Workbook> CreateWorkbook(const std::string& name) {
@@ -32,8 +65,14 @@ public:
         // Create a new Workbook object
         auto workbook = std::make_shared<Workbook>(name);
 
-        // Add the new workbook to m_workbooks
+        // Add the new workbook to m_workbooks, with its own string pool and
+        // calculation engine. Its first worksheet is the active sheet, so it
+        // shares the engine's cell store, as on open.
         m_workbooks[name] = workbook;
+        GetStringPool(workbook);
+        std::shared_ptr<CalculationEngine> engine = AcquireCalculationEngine();
+        m_calculationEngines[workbook.get()] = engine;
+        workbook->AddWorksheet(std::make_shared<Worksheet>(DEFAULT_WORKSHEET_NAME, engine->GetCellStore()));
 
         // Return the pointer to the new workbook
         return workbook;
@@ -46,17 +85,44 @@ public:
             return it->second;
         }
 
-        std::vector<uint8_t> fileContent;
-        if (isCloudStorage) {
-            // Download the file using m_cloudStorage
-            fileContent = m_cloudStorage->DownloadFile(path);
+        // Local files are memory-mapped: opening reads little more than the
+        // metadata, and a sheet's pages are read when its cells are first
+        // touched. The file data stays alive as long as a sheet needs it.
+        std::shared_ptr<const void> fileData;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        std::shared_ptr<MappedFile> mapping = isCloudStorage ? nullptr : MappedFile::Open(path);
+        if (mapping) {
+            data = mapping->GetData();
+            size = mapping->GetSize();
+            fileData = mapping;
         } else {
-            // Read the file using m_fileSystem
-            fileContent = m_fileSystem->ReadFile(path);
+            auto fileContent = std::make_shared<std::vector<uint8_t>>();
+            if (isCloudStorage) {
+                // Download the file using m_cloudStorage
+                *fileContent = m_cloudStorage->DownloadFile(path);
+            } else {
+                // Read the file using m_fileSystem if it cannot be mapped
+                *fileContent = m_fileSystem->ReadFile(path);
+            }
+            data = fileContent->data();
+            size = fileContent->size();
+            fileData = fileContent;
         }
 
-        // Deserialize the file content into a Workbook object
-        auto workbook = DeserializeWorkbook(fileContent);
+        // Deserialize the file content into a Workbook object, interning its
+        // strings into a pool that is then owned by the workbook. The active
+        // sheet and the formulas go to an engine of its own.
+        auto stringPool = std::make_unique<StringPool>();
+        std::shared_ptr<CalculationEngine> engine = AcquireCalculationEngine();
+        std::shared_ptr<Workbook> workbook;
+        {
+            StringPoolScope scope(*stringPool);
+            workbook = XlsxReader::IsXlsxFile(data, size) ? DeserializeXlsxWorkbook(*engine, path, data, size)
+                                                          : DeserializeWorkbook(*engine, fileData, data, size);
+        }
+        m_stringPools[workbook.get()] = std::move(stringPool);
+        m_calculationEngines[workbook.get()] = engine;
 
         // Add the workbook to m_workbooks
         m_workbooks[path] = workbook;
@@ -66,6 +132,11 @@ public:
     }
 
     bool SaveWorkbook(const std::shared_ptr<Workbook>& workbook, const std::string& path, bool isCloudStorage = false) {
+        // Local .xlsx files are streamed to disk rather than built in memory
+        if (!isCloudStorage && std::filesystem::path(path).extension() == XLSX_FILE_EXTENSION) {
+            return SaveXlsxWorkbook(workbook, path);
+        }
+
         // Serialize the workbook into a file format
         std::vector<uint8_t> serializedData = SerializeWorkbook(workbook);
 
@@ -74,6 +145,10 @@ public:
             // Upload the file using m_cloudStorage
             success = m_cloudStorage->UploadFile(path, serializedData);
         } else {
+            // A workbook opened from this path may still read cells from the
+            // file's mapping; bring them into memory before it is replaced
+            LoadOpenedWorkbook(path);
+
             // Write the file using m_fileSystem
             success = m_fileSystem->WriteFile(path, serializedData);
         }
@@ -82,104 +157,513 @@ public:
         return success;
     }
 
+    // Releases everything held for an open workbook: its calculation engine's
+    // formulas, compiled programs and indexes, the cells of its worksheets
+    // and its string pool. The workbook's cells must not be read afterwards.
+    // Returns false if the workbook is not open here.
+    bool CloseWorkbook(const std::shared_ptr<Workbook>& workbook) {
+        auto opened = std::find_if(m_workbooks.begin(), m_workbooks.end(),
+                                   [&](const auto& entry) { return entry.second == workbook; });
+        if (opened == m_workbooks.end()) {
+            return false;
+        }
+        m_workbooks.erase(opened);
+
+        // The engine clears the active sheet's store with the rest of its
+        // state; the engine given to the constructor is then free for the
+        // next workbook
+        auto engine = m_calculationEngines.find(workbook.get());
+        if (engine != m_calculationEngines.end()) {
+            engine->second->ReleaseWorkbook();
+            m_calculationEngines.erase(engine);
+        }
+        for (const auto& worksheet : workbook->GetWorksheets()) {
+            worksheet->GetCellStore()->Clear();
+            m_worksheetAccess.erase(worksheet.get());
+        }
+
+        // Last, as the cells released above may refer to its strings
+        m_stringPools.erase(workbook.get());
+        return true;
+    }
+
     CellValue GetCellValue(const std::shared_ptr<Workbook>& workbook, const std::string& worksheetName, const CellReference& cellRef) {
         // Get the specified worksheet from the workbook
-        auto worksheet = workbook->GetWorksheet(worksheetName);
+        auto worksheet = GetWorksheet(workbook, worksheetName);
         if (!worksheet) {
             return CellValue(); // Return empty value if worksheet not found
         }
 
-        // Get the cell from the worksheet using the cell reference
-        auto cell = worksheet->GetCell(cellRef);
-        if (!cell) {
-            return CellValue(); // Return empty value if cell not found
+        // The active sheet shares its cell store with the workbook's
+        // calculation engine, which computes formula results on demand if
+        // the cell is dirty; other sheets hold plain values
+        CalculationEngine& engine = GetWorkbookEngine(workbook);
+        std::shared_ptr<CellStore> store = worksheet->GetCellStore();
+        if (store != engine.GetCellStore()) {
+            return store->Get(cellRef);
         }
-
-        // Return the value of the cell
-        return cell->GetValue();
+        StringPoolScope scope(GetStringPool(workbook));
+        return engine.GetCellValue(cellRef);
     }
 
     void SetCellValue(const std::shared_ptr<Workbook>& workbook, const std::string& worksheetName, const CellReference& cellRef, const CellValue& value) {
         // Get the specified worksheet from the workbook
-        auto worksheet = workbook->GetWorksheet(worksheetName);
+        auto worksheet = GetWorksheet(workbook, worksheetName);
         if (!worksheet) {
             return; // Exit if worksheet not found
         }
 
+        SetCellValue(worksheet, cellRef, value);
+    }
+
+    // Returns the engine evaluating a workbook's formulas, or nullptr if the
+    // workbook is not open here. Its cell store backs the active sheet.
+    std::shared_ptr<CalculationEngine> GetCalculationEngine(const std::shared_ptr<Workbook>& workbook) const {
+        auto it = m_calculationEngines.find(workbook.get());
+        return it != m_calculationEngines.end() ? it->second : nullptr;
+    }
+
+    // Looks up a worksheet and records the access for TrimWorksheetMemory. A
+    // sheet that was deferred on open or released since is loaded from its
+    // file when its cells are first touched.
+    std::shared_ptr<Worksheet> GetWorksheet(const std::shared_ptr<Workbook>& workbook, const std::string& worksheetName) {
+        auto worksheet = workbook->GetWorksheet(worksheetName);
+        if (worksheet) {
+            m_worksheetAccess[worksheet.get()] = ++m_accessClock;
+        }
+        return worksheet;
+    }
+
+    // Releases the cells of the least recently used worksheets of the open
+    // workbooks until the rest fit in budgetBytes. A released sheet is read
+    // back from its file when next touched; a sheet modified since it was
+    // opened is first written to a temporary file. Worksheets sharing a
+    // calculation engine's cell store are never released. Called under memory
+    // pressure; must not overlap reads or writes of the released cells.
+    // Returns the number of worksheets released.
+    size_t TrimWorksheetMemory(size_t budgetBytes = WORKSHEET_CACHE_BYTES) {
+        struct Candidate {
+            uint64_t lastAccess;
+            std::shared_ptr<Workbook> workbook;
+            std::shared_ptr<CellStore> store;
+        };
+        std::vector<Candidate> candidates;
+        size_t usage = 0;
+        for (const auto& entry : m_workbooks) {
+            std::shared_ptr<CalculationEngine> engine = GetCalculationEngine(entry.second);
+            std::shared_ptr<CellStore> engineStore = engine ? engine->GetCellStore() : nullptr;
+            for (const auto& worksheet : entry.second->GetWorksheets()) {
+                std::shared_ptr<CellStore> store = worksheet->GetCellStore();
+                if (!store->IsSheetAttached()) {
+                    continue;
+                }
+                usage += store->GetMemoryUsage();
+                if (store != engineStore) {
+                    auto access = m_worksheetAccess.find(worksheet.get());
+                    candidates.push_back({access != m_worksheetAccess.end() ? access->second : 0, entry.second, store});
+                }
+            }
+        }
+
+        // Oldest access first
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const Candidate& a, const Candidate& b) { return a.lastAccess < b.lastAccess; });
+        size_t released = 0;
+        for (const auto& candidate : candidates) {
+            if (usage <= budgetBytes) {
+                break;
+            }
+            size_t memoryUsage = candidate.store->GetMemoryUsage();
+            if (!candidate.store->ReleaseSheet() && !SpillWorksheet(candidate.workbook, *candidate.store)) {
+                continue;
+            }
+            usage -= std::min(usage, memoryUsage);
+            ++released;
+        }
+        return released;
+    }
+
+    // Returns the pool that string cell values of a workbook are interned into
+    StringPool& GetStringPool(const std::shared_ptr<Workbook>& workbook) {
+        auto& pool = m_stringPools[workbook.get()];
+        if (!pool) {
+            pool = std::make_unique<StringPool>();
+        }
+        return *pool;
+    }
+
+    void SetCellValue(const std::shared_ptr<Worksheet>& worksheet, const CellReference& cellRef, const CellValue& value) {
         // Set the cell value in the worksheet
         worksheet->SetCell(cellRef, value);
 
-        // Notify the calculation engine of the cell update
-        m_calculationEngine->UpdateCell(workbook, worksheetName, cellRef, value);
+        // Notify the calculation engine evaluating the sheet, if any, of the
+        // cell update; this marks dependents dirty instead of recalculating
+        // the workbook. Other sheets hold plain values.
+        std::shared_ptr<CellStore> store = worksheet->GetCellStore();
+        for (const auto& entry : m_calculationEngines) {
+            if (entry.second->GetCellStore() == store) {
+                // Strings produced while recalculating belong to the workbook's pool
+                StringPoolScope scope(*m_stringPools.at(entry.first));
+                entry.second->UpdateCell(cellRef, value);
+                break;
+            }
+        }
+    }
+
+    // Starts a batch: cell writes to every open workbook are buffered by its
+    // calculation engine and their dependents recalculated once, in
+    // dependency order, at CommitBatch. Batches nest.
+    void BeginBatch() {
+        ++m_batchDepth;
+        for (const auto& entry : m_calculationEngines) {
+            entry.second->BeginBatch();
+        }
+    }
 
-        // Trigger recalculation of dependent cells
-        m_calculationEngine->Recalculate(workbook);
+    void CommitBatch() {
+        if (m_batchDepth == 0) {
+            throw std::runtime_error("CommitBatch called without a matching BeginBatch");
+        }
+        --m_batchDepth;
+        for (const auto& entry : m_calculationEngines) {
+            StringPoolScope scope(*m_stringPools.at(entry.first));
+            entry.second->CommitBatch();
+        }
+    }
+
+    // Runs writes inside a batch, committing it even if writes throws
+    void ExecuteBatch(const std::function<void()>& writes) {
+        BeginBatch();
+        try {
+            writes();
+        } catch (...) {
+            CommitBatch();
+            throw;
+        }
+        CommitBatch();
+    }
+
+    // Continues recalculating dirty cells of the open workbooks for at most
+    // one time slice, shared between them. Called from the idle loop;
+    // returns true once every cell is up to date.
+    bool RunBackgroundCalculation(std::chrono::milliseconds budget = BACKGROUND_CALCULATION_SLICE) {
+        auto deadline = std::chrono::steady_clock::now() + budget;
+        bool done = true;
+        for (const auto& entry : m_calculationEngines) {
+            auto remaining = deadline - std::chrono::steady_clock::now();
+            if (remaining <= std::chrono::steady_clock::duration::zero()) {
+                return false;
+            }
+            StringPoolScope scope(*m_stringPools.at(entry.first));
+            done = entry.second->RecalculatePending(remaining) && done;
+        }
+        return done;
+    }
+
+    // Stops a background calculation running on another thread at its next
+    // unit of work, e.g. when the user starts typing; the remaining cells
+    // stay dirty and the next RunBackgroundCalculation picks them up
+    void CancelBackgroundCalculation() {
+        for (const auto& entry : m_calculationEngines) {
+            entry.second->CancelCalculation();
+        }
     }
 
 private:
+    // Returns an engine for a workbook about to be created or opened: the
+    // engine given to the constructor if no open workbook uses it, else a
+    // new one. The engine starts from a clean state and joins any batch in
+    // progress.
+    std::shared_ptr<CalculationEngine> AcquireCalculationEngine() {
+        std::shared_ptr<CalculationEngine> engine = m_calculationEngine;
+        for (const auto& entry : m_calculationEngines) {
+            if (entry.second == m_calculationEngine) {
+                engine = std::make_shared<CalculationEngine>(CALCULATION_WORKER_COUNT);
+                engine->SetCalculationMode(CalculationMode::Lazy);
+                break;
+            }
+        }
+        engine->ReleaseWorkbook();
+        for (size_t i = 0; i < m_batchDepth; ++i) {
+            engine->BeginBatch();
+        }
+        return engine;
+    }
+
+    // Writes the workbook in the binary workbook format (see WorkbookWriter):
+    // metadata, the string table, each worksheet's cells as column chunks,
+    // the formulas and the calc chain. The worksheet sharing the cell store
+    // of the workbook's calculation engine is recorded as the active sheet;
+    // the engine's formulas belong to it.
     std::vector<uint8_t> SerializeWorkbook(const std::shared_ptr<Workbook>& workbook) {
-        std::vector<uint8_t> buffer;
+        WorkbookWriter writer;
+        WorkbookMetadata metadata;
+        metadata.name = workbook->GetName();
+        CalculationEngine& engine = GetWorkbookEngine(workbook);
+        std::shared_ptr<CellStore> engineStore = engine.GetCellStore();
+        for (const auto& worksheet : workbook->GetWorksheets()) {
+            std::shared_ptr<CellStore> store = worksheet->GetCellStore();
+            if (store == engineStore) {
+                metadata.activeSheet = static_cast<uint32_t>(metadata.sheetNames.size());
+            }
+            metadata.sheetNames.push_back(worksheet->GetName());
+
+            // A sheet still deferred is released again once written, so
+            // that saving does not keep every sheet in memory
+            bool deferred = !store->IsSheetAttached();
+            writer.WriteSheet(*store);
+            if (deferred) {
+                store->ReleaseSheet();
+            }
+        }
+        writer.WriteMetadata(metadata);
 
-        // Write workbook metadata (name, author, creation date, etc.)
-        // TODO: Implement workbook metadata serialization
+        writer.WriteFormulas(metadata.activeSheet, CollectFormulas(engine));
 
-        // For each worksheet in the workbook:
-        for (const auto& worksheet : workbook->GetWorksheets()) {
-            // Write worksheet metadata (name, index, etc.)
-            // TODO: Implement worksheet metadata serialization
+        // Write the calc chain, so that opening the file restores the
+        // dependency graph instead of evaluating every formula
+        std::vector<uint8_t> calcChain;
+        engine.SerializeCalcChain(calcChain);
+        writer.AddSection(CALC_CHAIN_SECTION, std::move(calcChain));
+
+        return writer.Finish();
+    }
 
-            // Write cell data (including values, formulas, and styles)
-            // TODO: Implement cell data serialization
+    // Threads that decode workbook files, started on first use
+    ThreadPool& GetLoadThreads() {
+        if (!m_loadThreads) {
+            m_loadThreads = std::make_unique<ThreadPool>(LOAD_WORKER_COUNT);
         }
+        return *m_loadThreads;
+    }
+
+    // Loads every cell of the workbook opened from path, if any, into memory
+    // so that it no longer reads from the file; the column chunks of all its
+    // sheets are decoded concurrently
+    void LoadOpenedWorkbook(const std::string& path) {
+        auto opened = m_workbooks.find(path);
+        if (opened == m_workbooks.end()) {
+            return;
+        }
+        std::vector<CellStore*> stores;
+        for (const auto& worksheet : opened->second->GetWorksheets()) {
+            stores.push_back(worksheet->GetCellStore().get());
+        }
+        CellStore::LoadDeferredChunks(stores, &GetLoadThreads(), true);
+    }
 
-        // Write additional workbook data (named ranges, shared formulas, etc.)
-        // TODO: Implement additional workbook data serialization
+    // The engine of a workbook that is open here
+    CalculationEngine& GetWorkbookEngine(const std::shared_ptr<Workbook>& workbook) const {
+        std::shared_ptr<CalculationEngine> engine = GetCalculationEngine(workbook);
+        if (!engine) {
+            throw std::runtime_error("Workbook is not open: " + workbook->GetName());
+        }
+        return *engine;
+    }
 
-        return buffer;
+    // An engine's formulas as templates plus the template of each cell
+    static FormulaTable CollectFormulas(const CalculationEngine& engine) {
+        FormulaTable formulas;
+        std::unordered_map<const FormulaTemplateSource*, uint32_t> templateIndexes;
+        engine.ForEachFormulaCell([&](const CellReference& cell, const FormulaTemplateSource& source) {
+            auto inserted = templateIndexes.emplace(&source, static_cast<uint32_t>(formulas.templates.size()));
+            if (inserted.second) {
+                formulas.templates.push_back(source);
+            }
+            formulas.cells.emplace_back(cell, inserted.first->second);
+        });
+        return formulas;
     }
 
-    std::shared_ptr<Workbook> DeserializeWorkbook(const std::vector<uint8_t>& data) {
-        // Create a new Workbook object
-        auto workbook = std::make_shared<Workbook>();
+    // Streams the workbook to an XLSX file through XlsxWriter, so memory
+    // stays bounded by a band of rows rather than the file. The file is
+    // written next to path and renamed over it once complete; a failed save
+    // leaves the previous file intact.
+    bool SaveXlsxWorkbook(const std::shared_ptr<Workbook>& workbook, const std::string& path) {
+        std::string temporaryPath = path + ".tmp";
+        try {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                return false;
+            }
+            XlsxWriter writer(file);
+            const CalculationEngine& engine = GetWorkbookEngine(workbook);
+            std::shared_ptr<CellStore> engineStore = engine.GetCellStore();
+            uint32_t activeSheet = 0;
+            uint32_t sheetIndex = 0;
+            for (const auto& worksheet : workbook->GetWorksheets()) {
+                std::shared_ptr<CellStore> store = worksheet->GetCellStore();
+                bool deferred = !store->IsSheetAttached();
+                if (store == engineStore) {
+                    activeSheet = sheetIndex;
+                    FormulaTable formulas = CollectFormulas(engine);
+                    writer.WriteSheet(worksheet->GetName(), *store, &formulas);
+                } else {
+                    writer.WriteSheet(worksheet->GetName(), *store);
+                }
+                if (deferred) {
+                    store->ReleaseSheet();
+                }
+                ++sheetIndex;
+            }
+            writer.Finish(activeSheet);
+        } catch (const std::runtime_error&) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
 
-        // Read and set workbook metadata
-        // TODO: Implement workbook metadata deserialization
+        // A workbook opened from this path may still read cells from the
+        // file's mapping; bring them into memory before it is replaced
+        LoadOpenedWorkbook(path);
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error) {
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        return true;
+    }
 
-        // While there is data remaining:
-        // TODO: Implement data parsing loop
+    // Writes the cells of a modified worksheet to a temporary file and
+    // defers store to it, releasing the cells' memory. The file is removed
+    // again right after it is mapped; on POSIX systems its space is kept
+    // until the mapping goes. Returns false if the file cannot be written.
+    bool SpillWorksheet(const std::shared_ptr<Workbook>& workbook, CellStore& store) {
+        StringPool& pool = GetStringPool(workbook);
+        StringPoolScope scope(pool);
+        WorkbookWriter writer;
+        writer.WriteMetadata({workbook->GetName(), {std::string()}, 0});
+        writer.WriteSheet(store);
+        std::vector<uint8_t> data = writer.Finish();
+
+        std::error_code error;
+        std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+        if (error) {
+            return false;
+        }
+        std::string path = (directory / ("worksheet_" + std::to_string(reinterpret_cast<uintptr_t>(this)) + "_" +
+                                         std::to_string(++m_spillCount) + ".xlwb")).string();
         {
-            // Read worksheet metadata
-            // TODO: Implement worksheet metadata deserialization
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+            if (!file) {
+                file.close();
+                std::remove(path.c_str());
+                return false;
+            }
+        }
+        std::shared_ptr<MappedFile> mapping = MappedFile::Open(path);
+        std::remove(path.c_str());
+        if (!mapping) {
+            return false;
+        }
+        WorkbookReader reader(mapping->GetData(), mapping->GetSize());
+        reader.DeferSheet(0, mapping, reader.AttachStringTable(mapping, pool), store);
+        return true;
+    }
 
-            // Create a new Worksheet object
-            auto worksheet = std::make_shared<Worksheet>();
+    // Reads a file written by SerializeWorkbook from data, which fileData
+    // owns, with engine evaluating it. Only the metadata is read up front:
+    // the active sheet is attached to the engine's cell store, which must be
+    // empty, without decoding its cells (see
+    // WorkbookReader::AttachSheet), and with lazy loading the other sheets
+    // are deferred as a whole until first touched (see
+    // WorkbookReader::DeferSheet). Strings are interned into the calling
+    // thread's current pool when first needed. Without lazy loading, the
+    // string table and every sheet's column chunks are instead decoded
+    // during the open, concurrently on the load threads; numbers stored raw
+    // are still read in place. Throws std::runtime_error if the file is
+    // damaged; with lazy loading, damage inside a cell chunk is detected
+    // when the chunk is first touched.
+    std::shared_ptr<Workbook> DeserializeWorkbook(CalculationEngine& engine, const std::shared_ptr<const void>& fileData,
+                                                  const uint8_t* data, size_t size) {
+        WorkbookReader reader(data, size);
+        WorkbookMetadata metadata = reader.ReadMetadata();
+        if (reader.GetSheetCount() != metadata.sheetNames.size() || metadata.sheetNames.size() > static_cast<size_t>(MAX_WORKSHEETS)) {
+            throw std::runtime_error("Corrupt workbook file: sheet count mismatch");
+        }
+        auto workbook = std::make_shared<Workbook>(metadata.name);
+
+        // Cells refer to the string table by position
+        auto strings = reader.AttachStringTable(fileData, StringPool::Current());
+        std::vector<CellStore*> stores;
+        for (size_t i = 0; i < metadata.sheetNames.size(); ++i) {
+            bool active = i == metadata.activeSheet;
+            auto store = active ? engine.GetCellStore() : std::make_shared<CellStore>();
+            if (active || !ENABLE_LAZY_LOADING) {
+                reader.AttachSheet(i, fileData, strings, *store);
+            } else {
+                reader.DeferSheet(i, fileData, strings, *store);
+            }
+            stores.push_back(store.get());
+            workbook->AddWorksheet(std::make_shared<Worksheet>(metadata.sheetNames[i], store));
+        }
+        if (!ENABLE_LAZY_LOADING) {
+            strings->Decode(GetLoadThreads());
+            CellStore::LoadDeferredChunks(stores, &GetLoadThreads(), false);
+        }
+
+        // Restore the calc chain. A missing or unreadable chain is not an
+        // error: the formulas are then installed from their templates and
+        // recalculated in the background.
+        const uint8_t* calcChain = nullptr;
+        size_t calcChainSize = 0;
+        if (!reader.FindSection(CALC_CHAIN_SECTION, calcChain, calcChainSize) ||
+            !engine.RestoreCalcChain(calcChain, calcChainSize)) {
+            FormulaTable formulas = reader.ReadFormulas(metadata.activeSheet);
+            engine.RestoreFormulas(formulas.templates, formulas.cells);
+        }
+
+        return workbook;
+    }
 
-            // Read and set cell data for the worksheet
-            // TODO: Implement cell data deserialization
+    // Reads an XLSX file from data. After the shared strings, sheets are
+    // parsed concurrently on the load threads, each straight into its own
+    // cell store as its XML is decompressed; the active sheet goes to the
+    // store of engine, which must be empty, and its formulas are installed
+    // from their text and recalculated. XLSX files carry no workbook name, so the
+    // file name is used. Throws std::runtime_error if the file is damaged.
+    std::shared_ptr<Workbook> DeserializeXlsxWorkbook(CalculationEngine& engine, const std::string& path, const uint8_t* data, size_t size) {
+        XlsxReader reader(data, size);
+        WorkbookMetadata metadata = reader.ReadMetadata();
+        if (metadata.sheetNames.empty() || metadata.sheetNames.size() > static_cast<size_t>(MAX_WORKSHEETS)) {
+            throw std::runtime_error("Corrupt XLSX file: bad sheet count");
+        }
+        auto workbook = std::make_shared<Workbook>(std::filesystem::path(path).stem().string());
 
-            // Add the worksheet to the workbook
-            workbook->AddWorksheet(worksheet);
+        std::vector<CellValue> strings = reader.ReadStringTable();
+        std::vector<std::shared_ptr<CellStore>> stores;
+        for (size_t i = 0; i < metadata.sheetNames.size(); ++i) {
+            bool active = i == metadata.activeSheet;
+            stores.push_back(active ? engine.GetCellStore() : std::make_shared<CellStore>());
         }
 
-        // Read and set additional workbook data
-        // TODO: Implement additional workbook data deserialization
+        // Strings outside the shared table are interned into this thread's pool
+        StringPool& pool = StringPool::Current();
+        FormulaTable formulas;
+        GetLoadThreads().ParallelFor(stores.size(), 1, [&](size_t begin, size_t end) {
+            StringPoolScope scope(pool);
+            for (size_t i = begin; i < end; ++i) {
+                reader.ReadSheet(i, strings, *stores[i], i == metadata.activeSheet ? &formulas : nullptr);
+            }
+        });
+        for (size_t i = 0; i < stores.size(); ++i) {
+            workbook->AddWorksheet(std::make_shared<Worksheet>(metadata.sheetNames[i], stores[i]));
+        }
+        engine.RestoreFormulas(formulas.templates, formulas.cells);
 
         return workbook;
     }
 
     std::unordered_map<std::string, std::shared_ptr<Workbook>> m_workbooks;
-    std::shared_ptr<CalculationEngine> m_calculationEngine;
+    std::unordered_map<const Workbook*, std::unique_ptr<StringPool>> m_stringPools;
+    std::unordered_map<const Workbook*, std::shared_ptr<CalculationEngine>> m_calculationEngines;
+    std::shared_ptr<CalculationEngine> m_calculationEngine;    // lent to one open workbook at a time
     std::shared_ptr<FileSystem> m_fileSystem;
     std::shared_ptr<CloudStorage> m_cloudStorage;
+    std::unique_ptr<ThreadPool> m_loadThreads;
+    std::unordered_map<const Worksheet*, uint64_t> m_worksheetAccess;    // m_accessClock at the last GetWorksheet
+    uint64_t m_accessClock;
+    uint64_t m_spillCount;
+    size_t m_batchDepth;                                                // nesting of BeginBatch
 };
-
-// Human tasks:
-// TODO: Implement workbook metadata serialization in SerializeWorkbook
-// TODO: Implement worksheet metadata serialization in SerializeWorkbook
-// TODO: Implement cell data serialization in SerializeWorkbook
-// TODO: Implement additional workbook data serialization in SerializeWorkbook
-// TODO: Implement workbook metadata deserialization in DeserializeWorkbook
-// TODO: Implement data parsing loop in DeserializeWorkbook
-// TODO: Implement worksheet metadata deserialization in DeserializeWorkbook
-// TODO: Implement cell data deserialization in DeserializeWorkbook
-// TODO: Implement additional workbook data deserialization in DeserializeWorkbook
\ No newline at end of file
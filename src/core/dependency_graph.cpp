@@ -0,0 +1,554 @@
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include "excel_types.h"
+#include "dependency_graph.h"
+
+// Global constants
+const size_t RANGE_INDEX_NODE_CAPACITY = 16;
+const size_t RANGE_INDEX_MAX_PENDING = 64;
+
+// Inclusive rectangle of cells, 1-based like CellReference
+struct CellRect {
+    int32_t firstRow;
+    int32_t firstColumn;
+    int32_t lastRow;
+    int32_t lastColumn;
+
+    bool Contains(int32_t row, int32_t column) const {
+        return row >= firstRow && row <= lastRow && column >= firstColumn && column <= lastColumn;
+    }
+
+    bool Intersects(const CellRect& other) const {
+        return firstRow <= other.lastRow && other.firstRow <= lastRow &&
+               firstColumn <= other.lastColumn && other.firstColumn <= lastColumn;
+    }
+
+    void Expand(const CellRect& other) {
+        firstRow = std::min(firstRow, other.firstRow);
+        firstColumn = std::min(firstColumn, other.firstColumn);
+        lastRow = std::max(lastRow, other.lastRow);
+        lastColumn = std::max(lastColumn, other.lastColumn);
+    }
+
+    bool operator==(const CellRect& other) const {
+        return firstRow == other.firstRow && firstColumn == other.firstColumn &&
+               lastRow == other.lastRow && lastColumn == other.lastColumn;
+    }
+};
+
+struct CellRectHash {
+    size_t operator()(const CellRect& rect) const {
+        uint64_t a = (static_cast<uint64_t>(static_cast<uint32_t>(rect.firstRow)) << 32) | static_cast<uint32_t>(rect.firstColumn);
+        uint64_t b = (static_cast<uint64_t>(static_cast<uint32_t>(rect.lastRow)) << 32) | static_cast<uint32_t>(rect.lastColumn);
+        return std::hash<uint64_t>()(a * 0x9E3779B97F4A7C15ULL ^ b);
+    }
+};
+
+// Everything a formula reads: individual cells and whole ranges. Ranges are
+// kept as rectangles so they never expand into per-cell edges.
+struct FormulaDependencies {
+    std::vector<CellReference> cells;
+    std::vector<CellRect> ranges;
+
+    bool empty() const {
+        return cells.empty() && ranges.empty();
+    }
+};
+
+// Packed R-tree over range rectangles answering "which ranges contain this
+// cell" and "which ranges overlap this rectangle". The tree is bulk-loaded with Sort-Tile-Recursive packing; ranges added
+// since the last build sit in a short pending list and removed ones are
+// tombstoned, and both are folded in by the next rebuild.
+class RangeIndex {
+private:
+    struct Entry {
+        CellRect rect;
+        uint32_t id;
+    };
+
+    struct Node {
+        CellRect bounds;
+        uint32_t first;
+        uint32_t count;
+        bool leaf;
+    };
+
+    std::vector<Entry> m_entries;
+    std::vector<Node> m_nodes;
+    std::vector<Entry> m_pending;
+    std::unordered_set<uint32_t> m_removed;
+
+public:
+    void Insert(uint32_t id, const CellRect& rect) {
+        m_pending.push_back({rect, id});
+    }
+
+    void Remove(uint32_t id) {
+        auto it = std::find_if(m_pending.begin(), m_pending.end(), [id](const Entry& e) { return e.id == id; });
+        if (it != m_pending.end()) {
+            *it = m_pending.back();
+            m_pending.pop_back();
+            return;
+        }
+        m_removed.insert(id);
+    }
+
+    size_t Size() const {
+        return m_entries.size() - m_removed.size() + m_pending.size();
+    }
+
+    // Calls visit(id) for every live range containing (row, column)
+    template <typename Visitor>
+    void Query(int32_t row, int32_t column, Visitor visit) {
+        QueryIntersecting({row, column, row, column}, visit);
+    }
+
+    // Calls visit(id) for every live range overlapping rect
+    template <typename Visitor>
+    void QueryIntersecting(const CellRect& rect, Visitor visit) {
+        if (m_pending.size() > RANGE_INDEX_MAX_PENDING || m_removed.size() > m_entries.size() / 4 + RANGE_INDEX_MAX_PENDING) {
+            Rebuild();
+        }
+
+        if (!m_nodes.empty()) {
+            std::vector<uint32_t> stack;
+            stack.push_back(static_cast<uint32_t>(m_nodes.size() - 1));
+            while (!stack.empty()) {
+                const Node& node = m_nodes[stack.back()];
+                stack.pop_back();
+                if (!node.bounds.Intersects(rect)) {
+                    continue;
+                }
+                if (node.leaf) {
+                    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                        const Entry& entry = m_entries[i];
+                        if (entry.rect.Intersects(rect) && !m_removed.count(entry.id)) {
+                            visit(entry.id);
+                        }
+                    }
+                } else {
+                    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                        stack.push_back(i);
+                    }
+                }
+            }
+        }
+
+        for (const auto& entry : m_pending) {
+            if (entry.rect.Intersects(rect)) {
+                visit(entry.id);
+            }
+        }
+    }
+
+private:
+    void Rebuild() {
+        // Gather live entries
+        std::vector<Entry> live;
+        live.reserve(Size());
+        for (const auto& entry : m_entries) {
+            if (!m_removed.count(entry.id)) {
+                live.push_back(entry);
+            }
+        }
+        live.insert(live.end(), m_pending.begin(), m_pending.end());
+        m_pending.clear();
+        m_removed.clear();
+
+        // Sort-Tile-Recursive: slice by column centre, then order each slice by row centre
+        size_t leafCount = (live.size() + RANGE_INDEX_NODE_CAPACITY - 1) / RANGE_INDEX_NODE_CAPACITY;
+        size_t sliceCount = std::max<size_t>(1, static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(leafCount)))));
+        size_t sliceSize = sliceCount * RANGE_INDEX_NODE_CAPACITY;
+
+        auto columnCentre = [](const Entry& e) { return e.rect.firstColumn + e.rect.lastColumn; };
+        auto rowCentre = [](const Entry& e) { return static_cast<int64_t>(e.rect.firstRow) + e.rect.lastRow; };
+        std::sort(live.begin(), live.end(), [&](const Entry& a, const Entry& b) { return columnCentre(a) < columnCentre(b); });
+        for (size_t start = 0; start < live.size(); start += sliceSize) {
+            auto sliceEnd = live.begin() + std::min(live.size(), start + sliceSize);
+            std::sort(live.begin() + start, sliceEnd, [&](const Entry& a, const Entry& b) { return rowCentre(a) < rowCentre(b); });
+        }
+        m_entries = std::move(live);
+
+        // Pack leaves, then pack each level's nodes into parents until one root remains
+        m_nodes.clear();
+        for (size_t start = 0; start < m_entries.size(); start += RANGE_INDEX_NODE_CAPACITY) {
+            size_t count = std::min(RANGE_INDEX_NODE_CAPACITY, m_entries.size() - start);
+            Node node{m_entries[start].rect, static_cast<uint32_t>(start), static_cast<uint32_t>(count), true};
+            for (size_t i = start + 1; i < start + count; ++i) {
+                node.bounds.Expand(m_entries[i].rect);
+            }
+            m_nodes.push_back(node);
+        }
+
+        size_t levelStart = 0;
+        size_t levelEnd = m_nodes.size();
+        while (levelEnd - levelStart > 1) {
+            for (size_t start = levelStart; start < levelEnd; start += RANGE_INDEX_NODE_CAPACITY) {
+                size_t count = std::min(RANGE_INDEX_NODE_CAPACITY, levelEnd - start);
+                Node node{m_nodes[start].bounds, static_cast<uint32_t>(start), static_cast<uint32_t>(count), false};
+                for (size_t i = start + 1; i < start + count; ++i) {
+                    node.bounds.Expand(m_nodes[i].bounds);
+                }
+                m_nodes.push_back(node);
+            }
+            levelStart = levelEnd;
+            levelEnd = m_nodes.size();
+        }
+    }
+};
+
+// Tracks which formula cells read which cells and ranges. Single-cell reads
+// are stored as direct edges; each distinct range read by any formula is a
+// single range node, so =SUM(A:A) costs one node regardless of its size.
+// A dynamic array formula owns a spill node covering the cells its result
+// spills into; everything reading those cells depends on the anchor cell.
+class DependencyGraph {
+private:
+    struct RangeNode {
+        CellRect rect;
+        std::vector<CellReference> dependents;
+    };
+
+    std::unordered_map<CellReference, std::vector<CellReference>> m_cellDependents;
+    std::unordered_map<CellReference, FormulaDependencies> m_precedents;
+    std::unordered_map<CellRect, uint32_t, CellRectHash> m_rangeIds;
+    std::vector<RangeNode> m_rangeNodes;
+    std::vector<uint32_t> m_freeRangeIds;
+    RangeIndex m_rangeIndex;
+
+    // Formula cells calling volatile functions; every calculation pass starts from these
+    std::unordered_set<CellReference> m_volatileCells;
+
+    // Spill ranges of dynamic array formulas, keyed by anchor cell
+    struct SpillNode {
+        CellReference anchor;
+        CellRect rect;
+    };
+    std::unordered_map<CellReference, uint32_t> m_spillIds;
+    std::vector<SpillNode> m_spillNodes;
+    std::vector<uint32_t> m_freeSpillIds;
+    RangeIndex m_spillIndex;
+
+public:
+    // Replaces the recorded dependencies of a formula cell
+    void UpdateDependencies(const CellReference& cell, const FormulaDependencies& dependencies) {
+        RemoveDependencies(cell);
+        if (dependencies.empty()) {
+            return;
+        }
+
+        for (const auto& precedent : dependencies.cells) {
+            m_cellDependents[precedent].push_back(cell);
+        }
+        for (const auto& rect : dependencies.ranges) {
+            m_rangeNodes[GetOrCreateRangeNode(rect)].dependents.push_back(cell);
+        }
+        m_precedents[cell] = dependencies;
+    }
+
+    // Returns the formula cells that read cell directly or through a range
+    std::vector<CellReference> GetDependentCells(const CellReference& cell) {
+        std::vector<CellReference> dependents;
+        ForEachDependent(cell, [&](const CellReference& dependent) { dependents.push_back(dependent); });
+        return dependents;
+    }
+
+    // Calls visit for each formula cell that reads cell, without allocating.
+    // For a spill anchor this includes every formula reading its spill range;
+    // a formula may then be visited more than once.
+    template <typename Visitor>
+    void ForEachDependent(const CellReference& cell, Visitor visit) {
+        auto it = m_cellDependents.find(cell);
+        if (it != m_cellDependents.end()) {
+            for (const auto& dependent : it->second) {
+                visit(dependent);
+            }
+        }
+
+        if (m_rangeIndex.Size() > 0) {
+            m_rangeIndex.Query(cell.GetRow(), cell.GetColumn(), [&](uint32_t id) {
+                for (const auto& dependent : m_rangeNodes[id].dependents) {
+                    visit(dependent);
+                }
+            });
+        }
+
+        if (!m_spillIds.empty()) {
+            auto spill = m_spillIds.find(cell);
+            if (spill != m_spillIds.end()) {
+                ForEachReaderOf(m_spillNodes[spill->second].rect, visit);
+            }
+        }
+    }
+
+    // Records the cells a dynamic array formula's result spills into,
+    // replacing any previous spill range of the anchor
+    void SetSpillRange(const CellReference& anchor, const CellRect& rect) {
+        ClearSpillRange(anchor);
+        uint32_t id;
+        if (!m_freeSpillIds.empty()) {
+            id = m_freeSpillIds.back();
+            m_freeSpillIds.pop_back();
+            m_spillNodes[id] = {anchor, rect};
+        } else {
+            id = static_cast<uint32_t>(m_spillNodes.size());
+            m_spillNodes.push_back({anchor, rect});
+        }
+        m_spillIds.emplace(anchor, id);
+        m_spillIndex.Insert(id, rect);
+    }
+
+    void ClearSpillRange(const CellReference& anchor) {
+        auto it = m_spillIds.find(anchor);
+        if (it == m_spillIds.end()) {
+            return;
+        }
+        m_spillIndex.Remove(it->second);
+        m_freeSpillIds.push_back(it->second);
+        m_spillIds.erase(it);
+    }
+
+    // Returns the spill range of an anchor, or nullptr if it has none
+    const CellRect* GetSpillRange(const CellReference& anchor) const {
+        auto it = m_spillIds.find(anchor);
+        return it != m_spillIds.end() ? &m_spillNodes[it->second].rect : nullptr;
+    }
+
+    // Calls visit(anchor) for every spill range overlapping rect
+    template <typename Visitor>
+    void ForEachSpillAnchor(const CellRect& rect, Visitor visit) {
+        if (m_spillIds.empty()) {
+            return;
+        }
+        m_spillIndex.QueryIntersecting(rect, [&](uint32_t id) { visit(m_spillNodes[id].anchor); });
+    }
+
+    // Returns every anchor that has a spill range, in no particular order
+    std::vector<CellReference> GetSpillAnchors() const {
+        std::vector<CellReference> anchors;
+        anchors.reserve(m_spillIds.size());
+        for (const auto& entry : m_spillIds) {
+            anchors.push_back(entry.first);
+        }
+        return anchors;
+    }
+
+    // Returns what a formula cell reads, or nullptr if it has no recorded dependencies
+    const FormulaDependencies* GetPrecedents(const CellReference& cell) const {
+        auto it = m_precedents.find(cell);
+        return it != m_precedents.end() ? &it->second : nullptr;
+    }
+
+    // Adds or removes a formula cell from the volatile roots
+    void SetVolatile(const CellReference& cell, bool isVolatile) {
+        if (isVolatile) {
+            m_volatileCells.insert(cell);
+        } else {
+            m_volatileCells.erase(cell);
+        }
+    }
+
+    const std::unordered_set<CellReference>& GetVolatileCells() const {
+        return m_volatileCells;
+    }
+
+    size_t GetRangeNodeCount() const {
+        return m_rangeIds.size();
+    }
+
+private:
+    uint32_t GetOrCreateRangeNode(const CellRect& rect) {
+        auto it = m_rangeIds.find(rect);
+        if (it != m_rangeIds.end()) {
+            return it->second;
+        }
+
+        uint32_t id;
+        if (!m_freeRangeIds.empty()) {
+            id = m_freeRangeIds.back();
+            m_freeRangeIds.pop_back();
+            m_rangeNodes[id].rect = rect;
+        } else {
+            id = static_cast<uint32_t>(m_rangeNodes.size());
+            m_rangeNodes.push_back({rect, {}});
+        }
+        m_rangeIds.emplace(rect, id);
+        m_rangeIndex.Insert(id, rect);
+        return id;
+    }
+
+    void RemoveDependencies(const CellReference& cell) {
+        auto it = m_precedents.find(cell);
+        if (it == m_precedents.end()) {
+            return;
+        }
+
+        for (const auto& precedent : it->second.cells) {
+            auto dependentsIt = m_cellDependents.find(precedent);
+            if (dependentsIt == m_cellDependents.end()) {
+                continue;
+            }
+            EraseOne(dependentsIt->second, cell);
+            if (dependentsIt->second.empty()) {
+                m_cellDependents.erase(dependentsIt);
+            }
+        }
+
+        for (const auto& rect : it->second.ranges) {
+            auto idIt = m_rangeIds.find(rect);
+            if (idIt == m_rangeIds.end()) {
+                continue;
+            }
+            uint32_t id = idIt->second;
+            RangeNode& node = m_rangeNodes[id];
+            EraseOne(node.dependents, cell);
+            if (node.dependents.empty()) {
+                m_rangeIndex.Remove(id);
+                m_rangeIds.erase(idIt);
+                m_freeRangeIds.push_back(id);
+            }
+        }
+
+        m_precedents.erase(it);
+    }
+
+    // Calls visit for each formula cell reading any cell of rect, scanning
+    // whichever of the rectangle and the single-cell edges is smaller
+    template <typename Visitor>
+    void ForEachReaderOf(const CellRect& rect, Visitor& visit) {
+        if (m_rangeIndex.Size() > 0) {
+            m_rangeIndex.QueryIntersecting(rect, [&](uint32_t id) {
+                for (const auto& dependent : m_rangeNodes[id].dependents) {
+                    visit(dependent);
+                }
+            });
+        }
+
+        uint64_t area = static_cast<uint64_t>(rect.lastRow - rect.firstRow + 1) * (rect.lastColumn - rect.firstColumn + 1);
+        if (area > m_cellDependents.size()) {
+            for (const auto& entry : m_cellDependents) {
+                if (rect.Contains(entry.first.GetRow(), entry.first.GetColumn())) {
+                    for (const auto& dependent : entry.second) {
+                        visit(dependent);
+                    }
+                }
+            }
+            return;
+        }
+        for (int32_t row = rect.firstRow; row <= rect.lastRow; ++row) {
+            for (int32_t column = rect.firstColumn; column <= rect.lastColumn; ++column) {
+                auto it = m_cellDependents.find(CellReference(row, column));
+                if (it != m_cellDependents.end()) {
+                    for (const auto& dependent : it->second) {
+                        visit(dependent);
+                    }
+                }
+            }
+        }
+    }
+
+    static void EraseOne(std::vector<CellReference>& cells, const CellReference& cell) {
+        auto pos = std::find(cells.begin(), cells.end(), cell);
+        if (pos != cells.end()) {
+            *pos = cells.back();
+            cells.pop_back();
+        }
+    }
+};
+
+// Tarjan's strongly-connected-components algorithm over the cells reachable
+// from roots, iterative so that long chains cannot overflow the stack.
+// forEachSuccessor(cell, push) calls push for each outgoing edge of cell.
+// visit(component, cyclic) receives each component after every component
+// reachable from it, so with precedent edges components arrive in evaluation
+// order. cyclic is true for components with more than one cell and for cells
+// that reach themselves directly.
+template <typename ForEachSuccessor, typename Visitor>
+void ForEachStronglyConnectedComponent(const std::vector<CellReference>& roots, ForEachSuccessor forEachSuccessor, Visitor visit) {
+    struct NodeState {
+        uint32_t index;
+        uint32_t lowLink;
+        bool onStack;
+        bool selfLoop;
+    };
+
+    // A frame's unexplored successors are the tail of the shared successor
+    // buffer from next onwards; deeper frames append after it and truncate
+    // the buffer again when they finish
+    struct Frame {
+        CellReference cell;
+        size_t successorBegin;
+        size_t next;
+    };
+
+    std::unordered_map<CellReference, NodeState> states;
+    std::vector<Frame> frames;
+    std::vector<CellReference> successors;
+    std::vector<CellReference> componentStack;
+    std::vector<CellReference> component;
+    uint32_t nextIndex = 0;
+
+    auto enter = [&](const CellReference& cell) {
+        states[cell] = {nextIndex, nextIndex, true, false};
+        ++nextIndex;
+        componentStack.push_back(cell);
+        size_t begin = successors.size();
+        forEachSuccessor(cell, [&](const CellReference& successor) { successors.push_back(successor); });
+        frames.push_back({cell, begin, begin});
+    };
+
+    for (const auto& root : roots) {
+        if (states.count(root)) {
+            continue;
+        }
+        enter(root);
+
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+            if (frame.next < successors.size()) {
+                CellReference successor = successors[frame.next++];
+                auto it = states.find(successor);
+                if (it == states.end()) {
+                    enter(successor);
+                    continue;
+                }
+                NodeState& state = states[frame.cell];
+                if (successor == frame.cell) {
+                    state.selfLoop = true;
+                }
+                if (it->second.onStack) {
+                    state.lowLink = std::min(state.lowLink, it->second.index);
+                }
+                continue;
+            }
+
+            // All successors explored: fold the low link into the parent
+            CellReference cell = frame.cell;
+            successors.resize(frame.successorBegin);
+            frames.pop_back();
+            NodeState& state = states[cell];
+            if (!frames.empty()) {
+                NodeState& parent = states[frames.back().cell];
+                parent.lowLink = std::min(parent.lowLink, state.lowLink);
+            }
+            if (state.lowLink != state.index) {
+                continue;
+            }
+
+            // cell is the root of a component: pop its members
+            component.clear();
+            CellReference member;
+            do {
+                member = componentStack.back();
+                componentStack.pop_back();
+                states[member].onStack = false;
+                component.push_back(member);
+            } while (member != cell);
+            visit(component, component.size() > 1 || state.selfLoop);
+        }
+    }
+}
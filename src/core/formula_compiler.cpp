@@ -0,0 +1,1059 @@
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <memory>
+#include <initializer_list>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include "excel_types.h"
+#include "cell_value.h"
+#include "dependency_graph.h"
+#include "formula_compiler.h"
+
+// Global constants
+const size_t MAX_FORMULA_LENGTH = 8192;
+const size_t MAX_FUNCTION_ARGUMENTS = 255;
+const int32_t MAX_ROW_INDEX = 1048576;
+const int32_t MAX_COLUMN_INDEX = 16384;
+
+// Token categories produced by the formula tokenizer
+enum class FormulaTokenType {
+    Number,
+    String,
+    Boolean,
+    Error,
+    Reference,
+    Range,
+    Function,
+    Operator,
+    LeftParen,
+    RightParen,
+    Comma,
+    End
+};
+
+struct FormulaToken {
+    FormulaTokenType type;
+    std::string text;
+};
+
+// Instruction set of the formula stack machine
+enum class OpCode : uint8_t {
+    PushConstant,
+    PushReference,
+    PushRange,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Power,
+    Concatenate,
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Negate,
+    Percent,
+    Call
+};
+
+// A single 8-byte bytecode instruction. The operand indexes into the
+// constant, reference, range or function-name table of the owning program.
+struct Instruction {
+    OpCode op;
+    uint8_t argumentCount;
+    uint16_t reserved;
+    uint32_t operand;
+};
+
+// A cell reference as written in the formula. Non-absolute components are
+// stored as offsets from the cell that owns the formula, so one program can
+// be reused by every cell whose formula has the same relative shape.
+struct ReferenceOperand {
+    int32_t row;
+    int32_t column;
+    bool rowAbsolute;
+    bool columnAbsolute;
+
+    CellReference Resolve(const CellReference& context) const {
+        return CellReference(rowAbsolute ? row : context.GetRow() + row,
+                             columnAbsolute ? column : context.GetColumn() + column);
+    }
+};
+
+struct RangeOperand {
+    ReferenceOperand start;
+    ReferenceOperand end;
+};
+
+class FormulaArena;
+
+// Immutable view of one compiled formula. The program's instructions,
+// references and ranges are contiguous slices of its FormulaArena, and
+// instruction operands index directly into the arena's tables.
+struct CompiledFormula {
+    const FormulaArena* arena;
+    uint32_t codeOffset;
+    uint32_t codeLength;
+    uint32_t referenceOffset;
+    uint32_t referenceCount;
+    uint32_t rangeOffset;
+    uint32_t rangeCount;
+    uint32_t maxStackDepth;
+    bool requiresSerialEvaluation;
+    bool isNumericKernel;       // only numeric constants, references and arithmetic
+    bool isVolatile;            // calls a volatile function, see IsVolatileFunction
+    bool isArrayFormula;        // the result is an array that spills, e.g. =A1:A10*2 or =SORT(...)
+
+    // Returns the cells and ranges read by the program when evaluated at context.
+    // Ranges are reported as rectangles and are never expanded cell by cell.
+    FormulaDependencies GetDependencies(const CellReference& context) const;
+};
+
+struct FormulaArenaMemoryUsage {
+    size_t programCount = 0;
+    size_t bytes = 0;
+    double bytesPerFormula = 0.0;
+};
+
+// Per-workbook storage for compiled formulas. Every program lives in a few
+// contiguous tables owned by the arena, so compiling a formula performs no
+// per-node or per-program heap allocation, and closing the workbook releases
+// all programs at once through Reset(). String constants are interned into a
+// pool of the arena's own, which lives exactly as long as the programs.
+class FormulaArena {
+private:
+    std::unique_ptr<StringPool> m_strings;
+    std::vector<Instruction> m_code;
+    std::vector<CellValue> m_constants;
+    std::vector<ReferenceOperand> m_references;
+    std::vector<RangeOperand> m_ranges;
+    std::vector<std::string> m_functionNames;
+    std::unordered_map<std::string, uint32_t> m_functionNameIds;
+    std::deque<CompiledFormula> m_programs;
+
+    friend class FormulaCompiler;
+
+public:
+    FormulaArena() : m_strings(std::make_unique<StringPool>()) {}
+
+    const std::vector<Instruction>& GetCode() const { return m_code; }
+    const std::vector<CellValue>& GetConstants() const { return m_constants; }
+    const std::vector<ReferenceOperand>& GetReferences() const { return m_references; }
+    const std::vector<RangeOperand>& GetRanges() const { return m_ranges; }
+    const std::vector<std::string>& GetFunctionNames() const { return m_functionNames; }
+
+    // Releases every program in bulk. All CompiledFormula pointers become invalid.
+    void Reset() {
+        m_strings = std::make_unique<StringPool>();
+        std::vector<Instruction>().swap(m_code);
+        std::vector<CellValue>().swap(m_constants);
+        std::vector<ReferenceOperand>().swap(m_references);
+        std::vector<RangeOperand>().swap(m_ranges);
+        std::vector<std::string>().swap(m_functionNames);
+        std::unordered_map<std::string, uint32_t>().swap(m_functionNameIds);
+        std::deque<CompiledFormula>().swap(m_programs);
+    }
+
+    FormulaArenaMemoryUsage GetMemoryUsage() const {
+        FormulaArenaMemoryUsage usage;
+        usage.programCount = m_programs.size();
+        usage.bytes = m_code.capacity() * sizeof(Instruction) +
+                      m_constants.capacity() * sizeof(CellValue) +
+                      m_references.capacity() * sizeof(ReferenceOperand) +
+                      m_ranges.capacity() * sizeof(RangeOperand) +
+                      m_programs.size() * sizeof(CompiledFormula) +
+                      m_strings->GetMemoryUsage();
+        for (const auto& name : m_functionNames) {
+            usage.bytes += sizeof(std::string) + name.capacity();
+        }
+        usage.bytesPerFormula = usage.programCount ? static_cast<double>(usage.bytes) / usage.programCount : 0.0;
+        return usage;
+    }
+
+private:
+    uint32_t InternFunctionName(const std::string& name) {
+        auto it = m_functionNameIds.find(name);
+        if (it != m_functionNameIds.end()) {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(m_functionNames.size());
+        m_functionNames.push_back(name);
+        m_functionNameIds.emplace(name, id);
+        return id;
+    }
+};
+
+inline FormulaDependencies CompiledFormula::GetDependencies(const CellReference& context) const {
+    FormulaDependencies dependencies;
+    dependencies.cells.reserve(referenceCount);
+    for (uint32_t i = 0; i < referenceCount; ++i) {
+        dependencies.cells.push_back(arena->GetReferences()[referenceOffset + i].Resolve(context));
+    }
+    dependencies.ranges.reserve(rangeCount);
+    for (uint32_t i = 0; i < rangeCount; ++i) {
+        const RangeOperand& range = arena->GetRanges()[rangeOffset + i];
+        CellReference start = range.start.Resolve(context);
+        CellReference end = range.end.Resolve(context);
+        dependencies.ranges.push_back({std::min(start.GetRow(), end.GetRow()), std::min(start.GetColumn(), end.GetColumn()),
+                                       std::max(start.GetRow(), end.GetRow()), std::max(start.GetColumn(), end.GetColumn())});
+    }
+    return dependencies;
+}
+
+// Flat parse tree produced by FormulaParser and consumed by FormulaCompiler.
+// Nodes are stored contiguously and refer to their children and payloads by
+// index; the tree is reused between compilations so its buffers are recycled.
+enum class FormulaNodeType { Constant, Reference, Range, UnaryOperator, BinaryOperator, Function };
+
+struct FormulaNode {
+    FormulaNodeType type;
+    OpCode op;
+    uint32_t payload;       // index into the tree's constant, reference, range or function-name table
+    uint32_t firstChild;    // index into FormulaTree::children
+    uint32_t childCount;
+};
+
+struct FormulaTree {
+    std::vector<FormulaNode> nodes;
+    std::vector<uint32_t> children;
+    std::vector<CellValue> constants;
+    std::vector<ReferenceOperand> references;
+    std::vector<RangeOperand> ranges;
+    std::vector<std::string> functionNames;
+
+    void Clear() {
+        nodes.clear();
+        children.clear();
+        constants.clear();
+        references.clear();
+        ranges.clear();
+        functionNames.clear();
+    }
+};
+
+// Functions with side effects or shared state that must not run concurrently
+// with other formulas during multithreaded recalculation
+bool IsThreadUnsafeFunction(const std::string& functionName) {
+    static const std::unordered_set<std::string> threadUnsafeFunctions = {
+        "RAND", "RANDBETWEEN", "RANDARRAY", "INDIRECT", "INFO", "CELL",
+        "RTD", "WEBSERVICE", "CALL", "REGISTER.ID"
+    };
+    return threadUnsafeFunctions.count(functionName) > 0;
+}
+
+// Functions whose result can change without any precedent changing. Cells
+// calling them are recalculated on every calculation pass. OFFSET and
+// INDIRECT are included because the cells they read are only known when they
+// are evaluated.
+bool IsVolatileFunction(const std::string& functionName) {
+    static const std::unordered_set<std::string> volatileFunctions = {
+        "NOW", "TODAY", "RAND", "RANDBETWEEN", "RANDARRAY", "OFFSET", "INDIRECT", "INFO", "CELL"
+    };
+    return volatileFunctions.count(functionName) > 0;
+}
+
+// Functions returning dynamic arrays that spill into neighbouring cells
+bool IsArrayFunction(const std::string& functionName) {
+    static const std::unordered_set<std::string> arrayFunctions = {
+        "FILTER", "SORT", "UNIQUE", "SEQUENCE"
+    };
+    return arrayFunctions.count(functionName) > 0;
+}
+
+// Converts a column label such as "AB" to its 1-based index
+int ColumnLabelToIndex(const std::string& label) {
+    int index = 0;
+    for (char c : label) {
+        index = index * 26 + (std::toupper(static_cast<unsigned char>(c)) - 'A' + 1);
+    }
+    return index;
+}
+
+// Converts a 1-based column index to its label, e.g. 28 to "AB"
+std::string ColumnIndexToLabel(int index) {
+    std::string label;
+    while (index > 0) {
+        label.insert(label.begin(), static_cast<char>('A' + (index - 1) % 26));
+        index = (index - 1) / 26;
+    }
+    return label;
+}
+
+// Parses an A1-style reference ("B7", "$B$7") relative to context
+bool ParseCellReference(const std::string& text, const CellReference& context, ReferenceOperand& out) {
+    size_t pos = 0;
+    bool columnAbsolute = false;
+    bool rowAbsolute = false;
+
+    if (pos < text.size() && text[pos] == '$') {
+        columnAbsolute = true;
+        ++pos;
+    }
+    size_t columnStart = pos;
+    while (pos < text.size() && std::isalpha(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+    }
+    size_t columnLength = pos - columnStart;
+    if (columnLength == 0 || columnLength > 3) {
+        return false;
+    }
+
+    if (pos < text.size() && text[pos] == '$') {
+        rowAbsolute = true;
+        ++pos;
+    }
+    size_t rowStart = pos;
+    while (pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+    }
+    if (pos == rowStart || pos != text.size() || rowStart - columnStart > 4) {
+        return false;
+    }
+
+    // References beyond the sheet, e.g. XFE1 or A1048577, are not references;
+    // the row is accumulated with a bound check so long digit runs cannot overflow
+    int column = ColumnLabelToIndex(text.substr(columnStart, columnLength));
+    int32_t row = 0;
+    for (size_t i = rowStart; i < text.size(); ++i) {
+        row = row * 10 + (text[i] - '0');
+        if (row > MAX_ROW_INDEX) {
+            return false;
+        }
+    }
+    if (row <= 0 || column > MAX_COLUMN_INDEX) {
+        return false;
+    }
+
+    out.columnAbsolute = columnAbsolute;
+    out.rowAbsolute = rowAbsolute;
+    out.column = columnAbsolute ? column : column - context.GetColumn();
+    out.row = rowAbsolute ? row : row - context.GetRow();
+    return true;
+}
+
+// Parses a whole-column reference ("C", "$C") as used in C:C, spanning every row
+bool ParseColumnReference(const std::string& text, const CellReference& context, bool isEnd, ReferenceOperand& out) {
+    size_t pos = (!text.empty() && text[0] == '$') ? 1 : 0;
+    if (text.size() == pos || text.size() - pos > 3) {
+        return false;
+    }
+    for (size_t i = pos; i < text.size(); ++i) {
+        if (!std::isalpha(static_cast<unsigned char>(text[i]))) {
+            return false;
+        }
+    }
+
+    int column = ColumnLabelToIndex(text.substr(pos));
+    if (column > MAX_COLUMN_INDEX) {
+        return false;
+    }
+    out.columnAbsolute = pos == 1;
+    out.column = out.columnAbsolute ? column : column - context.GetColumn();
+    out.rowAbsolute = true;
+    out.row = isEnd ? MAX_ROW_INDEX : 1;
+    return true;
+}
+
+// Splits a formula string into tokens
+std::vector<FormulaToken> TokenizeFormula(const std::string& formulaStr) {
+    if (formulaStr.size() > MAX_FORMULA_LENGTH) {
+        throw std::runtime_error("Formula exceeds maximum length");
+    }
+
+    std::vector<FormulaToken> tokens;
+    size_t pos = (!formulaStr.empty() && formulaStr[0] == '=') ? 1 : 0;
+
+    while (pos < formulaStr.size()) {
+        char c = formulaStr[pos];
+
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            ++pos;
+            continue;
+        }
+
+        // Numeric literals, including exponents
+        if (std::isdigit(static_cast<unsigned char>(c)) ||
+            (c == '.' && pos + 1 < formulaStr.size() && std::isdigit(static_cast<unsigned char>(formulaStr[pos + 1])))) {
+            size_t start = pos;
+            while (pos < formulaStr.size() &&
+                   (std::isdigit(static_cast<unsigned char>(formulaStr[pos])) || formulaStr[pos] == '.')) {
+                ++pos;
+            }
+            if (pos < formulaStr.size() && (formulaStr[pos] == 'e' || formulaStr[pos] == 'E')) {
+                size_t exponent = pos + 1;
+                if (exponent < formulaStr.size() && (formulaStr[exponent] == '+' || formulaStr[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < formulaStr.size() && std::isdigit(static_cast<unsigned char>(formulaStr[exponent]))) {
+                    pos = exponent;
+                    while (pos < formulaStr.size() && std::isdigit(static_cast<unsigned char>(formulaStr[pos]))) {
+                        ++pos;
+                    }
+                }
+            }
+            tokens.push_back({FormulaTokenType::Number, formulaStr.substr(start, pos - start)});
+            continue;
+        }
+
+        // String literals, with "" as an escaped quote
+        if (c == '"') {
+            std::string text;
+            ++pos;
+            while (true) {
+                if (pos >= formulaStr.size()) {
+                    throw std::runtime_error("Unterminated string literal in formula");
+                }
+                if (formulaStr[pos] == '"') {
+                    if (pos + 1 < formulaStr.size() && formulaStr[pos + 1] == '"') {
+                        text += '"';
+                        pos += 2;
+                        continue;
+                    }
+                    ++pos;
+                    break;
+                }
+                text += formulaStr[pos++];
+            }
+            tokens.push_back({FormulaTokenType::String, text});
+            continue;
+        }
+
+        // Error literals such as #DIV/0! or #N/A
+        if (c == '#') {
+            size_t start = pos++;
+            while (pos < formulaStr.size() && formulaStr[pos] != ',' && formulaStr[pos] != ')' &&
+                   !std::isspace(static_cast<unsigned char>(formulaStr[pos]))) {
+                char previous = formulaStr[pos++];
+                if (previous == '!' || previous == '?') {
+                    break;
+                }
+            }
+            tokens.push_back({FormulaTokenType::Error, formulaStr.substr(start, pos - start)});
+            continue;
+        }
+
+        // Identifiers: functions, booleans, cell references and ranges
+        if (std::isalpha(static_cast<unsigned char>(c)) || c == '$' || c == '_') {
+            size_t start = pos;
+            while (pos < formulaStr.size() &&
+                   (std::isalnum(static_cast<unsigned char>(formulaStr[pos])) || formulaStr[pos] == '$' ||
+                    formulaStr[pos] == '_' || formulaStr[pos] == '.')) {
+                ++pos;
+            }
+            std::string text = formulaStr.substr(start, pos - start);
+            std::string upper = text;
+            for (auto& ch : upper) {
+                ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+            }
+
+            if (pos < formulaStr.size() && formulaStr[pos] == '(') {
+                tokens.push_back({FormulaTokenType::Function, upper});
+            } else if (upper == "TRUE" || upper == "FALSE") {
+                tokens.push_back({FormulaTokenType::Boolean, upper});
+            } else if (pos < formulaStr.size() && formulaStr[pos] == ':') {
+                size_t end = pos + 1;
+                while (end < formulaStr.size() &&
+                       (std::isalnum(static_cast<unsigned char>(formulaStr[end])) || formulaStr[end] == '$')) {
+                    ++end;
+                }
+                tokens.push_back({FormulaTokenType::Range, upper + ":" + formulaStr.substr(pos + 1, end - pos - 1)});
+                pos = end;
+            } else {
+                tokens.push_back({FormulaTokenType::Reference, upper});
+            }
+            continue;
+        }
+
+        // Two-character comparison operators
+        if ((c == '<' || c == '>') && pos + 1 < formulaStr.size() &&
+            (formulaStr[pos + 1] == '=' || (c == '<' && formulaStr[pos + 1] == '>'))) {
+            tokens.push_back({FormulaTokenType::Operator, formulaStr.substr(pos, 2)});
+            pos += 2;
+            continue;
+        }
+
+        switch (c) {
+            case '+': case '-': case '*': case '/': case '^': case '&': case '=': case '<': case '>': case '%':
+                tokens.push_back({FormulaTokenType::Operator, std::string(1, c)});
+                break;
+            case '(':
+                tokens.push_back({FormulaTokenType::LeftParen, "("});
+                break;
+            case ')':
+                tokens.push_back({FormulaTokenType::RightParen, ")"});
+                break;
+            case ',':
+                tokens.push_back({FormulaTokenType::Comma, ","});
+                break;
+            default:
+                throw std::runtime_error(std::string("Unexpected character in formula: ") + c);
+        }
+        ++pos;
+    }
+
+    tokens.push_back({FormulaTokenType::End, ""});
+    return tokens;
+}
+
+// Appends a reference component in R1C1 notation: absolute as "R5", relative as
+// "R[-1]". A leading marker byte keeps rewritten references distinct from
+// identifiers that merely look like R1C1 text.
+void AppendR1C1Component(std::string& key, char axis, bool absolute, int32_t value) {
+    key += '\x01';
+    key += axis;
+    if (absolute) {
+        key += std::to_string(value);
+    } else if (value != 0) {
+        key += '[';
+        key += std::to_string(value);
+        key += ']';
+    }
+}
+
+// Copies formulaStr to key, replacing every A1 reference, parsed relative to
+// context, with what rewriteCell(key, reference) appends, and every
+// whole-column reference such as A:A with what rewriteColumn appends
+template <typename CellRewriter, typename ColumnRewriter>
+void RewriteReferences(const std::string& formulaStr, const CellReference& context, std::string& key,
+                       CellRewriter rewriteCell, ColumnRewriter rewriteColumn) {
+    key.clear();
+    size_t pos = 0;
+    while (pos < formulaStr.size()) {
+        char c = formulaStr[pos];
+
+        // Copy string literals verbatim so their contents are never rewritten
+        if (c == '"') {
+            size_t end = pos + 1;
+            while (end < formulaStr.size()) {
+                if (formulaStr[end] == '"') {
+                    if (end + 1 < formulaStr.size() && formulaStr[end + 1] == '"') {
+                        end += 2;
+                        continue;
+                    }
+                    break;
+                }
+                ++end;
+            }
+            end = std::min(end + 1, formulaStr.size());
+            key.append(formulaStr, pos, end - pos);
+            pos = end;
+            continue;
+        }
+
+        // Skip numbers whole so exponents such as 1E5 are not read as references
+        if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+            size_t end = pos;
+            while (end < formulaStr.size() &&
+                   (std::isdigit(static_cast<unsigned char>(formulaStr[end])) || formulaStr[end] == '.')) {
+                ++end;
+            }
+            if (end < formulaStr.size() && (formulaStr[end] == 'e' || formulaStr[end] == 'E')) {
+                ++end;
+                if (end < formulaStr.size() && (formulaStr[end] == '+' || formulaStr[end] == '-')) {
+                    ++end;
+                }
+                while (end < formulaStr.size() && std::isdigit(static_cast<unsigned char>(formulaStr[end]))) {
+                    ++end;
+                }
+            }
+            key.append(formulaStr, pos, end - pos);
+            pos = end;
+            continue;
+        }
+
+        if (!std::isalpha(static_cast<unsigned char>(c)) && c != '$' && c != '_') {
+            key += c;
+            ++pos;
+            continue;
+        }
+
+        // Identifiers, scanned exactly as TokenizeFormula does
+        size_t end = pos;
+        while (end < formulaStr.size() &&
+               (std::isalnum(static_cast<unsigned char>(formulaStr[end])) || formulaStr[end] == '$' ||
+                formulaStr[end] == '_' || formulaStr[end] == '.')) {
+            ++end;
+        }
+        std::string identifier = formulaStr.substr(pos, end - pos);
+        bool adjacentToColon = (end < formulaStr.size() && formulaStr[end] == ':') || (pos > 0 && formulaStr[pos - 1] == ':');
+
+        ReferenceOperand reference{};
+        if (end < formulaStr.size() && formulaStr[end] == '(') {
+            key += identifier;
+        } else if (ParseCellReference(identifier, context, reference)) {
+            rewriteCell(key, reference);
+        } else if (adjacentToColon && ParseColumnReference(identifier, context, false, reference)) {
+            rewriteColumn(key, reference);
+        } else {
+            key += identifier;
+        }
+        pos = end;
+    }
+}
+
+// Builds the shared-formula template key of a formula: its text with every
+// A1 reference rewritten in R1C1 notation relative to context. Formulas that
+// were filled down or across (=B2*C2, =B3*C3, ...) produce the same key and
+// therefore share one compiled program.
+void BuildTemplateKey(const std::string& formulaStr, const CellReference& context, std::string& key) {
+    RewriteReferences(formulaStr, context, key,
+        [](std::string& out, const ReferenceOperand& reference) {
+            AppendR1C1Component(out, 'R', reference.rowAbsolute, reference.row);
+            AppendR1C1Component(out, 'C', reference.columnAbsolute, reference.column);
+        },
+        [](std::string& out, const ReferenceOperand& reference) {
+            AppendR1C1Component(out, 'C', reference.columnAbsolute, reference.column);
+        });
+}
+
+// Rewrites a formula written for cell from as it reads when filled to cell
+// to: relative references move by the distance between the two cells,
+// absolute ones stay. References moved off the sheet become #REF!, as when
+// Excel pastes a formula.
+std::string TranslateFormula(const std::string& formulaStr, const CellReference& from, const CellReference& to) {
+    std::string translated;
+    auto appendColumn = [&](std::string& out, const ReferenceOperand& reference) {
+        int32_t column = reference.columnAbsolute ? reference.column : to.GetColumn() + reference.column;
+        if (column < 1 || column > MAX_COLUMN_INDEX) {
+            return false;
+        }
+        out += reference.columnAbsolute ? "$" : "";
+        out += ColumnIndexToLabel(column);
+        return true;
+    };
+    RewriteReferences(formulaStr, from, translated,
+        [&](std::string& out, const ReferenceOperand& reference) {
+            int32_t row = reference.rowAbsolute ? reference.row : to.GetRow() + reference.row;
+            size_t start = out.size();
+            if (row < 1 || row > MAX_ROW_INDEX || !appendColumn(out, reference)) {
+                out.resize(start);
+                out += "#REF!";
+                return;
+            }
+            out += reference.rowAbsolute ? "$" : "";
+            out += std::to_string(row);
+        },
+        [&](std::string& out, const ReferenceOperand& reference) {
+            if (!appendColumn(out, reference)) {
+                out += "#REF!";
+            }
+        });
+    return translated;
+}
+
+// Recursive-descent parser producing a parse tree with Excel operator precedence:
+// comparison < concatenation < additive < multiplicative < power < percent < unary
+class FormulaParser {
+private:
+    const std::vector<FormulaToken>& m_tokens;
+    const CellReference& m_context;
+    FormulaTree& m_tree;
+    size_t m_position;
+
+public:
+    FormulaParser(const std::vector<FormulaToken>& tokens, const CellReference& context, FormulaTree& tree)
+        : m_tokens(tokens), m_context(context), m_tree(tree), m_position(0) {}
+
+    // Parses the whole token stream and returns the index of the root node
+    uint32_t Parse() {
+        uint32_t root = ParseComparison();
+        if (Peek().type != FormulaTokenType::End) {
+            throw std::runtime_error("Unexpected token in formula: " + Peek().text);
+        }
+        return root;
+    }
+
+private:
+    const FormulaToken& Peek() const { return m_tokens[m_position]; }
+    const FormulaToken& Next() { return m_tokens[m_position++]; }
+
+    bool MatchOperator(const char* op) {
+        if (Peek().type == FormulaTokenType::Operator && Peek().text == op) {
+            ++m_position;
+            return true;
+        }
+        return false;
+    }
+
+    uint32_t AddNode(FormulaNodeType type, OpCode op, uint32_t payload, std::initializer_list<uint32_t> children = {}) {
+        uint32_t firstChild = static_cast<uint32_t>(m_tree.children.size());
+        m_tree.children.insert(m_tree.children.end(), children.begin(), children.end());
+        m_tree.nodes.push_back({type, op, payload, firstChild, static_cast<uint32_t>(children.size())});
+        return static_cast<uint32_t>(m_tree.nodes.size() - 1);
+    }
+
+    uint32_t AddConstant(const CellValue& value) {
+        m_tree.constants.push_back(value);
+        return AddNode(FormulaNodeType::Constant, OpCode::PushConstant, static_cast<uint32_t>(m_tree.constants.size() - 1));
+    }
+
+    uint32_t ParseComparison() {
+        uint32_t lhs = ParseConcatenation();
+        while (true) {
+            OpCode op;
+            if (MatchOperator("=")) op = OpCode::Equal;
+            else if (MatchOperator("<>")) op = OpCode::NotEqual;
+            else if (MatchOperator("<=")) op = OpCode::LessEqual;
+            else if (MatchOperator(">=")) op = OpCode::GreaterEqual;
+            else if (MatchOperator("<")) op = OpCode::Less;
+            else if (MatchOperator(">")) op = OpCode::Greater;
+            else return lhs;
+            uint32_t rhs = ParseConcatenation();
+            lhs = AddNode(FormulaNodeType::BinaryOperator, op, 0, {lhs, rhs});
+        }
+    }
+
+    uint32_t ParseConcatenation() {
+        uint32_t lhs = ParseAdditive();
+        while (MatchOperator("&")) {
+            uint32_t rhs = ParseAdditive();
+            lhs = AddNode(FormulaNodeType::BinaryOperator, OpCode::Concatenate, 0, {lhs, rhs});
+        }
+        return lhs;
+    }
+
+    uint32_t ParseAdditive() {
+        uint32_t lhs = ParseMultiplicative();
+        while (true) {
+            OpCode op;
+            if (MatchOperator("+")) op = OpCode::Add;
+            else if (MatchOperator("-")) op = OpCode::Subtract;
+            else return lhs;
+            uint32_t rhs = ParseMultiplicative();
+            lhs = AddNode(FormulaNodeType::BinaryOperator, op, 0, {lhs, rhs});
+        }
+    }
+
+    uint32_t ParseMultiplicative() {
+        uint32_t lhs = ParsePower();
+        while (true) {
+            OpCode op;
+            if (MatchOperator("*")) op = OpCode::Multiply;
+            else if (MatchOperator("/")) op = OpCode::Divide;
+            else return lhs;
+            uint32_t rhs = ParsePower();
+            lhs = AddNode(FormulaNodeType::BinaryOperator, op, 0, {lhs, rhs});
+        }
+    }
+
+    uint32_t ParsePower() {
+        uint32_t lhs = ParsePercent();
+        while (MatchOperator("^")) {
+            uint32_t rhs = ParsePercent();
+            lhs = AddNode(FormulaNodeType::BinaryOperator, OpCode::Power, 0, {lhs, rhs});
+        }
+        return lhs;
+    }
+
+    uint32_t ParsePercent() {
+        uint32_t operand = ParseUnary();
+        while (MatchOperator("%")) {
+            operand = AddNode(FormulaNodeType::UnaryOperator, OpCode::Percent, 0, {operand});
+        }
+        return operand;
+    }
+
+    uint32_t ParseUnary() {
+        if (MatchOperator("-")) {
+            uint32_t operand = ParseUnary();
+            return AddNode(FormulaNodeType::UnaryOperator, OpCode::Negate, 0, {operand});
+        }
+        if (MatchOperator("+")) {
+            return ParseUnary();
+        }
+        return ParsePrimary();
+    }
+
+    uint32_t ParsePrimary() {
+        const FormulaToken& token = Next();
+
+        switch (token.type) {
+            case FormulaTokenType::Number:
+                return AddConstant(CellValue(std::strtod(token.text.c_str(), nullptr)));
+
+            case FormulaTokenType::String:
+                return AddConstant(CellValue(token.text));
+
+            case FormulaTokenType::Boolean:
+                return AddConstant(CellValue(token.text == "TRUE"));
+
+            case FormulaTokenType::Error:
+                return AddConstant(CellValue(ParseErrorLiteral(token.text)));
+
+            case FormulaTokenType::Reference: {
+                ReferenceOperand reference{};
+                if (!ParseCellReference(token.text, m_context, reference)) {
+                    // Unknown identifiers (e.g. undefined names) evaluate to #NAME?
+                    return AddConstant(CellValue(CellErrorType::Name));
+                }
+                m_tree.references.push_back(reference);
+                return AddNode(FormulaNodeType::Reference, OpCode::PushReference, static_cast<uint32_t>(m_tree.references.size() - 1));
+            }
+
+            case FormulaTokenType::Range: {
+                size_t colon = token.text.find(':');
+                std::string first = token.text.substr(0, colon);
+                std::string last = token.text.substr(colon + 1);
+                RangeOperand range{};
+                bool cellRange = ParseCellReference(first, m_context, range.start) &&
+                                 ParseCellReference(last, m_context, range.end);
+                bool columnRange = !cellRange && ParseColumnReference(first, m_context, false, range.start) &&
+                                   ParseColumnReference(last, m_context, true, range.end);
+                if (!cellRange && !columnRange) {
+                    return AddConstant(CellValue(CellErrorType::Reference));
+                }
+                m_tree.ranges.push_back(range);
+                return AddNode(FormulaNodeType::Range, OpCode::PushRange, static_cast<uint32_t>(m_tree.ranges.size() - 1));
+            }
+
+            case FormulaTokenType::Function: {
+                if (Next().type != FormulaTokenType::LeftParen) {
+                    throw std::runtime_error("Expected '(' after function " + token.text);
+                }
+                std::vector<uint32_t> arguments;
+                if (Peek().type != FormulaTokenType::RightParen) {
+                    do {
+                        arguments.push_back(ParseComparison());
+                    } while (Peek().type == FormulaTokenType::Comma && (Next(), true));
+                }
+                if (Next().type != FormulaTokenType::RightParen) {
+                    throw std::runtime_error("Expected ')' after arguments to " + token.text);
+                }
+                if (arguments.size() > MAX_FUNCTION_ARGUMENTS) {
+                    throw std::runtime_error("Too many arguments to " + token.text);
+                }
+
+                m_tree.functionNames.push_back(token.text);
+                uint32_t firstChild = static_cast<uint32_t>(m_tree.children.size());
+                m_tree.children.insert(m_tree.children.end(), arguments.begin(), arguments.end());
+                m_tree.nodes.push_back({FormulaNodeType::Function, OpCode::Call,
+                                        static_cast<uint32_t>(m_tree.functionNames.size() - 1),
+                                        firstChild, static_cast<uint32_t>(arguments.size())});
+                return static_cast<uint32_t>(m_tree.nodes.size() - 1);
+            }
+
+            case FormulaTokenType::LeftParen: {
+                uint32_t inner = ParseComparison();
+                if (Next().type != FormulaTokenType::RightParen) {
+                    throw std::runtime_error("Mismatched parentheses in formula");
+                }
+                return inner;
+            }
+
+            default:
+                throw std::runtime_error("Unexpected token in formula: " + token.text);
+        }
+    }
+
+    static CellErrorType ParseErrorLiteral(const std::string& text) {
+        if (text == "#DIV/0!") return CellErrorType::DivisionByZero;
+        if (text == "#REF!") return CellErrorType::Reference;
+        if (text == "#NAME?") return CellErrorType::Name;
+        if (text == "#NUM!") return CellErrorType::Number;
+        if (text == "#N/A") return CellErrorType::NotAvailable;
+        if (text == "#NULL!") return CellErrorType::Null;
+        if (text == "#SPILL!") return CellErrorType::Spill;
+        if (text == "#CALC!") return CellErrorType::Calc;
+        return CellErrorType::Value;
+    }
+};
+
+// Lowers parse trees into flat postfix bytecode stored in a FormulaArena
+class FormulaCompiler {
+private:
+    FormulaTree m_tree;
+
+public:
+    const CompiledFormula* Compile(const std::string& formulaStr, const CellReference& context, FormulaArena& arena) {
+        // Tokenize and parse the formula string into the reusable flat tree;
+        // string constants go to the arena's pool, not the workbook's
+        std::vector<FormulaToken> tokens = TokenizeFormula(formulaStr);
+        m_tree.Clear();
+        uint32_t root;
+        {
+            StringPoolScope scope(*arena.m_strings);
+            root = FormulaParser(tokens, context, m_tree).Parse();
+        }
+
+        // Emit the tree in post-order so operands precede their operators
+        CompiledFormula program{};
+        program.arena = &arena;
+        program.isNumericKernel = true;
+        program.codeOffset = static_cast<uint32_t>(arena.m_code.size());
+        program.referenceOffset = static_cast<uint32_t>(arena.m_references.size());
+        program.rangeOffset = static_cast<uint32_t>(arena.m_ranges.size());
+        uint32_t depth = 0;
+        Emit(root, arena, program, depth);
+        program.isArrayFormula = IsArrayValued(root);
+        program.codeLength = static_cast<uint32_t>(arena.m_code.size()) - program.codeOffset;
+        program.referenceCount = static_cast<uint32_t>(arena.m_references.size()) - program.referenceOffset;
+        program.rangeCount = static_cast<uint32_t>(arena.m_ranges.size()) - program.rangeOffset;
+
+        arena.m_programs.push_back(program);
+        return &arena.m_programs.back();
+    }
+
+private:
+    // True if a subtree evaluates to an array: a range, an array function, or
+    // an operator applied to either. Other functions reduce arrays to scalars.
+    bool IsArrayValued(uint32_t index) const {
+        const FormulaNode& node = m_tree.nodes[index];
+        switch (node.type) {
+            case FormulaNodeType::Range:
+                return true;
+            case FormulaNodeType::Function:
+                return IsArrayFunction(m_tree.functionNames[node.payload]);
+            case FormulaNodeType::UnaryOperator:
+            case FormulaNodeType::BinaryOperator:
+                for (uint32_t i = 0; i < node.childCount; ++i) {
+                    if (IsArrayValued(m_tree.children[node.firstChild + i])) {
+                        return true;
+                    }
+                }
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    static void Push(FormulaArena& arena, CompiledFormula& program, uint32_t& depth, OpCode op, uint32_t operand) {
+        arena.m_code.push_back({op, 0, 0, operand});
+        program.maxStackDepth = std::max(program.maxStackDepth, ++depth);
+    }
+
+    void Emit(uint32_t index, FormulaArena& arena, CompiledFormula& program, uint32_t& depth) {
+        const FormulaNode node = m_tree.nodes[index];
+        switch (node.type) {
+            case FormulaNodeType::Constant:
+                program.isNumericKernel &= m_tree.constants[node.payload].IsNumeric();
+                arena.m_constants.push_back(m_tree.constants[node.payload]);
+                Push(arena, program, depth, OpCode::PushConstant, static_cast<uint32_t>(arena.m_constants.size() - 1));
+                break;
+
+            case FormulaNodeType::Reference: {
+                const ReferenceOperand& reference = m_tree.references[node.payload];
+                arena.m_references.push_back(reference);
+                Push(arena, program, depth, OpCode::PushReference, static_cast<uint32_t>(arena.m_references.size() - 1));
+                break;
+            }
+
+            case FormulaNodeType::Range: {
+                const RangeOperand& range = m_tree.ranges[node.payload];
+                arena.m_ranges.push_back(range);
+                program.isNumericKernel = false;
+                Push(arena, program, depth, OpCode::PushRange, static_cast<uint32_t>(arena.m_ranges.size() - 1));
+                break;
+            }
+
+            case FormulaNodeType::UnaryOperator:
+                Emit(m_tree.children[node.firstChild], arena, program, depth);
+                arena.m_code.push_back({node.op, 0, 0, 0});
+                break;
+
+            case FormulaNodeType::BinaryOperator:
+                program.isNumericKernel &= node.op <= OpCode::Power;
+                Emit(m_tree.children[node.firstChild], arena, program, depth);
+                Emit(m_tree.children[node.firstChild + 1], arena, program, depth);
+                arena.m_code.push_back({node.op, 0, 0, 0});
+                --depth;
+                break;
+
+            case FormulaNodeType::Function: {
+                for (uint32_t i = 0; i < node.childCount; ++i) {
+                    Emit(m_tree.children[node.firstChild + i], arena, program, depth);
+                }
+                const std::string& functionName = m_tree.functionNames[node.payload];
+                program.requiresSerialEvaluation |= IsThreadUnsafeFunction(functionName);
+                program.isVolatile |= IsVolatileFunction(functionName);
+                program.isNumericKernel = false;
+                arena.m_code.push_back({OpCode::Call, static_cast<uint8_t>(node.childCount), 0,
+                                        arena.InternFunctionName(functionName)});
+                depth -= node.childCount;
+                program.maxStackDepth = std::max(program.maxStackDepth, ++depth);
+                break;
+            }
+        }
+    }
+};
+
+// Formula text and cell a shared-formula template was first compiled from;
+// compiling the text again at that cell reproduces the template
+struct FormulaTemplateSource {
+    std::string formula;
+    CellReference context;
+};
+
+struct FormulaCacheStatistics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+};
+
+// Cache of compiled programs keyed by shared-formula template (see
+// BuildTemplateKey). Because reference operands are stored relative to the
+// owning cell, one program serves every cell with the same R1C1 form.
+// Programs are stored in the cache's FormulaArena and stay valid until
+// Clear() is called when the workbook closes.
+class FormulaCache {
+private:
+    std::unordered_map<std::string, const CompiledFormula*> m_templates;
+    std::unordered_map<const CompiledFormula*, FormulaTemplateSource> m_sources;
+    FormulaArena m_arena;
+    FormulaCompiler m_compiler;
+    std::string m_keyBuffer;
+    uint64_t m_hits;
+    uint64_t m_misses;
+
+public:
+    FormulaCache() : m_hits(0), m_misses(0) {}
+
+    // Returns the compiled program for formulaStr at context, compiling it on a miss
+    const CompiledFormula* GetOrCompile(const std::string& formulaStr, const CellReference& context) {
+        BuildTemplateKey(formulaStr, context, m_keyBuffer);
+        auto it = m_templates.find(m_keyBuffer);
+        if (it != m_templates.end()) {
+            ++m_hits;
+            return it->second;
+        }
+
+        ++m_misses;
+        const CompiledFormula* program = m_compiler.Compile(formulaStr, context, m_arena);
+        m_templates.emplace(m_keyBuffer, program);
+        m_sources.emplace(program, FormulaTemplateSource{formulaStr, context});
+        return program;
+    }
+
+    // Returns where a cached program was compiled from, or nullptr if the
+    // program did not come from this cache
+    const FormulaTemplateSource* GetTemplateSource(const CompiledFormula* program) const {
+        auto it = m_sources.find(program);
+        return it != m_sources.end() ? &it->second : nullptr;
+    }
+
+    // Drops every cached program and releases the arena in bulk
+    void Clear() {
+        std::unordered_map<std::string, const CompiledFormula*>().swap(m_templates);
+        std::unordered_map<const CompiledFormula*, FormulaTemplateSource>().swap(m_sources);
+        m_arena.Reset();
+    }
+
+    FormulaCacheStatistics GetStatistics() const {
+        FormulaCacheStatistics stats;
+        stats.hits = m_hits;
+        stats.misses = m_misses;
+        stats.entries = m_templates.size();
+        return stats;
+    }
+
+    FormulaArenaMemoryUsage GetMemoryUsage() const {
+        return m_arena.GetMemoryUsage();
+    }
+};
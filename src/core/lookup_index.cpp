@@ -0,0 +1,211 @@
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include "excel_types.h"
+#include "lookup_index.h"
+
+// Global constants
+const uint32_t LOOKUP_NOT_FOUND = UINT32_MAX;
+
+// Lookup values fall into three classes that never compare equal to each
+// other; blanks and errors are not indexed
+enum class LookupKeyType : uint8_t {
+    Number,
+    Text,
+    Boolean
+};
+
+// Normalized lookup value: text is upper-cased because Excel lookups are case-insensitive
+struct LookupKey {
+    LookupKeyType type;
+    double number;
+    std::string text;
+
+    // Converts a cell value to a key; returns false for blanks and errors
+    static bool FromValue(const CellValue& value, LookupKey& out) {
+        if (value.IsNumeric()) {
+            out.type = LookupKeyType::Number;
+            out.number = value.GetNumeric() == 0.0 ? 0.0 : value.GetNumeric();   // fold -0 into 0
+            out.text.clear();
+            return true;
+        }
+        if (value.IsBoolean()) {
+            out.type = LookupKeyType::Boolean;
+            out.number = value.GetBoolean() ? 1.0 : 0.0;
+            out.text.clear();
+            return true;
+        }
+        if (value.IsString()) {
+            out.type = LookupKeyType::Text;
+            out.number = 0.0;
+            out.text = value.GetString();
+            for (auto& ch : out.text) {
+                ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool operator==(const LookupKey& other) const {
+        return type == other.type && number == other.number && text == other.text;
+    }
+};
+
+struct LookupKeyHash {
+    size_t operator()(const LookupKey& key) const {
+        size_t hash = key.type == LookupKeyType::Text ? std::hash<std::string>()(key.text) : std::hash<double>()(key.number);
+        return hash ^ (static_cast<size_t>(key.type) * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+// Returns true if text matches an Excel wildcard pattern (* ? and ~ escapes).
+// Both strings are expected to be upper-cased already.
+inline bool WildcardMatch(const std::string& pattern, const std::string& text) {
+    size_t p = 0;
+    size_t t = 0;
+    size_t starPattern = std::string::npos;
+    size_t starText = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            starPattern = ++p;
+            starText = t;
+            continue;
+        }
+        if (p < pattern.size()) {
+            bool escaped = pattern[p] == '~' && p + 1 < pattern.size();
+            char expected = escaped ? pattern[p + 1] : pattern[p];
+            if ((!escaped && expected == '?') || expected == text[t]) {
+                p += escaped ? 2 : 1;
+                ++t;
+                continue;
+            }
+        }
+        if (starPattern == std::string::npos) {
+            return false;
+        }
+        p = starPattern;
+        t = ++starText;
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+inline bool HasWildcards(const std::string& text) {
+    return text.find_first_of("*?~") != std::string::npos;
+}
+
+// Immutable index over one row or column of lookup values, addressed by
+// position within that vector. The hash table answers exact matches with
+// the first and last occurrence; per-type sorted arrays answer approximate
+// matches in O(log n). Approximate results equal Excel's binary search
+// whenever the data is sorted, which is what Excel requires for them.
+class LookupIndex {
+private:
+    struct Occurrence {
+        uint32_t first;
+        uint32_t last;
+    };
+
+    std::unordered_map<LookupKey, Occurrence, LookupKeyHash> m_exact;
+    std::vector<std::pair<double, uint32_t>> m_numbers;
+    std::vector<std::pair<std::string, uint32_t>> m_texts;
+    std::vector<std::pair<double, uint32_t>> m_booleans;
+
+public:
+    explicit LookupIndex(const std::vector<CellValue>& values) {
+        m_exact.reserve(values.size());
+        LookupKey key;
+        for (uint32_t position = 0; position < values.size(); ++position) {
+            if (!LookupKey::FromValue(values[position], key)) {
+                continue;
+            }
+
+            auto inserted = m_exact.emplace(key, Occurrence{position, position});
+            if (!inserted.second) {
+                inserted.first->second.last = position;
+            }
+
+            switch (key.type) {
+                case LookupKeyType::Number:
+                    m_numbers.emplace_back(key.number, position);
+                    break;
+                case LookupKeyType::Text:
+                    m_texts.emplace_back(key.text, position);
+                    break;
+                case LookupKeyType::Boolean:
+                    m_booleans.emplace_back(key.number, position);
+                    break;
+            }
+        }
+
+        // Order by value, then by position so ties resolve deterministically
+        std::sort(m_numbers.begin(), m_numbers.end());
+        std::sort(m_texts.begin(), m_texts.end());
+        std::sort(m_booleans.begin(), m_booleans.end());
+    }
+
+    // Position of the first (or last) value equal to key
+    uint32_t FindExact(const LookupKey& key, bool last) const {
+        auto it = m_exact.find(key);
+        if (it == m_exact.end()) {
+            return LOOKUP_NOT_FOUND;
+        }
+        return last ? it->second.last : it->second.first;
+    }
+
+    // Position of the first (or last) text value matching a wildcard pattern
+    uint32_t FindWildcard(const std::string& pattern, bool last) const {
+        uint32_t result = LOOKUP_NOT_FOUND;
+        for (const auto& entry : m_texts) {
+            if (!WildcardMatch(pattern, entry.first)) {
+                continue;
+            }
+            if (result == LOOKUP_NOT_FOUND || (last ? entry.second > result : entry.second < result)) {
+                result = entry.second;
+            }
+        }
+        return result;
+    }
+
+    // Position of the largest value not greater than key, preferring the last
+    // of equal values
+    uint32_t FindLessOrEqual(const LookupKey& key) const {
+        switch (key.type) {
+            case LookupKeyType::Number:  return LessOrEqual(m_numbers, key.number);
+            case LookupKeyType::Text:    return LessOrEqual(m_texts, key.text);
+            default:                     return LessOrEqual(m_booleans, key.number);
+        }
+    }
+
+    // Position of the smallest value not less than key, preferring the first
+    // of equal values
+    uint32_t FindGreaterOrEqual(const LookupKey& key) const {
+        switch (key.type) {
+            case LookupKeyType::Number:  return GreaterOrEqual(m_numbers, key.number);
+            case LookupKeyType::Text:    return GreaterOrEqual(m_texts, key.text);
+            default:                     return GreaterOrEqual(m_booleans, key.number);
+        }
+    }
+
+private:
+    template <typename Value>
+    static uint32_t LessOrEqual(const std::vector<std::pair<Value, uint32_t>>& sorted, const Value& key) {
+        auto it = std::upper_bound(sorted.begin(), sorted.end(), key,
+                                   [](const Value& k, const std::pair<Value, uint32_t>& entry) { return k < entry.first; });
+        return it == sorted.begin() ? LOOKUP_NOT_FOUND : std::prev(it)->second;
+    }
+
+    template <typename Value>
+    static uint32_t GreaterOrEqual(const std::vector<std::pair<Value, uint32_t>>& sorted, const Value& key) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), key,
+                                   [](const std::pair<Value, uint32_t>& entry, const Value& k) { return entry.first < k; });
+        return it == sorted.end() ? LOOKUP_NOT_FOUND : it->second;
+    }
+};
@@ -0,0 +1,115 @@
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only mapping of a whole file. Opening it reads nothing: pages are
+// read from disk when first touched and, being backed by the file, can be
+// dropped again by the OS under memory pressure. The file must not be
+// modified or truncated while it is mapped.
+class MappedFile {
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+
+    MappedFile() : m_data(nullptr), m_size(0) {
+#if defined(_WIN32)
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = nullptr;
+#endif
+    }
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the file at path, or returns nullptr if it cannot be opened or
+    // mapped, e.g. because it does not exist or is empty
+    static std::shared_ptr<MappedFile> Open(const std::string& path) {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+#if defined(_WIN32)
+        file->m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file->m_file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file->m_file, &size) || size.QuadPart == 0 ||
+            static_cast<unsigned long long>(size.QuadPart) > SIZE_MAX) {
+            return nullptr;
+        }
+        file->m_mapping = CreateFileMappingA(file->m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!file->m_mapping) {
+            return nullptr;
+        }
+        void* view = MapViewOfFile(file->m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view) {
+            return nullptr;
+        }
+        file->m_data = static_cast<const uint8_t*>(view);
+        file->m_size = static_cast<size_t>(size.QuadPart);
+#else
+        int descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (descriptor < 0) {
+            return nullptr;
+        }
+        struct stat status;
+        if (::fstat(descriptor, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size <= 0) {
+            ::close(descriptor);
+            return nullptr;
+        }
+        void* view = ::mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, descriptor, 0);
+        // The mapping keeps the file referenced after the descriptor is closed
+        ::close(descriptor);
+        if (view == MAP_FAILED) {
+            return nullptr;
+        }
+        file->m_data = static_cast<const uint8_t*>(view);
+        file->m_size = static_cast<size_t>(status.st_size);
+#endif
+        return file;
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if (m_data) {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+        }
+#else
+        if (m_data) {
+            ::munmap(const_cast<uint8_t*>(m_data), m_size);
+        }
+#endif
+    }
+
+    const uint8_t* GetData() const {
+        return m_data;
+    }
+
+    size_t GetSize() const {
+        return m_size;
+    }
+};
@@ -0,0 +1,509 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include "excel_types.h"
+#include "recalc_profiler.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EXCEL_PROFILER_TSC 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+// Global constants
+const size_t MAX_RECORDED_RECALCS = 32;        // older profiles are dropped
+const size_t MAX_EXPORTED_CELLS = 1000;        // slowest cells exported individually per recalc
+
+// Reads a cheap monotonic tick counter: the time-stamp counter where there
+// is one, which costs a few nanoseconds, and the steady clock elsewhere.
+// Ticks are converted to nanoseconds with the rate measured while profiling.
+inline uint64_t ReadProfileTicks() {
+#ifdef EXCEL_PROFILER_TSC
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Stages of a recalculation timed on the calling thread. Evaluate is the
+// wall time not spent parsing or updating dependencies.
+enum class RecalcPhase : uint8_t {
+    Parse,
+    Dependencies,
+    Evaluate
+};
+
+struct CellTiming {
+    CellReference cell;
+    uint64_t nanoseconds = 0;
+    uint64_t functionNanoseconds = 0;   // part of nanoseconds spent inside function calls
+    uint32_t evaluations = 0;
+};
+
+struct FunctionTiming {
+    std::string name;
+    uint64_t nanoseconds = 0;
+    uint64_t calls = 0;
+};
+
+// Time one cell spent in one function, for the folded-stack export
+struct CellFunctionTiming {
+    CellReference cell;
+    uint32_t function;                  // index into RecalcProfile::functions
+    uint64_t nanoseconds;
+};
+
+// Timings of one profiled recalculation, e.g. one UpdateCell or CommitBatch
+// of one worksheet. Cell times add up the work of every thread, so under
+// multithreaded calculation they can exceed totalNanoseconds.
+struct RecalcProfile {
+    uint64_t sequence = 0;
+    std::string sheet;
+    uint64_t totalNanoseconds = 0;
+    uint64_t phaseNanoseconds[3] = {0, 0, 0};   // by RecalcPhase
+    std::vector<CellTiming> cells;              // slowest first
+    std::vector<FunctionTiming> functions;      // slowest first
+    std::vector<CellFunctionTiming> cellFunctions;
+};
+
+struct SheetTiming {
+    std::string name;
+    uint64_t nanoseconds = 0;
+    uint64_t recalcs = 0;
+    uint64_t cellEvaluations = 0;
+};
+
+// Opt-in recalculation profiler, shared by the calculation engines of a
+// workbook (see CalculationEngine::EnableProfiling). While a recalculation
+// runs, each thread appends raw tick samples to its own buffer, so recording
+// takes no lock. EndRecalc only files the buffers away; they are summed into
+// a RecalcProfile when the profiles are first read, which keeps that work out
+// of the recalculation being measured. One recalculation is profiled at a
+// time.
+class RecalcProfiler {
+private:
+    struct CellSample {
+        CellReference cell;
+        uint64_t ticks;
+    };
+
+    struct FunctionSample {
+        const std::string* name;        // into the formula arena until EndRecalc, then into Samples::functionNames
+        CellReference cell;
+        uint64_t ticks;
+    };
+
+    struct ThreadBuffer {
+        std::vector<CellSample> cells;
+        std::vector<FunctionSample> functions;
+    };
+
+    // Raw samples of a recorded recalculation awaiting Summarize
+    struct Samples {
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+        std::deque<std::string> functionNames;
+        double nanosecondsPerTick = 1.0;
+    };
+
+    // Buffers of the threads that recorded in the current recalculation.
+    // m_generation changes with every recalculation so that threads pick up
+    // a fresh buffer, sized like the average of the previous recalculation
+    // so that growing it is rarely charged to the cell that hits the limit.
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+    std::atomic<uint64_t> m_generation;
+    size_t m_cellReserve;
+    size_t m_functionReserve;
+
+    bool m_active;
+    std::string m_sheet;
+    uint64_t m_startTicks;
+    std::chrono::steady_clock::time_point m_startTime;
+    uint64_t m_phaseTicks[3];
+
+    // Tick rate accumulated over every profiled recalculation
+    double m_calibrationTicks;
+    double m_calibrationNanoseconds;
+
+    // m_samples[i] holds the samples of m_profiles[i]; the first
+    // m_summarizedCount profiles are complete and their samples released
+    uint64_t m_sequence;
+    std::deque<RecalcProfile> m_profiles;
+    std::deque<Samples> m_samples;
+    size_t m_summarizedCount;
+
+public:
+    RecalcProfiler()
+        : m_generation(0), m_cellReserve(0), m_functionReserve(0), m_active(false), m_startTicks(0), m_phaseTicks{0, 0, 0},
+          m_calibrationTicks(0.0), m_calibrationNanoseconds(0.0), m_sequence(0), m_summarizedCount(0) {}
+
+    RecalcProfiler(const RecalcProfiler&) = delete;
+    RecalcProfiler& operator=(const RecalcProfiler&) = delete;
+
+    static uint64_t Now() {
+        return ReadProfileTicks();
+    }
+
+    bool IsActive() const {
+        return m_active;
+    }
+
+    // Starts a profile of a recalculation of sheet
+    void BeginRecalc(const std::string& sheet) {
+        m_generation.store(NextGeneration(), std::memory_order_release);
+        m_buffers.clear();
+        m_sheet = sheet;
+        std::fill(std::begin(m_phaseTicks), std::end(m_phaseTicks), 0);
+        m_active = true;
+        m_startTime = std::chrono::steady_clock::now();
+        m_startTicks = Now();
+    }
+
+    // Adds time measured on the calling thread to a phase
+    void AddPhaseTicks(RecalcPhase phase, uint64_t ticks) {
+        if (m_active) {
+            m_phaseTicks[static_cast<size_t>(phase)] += ticks;
+        }
+    }
+
+    // Records one evaluation of a formula cell; may be called from any thread
+    void RecordCell(const CellReference& cell, uint64_t ticks) {
+        if (m_active) {
+            LocalBuffer().cells.push_back({cell, ticks});
+        }
+    }
+
+    // Records one call of a function made while evaluating cell
+    void RecordFunction(const std::string& name, const CellReference& cell, uint64_t ticks) {
+        if (m_active) {
+            LocalBuffer().functions.push_back({&name, cell, ticks});
+        }
+    }
+
+    // Finishes the current profile. Function names are copied out of the
+    // formula arenas here, since the workbook may be closed before the
+    // profile is read.
+    void EndRecalc() {
+        uint64_t endTicks = Now();
+        auto endTime = std::chrono::steady_clock::now();
+        m_active = false;
+        m_calibrationTicks += static_cast<double>(endTicks - m_startTicks);
+        m_calibrationNanoseconds += std::chrono::duration<double, std::nano>(endTime - m_startTime).count();
+
+        RecalcProfile profile;
+        profile.sequence = ++m_sequence;
+        profile.sheet = m_sheet;
+        profile.totalNanoseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - m_startTime).count());
+        profile.phaseNanoseconds[0] = ToNanoseconds(m_phaseTicks[0]);
+        profile.phaseNanoseconds[1] = ToNanoseconds(m_phaseTicks[1]);
+        uint64_t measured = profile.phaseNanoseconds[0] + profile.phaseNanoseconds[1];
+        profile.phaseNanoseconds[2] = profile.totalNanoseconds > measured ? profile.totalNanoseconds - measured : 0;
+
+        Samples samples;
+        samples.nanosecondsPerTick = m_calibrationNanoseconds / m_calibrationTicks;
+        samples.buffers.swap(m_buffers);
+        m_cellReserve = 0;
+        m_functionReserve = 0;
+        for (const auto& buffer : samples.buffers) {
+            m_cellReserve += buffer->cells.size();
+            m_functionReserve += buffer->functions.size();
+        }
+        if (!samples.buffers.empty()) {
+            m_cellReserve /= samples.buffers.size();
+            m_functionReserve /= samples.buffers.size();
+        }
+        std::unordered_map<const std::string*, const std::string*> names;
+        const std::string* lastArenaName = nullptr;
+        const std::string* lastName = nullptr;
+        for (const auto& buffer : samples.buffers) {
+            for (auto& sample : buffer->functions) {
+                if (sample.name != lastArenaName) {
+                    lastArenaName = sample.name;
+                    auto inserted = names.emplace(sample.name, nullptr);
+                    if (inserted.second) {
+                        samples.functionNames.push_back(*sample.name);
+                        inserted.first->second = &samples.functionNames.back();
+                    }
+                    lastName = inserted.first->second;
+                }
+                sample.name = lastName;
+            }
+        }
+
+        m_profiles.push_back(std::move(profile));
+        m_samples.push_back(std::move(samples));
+        if (m_profiles.size() > MAX_RECORDED_RECALCS) {
+            m_profiles.pop_front();
+            m_samples.pop_front();
+            m_summarizedCount -= std::min<size_t>(m_summarizedCount, 1);
+        }
+    }
+
+    // Profiles of the most recent recalculations, oldest first
+    const std::deque<RecalcProfile>& GetProfiles() {
+        for (; m_summarizedCount < m_profiles.size(); ++m_summarizedCount) {
+            Summarize(m_samples[m_summarizedCount], m_profiles[m_summarizedCount]);
+            m_samples[m_summarizedCount] = Samples();
+        }
+        return m_profiles;
+    }
+
+    void Clear() {
+        m_profiles.clear();
+        m_samples.clear();
+        m_summarizedCount = 0;
+    }
+
+    // Per-worksheet totals over the recorded profiles, in first-seen order
+    std::vector<SheetTiming> GetSheetTimings() {
+        GetProfiles();
+        std::vector<SheetTiming> sheets;
+        for (const auto& profile : m_profiles) {
+            auto it = std::find_if(sheets.begin(), sheets.end(), [&](const SheetTiming& sheet) { return sheet.name == profile.sheet; });
+            if (it == sheets.end()) {
+                sheets.push_back({profile.sheet});
+                it = sheets.end() - 1;
+            }
+            it->nanoseconds += profile.totalNanoseconds;
+            ++it->recalcs;
+            for (const auto& cell : profile.cells) {
+                it->cellEvaluations += cell.evaluations;
+            }
+        }
+        return sheets;
+    }
+
+    // Writes the recorded profiles as JSON: per-sheet totals, then each
+    // recalculation with its phases, functions and slowest cells
+    std::string ExportJson() {
+        GetProfiles();
+        std::string json = "{\"sheets\":[";
+        std::vector<SheetTiming> sheets = GetSheetTimings();
+        for (size_t i = 0; i < sheets.size(); ++i) {
+            json += i > 0 ? "," : "";
+            json += "{\"name\":" + QuoteJson(sheets[i].name) + ",\"ns\":" + std::to_string(sheets[i].nanoseconds) +
+                    ",\"recalcs\":" + std::to_string(sheets[i].recalcs) +
+                    ",\"cellEvaluations\":" + std::to_string(sheets[i].cellEvaluations) + "}";
+        }
+        json += "],\"recalcs\":[";
+        for (size_t p = 0; p < m_profiles.size(); ++p) {
+            const RecalcProfile& profile = m_profiles[p];
+            json += p > 0 ? "," : "";
+            json += "{\"sequence\":" + std::to_string(profile.sequence) + ",\"sheet\":" + QuoteJson(profile.sheet) +
+                    ",\"totalNs\":" + std::to_string(profile.totalNanoseconds) +
+                    ",\"phases\":{\"parseNs\":" + std::to_string(profile.phaseNanoseconds[0]) +
+                    ",\"dependenciesNs\":" + std::to_string(profile.phaseNanoseconds[1]) +
+                    ",\"evaluateNs\":" + std::to_string(profile.phaseNanoseconds[2]) + "},\"functions\":[";
+            for (size_t i = 0; i < profile.functions.size(); ++i) {
+                const FunctionTiming& function = profile.functions[i];
+                json += i > 0 ? "," : "";
+                json += "{\"name\":" + QuoteJson(function.name) + ",\"ns\":" + std::to_string(function.nanoseconds) +
+                        ",\"calls\":" + std::to_string(function.calls) + "}";
+            }
+            json += "],\"cellCount\":" + std::to_string(profile.cells.size()) + ",\"cells\":[";
+            for (size_t i = 0; i < profile.cells.size() && i < MAX_EXPORTED_CELLS; ++i) {
+                const CellTiming& cell = profile.cells[i];
+                json += i > 0 ? "," : "";
+                json += "{\"cell\":" + QuoteJson(cell.cell.ToString()) + ",\"ns\":" + std::to_string(cell.nanoseconds) +
+                        ",\"functionNs\":" + std::to_string(cell.functionNanoseconds) +
+                        ",\"evaluations\":" + std::to_string(cell.evaluations) + "}";
+            }
+            json += "]}";
+        }
+        json += "]}";
+        return json;
+    }
+
+    // Writes the recorded profiles in the folded-stack format read by
+    // flamegraph.pl and speedscope, one "frame;frame;... nanoseconds" line per
+    // stack: sheet;parse, sheet;dependencies, sheet;evaluate;cell for a cell's
+    // own time and sheet;evaluate;cell;function for its function calls. Cells
+    // beyond the MAX_EXPORTED_CELLS slowest of a recalculation are merged into
+    // one (other_cells) frame. Stacks repeated across recalculations are left
+    // for the viewer to merge.
+    std::string ExportFoldedStacks() {
+        GetProfiles();
+        std::string folded;
+        for (const auto& profile : m_profiles) {
+            std::string sheet = FoldedFrame(profile.sheet);
+            if (profile.phaseNanoseconds[0] > 0) {
+                folded += sheet + ";parse " + std::to_string(profile.phaseNanoseconds[0]) + "\n";
+            }
+            if (profile.phaseNanoseconds[1] > 0) {
+                folded += sheet + ";dependencies " + std::to_string(profile.phaseNanoseconds[1]) + "\n";
+            }
+
+            std::unordered_map<CellReference, std::string> frames;
+            uint64_t otherSelf = 0;
+            for (size_t i = 0; i < profile.cells.size(); ++i) {
+                const CellTiming& cell = profile.cells[i];
+                uint64_t self = cell.nanoseconds > cell.functionNanoseconds ? cell.nanoseconds - cell.functionNanoseconds : 0;
+                if (i >= MAX_EXPORTED_CELLS) {
+                    otherSelf += self;
+                    continue;
+                }
+                std::string frame = sheet + ";evaluate;" + cell.cell.ToString();
+                if (self > 0) {
+                    folded += frame + " " + std::to_string(self) + "\n";
+                }
+                frames.emplace(cell.cell, std::move(frame));
+            }
+            std::string other = sheet + ";evaluate;(other_cells)";
+            if (otherSelf > 0) {
+                folded += other + " " + std::to_string(otherSelf) + "\n";
+            }
+
+            std::vector<uint64_t> otherFunctions(profile.functions.size(), 0);
+            for (const auto& timing : profile.cellFunctions) {
+                auto frame = frames.find(timing.cell);
+                if (frame == frames.end()) {
+                    otherFunctions[timing.function] += timing.nanoseconds;
+                } else if (timing.nanoseconds > 0) {
+                    folded += frame->second + ";" + FoldedFrame(profile.functions[timing.function].name) + " " +
+                              std::to_string(timing.nanoseconds) + "\n";
+                }
+            }
+            for (size_t i = 0; i < otherFunctions.size(); ++i) {
+                if (otherFunctions[i] > 0) {
+                    folded += other + ";" + FoldedFrame(profile.functions[i].name) + " " + std::to_string(otherFunctions[i]) + "\n";
+                }
+            }
+        }
+        return folded;
+    }
+
+private:
+    // Sums a recalculation's samples per cell, per function and per cell and
+    // function, and orders cells and functions slowest first
+    static void Summarize(const Samples& samples, RecalcProfile& profile) {
+        auto toNanoseconds = [&](uint64_t ticks) {
+            return static_cast<uint64_t>(static_cast<double>(ticks) * samples.nanosecondsPerTick);
+        };
+        std::unordered_map<CellReference, size_t> cellIndexes;
+        std::unordered_map<const std::string*, uint32_t> functionIndexes;
+        std::unordered_map<uint64_t, size_t> cellFunctionIndexes;
+        for (const auto& buffer : samples.buffers) {
+            for (const auto& sample : buffer->cells) {
+                auto inserted = cellIndexes.emplace(sample.cell, profile.cells.size());
+                if (inserted.second) {
+                    profile.cells.push_back({sample.cell});
+                }
+                CellTiming& timing = profile.cells[inserted.first->second];
+                timing.nanoseconds += toNanoseconds(sample.ticks);
+                ++timing.evaluations;
+            }
+        }
+        for (const auto& buffer : samples.buffers) {
+            for (const auto& sample : buffer->functions) {
+                auto function = functionIndexes.emplace(sample.name, static_cast<uint32_t>(profile.functions.size()));
+                if (function.second) {
+                    profile.functions.push_back({*sample.name});
+                }
+                uint64_t nanoseconds = toNanoseconds(sample.ticks);
+                FunctionTiming& timing = profile.functions[function.first->second];
+                timing.nanoseconds += nanoseconds;
+                ++timing.calls;
+
+                auto cell = cellIndexes.find(sample.cell);
+                if (cell == cellIndexes.end()) {
+                    continue;
+                }
+                profile.cells[cell->second].functionNanoseconds += nanoseconds;
+                uint64_t key = (static_cast<uint64_t>(cell->second) << 32) | function.first->second;
+                auto entry = cellFunctionIndexes.emplace(key, profile.cellFunctions.size());
+                if (entry.second) {
+                    profile.cellFunctions.push_back({sample.cell, function.first->second, 0});
+                }
+                profile.cellFunctions[entry.first->second].nanoseconds += nanoseconds;
+            }
+        }
+
+        // Slowest first, renumbering the functions cellFunctions refers to
+        std::sort(profile.cells.begin(), profile.cells.end(),
+                  [](const CellTiming& a, const CellTiming& b) { return a.nanoseconds > b.nanoseconds; });
+        std::vector<uint32_t> order(profile.functions.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return profile.functions[a].nanoseconds > profile.functions[b].nanoseconds;
+        });
+        std::vector<FunctionTiming> functions(order.size());
+        std::vector<uint32_t> rank(order.size());
+        for (uint32_t i = 0; i < order.size(); ++i) {
+            functions[i] = std::move(profile.functions[order[i]]);
+            rank[order[i]] = i;
+        }
+        profile.functions.swap(functions);
+        for (auto& timing : profile.cellFunctions) {
+            timing.function = rank[timing.function];
+        }
+    }
+
+    ThreadBuffer& LocalBuffer() {
+        struct Cache {
+            uint64_t generation = 0;
+            ThreadBuffer* buffer = nullptr;
+        };
+        thread_local Cache cache;
+        uint64_t generation = m_generation.load(std::memory_order_acquire);
+        if (cache.generation != generation) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_buffers.push_back(std::make_unique<ThreadBuffer>());
+            m_buffers.back()->cells.reserve(m_cellReserve);
+            m_buffers.back()->functions.reserve(m_functionReserve);
+            cache.generation = generation;
+            cache.buffer = m_buffers.back().get();
+        }
+        return *cache.buffer;
+    }
+
+    // Generations are unique across profilers, so a thread's cached buffer
+    // can never be mistaken for one of another profiler
+    static uint64_t NextGeneration() {
+        static std::atomic<uint64_t> generations(0);
+        return generations.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    uint64_t ToNanoseconds(uint64_t ticks) const {
+        double rate = m_calibrationTicks > 0.0 ? m_calibrationNanoseconds / m_calibrationTicks : 1.0;
+        return static_cast<uint64_t>(static_cast<double>(ticks) * rate);
+    }
+
+    static std::string QuoteJson(const std::string& text) {
+        std::string quoted = "\"";
+        for (char ch : text) {
+            if (ch == '"' || ch == '\\') {
+                quoted += '\\';
+                quoted += ch;
+            } else if (static_cast<unsigned char>(ch) < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned char>(ch));
+                quoted += escape;
+            } else {
+                quoted += ch;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    // Frame names may not contain the separators of the folded format
+    static std::string FoldedFrame(const std::string& name) {
+        std::string frame = name;
+        std::replace(frame.begin(), frame.end(), ';', ':');
+        std::replace(frame.begin(), frame.end(), ' ', '_');
+        std::replace(frame.begin(), frame.end(), '\n', '_');
+        return frame;
+    }
+};
@@ -0,0 +1,193 @@
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include "thread_pool.h"
+
+// Global constants
+const size_t DEFAULT_WORKER_COUNT = 8;      // performance.max_threads in app_config.json
+const size_t NO_WORKER_INDEX = static_cast<size_t>(-1);
+
+// Fixed-size work-stealing thread pool. Each worker owns a deque: it pops its
+// own work LIFO for locality and steals FIFO from the other workers when idle.
+class ThreadPool {
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wakeCondition;
+    std::atomic<size_t> m_pendingTasks;
+    std::atomic<size_t> m_nextQueue;
+    std::atomic<bool> m_stopping;
+
+    // Index of the worker running on the current thread, if any
+    static size_t& CurrentWorkerIndex() {
+        thread_local size_t index = NO_WORKER_INDEX;
+        return index;
+    }
+
+public:
+    explicit ThreadPool(size_t threadCount = DEFAULT_WORKER_COUNT)
+        : m_pendingTasks(0), m_nextQueue(0), m_stopping(false) {
+        threadCount = std::max<size_t>(1, threadCount);
+
+        // Create one queue per worker before any worker can try to steal
+        for (size_t i = 0; i < threadCount; ++i) {
+            m_queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < threadCount; ++i) {
+            m_workers.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_stopping = true;
+        }
+        m_wakeCondition.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const {
+        return m_workers.size();
+    }
+
+    // Queues a task. Tasks submitted from a worker go to that worker's own deque.
+    void Submit(std::function<void()> task) {
+        size_t index = CurrentWorkerIndex();
+        if (index == NO_WORKER_INDEX) {
+            index = m_nextQueue.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            ++m_pendingTasks;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+            m_queues[index]->tasks.push_back(std::move(task));
+        }
+        m_wakeCondition.notify_one();
+    }
+
+    // Runs body over [0, count) in chunks of at most grainSize and blocks until
+    // every chunk has finished. The calling thread executes queued work while it
+    // waits, so nested calls from inside a worker cannot deadlock. The first
+    // exception thrown by any chunk is rethrown to the caller.
+    void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t, size_t)>& body) {
+        if (count == 0) {
+            return;
+        }
+        grainSize = std::max<size_t>(1, grainSize);
+        if (count <= grainSize) {
+            body(0, count);
+            return;
+        }
+
+        size_t chunkCount = (count + grainSize - 1) / grainSize;
+        std::atomic<size_t> remaining(chunkCount);
+        std::exception_ptr firstError;
+        std::mutex errorMutex;
+
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            size_t begin = chunk * grainSize;
+            size_t end = std::min(count, begin + grainSize);
+            Submit([&, begin, end]() {
+                try {
+                    body(begin, end);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (!firstError) {
+                        firstError = std::current_exception();
+                    }
+                }
+                remaining.fetch_sub(1, std::memory_order_acq_rel);
+            });
+        }
+
+        // Help drain the queues until our own chunks are done
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (!RunPendingTask(CurrentWorkerIndex())) {
+                std::this_thread::yield();
+            }
+        }
+
+        if (firstError) {
+            std::rethrow_exception(firstError);
+        }
+    }
+
+private:
+    void WorkerLoop(size_t index) {
+        CurrentWorkerIndex() = index;
+        while (true) {
+            if (RunPendingTask(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            m_wakeCondition.wait(lock, [this]() { return m_stopping || m_pendingTasks > 0; });
+            if (m_stopping && m_pendingTasks == 0) {
+                return;
+            }
+        }
+    }
+
+    // Pops from the worker's own deque first, then tries to steal from the others
+    bool RunPendingTask(size_t index) {
+        std::function<void()> task;
+        if (index != NO_WORKER_INDEX && PopBack(*m_queues[index], task)) {
+            Run(task);
+            return true;
+        }
+        size_t start = (index == NO_WORKER_INDEX) ? 0 : index + 1;
+        for (size_t i = 0; i < m_queues.size(); ++i) {
+            size_t victim = (start + i) % m_queues.size();
+            if (victim != index && PopFront(*m_queues[victim], task)) {
+                Run(task);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(std::function<void()>& task) {
+        --m_pendingTasks;
+        task();
+    }
+
+    static bool PopBack(WorkerQueue& queue, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    static bool PopFront(WorkerQueue& queue, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+};
@@ -0,0 +1,1277 @@
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "excel_types.h"
+#include "cell_value.h"
+#include "dependency_graph.h"
+#include "cell_store.h"
+#include "formula_compiler.h"
+#include "thread_pool.h"
+#include "workbook_format.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EXCEL_WORKBOOK_FORMAT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// Functions compiled for SSE4.2 regardless of the baseline target; they are
+// only called after runtime detection confirms the CPU supports it
+#if defined(__GNUC__) || defined(__clang__)
+#define EXCEL_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define EXCEL_TARGET_SSE42
+#endif
+
+// Global constants
+const uint32_t WORKBOOK_FILE_MAGIC = 0x42574C58;        // "XLWB"
+const uint32_t WORKBOOK_FILE_VERSION = 1;
+const uint32_t DIRECTORY_SECTION = 0x53524944;          // "DIRS"
+const uint32_t METADATA_SECTION = 0x4154454D;           // "META"
+const uint32_t STRING_TABLE_SECTION = 0x53525453;       // "STRS"
+const uint32_t STYLE_SECTION = 0x4C595453;              // "STYL"
+const uint32_t SHEET_SECTION = 0x54454853;              // "SHET"
+const uint32_t FORMULA_SECTION = 0x4C4D5246;            // "FRML"
+const size_t FORMAT_ALIGNMENT = 8;                      // sections, chunks and raw numbers start 8-aligned
+const size_t SHEET_HEADER_SIZE = 24;
+const size_t SECTION_HEADER_SIZE = 16;
+const size_t DIRECTORY_ENTRY_SIZE = 32;
+const int32_t COLUMN_CHUNK_ROWS = 65536;                // rows covered by one column chunk
+const size_t STRING_CHUNK_SIZE = 65536;                 // strings per string table chunk
+const int32_t MAX_SHEET_ROWS = 1048576;
+const int32_t MAX_SHEET_COLUMNS = 16384;
+const double MAX_EXACT_INTEGER = 9007199254740992.0;    // 2^53
+
+// How the numbers of a column chunk are stored
+enum class NumberEncoding : uint8_t {
+    DeltaInteger,   // all integral: zigzag varints of the difference to the previous number
+    Raw             // 8-aligned little-endian doubles
+};
+
+// Portable CRC-32C, slicing by 8 bytes
+namespace crc32c_software {
+
+struct Tables {
+    uint32_t entries[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+            }
+            entries[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice) {
+                entries[slice][i] = (entries[slice - 1][i] >> 8) ^ entries[0][entries[slice - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+uint32_t Update(uint32_t crc, const uint8_t* data, size_t size) {
+    static const Tables tables;
+    const auto& t = tables.entries;
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+        std::memcpy(&low, data, 4);
+        std::memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+} // namespace crc32c_software
+
+#ifdef EXCEL_WORKBOOK_FORMAT_X86
+
+// CRC-32C with the SSE4.2 crc32 instruction, 8 bytes at a time
+namespace crc32c_sse42 {
+
+EXCEL_TARGET_SSE42 uint32_t Update(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+} // namespace crc32c_sse42
+
+static bool CpuSupportsSse42() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif // EXCEL_WORKBOOK_FORMAT_X86
+
+// CRC-32C (Castagnoli) of a chunk, using the crc32 instruction when the CPU has one
+uint32_t Crc32c(const uint8_t* data, size_t size) {
+    static uint32_t (*const update)(uint32_t, const uint8_t*, size_t) = []() {
+#ifdef EXCEL_WORKBOOK_FORMAT_X86
+        if (CpuSupportsSse42()) {
+            return crc32c_sse42::Update;
+        }
+#endif
+        return crc32c_software::Update;
+    }();
+    return ~update(~0u, data, size);
+}
+
+// Appends the primitive encodings of the workbook format to a buffer.
+// Fixed-width integers and doubles are written in host byte order, which
+// the format defines as little-endian.
+class FormatEncoder {
+private:
+    std::vector<uint8_t>& m_buffer;
+
+public:
+    explicit FormatEncoder(std::vector<uint8_t>& buffer) : m_buffer(buffer) {}
+
+    template <typename T>
+    void PutFixed(T value) {
+        size_t offset = m_buffer.size();
+        m_buffer.resize(offset + sizeof(T));
+        std::memcpy(m_buffer.data() + offset, &value, sizeof(T));
+    }
+
+    void PutByte(uint8_t value) {
+        m_buffer.push_back(value);
+    }
+
+    // LEB128: seven bits per byte, low bits first
+    void PutVarint(uint64_t value) {
+        while (value >= 0x80) {
+            m_buffer.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        m_buffer.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Zigzag maps small negative and positive numbers to small varints
+    void PutSignedVarint(int64_t value) {
+        PutVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    void PutString(std::string_view text) {
+        PutVarint(text.size());
+        m_buffer.insert(m_buffer.end(), text.begin(), text.end());
+    }
+
+    void PutBytes(const void* data, size_t size) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+    }
+
+    // Pads with zeros to a multiple of FORMAT_ALIGNMENT from the buffer start
+    void Align() {
+        m_buffer.resize((m_buffer.size() + FORMAT_ALIGNMENT - 1) / FORMAT_ALIGNMENT * FORMAT_ALIGNMENT, 0);
+    }
+
+    size_t Size() const {
+        return m_buffer.size();
+    }
+};
+
+// Bounds-checked reader of the primitive encodings. Malformed input throws
+// std::runtime_error rather than reading past the end.
+class FormatDecoder {
+private:
+    const uint8_t* m_begin;
+    const uint8_t* m_pos;
+    const uint8_t* m_end;
+
+public:
+    FormatDecoder(const uint8_t* data, size_t size) : m_begin(data), m_pos(data), m_end(data + size) {}
+
+    template <typename T>
+    T GetFixed() {
+        T value;
+        std::memcpy(&value, GetBytes(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    uint8_t GetByte() {
+        return *GetBytes(1);
+    }
+
+    uint64_t GetVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_pos == m_end) {
+                Fail("truncated data");
+            }
+            uint8_t byte = *m_pos++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+        Fail("malformed varint");
+    }
+
+    int64_t GetSignedVarint() {
+        uint64_t value = GetVarint();
+        return static_cast<int64_t>((value >> 1) ^ (0 - (value & 1)));
+    }
+
+    // Varint that must not exceed limit, e.g. a count bounded by the bytes left
+    uint64_t GetBoundedVarint(uint64_t limit) {
+        uint64_t value = GetVarint();
+        if (value > limit) {
+            Fail("value out of range");
+        }
+        return value;
+    }
+
+    std::string_view GetString() {
+        size_t size = static_cast<size_t>(GetBoundedVarint(Remaining()));
+        return std::string_view(reinterpret_cast<const char*>(GetBytes(size)), size);
+    }
+
+    const uint8_t* GetBytes(size_t size) {
+        if (size > Remaining()) {
+            Fail("truncated data");
+        }
+        const uint8_t* bytes = m_pos;
+        m_pos += size;
+        return bytes;
+    }
+
+    // Skips padding up to a multiple of FORMAT_ALIGNMENT from the start
+    void Align() {
+        size_t offset = static_cast<size_t>(m_pos - m_begin);
+        GetBytes((FORMAT_ALIGNMENT - offset % FORMAT_ALIGNMENT) % FORMAT_ALIGNMENT);
+    }
+
+    size_t Remaining() const {
+        return static_cast<size_t>(m_end - m_pos);
+    }
+
+    bool AtEnd() const {
+        return m_pos == m_end;
+    }
+
+    [[noreturn]] static void Fail(const char* reason) {
+        throw std::runtime_error(std::string("Corrupt workbook file: ") + reason);
+    }
+};
+
+struct WorkbookMetadata {
+    std::string name;
+    std::vector<std::string> sheetNames;
+    uint32_t activeSheet = 0;
+};
+
+// Style records are opaque to the format, e.g. a CellStyle serialized by
+// the formatting layer; ranges assign them to cells of a sheet
+struct StyleRange {
+    uint32_t sheet;
+    CellRect rect;
+    uint32_t style;
+};
+
+struct StyleTable {
+    std::vector<std::string> records;
+    std::vector<StyleRange> ranges;
+};
+
+// Formula cells of one sheet, each referring to the template its program
+// was compiled from, as CalculationEngine::ForEachFormulaCell reports them
+struct FormulaTable {
+    std::vector<FormulaTemplateSource> templates;
+    std::vector<std::pair<CellReference, uint32_t>> cells;
+};
+
+// Appends a chunk: its payload size and CRC-32C, then the payload padded
+// to FORMAT_ALIGNMENT, so that every payload starts 8-aligned in the file
+static void AppendChunk(std::vector<uint8_t>& content, const std::vector<uint8_t>& payload) {
+    FormatEncoder encoder(content);
+    encoder.PutFixed(static_cast<uint32_t>(payload.size()));
+    encoder.PutFixed(Crc32c(payload.data(), payload.size()));
+    encoder.PutBytes(payload.data(), payload.size());
+    encoder.Align();
+}
+
+// A chunk located in a section but not yet checked
+struct ChunkSpan {
+    const uint8_t* payload;
+    uint32_t size;
+    uint32_t checksum;
+};
+
+// Steps over the chunk at the decoder's position without reading its payload
+static ChunkSpan LocateChunk(FormatDecoder& section) {
+    ChunkSpan span;
+    span.size = section.GetFixed<uint32_t>();
+    span.checksum = section.GetFixed<uint32_t>();
+    span.payload = section.GetBytes(span.size);
+    section.Align();
+    return span;
+}
+
+static FormatDecoder VerifyChunk(const ChunkSpan& span) {
+    if (Crc32c(span.payload, span.size) != span.checksum) {
+        FormatDecoder::Fail("chunk checksum mismatch");
+    }
+    return FormatDecoder(span.payload, span.size);
+}
+
+// Reads the chunk at the decoder's position and verifies its checksum
+static FormatDecoder ReadChunk(FormatDecoder& section) {
+    return VerifyChunk(LocateChunk(section));
+}
+
+// Builds a workbook file in memory, laid out for one sequential pass on
+// load. A file is a 16-byte header (magic, version) followed by sections,
+// each a 4-byte tag, 4 reserved bytes and an 8-byte length, with contents
+// padded to 8 bytes; readers skip tags they do not know. Except for raw
+// sections added with AddSection, contents are CRC-32C checked chunks.
+// Finish orders the sections directory, metadata, string table, styles,
+// sheets, formulas and then raw sections. The directory gives the offset
+// and length of every other section and each sheet's cell count, so that
+// a reader can find any sheet without touching the others. Strings are
+// collected while the sheets are written, so the string table still
+// precedes the cells using it.
+class WorkbookWriter {
+private:
+    std::vector<uint8_t> m_metadata;
+    std::vector<uint8_t> m_styles;
+    std::vector<std::vector<uint8_t>> m_sheets;
+    std::vector<std::vector<uint8_t>> m_formulas;
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> m_rawSections;
+
+    // Distinct strings in file order. Interned strings never move, so their
+    // addresses identify them.
+    std::vector<const std::string*> m_strings;
+    std::unordered_map<const std::string*, uint32_t> m_stringIndexes;
+
+    // Scratch space of the column chunk encoder
+    std::vector<int32_t> m_rows;
+    std::vector<CellValue> m_values;
+    std::vector<uint8_t> m_payload;
+    std::vector<uint8_t> m_others;
+
+public:
+    WorkbookWriter() = default;
+
+    WorkbookWriter(const WorkbookWriter&) = delete;
+    WorkbookWriter& operator=(const WorkbookWriter&) = delete;
+
+    void WriteMetadata(const WorkbookMetadata& metadata) {
+        std::vector<uint8_t> payload;
+        FormatEncoder encoder(payload);
+        encoder.PutString(metadata.name);
+        encoder.PutVarint(metadata.sheetNames.size());
+        for (const auto& name : metadata.sheetNames) {
+            encoder.PutString(name);
+        }
+        encoder.PutVarint(metadata.activeSheet);
+        m_metadata.clear();
+        AppendChunk(m_metadata, payload);
+    }
+
+    void WriteStyles(const StyleTable& styles) {
+        std::vector<uint8_t> payload;
+        FormatEncoder encoder(payload);
+        encoder.PutVarint(styles.records.size());
+        for (const auto& record : styles.records) {
+            encoder.PutString(record);
+        }
+        encoder.PutVarint(styles.ranges.size());
+        for (const auto& range : styles.ranges) {
+            encoder.PutVarint(range.sheet);
+            encoder.PutVarint(static_cast<uint32_t>(range.rect.firstRow));
+            encoder.PutVarint(static_cast<uint32_t>(range.rect.firstColumn));
+            encoder.PutVarint(static_cast<uint32_t>(range.rect.lastRow - range.rect.firstRow));
+            encoder.PutVarint(static_cast<uint32_t>(range.rect.lastColumn - range.rect.firstColumn));
+            encoder.PutVarint(range.style);
+        }
+        m_styles.clear();
+        AppendChunk(m_styles, payload);
+    }
+
+    // Writes the cells of the next sheet: a header chunk with the cell and
+    // chunk counts and the offset of the index, then one chunk per column
+    // and COLUMN_CHUNK_ROWS rows holding the populated cells in row order,
+    // then an index chunk giving each chunk's column, first row, cell count
+    // and offset, so that readers can locate chunks without touching them.
+    // Formula cells are written with their current results.
+    void WriteSheet(const CellStore& store) {
+        m_sheets.emplace_back();
+        std::vector<uint8_t>& content = m_sheets.back();
+        content.resize(FORMAT_ALIGNMENT + SHEET_HEADER_SIZE);
+
+        std::vector<uint8_t> index;
+        FormatEncoder indexEncoder(index);
+        uint32_t chunkCount = 0;
+        size_t previousOffset = content.size();
+        int32_t chunkColumn = 0;
+        int32_t chunkIndex = 0;
+        m_rows.clear();
+        m_values.clear();
+        auto flush = [&]() {
+            if (!m_rows.empty()) {
+                indexEncoder.PutVarint(static_cast<uint32_t>(chunkColumn));
+                indexEncoder.PutVarint(static_cast<uint32_t>(m_rows.front()));
+                indexEncoder.PutVarint(m_rows.size());
+                indexEncoder.PutVarint((content.size() - previousOffset) / FORMAT_ALIGNMENT);
+                previousOffset = content.size();
+                EncodeColumnChunk(chunkColumn);
+                AppendChunk(content, m_payload);
+                ++chunkCount;
+            }
+            m_rows.clear();
+            m_values.clear();
+        };
+        store.ForEachInRange({1, 1, MAX_SHEET_ROWS, MAX_SHEET_COLUMNS}, [&](int32_t row, int32_t column, const CellValue& value) {
+            int32_t index = (row - 1) / COLUMN_CHUNK_ROWS;
+            if (column != chunkColumn || index != chunkIndex) {
+                flush();
+                chunkColumn = column;
+                chunkIndex = index;
+            }
+            m_rows.push_back(row);
+            m_values.push_back(value);
+        });
+        flush();
+        uint64_t indexOffset = content.size();
+        AppendChunk(content, index);
+
+        // Fill in the header chunk reserved at the start
+        std::vector<uint8_t> header;
+        FormatEncoder encoder(header);
+        encoder.PutFixed(static_cast<uint64_t>(store.GetCellCount()));
+        encoder.PutFixed(chunkCount);
+        encoder.PutFixed(static_cast<uint32_t>(0));
+        encoder.PutFixed(indexOffset);
+        uint32_t size = SHEET_HEADER_SIZE;
+        uint32_t checksum = Crc32c(header.data(), header.size());
+        std::memcpy(content.data(), &size, sizeof(size));
+        std::memcpy(content.data() + sizeof(size), &checksum, sizeof(checksum));
+        std::memcpy(content.data() + FORMAT_ALIGNMENT, header.data(), header.size());
+    }
+
+    // Writes the formulas of a sheet as their templates and, per cell, the
+    // template it uses; cells are delta-encoded in column-major order
+    void WriteFormulas(uint32_t sheet, const FormulaTable& formulas) {
+        std::vector<std::pair<CellReference, uint32_t>> cells = formulas.cells;
+        std::sort(cells.begin(), cells.end(), [](const auto& a, const auto& b) {
+            return a.first.GetColumn() != b.first.GetColumn() ? a.first.GetColumn() < b.first.GetColumn()
+                                                              : a.first.GetRow() < b.first.GetRow();
+        });
+
+        std::vector<uint8_t> payload;
+        FormatEncoder encoder(payload);
+        encoder.PutVarint(sheet);
+        encoder.PutVarint(formulas.templates.size());
+        for (const auto& source : formulas.templates) {
+            encoder.PutVarint(static_cast<uint32_t>(source.context.GetRow()));
+            encoder.PutVarint(static_cast<uint32_t>(source.context.GetColumn()));
+            encoder.PutString(source.formula);
+        }
+        encoder.PutVarint(cells.size());
+        int32_t column = 0;
+        int32_t row = 0;
+        for (const auto& cell : cells) {
+            if (cell.first.GetColumn() != column) {
+                row = 0;
+            }
+            encoder.PutVarint(static_cast<uint32_t>(cell.first.GetColumn() - column));
+            encoder.PutVarint(static_cast<uint32_t>(cell.first.GetRow() - row));
+            encoder.PutVarint(cell.second);
+            column = cell.first.GetColumn();
+            row = cell.first.GetRow();
+        }
+
+        m_formulas.emplace_back();
+        AppendChunk(m_formulas.back(), payload);
+    }
+
+    // Adds a section whose content is stored as given, e.g. the calc chain,
+    // which carries its own checksum
+    void AddSection(uint32_t tag, std::vector<uint8_t> content) {
+        m_rawSections.emplace_back(tag, std::move(content));
+    }
+
+    std::vector<uint8_t> Finish() {
+        std::vector<uint8_t> strings = EncodeStringTable();
+        std::vector<std::pair<uint32_t, const std::vector<uint8_t>*>> sections;
+        sections.emplace_back(METADATA_SECTION, &m_metadata);
+        sections.emplace_back(STRING_TABLE_SECTION, &strings);
+        if (!m_styles.empty()) {
+            sections.emplace_back(STYLE_SECTION, &m_styles);
+        }
+        for (const auto& sheet : m_sheets) {
+            sections.emplace_back(SHEET_SECTION, &sheet);
+        }
+        for (const auto& formulas : m_formulas) {
+            sections.emplace_back(FORMULA_SECTION, &formulas);
+        }
+        for (const auto& section : m_rawSections) {
+            sections.emplace_back(section.first, &section.second);
+        }
+
+        // Lay the sections out behind the directory, whose size only
+        // depends on their number
+        std::vector<uint8_t> directory;
+        FormatEncoder directoryEncoder(directory);
+        directoryEncoder.PutFixed(static_cast<uint32_t>(sections.size()));
+        directoryEncoder.PutFixed(static_cast<uint32_t>(0));
+        uint64_t offset = 2 * FORMAT_ALIGNMENT + SECTION_HEADER_SIZE + FORMAT_ALIGNMENT + FORMAT_ALIGNMENT +
+                          sections.size() * DIRECTORY_ENTRY_SIZE;
+        for (const auto& section : sections) {
+            uint64_t cellCount = 0;
+            if (section.first == SHEET_SECTION) {
+                std::memcpy(&cellCount, section.second->data() + FORMAT_ALIGNMENT, sizeof(cellCount));
+            }
+            directoryEncoder.PutFixed(section.first);
+            directoryEncoder.PutFixed(static_cast<uint32_t>(0));
+            directoryEncoder.PutFixed(offset);
+            directoryEncoder.PutFixed(static_cast<uint64_t>(section.second->size()));
+            directoryEncoder.PutFixed(cellCount);
+            offset += SECTION_HEADER_SIZE + (section.second->size() + FORMAT_ALIGNMENT - 1) / FORMAT_ALIGNMENT * FORMAT_ALIGNMENT;
+        }
+        std::vector<uint8_t> directoryContent;
+        AppendChunk(directoryContent, directory);
+
+        std::vector<uint8_t> file;
+        file.reserve(static_cast<size_t>(offset));
+        FormatEncoder encoder(file);
+        encoder.PutFixed(WORKBOOK_FILE_MAGIC);
+        encoder.PutFixed(WORKBOOK_FILE_VERSION);
+        encoder.PutFixed(static_cast<uint64_t>(0));
+        AppendSection(file, DIRECTORY_SECTION, directoryContent);
+        for (const auto& section : sections) {
+            AppendSection(file, section.first, *section.second);
+        }
+        return file;
+    }
+
+private:
+    static void AppendSection(std::vector<uint8_t>& file, uint32_t tag, const std::vector<uint8_t>& content) {
+        FormatEncoder encoder(file);
+        encoder.PutFixed(tag);
+        encoder.PutFixed(static_cast<uint32_t>(0));
+        encoder.PutFixed(static_cast<uint64_t>(content.size()));
+        encoder.PutBytes(content.data(), content.size());
+        encoder.Align();
+    }
+
+    uint32_t InternString(const std::string& text) {
+        auto inserted = m_stringIndexes.emplace(&text, static_cast<uint32_t>(m_strings.size()));
+        if (inserted.second) {
+            m_strings.push_back(&text);
+        }
+        return inserted.first->second;
+    }
+
+    std::vector<uint8_t> EncodeStringTable() {
+        std::vector<uint8_t> content;
+        std::vector<uint8_t> payload;
+        for (size_t first = 0; first < m_strings.size(); first += STRING_CHUNK_SIZE) {
+            size_t count = std::min(STRING_CHUNK_SIZE, m_strings.size() - first);
+            payload.clear();
+            FormatEncoder encoder(payload);
+            encoder.PutVarint(count);
+            for (size_t i = first; i < first + count; ++i) {
+                encoder.PutString(*m_strings[i]);
+            }
+            AppendChunk(content, payload);
+        }
+        return content;
+    }
+
+    // Encodes m_rows and m_values, the populated cells of one column chunk,
+    // into m_payload: the column and first row, the rows as runs of
+    // consecutive rows, the cell types as runs, the numbers, then booleans,
+    // string table indexes and error codes in cell order
+    void EncodeColumnChunk(int32_t column) {
+        m_payload.clear();
+        m_others.clear();
+        FormatEncoder encoder(m_payload);
+        FormatEncoder others(m_others);
+        encoder.PutVarint(static_cast<uint32_t>(column));
+        encoder.PutVarint(static_cast<uint32_t>(m_rows.front()));
+        encoder.PutVarint(m_rows.size());
+
+        // Row runs as (gap after the previous run, length)
+        std::vector<std::pair<uint32_t, uint32_t>> runs;
+        int32_t runEnd = m_rows.front();
+        for (size_t i = 0; i < m_rows.size(); ++i) {
+            if (runs.empty() || m_rows[i] != runEnd) {
+                runs.emplace_back(static_cast<uint32_t>(m_rows[i] - runEnd), 0);
+            }
+            ++runs.back().second;
+            runEnd = m_rows[i] + 1;
+        }
+        encoder.PutVarint(runs.size());
+        for (const auto& run : runs) {
+            encoder.PutVarint(run.first);
+            encoder.PutVarint(run.second);
+        }
+
+        // Type runs, gathering the numbers and the other values on the way
+        std::vector<double> numbers;
+        bool integral = true;
+        size_t typeRunCount = 0;
+        size_t typeRunsAt = encoder.Size();
+        for (size_t i = 0; i < m_values.size();) {
+            CellValue::Type type = m_values[i].GetType();
+            size_t end = i;
+            for (; end < m_values.size() && m_values[end].GetType() == type; ++end) {
+                const CellValue& value = m_values[end];
+                switch (type) {
+                    case CellValue::Type::Number: {
+                        double number = value.GetNumeric();
+                        integral = integral && std::fabs(number) < MAX_EXACT_INTEGER && number == std::trunc(number) &&
+                                   !(number == 0.0 && std::signbit(number));
+                        numbers.push_back(number);
+                        break;
+                    }
+                    case CellValue::Type::Boolean:
+                        others.PutByte(value.GetBoolean() ? 1 : 0);
+                        break;
+                    case CellValue::Type::String:
+                        others.PutVarint(InternString(value.GetString()));
+                        break;
+                    default:
+                        others.PutVarint(static_cast<uint32_t>(value.GetError()));
+                        break;
+                }
+            }
+            encoder.PutByte(static_cast<uint8_t>(type));
+            encoder.PutVarint(end - i);
+            ++typeRunCount;
+            i = end;
+        }
+        std::vector<uint8_t> typeRuns(m_payload.begin() + typeRunsAt, m_payload.end());
+        m_payload.resize(typeRunsAt);
+        encoder.PutVarint(typeRunCount);
+        encoder.PutBytes(typeRuns.data(), typeRuns.size());
+
+        // Numbers: integers as deltas, anything else as raw doubles
+        if (integral) {
+            std::vector<uint8_t> deltas;
+            FormatEncoder deltaEncoder(deltas);
+            int64_t previous = 0;
+            for (double number : numbers) {
+                int64_t value = static_cast<int64_t>(number);
+                deltaEncoder.PutSignedVarint(value - previous);
+                previous = value;
+            }
+            encoder.PutByte(static_cast<uint8_t>(NumberEncoding::DeltaInteger));
+            encoder.PutVarint(deltas.size());
+            encoder.PutBytes(deltas.data(), deltas.size());
+        } else {
+            encoder.PutByte(static_cast<uint8_t>(NumberEncoding::Raw));
+            encoder.PutVarint(numbers.size() * sizeof(double));
+            encoder.Align();
+            encoder.PutBytes(numbers.data(), numbers.size() * sizeof(double));
+        }
+        encoder.PutBytes(m_others.data(), m_others.size());
+    }
+};
+
+// Interns the strings of a string table section into pool, in file order.
+// Each chunk starts with its string count, so every chunk's place in the
+// table is known up front and threads, if given, decode chunks
+// concurrently; they share only the pool's lock.
+static std::vector<CellValue> DecodeStringTable(FormatDecoder section, StringPool& pool, ThreadPool* threads = nullptr) {
+    std::vector<ChunkSpan> chunks;
+    std::vector<size_t> firstStrings;
+    size_t total = 0;
+    while (!section.AtEnd()) {
+        chunks.push_back(LocateChunk(section));
+        FormatDecoder header(chunks.back().payload, chunks.back().size);
+        firstStrings.push_back(total);
+        total += static_cast<size_t>(header.GetBoundedVarint(header.Remaining()));
+    }
+
+    std::vector<CellValue> strings(total);
+    auto decodeChunks = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            FormatDecoder chunk = VerifyChunk(chunks[i]);
+            size_t count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+            CellValue* out = strings.data() + firstStrings[i];
+            for (size_t j = 0; j < count; ++j) {
+                out[j] = CellValue(chunk.GetString(), pool);
+            }
+        }
+    };
+    if (threads) {
+        threads->ParallelFor(chunks.size(), 1, decodeChunks);
+    } else {
+        decodeChunks(0, chunks.size());
+    }
+    return strings;
+}
+
+// Decodes one column chunk written by EncodeColumnChunk into store and
+// returns its cell count; values is scratch space. getStrings() returns the
+// string table and is only called for chunks holding strings. A deferred
+// chunk is filled in through CellStore::FillChunk, except that numbers
+// stored as raw doubles in a single run of rows are read in place.
+template <typename StringTable>
+static uint64_t DecodeColumnChunk(FormatDecoder& chunk, StringTable getStrings, std::vector<CellValue>& values,
+                                  CellStore& store, bool deferred) {
+    int32_t column = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_COLUMNS));
+    int32_t firstRow = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_ROWS));
+    size_t count = static_cast<size_t>(chunk.GetBoundedVarint(COLUMN_CHUNK_ROWS));
+    if (column < 1 || firstRow < 1 || count == 0) {
+        FormatDecoder::Fail("column chunk out of range");
+    }
+
+    std::vector<std::pair<int32_t, uint32_t>> runs(static_cast<size_t>(chunk.GetBoundedVarint(count)));
+    int64_t row = firstRow;
+    size_t covered = 0;
+    for (auto& run : runs) {
+        row += static_cast<int64_t>(chunk.GetBoundedVarint(COLUMN_CHUNK_ROWS));
+        run.first = static_cast<int32_t>(row);
+        run.second = static_cast<uint32_t>(chunk.GetBoundedVarint(count - covered));
+        covered += run.second;
+        row += run.second;
+    }
+    if (covered != count || row - 1 > MAX_SHEET_ROWS) {
+        FormatDecoder::Fail("column chunk rows out of range");
+    }
+
+    // Type runs lay out the values; numbers are filled in next
+    values.resize(count);
+    size_t numberCount = 0;
+    size_t typeRunCount = static_cast<size_t>(chunk.GetBoundedVarint(count));
+    std::vector<std::pair<CellValue::Type, size_t>> typeRuns(typeRunCount);
+    covered = 0;
+    for (auto& run : typeRuns) {
+        uint8_t type = chunk.GetByte();
+        if (type == static_cast<uint8_t>(CellValue::Type::Empty) || type > static_cast<uint8_t>(CellValue::Type::Error)) {
+            FormatDecoder::Fail("unknown cell type");
+        }
+        run.first = static_cast<CellValue::Type>(type);
+        run.second = static_cast<size_t>(chunk.GetBoundedVarint(count - covered));
+        covered += run.second;
+        numberCount += run.first == CellValue::Type::Number ? run.second : 0;
+    }
+    if (covered != count) {
+        FormatDecoder::Fail("column chunk types do not cover its cells");
+    }
+
+    uint8_t encoding = chunk.GetByte();
+    size_t numberBytes = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+    const uint8_t* numbers = nullptr;
+    if (encoding == static_cast<uint8_t>(NumberEncoding::Raw)) {
+        chunk.Align();
+        if (numberBytes != numberCount * sizeof(double)) {
+            FormatDecoder::Fail("column chunk number count mismatch");
+        }
+    } else if (encoding != static_cast<uint8_t>(NumberEncoding::DeltaInteger)) {
+        FormatDecoder::Fail("unknown number encoding");
+    }
+    numbers = chunk.GetBytes(numberBytes);
+    if (deferred && encoding == static_cast<uint8_t>(NumberEncoding::Raw) && runs.size() == 1 && typeRuns.size() == 1 &&
+        typeRuns[0].first == CellValue::Type::Number && reinterpret_cast<uintptr_t>(numbers) % alignof(double) == 0) {
+        if (!chunk.AtEnd()) {
+            FormatDecoder::Fail("column chunk has trailing data");
+        }
+        store.MapChunk(runs[0].first, reinterpret_cast<const double*>(numbers), count);
+        return count;
+    }
+    FormatDecoder deltas(numbers, numberBytes);
+    int64_t previous = 0;
+
+    size_t position = 0;
+    size_t numberIndex = 0;
+    for (const auto& run : typeRuns) {
+        CellValue* out = values.data() + position;
+        switch (run.first) {
+            case CellValue::Type::Number:
+                if (encoding == static_cast<uint8_t>(NumberEncoding::Raw)) {
+                    for (size_t i = 0; i < run.second; ++i) {
+                        double number;
+                        std::memcpy(&number, numbers + (numberIndex + i) * sizeof(double), sizeof(double));
+                        out[i] = CellValue(number);
+                    }
+                } else {
+                    for (size_t i = 0; i < run.second; ++i) {
+                        previous += deltas.GetSignedVarint();
+                        out[i] = CellValue(static_cast<double>(previous));
+                    }
+                }
+                numberIndex += run.second;
+                break;
+            case CellValue::Type::Boolean:
+                for (size_t i = 0; i < run.second; ++i) {
+                    out[i] = CellValue(chunk.GetByte() != 0);
+                }
+                break;
+            case CellValue::Type::String: {
+                const std::vector<CellValue>& strings = getStrings();
+                for (size_t i = 0; i < run.second; ++i) {
+                    uint64_t index = chunk.GetVarint();
+                    if (index >= strings.size()) {
+                        FormatDecoder::Fail("string index out of range");
+                    }
+                    out[i] = strings[index];
+                }
+                break;
+            }
+            default:
+                for (size_t i = 0; i < run.second; ++i) {
+                    out[i] = CellValue(static_cast<CellErrorType>(chunk.GetBoundedVarint(UINT8_MAX)));
+                }
+                break;
+        }
+        position += run.second;
+    }
+    if (!chunk.AtEnd() || (encoding == static_cast<uint8_t>(NumberEncoding::DeltaInteger) && !deltas.AtEnd())) {
+        FormatDecoder::Fail("column chunk has trailing data");
+    }
+
+    position = 0;
+    for (const auto& run : runs) {
+        if (deferred) {
+            store.FillChunk(run.first, values.data() + position, run.second);
+        } else {
+            store.SetColumn(column, run.first, values.data() + position, run.second);
+        }
+        position += run.second;
+    }
+    return count;
+}
+
+// String table of a workbook whose sheets are attached with
+// WorkbookReader::AttachSheet. The first chunk holding strings decodes and
+// interns it, so opening a workbook does not read it.
+class DeferredStringTable {
+private:
+    std::shared_ptr<const void> m_data;     // keeps the file data alive
+    const uint8_t* m_content;
+    size_t m_size;
+    StringPool& m_pool;
+    std::once_flag m_decoded;
+    std::vector<CellValue> m_strings;
+
+public:
+    DeferredStringTable(std::shared_ptr<const void> data, const uint8_t* content, size_t size, StringPool& pool)
+        : m_data(std::move(data)), m_content(content), m_size(size), m_pool(pool) {}
+
+    const std::vector<CellValue>& Get() {
+        std::call_once(m_decoded, [this]() { m_strings = DecodeStringTable(FormatDecoder(m_content, m_size), m_pool); });
+        return m_strings;
+    }
+
+    // Decodes the table now, its chunks concurrently on threads, e.g.
+    // before loading every sheet. Must not be called from a task of
+    // threads that could be waiting in Get.
+    void Decode(ThreadPool& threads) {
+        std::call_once(m_decoded, [&]() { m_strings = DecodeStringTable(FormatDecoder(m_content, m_size), m_pool, &threads); });
+    }
+};
+
+// Loads the column chunks of an attached sheet when its store first touches
+// them, verifying each chunk's checksum and its agreement with the sheet
+// index at that point
+class DeferredSheetLoader : public CellChunkLoader {
+public:
+    struct ChunkLocation {
+        const uint8_t* data;    // the chunk's size and checksum, then its payload
+        int32_t column;
+        int32_t firstRow;
+        size_t count;
+    };
+
+private:
+    std::shared_ptr<const void> m_data;
+    std::shared_ptr<DeferredStringTable> m_strings;
+    const uint8_t* m_chunksEnd;
+    std::vector<ChunkLocation> m_chunks;
+
+public:
+    DeferredSheetLoader(std::shared_ptr<const void> data, std::shared_ptr<DeferredStringTable> strings, const uint8_t* chunksEnd)
+        : m_data(std::move(data)), m_strings(std::move(strings)), m_chunksEnd(chunksEnd) {}
+
+    uint32_t AddChunk(const ChunkLocation& location) {
+        m_chunks.push_back(location);
+        return static_cast<uint32_t>(m_chunks.size() - 1);
+    }
+
+    void LoadChunk(uint32_t chunk, CellStore& store) override {
+        const ChunkLocation& location = m_chunks[chunk];
+        FormatDecoder section(location.data, static_cast<size_t>(m_chunksEnd - location.data));
+        FormatDecoder decoder = ReadChunk(section);
+        FormatDecoder header = decoder;
+        if (header.GetVarint() != static_cast<uint64_t>(location.column) ||
+            header.GetVarint() != static_cast<uint64_t>(location.firstRow) || header.GetVarint() != location.count) {
+            FormatDecoder::Fail("column chunk does not match the sheet index");
+        }
+        std::vector<CellValue> values;
+        DecodeColumnChunk(decoder, [this]() -> const std::vector<CellValue>& { return m_strings->Get(); }, values, store, true);
+    }
+};
+
+// Registers the cells of a sheet section with store as deferred chunks, as
+// WorkbookReader::AttachSheet describes. Only the section's header and
+// chunk index are read.
+static void AttachSheetSection(const uint8_t* content, size_t size, std::shared_ptr<const void> data,
+                               std::shared_ptr<DeferredStringTable> strings, CellStore& store) {
+    FormatDecoder section(content, size);
+    FormatDecoder header = ReadChunk(section);
+    uint64_t cellCount = header.GetFixed<uint64_t>();
+    uint32_t chunkCount = header.GetFixed<uint32_t>();
+    header.GetFixed<uint32_t>();
+    uint64_t indexOffset = header.GetFixed<uint64_t>();
+    size_t firstChunkOffset = size - section.Remaining();
+    if (indexOffset < firstChunkOffset || indexOffset > size || indexOffset % FORMAT_ALIGNMENT != 0) {
+        FormatDecoder::Fail("sheet index out of range");
+    }
+    FormatDecoder indexSection(content + indexOffset, size - static_cast<size_t>(indexOffset));
+    FormatDecoder index = ReadChunk(indexSection);
+    if (!indexSection.AtEnd() || chunkCount > index.Remaining() / 4) {
+        FormatDecoder::Fail("sheet index mismatch");
+    }
+
+    // Check the whole index before registering any chunk, so that a bad
+    // file leaves the store untouched
+    auto loader = std::make_shared<DeferredSheetLoader>(std::move(data), std::move(strings), content + indexOffset);
+    std::vector<DeferredSheetLoader::ChunkLocation> chunks(chunkCount);
+    uint64_t indexed = 0;
+    uint64_t offset = firstChunkOffset;
+    for (uint32_t i = 0; i < chunkCount; ++i) {
+        auto& chunk = chunks[i];
+        chunk.column = static_cast<int32_t>(index.GetBoundedVarint(MAX_SHEET_COLUMNS));
+        chunk.firstRow = static_cast<int32_t>(index.GetBoundedVarint(MAX_SHEET_ROWS));
+        chunk.count = static_cast<size_t>(index.GetBoundedVarint(COLUMN_CHUNK_ROWS));
+        uint64_t step = index.GetBoundedVarint(size / FORMAT_ALIGNMENT);
+        offset += step * FORMAT_ALIGNMENT;
+        if (chunk.column < 1 || chunk.firstRow < 1 || chunk.count == 0 || (i > 0 && step == 0) || offset >= indexOffset) {
+            FormatDecoder::Fail("sheet index out of range");
+        }
+        chunk.data = content + offset;
+        indexed += chunk.count;
+    }
+    if (indexed != cellCount || !index.AtEnd()) {
+        FormatDecoder::Fail("sheet cell count mismatch");
+    }
+
+    // Chunks cover COLUMN_CHUNK_ROWS-aligned rows, as WriteSheet cuts them
+    for (const auto& chunk : chunks) {
+        int32_t windowFirst = (chunk.firstRow - 1) / COLUMN_CHUNK_ROWS * COLUMN_CHUNK_ROWS + 1;
+        store.AddDeferredChunk(chunk.column, windowFirst, COLUMN_CHUNK_ROWS, chunk.count, loader,
+                               loader->AddChunk(chunk));
+    }
+}
+
+// A sheet deferred with WorkbookReader::DeferSheet, attached on first touch
+class DeferredSheet : public CellSheetLoader {
+private:
+    std::shared_ptr<const void> m_data;
+    std::shared_ptr<DeferredStringTable> m_strings;
+    const uint8_t* m_content;
+    size_t m_size;
+
+public:
+    DeferredSheet(std::shared_ptr<const void> data, std::shared_ptr<DeferredStringTable> strings, const uint8_t* content, size_t size)
+        : m_data(std::move(data)), m_strings(std::move(strings)), m_content(content), m_size(size) {}
+
+    void AttachSheet(CellStore& store) override {
+        AttachSheetSection(m_content, m_size, m_data, m_strings, store);
+    }
+};
+
+// Reads a workbook file written by WorkbookWriter. The constructor checks
+// the header and reads the section directory, touching no other section;
+// each Read call decodes one part, verifying chunk checksums as it goes.
+// The data must outlive the reader. Corrupt or truncated input throws
+// std::runtime_error.
+class WorkbookReader {
+private:
+    struct Section {
+        uint32_t tag;
+        const uint8_t* content;
+        size_t size;
+        uint64_t cellCount;     // of a sheet section
+    };
+
+    std::vector<Section> m_sections;
+
+public:
+    WorkbookReader(const uint8_t* data, size_t size) {
+        if (!IsWorkbookFile(data, size)) {
+            FormatDecoder::Fail("not a workbook file");
+        }
+        FormatDecoder file(data, size);
+        file.GetFixed<uint32_t>();
+        if (file.GetFixed<uint32_t>() != WORKBOOK_FILE_VERSION) {
+            throw std::runtime_error("Unsupported workbook file version");
+        }
+        file.GetFixed<uint64_t>();
+        if (file.GetFixed<uint32_t>() != DIRECTORY_SECTION) {
+            FormatDecoder::Fail("missing section directory");
+        }
+        file.GetFixed<uint32_t>();
+        uint64_t length = file.GetFixed<uint64_t>();
+        if (length > file.Remaining()) {
+            FormatDecoder::Fail("truncated section");
+        }
+        FormatDecoder directorySection(file.GetBytes(static_cast<size_t>(length)), static_cast<size_t>(length));
+        file.Align();
+        size_t firstOffset = size - file.Remaining();
+
+        FormatDecoder directory = ReadChunk(directorySection);
+        uint32_t count = directory.GetFixed<uint32_t>();
+        directory.GetFixed<uint32_t>();
+        if (count > directory.Remaining() / DIRECTORY_ENTRY_SIZE) {
+            FormatDecoder::Fail("section directory out of range");
+        }
+        m_sections.resize(count);
+        for (auto& section : m_sections) {
+            section.tag = directory.GetFixed<uint32_t>();
+            directory.GetFixed<uint32_t>();
+            uint64_t offset = directory.GetFixed<uint64_t>();
+            uint64_t sectionSize = directory.GetFixed<uint64_t>();
+            section.cellCount = directory.GetFixed<uint64_t>();
+            if (offset < firstOffset || offset % FORMAT_ALIGNMENT != 0 || offset > size ||
+                sectionSize > size - offset || SECTION_HEADER_SIZE > size - offset - sectionSize) {
+                FormatDecoder::Fail("truncated section");
+            }
+            section.content = data + offset + SECTION_HEADER_SIZE;
+            section.size = static_cast<size_t>(sectionSize);
+        }
+    }
+
+    // True if data starts with the workbook file magic
+    static bool IsWorkbookFile(const uint8_t* data, size_t size) {
+        uint32_t magic = 0;
+        if (size < 2 * FORMAT_ALIGNMENT) {
+            return false;
+        }
+        std::memcpy(&magic, data, sizeof(magic));
+        return magic == WORKBOOK_FILE_MAGIC;
+    }
+
+    // Content of the ordinal-th section with tag, or false if there is none
+    bool FindSection(uint32_t tag, const uint8_t*& content, size_t& size, size_t ordinal = 0) const {
+        for (const auto& section : m_sections) {
+            if (section.tag == tag && ordinal-- == 0) {
+                content = section.content;
+                size = section.size;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    WorkbookMetadata ReadMetadata() const {
+        FormatDecoder section = GetSection(METADATA_SECTION);
+        FormatDecoder chunk = ReadChunk(section);
+        WorkbookMetadata metadata;
+        metadata.name = std::string(chunk.GetString());
+        size_t count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+        for (size_t i = 0; i < count; ++i) {
+            metadata.sheetNames.emplace_back(chunk.GetString());
+        }
+        metadata.activeSheet = static_cast<uint32_t>(chunk.GetBoundedVarint(count > 0 ? count - 1 : 0));
+        return metadata;
+    }
+
+    // Interns the string table into the calling thread's current pool; the
+    // sheets' string cells refer to it by position
+    std::vector<CellValue> ReadStringTable() const {
+        return DecodeStringTable(GetSection(STRING_TABLE_SECTION), StringPool::Current());
+    }
+
+    // The string table for AttachSheet, decoded and interned into pool when
+    // a chunk first needs it. data owns the bytes the reader was
+    // constructed over.
+    std::shared_ptr<DeferredStringTable> AttachStringTable(std::shared_ptr<const void> data, StringPool& pool) const {
+        const uint8_t* content = nullptr;
+        size_t size = 0;
+        if (!FindSection(STRING_TABLE_SECTION, content, size)) {
+            FormatDecoder::Fail("missing section");
+        }
+        return std::make_shared<DeferredStringTable>(std::move(data), content, size, pool);
+    }
+
+    StyleTable ReadStyles() const {
+        StyleTable styles;
+        const uint8_t* content = nullptr;
+        size_t size = 0;
+        if (!FindSection(STYLE_SECTION, content, size)) {
+            return styles;
+        }
+        FormatDecoder section(content, size);
+        FormatDecoder chunk = ReadChunk(section);
+        size_t count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+        for (size_t i = 0; i < count; ++i) {
+            styles.records.emplace_back(chunk.GetString());
+        }
+        count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+        styles.ranges.resize(count);
+        for (auto& range : styles.ranges) {
+            range.sheet = static_cast<uint32_t>(chunk.GetBoundedVarint(UINT32_MAX));
+            range.rect.firstRow = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_ROWS));
+            range.rect.firstColumn = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_COLUMNS));
+            range.rect.lastRow = range.rect.firstRow + static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_ROWS));
+            range.rect.lastColumn = range.rect.firstColumn + static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_COLUMNS));
+            range.style = static_cast<uint32_t>(chunk.GetVarint());
+            if (range.style >= styles.records.size()) {
+                FormatDecoder::Fail("style index out of range");
+            }
+        }
+        return styles;
+    }
+
+    size_t GetSheetCount() const {
+        return static_cast<size_t>(std::count_if(m_sections.begin(), m_sections.end(),
+                                                 [](const Section& section) { return section.tag == SHEET_SECTION; }));
+    }
+
+    // Decodes the cells of a sheet into store; strings is the table
+    // returned by ReadStringTable
+    void ReadSheet(size_t sheet, const std::vector<CellValue>& strings, CellStore& store) const {
+        const uint8_t* content = nullptr;
+        size_t size = 0;
+        if (!FindSection(SHEET_SECTION, content, size, sheet)) {
+            throw std::runtime_error("Workbook file has no sheet " + std::to_string(sheet));
+        }
+        FormatDecoder section(content, size);
+        FormatDecoder header = ReadChunk(section);
+        uint64_t cellCount = header.GetFixed<uint64_t>();
+        uint32_t chunkCount = header.GetFixed<uint32_t>();
+
+        std::vector<CellValue> values;
+        uint64_t decoded = 0;
+        for (uint32_t i = 0; i < chunkCount; ++i) {
+            FormatDecoder chunk = ReadChunk(section);
+            decoded += DecodeColumnChunk(chunk, [&]() -> const std::vector<CellValue>& { return strings; }, values, store, false);
+        }
+        ReadChunk(section);
+        if (decoded != cellCount || !section.AtEnd()) {
+            FormatDecoder::Fail("sheet cell count mismatch");
+        }
+    }
+
+    // Registers the cells of a sheet with store without decoding them. Each
+    // column chunk is checked and decoded the first time one of its cells
+    // is read or written; numbers stored as raw doubles in a single run of
+    // rows are then read in place. data owns the bytes the reader was
+    // constructed over and is kept alive by the store; strings comes from
+    // AttachStringTable. Only the sheet's header and index are read here.
+    void AttachSheet(size_t sheet, std::shared_ptr<const void> data, std::shared_ptr<DeferredStringTable> strings,
+                     CellStore& store) const {
+        const Section& section = GetSheetSection(sheet);
+        AttachSheetSection(section.content, section.size, std::move(data), std::move(strings), store);
+    }
+
+    // Defers a sheet as a whole (see CellStore::DeferSheet): nothing of it
+    // is read until the store is first touched, when it is attached as by
+    // AttachSheet. Until then the store reports the sheet's cell count from
+    // the directory.
+    void DeferSheet(size_t sheet, std::shared_ptr<const void> data, std::shared_ptr<DeferredStringTable> strings,
+                    CellStore& store) const {
+        const Section& section = GetSheetSection(sheet);
+        store.DeferSheet(std::make_shared<DeferredSheet>(std::move(data), std::move(strings), section.content, section.size),
+                         static_cast<size_t>(section.cellCount));
+    }
+
+    uint64_t GetSheetCellCount(size_t sheet) const {
+        return GetSheetSection(sheet).cellCount;
+    }
+
+    // Formula templates and cells of a sheet; empty if it has no formulas
+    FormulaTable ReadFormulas(uint32_t sheet) const {
+        FormulaTable formulas;
+        const uint8_t* content = nullptr;
+        size_t size = 0;
+        for (size_t ordinal = 0; FindSection(FORMULA_SECTION, content, size, ordinal); ++ordinal) {
+            FormatDecoder section(content, size);
+            FormatDecoder chunk = ReadChunk(section);
+            if (chunk.GetVarint() != sheet) {
+                continue;
+            }
+            size_t count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+            formulas.templates.resize(count);
+            for (auto& source : formulas.templates) {
+                int32_t row = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_ROWS));
+                int32_t column = static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_COLUMNS));
+                source.context = CellReference(row, column);
+                source.formula = std::string(chunk.GetString());
+            }
+            count = static_cast<size_t>(chunk.GetBoundedVarint(chunk.Remaining()));
+            formulas.cells.resize(count);
+            int32_t column = 0;
+            int32_t row = 0;
+            for (auto& cell : formulas.cells) {
+                uint64_t columnDelta = chunk.GetBoundedVarint(MAX_SHEET_COLUMNS);
+                if (columnDelta > 0) {
+                    row = 0;
+                }
+                column += static_cast<int32_t>(columnDelta);
+                row += static_cast<int32_t>(chunk.GetBoundedVarint(MAX_SHEET_ROWS));
+                if (column < 1 || column > MAX_SHEET_COLUMNS || row < 1 || row > MAX_SHEET_ROWS) {
+                    FormatDecoder::Fail("formula cell out of range");
+                }
+                cell.first = CellReference(row, column);
+                cell.second = static_cast<uint32_t>(chunk.GetVarint());
+                if (cell.second >= formulas.templates.size()) {
+                    FormatDecoder::Fail("formula template index out of range");
+                }
+            }
+            break;
+        }
+        return formulas;
+    }
+
+private:
+    const Section& GetSheetSection(size_t sheet) const {
+        for (const auto& section : m_sections) {
+            if (section.tag == SHEET_SECTION && sheet-- == 0) {
+                return section;
+            }
+        }
+        throw std::runtime_error("Workbook file has no sheet " + std::to_string(sheet));
+    }
+
+    FormatDecoder GetSection(uint32_t tag) const {
+        const uint8_t* content = nullptr;
+        size_t size = 0;
+        if (!FindSection(tag, content, size)) {
+            FormatDecoder::Fail("missing section");
+        }
+        return FormatDecoder(content, size);
+    }
+};
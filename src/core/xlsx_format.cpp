@@ -0,0 +1,1739 @@
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <memory>
+#include <ostream>
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <zlib.h>
+#include "excel_types.h"
+#include "cell_value.h"
+#include "cell_store.h"
+#include "formula_compiler.h"
+#include "workbook_format.h"
+#include "xlsx_format.h"
+
+// Global constants
+const uint32_t ZIP_LOCAL_HEADER_SIGNATURE = 0x04034B50;
+const uint32_t ZIP_DATA_DESCRIPTOR_SIGNATURE = 0x08074B50;
+const uint32_t ZIP_CENTRAL_HEADER_SIGNATURE = 0x02014B50;
+const uint32_t ZIP64_END_SIGNATURE = 0x06064B50;
+const uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064B50;
+const uint32_t ZIP_END_SIGNATURE = 0x06054B50;
+const uint16_t ZIP_METHOD_STORED = 0;
+const uint16_t ZIP_METHOD_DEFLATED = 8;
+const uint16_t ZIP_FLAG_ENCRYPTED = 0x0001;
+const uint16_t ZIP_FLAG_DATA_DESCRIPTOR = 0x0008;
+const uint16_t ZIP_FLAG_UTF8 = 0x0800;
+const uint16_t ZIP64_EXTRA_FIELD = 0x0001;
+const uint16_t ZIP_VERSION_DEFLATE = 20;
+const uint16_t ZIP_VERSION_ZIP64 = 45;
+const uint16_t ZIP_DOS_DATE_1980 = 0x0021;          // entries are dated 1980-01-01 so output is reproducible
+const uint64_t ZIP32_LIMIT = 0xFFFFFFFF;
+const uint64_t ZIP16_LIMIT = 0xFFFF;
+const size_t ZIP_LOCAL_HEADER_SIZE = 30;
+const size_t ZIP_CENTRAL_HEADER_SIZE = 46;
+const size_t ZIP_END_RECORD_SIZE = 22;
+const size_t ZIP64_END_RECORD_SIZE = 56;
+const size_t ZIP64_LOCATOR_SIZE = 20;
+const int XLSX_COMPRESSION_LEVEL = 1;               // fastest deflate; sheet XML still shrinks about 8:1
+const size_t XLSX_STREAM_BUFFER_SIZE = 64 * 1024;
+const size_t XLSX_MAX_TOKEN_SIZE = 16 * 1024 * 1024; // longest tag or text run the parser buffers
+const int32_t XLSX_WRITE_BAND_ROWS = 256;           // rows gathered from the column store per pass
+const int32_t XLSX_MAX_ROWS = 1048576;
+const int32_t XLSX_MAX_COLUMNS = 16384;
+const char* const SPREADSHEETML_NAMESPACE = "http://schemas.openxmlformats.org/spreadsheetml/2006/main";
+const char* const OFFICE_RELATIONSHIPS_NAMESPACE = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
+const char* const PACKAGE_RELATIONSHIPS_NAMESPACE = "http://schemas.openxmlformats.org/package/2006/relationships";
+const char* const XML_DECLARATION = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n";
+
+[[noreturn]] static void FailXlsx(const std::string& reason) {
+    throw std::runtime_error("Corrupt XLSX file: " + reason);
+}
+
+// Zip stores integers little-endian regardless of the host
+static void PutLittleEndian(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+// CRC-32 of any length; zlib takes at most UINT_MAX bytes per call
+static uint32_t UpdateCrc32(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        uInt piece = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+        crc = static_cast<uint32_t>(crc32(crc, data, piece));
+        data += piece;
+        size -= piece;
+    }
+    return crc;
+}
+
+// Writes a zip archive to a stream entry by entry. Entry data is deflated
+// as it is written and never held in memory; each entry's sizes and CRC
+// follow its data in a data descriptor, and the central directory is
+// written by Finish. Entries and archives beyond 4 GB use the zip64
+// extensions.
+class ZipStreamWriter {
+private:
+    struct Entry {
+        std::string name;
+        uint32_t crc;
+        uint64_t compressedSize;
+        uint64_t size;
+        uint64_t offset;
+    };
+
+    std::ostream& m_out;
+    uint64_t m_offset;
+    std::vector<Entry> m_entries;
+    bool m_entryOpen;
+    z_stream m_deflate;
+    std::vector<uint8_t> m_buffer;
+
+public:
+    explicit ZipStreamWriter(std::ostream& out)
+        : m_out(out), m_offset(0), m_entryOpen(false), m_buffer(XLSX_STREAM_BUFFER_SIZE) {
+        std::memset(&m_deflate, 0, sizeof(m_deflate));
+        if (deflateInit2(&m_deflate, XLSX_COMPRESSION_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zip compression");
+        }
+    }
+
+    ~ZipStreamWriter() {
+        deflateEnd(&m_deflate);
+    }
+
+    ZipStreamWriter(const ZipStreamWriter&) = delete;
+    ZipStreamWriter& operator=(const ZipStreamWriter&) = delete;
+
+    // Starts an entry, ending the previous one
+    void BeginEntry(const std::string& name) {
+        if (m_entryOpen) {
+            EndEntry();
+        }
+        if (name.empty() || name.size() > ZIP16_LIMIT) {
+            throw std::runtime_error("Invalid zip entry name");
+        }
+        m_entries.push_back({name, 0, 0, 0, m_offset});
+        std::string header;
+        PutLittleEndian(header, ZIP_LOCAL_HEADER_SIGNATURE, 4);
+        PutLittleEndian(header, ZIP_VERSION_DEFLATE, 2);
+        PutLittleEndian(header, ZIP_FLAG_DATA_DESCRIPTOR | ZIP_FLAG_UTF8, 2);
+        PutLittleEndian(header, ZIP_METHOD_DEFLATED, 2);
+        PutLittleEndian(header, 0, 2);
+        PutLittleEndian(header, ZIP_DOS_DATE_1980, 2);
+        PutLittleEndian(header, 0, 4);       // CRC and sizes, given by the data descriptor
+        PutLittleEndian(header, 0, 8);
+        PutLittleEndian(header, name.size(), 2);
+        PutLittleEndian(header, 0, 2);
+        header += name;
+        WriteRaw(header.data(), header.size());
+        if (deflateReset(&m_deflate) != Z_OK) {
+            throw std::runtime_error("Failed to reset zip compression");
+        }
+        m_entryOpen = true;
+    }
+
+    void Write(const void* data, size_t size) {
+        if (!m_entryOpen) {
+            throw std::runtime_error("No zip entry is open");
+        }
+        Entry& entry = m_entries.back();
+        entry.crc = UpdateCrc32(entry.crc, static_cast<const uint8_t*>(data), size);
+        entry.size += size;
+        Deflate(static_cast<const uint8_t*>(data), size, Z_NO_FLUSH);
+    }
+
+    void EndEntry() {
+        if (!m_entryOpen) {
+            return;
+        }
+        Deflate(nullptr, 0, Z_FINISH);
+        m_entryOpen = false;
+        const Entry& entry = m_entries.back();
+        int sizeBytes = entry.size >= ZIP32_LIMIT || entry.compressedSize >= ZIP32_LIMIT ? 8 : 4;
+        std::string descriptor;
+        PutLittleEndian(descriptor, ZIP_DATA_DESCRIPTOR_SIGNATURE, 4);
+        PutLittleEndian(descriptor, entry.crc, 4);
+        PutLittleEndian(descriptor, entry.compressedSize, sizeBytes);
+        PutLittleEndian(descriptor, entry.size, sizeBytes);
+        WriteRaw(descriptor.data(), descriptor.size());
+    }
+
+    // Ends the last entry and writes the central directory
+    void Finish() {
+        EndEntry();
+        uint64_t directoryOffset = m_offset;
+        for (const auto& entry : m_entries) {
+            // Values that do not fit 32 bits move to the zip64 extra field,
+            // in this order
+            std::string extra;
+            for (uint64_t value : {entry.size, entry.compressedSize, entry.offset}) {
+                if (value >= ZIP32_LIMIT) {
+                    PutLittleEndian(extra, value, 8);
+                }
+            }
+            std::string header;
+            PutLittleEndian(header, ZIP_CENTRAL_HEADER_SIGNATURE, 4);
+            PutLittleEndian(header, ZIP_VERSION_ZIP64, 2);
+            PutLittleEndian(header, extra.empty() ? ZIP_VERSION_DEFLATE : ZIP_VERSION_ZIP64, 2);
+            PutLittleEndian(header, ZIP_FLAG_DATA_DESCRIPTOR | ZIP_FLAG_UTF8, 2);
+            PutLittleEndian(header, ZIP_METHOD_DEFLATED, 2);
+            PutLittleEndian(header, 0, 2);
+            PutLittleEndian(header, ZIP_DOS_DATE_1980, 2);
+            PutLittleEndian(header, entry.crc, 4);
+            PutLittleEndian(header, std::min(entry.compressedSize, ZIP32_LIMIT), 4);
+            PutLittleEndian(header, std::min(entry.size, ZIP32_LIMIT), 4);
+            PutLittleEndian(header, entry.name.size(), 2);
+            PutLittleEndian(header, extra.empty() ? 0 : extra.size() + 4, 2);
+            PutLittleEndian(header, 0, 6);       // comment length, disk and internal attributes
+            PutLittleEndian(header, 0, 4);       // external attributes
+            PutLittleEndian(header, std::min(entry.offset, ZIP32_LIMIT), 4);
+            header += entry.name;
+            if (!extra.empty()) {
+                PutLittleEndian(header, ZIP64_EXTRA_FIELD, 2);
+                PutLittleEndian(header, extra.size(), 2);
+                header += extra;
+            }
+            WriteRaw(header.data(), header.size());
+        }
+
+        uint64_t directorySize = m_offset - directoryOffset;
+        std::string end;
+        if (m_entries.size() >= ZIP16_LIMIT || directoryOffset >= ZIP32_LIMIT || directorySize >= ZIP32_LIMIT) {
+            uint64_t zip64EndOffset = m_offset;
+            PutLittleEndian(end, ZIP64_END_SIGNATURE, 4);
+            PutLittleEndian(end, ZIP64_END_RECORD_SIZE - 12, 8);
+            PutLittleEndian(end, ZIP_VERSION_ZIP64, 2);
+            PutLittleEndian(end, ZIP_VERSION_ZIP64, 2);
+            PutLittleEndian(end, 0, 8);          // this disk and the directory's disk
+            PutLittleEndian(end, m_entries.size(), 8);
+            PutLittleEndian(end, m_entries.size(), 8);
+            PutLittleEndian(end, directorySize, 8);
+            PutLittleEndian(end, directoryOffset, 8);
+            PutLittleEndian(end, ZIP64_LOCATOR_SIGNATURE, 4);
+            PutLittleEndian(end, 0, 4);
+            PutLittleEndian(end, zip64EndOffset, 8);
+            PutLittleEndian(end, 1, 4);
+        }
+        PutLittleEndian(end, ZIP_END_SIGNATURE, 4);
+        PutLittleEndian(end, 0, 4);
+        PutLittleEndian(end, std::min<uint64_t>(m_entries.size(), ZIP16_LIMIT), 2);
+        PutLittleEndian(end, std::min<uint64_t>(m_entries.size(), ZIP16_LIMIT), 2);
+        PutLittleEndian(end, std::min(directorySize, ZIP32_LIMIT), 4);
+        PutLittleEndian(end, std::min(directoryOffset, ZIP32_LIMIT), 4);
+        PutLittleEndian(end, 0, 2);
+        WriteRaw(end.data(), end.size());
+        m_out.flush();
+        if (!m_out) {
+            throw std::runtime_error("Failed to write zip archive");
+        }
+    }
+
+private:
+    void Deflate(const uint8_t* data, size_t size, int flush) {
+        do {
+            uInt piece = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+            m_deflate.next_in = const_cast<Bytef*>(data);
+            m_deflate.avail_in = piece;
+            data += piece;
+            size -= piece;
+            int pieceFlush = size == 0 ? flush : Z_NO_FLUSH;
+            int result = Z_OK;
+            do {
+                m_deflate.next_out = m_buffer.data();
+                m_deflate.avail_out = static_cast<uInt>(m_buffer.size());
+                result = deflate(&m_deflate, pieceFlush);
+                if (result == Z_STREAM_ERROR) {
+                    throw std::runtime_error("Zip compression failed");
+                }
+                size_t produced = m_buffer.size() - m_deflate.avail_out;
+                WriteRaw(m_buffer.data(), produced);
+                m_entries.back().compressedSize += produced;
+            } while (m_deflate.avail_out == 0 || (pieceFlush == Z_FINISH && result != Z_STREAM_END));
+        } while (size > 0);
+    }
+
+    void WriteRaw(const void* data, size_t size) {
+        m_out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        if (!m_out) {
+            throw std::runtime_error("Failed to write zip archive");
+        }
+        m_offset += size;
+    }
+};
+
+// Entries of a zip archive held in memory, e.g. a mapped file. Only the
+// central directory and local headers are read up front; entry names are
+// matched case-insensitively, as package part names are.
+class ZipArchive {
+public:
+    struct Entry {
+        uint16_t method;
+        uint32_t crc;
+        uint64_t compressedSize;
+        uint64_t size;
+        const uint8_t* data;        // compressed bytes
+    };
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    std::unordered_map<std::string, Entry> m_entries;
+
+public:
+    ZipArchive(const uint8_t* data, size_t size) : m_data(data), m_size(size) {
+        // The end record is the last 22 bytes unless the archive has a comment
+        if (size < ZIP_END_RECORD_SIZE) {
+            FailXlsx("not a zip archive");
+        }
+        size_t end = size - ZIP_END_RECORD_SIZE;
+        size_t searchStart = end > ZIP16_LIMIT ? end - ZIP16_LIMIT : 0;
+        while (Read(end, 4) != ZIP_END_SIGNATURE || end + ZIP_END_RECORD_SIZE + Read(end + 20, 2) > size) {
+            if (end == searchStart) {
+                FailXlsx("not a zip archive");
+            }
+            --end;
+        }
+        uint64_t entryCount = Read(end + 10, 2);
+        uint64_t directorySize = Read(end + 12, 4);
+        uint64_t directoryOffset = Read(end + 16, 4);
+        if (entryCount == ZIP16_LIMIT || directorySize == ZIP32_LIMIT || directoryOffset == ZIP32_LIMIT) {
+            if (end < ZIP64_LOCATOR_SIZE || Read(end - ZIP64_LOCATOR_SIZE, 4) != ZIP64_LOCATOR_SIGNATURE) {
+                FailXlsx("missing zip64 end record");
+            }
+            uint64_t zip64End = Read(end - ZIP64_LOCATOR_SIZE + 8, 8);
+            if (zip64End > size - ZIP64_END_RECORD_SIZE || Read(static_cast<size_t>(zip64End), 4) != ZIP64_END_SIGNATURE) {
+                FailXlsx("damaged zip64 end record");
+            }
+            entryCount = Read(static_cast<size_t>(zip64End) + 32, 8);
+            directorySize = Read(static_cast<size_t>(zip64End) + 40, 8);
+            directoryOffset = Read(static_cast<size_t>(zip64End) + 48, 8);
+        }
+        if (directoryOffset > size || directorySize > size - directoryOffset ||
+            entryCount > directorySize / ZIP_CENTRAL_HEADER_SIZE) {
+            FailXlsx("central directory out of range");
+        }
+
+        size_t position = static_cast<size_t>(directoryOffset);
+        size_t directoryEnd = static_cast<size_t>(directoryOffset + directorySize);
+        for (uint64_t i = 0; i < entryCount; ++i) {
+            if (position + ZIP_CENTRAL_HEADER_SIZE > directoryEnd || Read(position, 4) != ZIP_CENTRAL_HEADER_SIGNATURE) {
+                FailXlsx("damaged central directory");
+            }
+            uint16_t flags = static_cast<uint16_t>(Read(position + 8, 2));
+            Entry entry;
+            entry.method = static_cast<uint16_t>(Read(position + 10, 2));
+            entry.crc = static_cast<uint32_t>(Read(position + 16, 4));
+            entry.compressedSize = Read(position + 20, 4);
+            entry.size = Read(position + 24, 4);
+            size_t nameLength = static_cast<size_t>(Read(position + 28, 2));
+            size_t extraLength = static_cast<size_t>(Read(position + 30, 2));
+            size_t commentLength = static_cast<size_t>(Read(position + 32, 2));
+            uint64_t localOffset = Read(position + 42, 4);
+            size_t name = position + ZIP_CENTRAL_HEADER_SIZE;
+            if (name + nameLength + extraLength + commentLength > directoryEnd) {
+                FailXlsx("damaged central directory");
+            }
+
+            // Sizes and offsets saturated at 32 bits are in the zip64 field
+            for (size_t field = name + nameLength; field + 4 <= name + nameLength + extraLength;) {
+                size_t fieldSize = static_cast<size_t>(Read(field + 2, 2));
+                size_t value = field + 4;
+                if (value + fieldSize > name + nameLength + extraLength) {
+                    FailXlsx("damaged central directory");
+                }
+                if (Read(field, 2) == ZIP64_EXTRA_FIELD) {
+                    for (uint64_t* target : {&entry.size, &entry.compressedSize, &localOffset}) {
+                        if (*target == ZIP32_LIMIT) {
+                            if (value + 8 > field + 4 + fieldSize) {
+                                FailXlsx("damaged zip64 field");
+                            }
+                            *target = Read(value, 8);
+                            value += 8;
+                        }
+                    }
+                }
+                field += 4 + fieldSize;
+            }
+            if (flags & ZIP_FLAG_ENCRYPTED) {
+                FailXlsx("encrypted entries are not supported");
+            }
+
+            // The data follows the local header, whose name and extra
+            // field lengths may differ from the central directory's
+            if (localOffset > size - ZIP_LOCAL_HEADER_SIZE || Read(static_cast<size_t>(localOffset), 4) != ZIP_LOCAL_HEADER_SIGNATURE) {
+                FailXlsx("damaged local header");
+            }
+            uint64_t dataOffset = localOffset + ZIP_LOCAL_HEADER_SIZE + Read(static_cast<size_t>(localOffset) + 26, 2) +
+                                  Read(static_cast<size_t>(localOffset) + 28, 2);
+            if (dataOffset > size || entry.compressedSize > size - dataOffset) {
+                FailXlsx("entry out of range");
+            }
+            entry.data = m_data + dataOffset;
+            m_entries[LowerCase(std::string(reinterpret_cast<const char*>(m_data) + name, nameLength))] = entry;
+            position = name + nameLength + extraLength + commentLength;
+        }
+    }
+
+    // Returns the entry with the given name, or nullptr
+    const Entry* Find(const std::string& name) const {
+        auto it = m_entries.find(LowerCase(name));
+        return it != m_entries.end() ? &it->second : nullptr;
+    }
+
+private:
+    uint64_t Read(size_t offset, int bytes) const {
+        if (offset > m_size || static_cast<size_t>(bytes) > m_size - offset) {
+            FailXlsx("truncated zip archive");
+        }
+        uint64_t value = 0;
+        for (int i = bytes - 1; i >= 0; --i) {
+            value = (value << 8) | m_data[offset + i];
+        }
+        return value;
+    }
+
+    static std::string LowerCase(std::string text) {
+        for (char& c : text) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+        }
+        return text;
+    }
+};
+
+// Decompresses one zip entry incrementally into the caller's buffer and
+// checks its size and CRC-32 once the end is reached
+class ZipEntryReader {
+private:
+    const ZipArchive::Entry& m_entry;
+    z_stream m_inflate;
+    uint64_t m_consumed;
+    uint64_t m_produced;
+    uint32_t m_crc;
+    bool m_streamEnd;
+    bool m_finished;
+
+public:
+    explicit ZipEntryReader(const ZipArchive::Entry& entry)
+        : m_entry(entry), m_consumed(0), m_produced(0), m_crc(0), m_streamEnd(false), m_finished(false) {
+        if (entry.method != ZIP_METHOD_STORED && entry.method != ZIP_METHOD_DEFLATED) {
+            FailXlsx("unsupported compression method " + std::to_string(entry.method));
+        }
+        std::memset(&m_inflate, 0, sizeof(m_inflate));
+        if (inflateInit2(&m_inflate, -MAX_WBITS) != Z_OK) {
+            throw std::runtime_error("Failed to initialize zip decompression");
+        }
+    }
+
+    ~ZipEntryReader() {
+        inflateEnd(&m_inflate);
+    }
+
+    ZipEntryReader(const ZipEntryReader&) = delete;
+    ZipEntryReader& operator=(const ZipEntryReader&) = delete;
+
+    // Fills up to capacity bytes of buffer; returns 0 at the end of the entry
+    size_t Read(uint8_t* buffer, size_t capacity) {
+        if (m_finished) {
+            return 0;
+        }
+        size_t produced = 0;
+        if (m_entry.method == ZIP_METHOD_STORED) {
+            produced = static_cast<size_t>(std::min<uint64_t>(capacity, m_entry.compressedSize - m_consumed));
+            std::memcpy(buffer, m_entry.data + m_consumed, produced);
+            m_consumed += produced;
+        } else if (!m_streamEnd) {
+            uInt available = static_cast<uInt>(std::min<size_t>(capacity, UINT_MAX));
+            m_inflate.next_out = buffer;
+            m_inflate.avail_out = available;
+            while (m_inflate.avail_out > 0) {
+                if (m_inflate.avail_in == 0 && m_consumed < m_entry.compressedSize) {
+                    uInt piece = static_cast<uInt>(std::min<uint64_t>(m_entry.compressedSize - m_consumed, UINT_MAX));
+                    m_inflate.next_in = const_cast<Bytef*>(m_entry.data + m_consumed);
+                    m_inflate.avail_in = piece;
+                    m_consumed += piece;
+                }
+                int result = inflate(&m_inflate, Z_NO_FLUSH);
+                if (result == Z_STREAM_END) {
+                    m_streamEnd = true;
+                    break;
+                }
+                if (result != Z_OK) {
+                    FailXlsx("damaged compressed data");
+                }
+            }
+            produced = available - m_inflate.avail_out;
+        }
+
+        m_produced += produced;
+        if (m_produced > m_entry.size) {
+            FailXlsx("entry larger than recorded");
+        }
+        m_crc = UpdateCrc32(m_crc, buffer, produced);
+        if (produced == 0) {
+            if (m_produced != m_entry.size || m_crc != m_entry.crc) {
+                FailXlsx("entry checksum mismatch");
+            }
+            m_finished = true;
+        }
+        return produced;
+    }
+};
+
+// Appends the UTF-8 encoding of a code point
+static void AppendUtf8(std::string& out, uint32_t codePoint) {
+    if (codePoint < 0x80) {
+        out += static_cast<char>(codePoint);
+    } else if (codePoint < 0x800) {
+        out += static_cast<char>(0xC0 | (codePoint >> 6));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+        out += static_cast<char>(0xE0 | (codePoint >> 12));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (codePoint >> 18));
+        out += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+}
+
+// Pull parser for the XML parts of a package, reading through a
+// ZipEntryReader so that only a window of the part is in memory. It covers
+// what SpreadsheetML uses: elements, attributes, character data, CDATA and
+// the predefined and numeric character references. Namespace prefixes are
+// dropped from names; comments, processing instructions and DOCTYPE
+// declarations without an internal subset are skipped. Names, attributes
+// and text returned for an event stay valid until the next call to Next.
+class XmlPullParser {
+public:
+    enum class Event { StartElement, EndElement, Text, EndDocument };
+
+private:
+    ZipEntryReader& m_source;
+    std::vector<char> m_buffer;
+    size_t m_begin;
+    size_t m_end;
+    bool m_sourceDone;
+    std::string_view m_name;
+    std::vector<std::pair<std::string_view, std::string_view>> m_attributes;
+    std::string_view m_text;
+    std::string m_decoded;
+    bool m_closePending;        // a self-closing element was reported as started
+
+public:
+    explicit XmlPullParser(ZipEntryReader& source)
+        : m_source(source), m_buffer(XLSX_STREAM_BUFFER_SIZE), m_begin(0), m_end(0), m_sourceDone(false),
+          m_closePending(false) {}
+
+    Event Next() {
+        if (m_closePending) {
+            m_closePending = false;
+            return Event::EndElement;
+        }
+        while (true) {
+            if (!Available(0)) {
+                return Event::EndDocument;
+            }
+            if (m_buffer[m_begin] != '<') {
+                size_t end = FindCharacter('<');
+                m_text = std::string_view(&m_buffer[m_begin], end);
+                m_begin += end;
+                if (m_text.find_first_of("&\r") != std::string_view::npos) {
+                    DecodeText(m_text, m_decoded);
+                    m_text = m_decoded;
+                }
+                return Event::Text;
+            }
+
+            if (StartsWith("<?")) {
+                Skip(FindSequence("?>") + 2);
+            } else if (StartsWith("<!--")) {
+                Skip(FindSequence("-->") + 3);
+            } else if (StartsWith("<![CDATA[")) {
+                size_t end = FindSequence("]]>");
+                m_text = std::string_view(&m_buffer[m_begin + 9], end - 9);
+                m_begin += end + 3;
+                return Event::Text;
+            } else if (StartsWith("<!")) {
+                size_t end = FindCharacter('>');
+                if (std::memchr(&m_buffer[m_begin], '[', end) != nullptr) {
+                    FailXlsx("DTDs are not supported");
+                }
+                Skip(end + 1);
+            } else if (StartsWith("</")) {
+                size_t end = FindCharacter('>');
+                std::string_view name(&m_buffer[m_begin + 2], end - 2);
+                while (!name.empty() && IsSpace(name.back())) {
+                    name.remove_suffix(1);
+                }
+                m_name = LocalName(name);
+                m_begin += end + 1;
+                return Event::EndElement;
+            } else {
+                return ParseStartTag();
+            }
+        }
+    }
+
+    // Local name of the element just started or ended
+    std::string_view GetName() const {
+        return m_name;
+    }
+
+    // Text of a Text event, with references replaced
+    std::string_view GetText() const {
+        return m_text;
+    }
+
+    // Finds an attribute of the element just started by its local name;
+    // value is its raw text, before references are replaced
+    bool FindAttribute(std::string_view name, std::string_view& value) const {
+        for (const auto& attribute : m_attributes) {
+            if (attribute.first == name) {
+                value = attribute.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Value of an attribute with references replaced, or empty
+    std::string GetAttribute(std::string_view name) const {
+        std::string value;
+        std::string_view raw;
+        if (FindAttribute(name, raw)) {
+            DecodeText(raw, value);
+        }
+        return value;
+    }
+
+    // Skips the rest of the element just started, including its children
+    void SkipElement() {
+        for (int depth = 1; depth > 0;) {
+            switch (Next()) {
+                case Event::StartElement:
+                    ++depth;
+                    break;
+                case Event::EndElement:
+                    --depth;
+                    break;
+                case Event::Text:
+                    break;
+                case Event::EndDocument:
+                    FailXlsx("unexpected end of part");
+            }
+        }
+    }
+
+    // Replaces character references and normalizes line ends as XML
+    // requires; raw must not point into out
+    static void DecodeText(std::string_view raw, std::string& out) {
+        out.clear();
+        out.reserve(raw.size());
+        for (size_t i = 0; i < raw.size(); ++i) {
+            char c = raw[i];
+            if (c == '\r') {
+                out += '\n';
+                if (i + 1 < raw.size() && raw[i + 1] == '\n') {
+                    ++i;
+                }
+                continue;
+            }
+            if (c != '&') {
+                out += c;
+                continue;
+            }
+            size_t end = raw.find(';', i);
+            if (end == std::string_view::npos) {
+                FailXlsx("unterminated character reference");
+            }
+            std::string_view entity = raw.substr(i + 1, end - i - 1);
+            if (entity == "lt") {
+                out += '<';
+            } else if (entity == "gt") {
+                out += '>';
+            } else if (entity == "amp") {
+                out += '&';
+            } else if (entity == "quot") {
+                out += '"';
+            } else if (entity == "apos") {
+                out += '\'';
+            } else if (entity.size() > 1 && entity[0] == '#') {
+                bool hex = entity[1] == 'x';
+                uint32_t codePoint = 0;
+                const char* first = entity.data() + (hex ? 2 : 1);
+                const char* last = entity.data() + entity.size();
+                auto result = std::from_chars(first, last, codePoint, hex ? 16 : 10);
+                if (first == last || result.ec != std::errc() || result.ptr != last || codePoint == 0 || codePoint > 0x10FFFF ||
+                    (codePoint >= 0xD800 && codePoint <= 0xDFFF)) {
+                    FailXlsx("invalid character reference");
+                }
+                AppendUtf8(out, codePoint);
+            } else {
+                FailXlsx("unknown entity &" + std::string(entity) + ";");
+            }
+            i = end;
+        }
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static std::string_view LocalName(std::string_view name) {
+        size_t colon = name.rfind(':');
+        return colon == std::string_view::npos ? name : name.substr(colon + 1);
+    }
+
+    // Makes the byte at m_begin + offset available; false at the end of the part
+    bool Available(size_t offset) {
+        while (m_begin + offset >= m_end) {
+            if (!Fill()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Reads more of the part, moving unconsumed bytes to the front and
+    // growing the buffer when a single token fills it
+    bool Fill() {
+        if (m_sourceDone) {
+            return false;
+        }
+        if (m_begin > 0) {
+            std::memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+        if (m_end == m_buffer.size()) {
+            if (m_buffer.size() >= XLSX_MAX_TOKEN_SIZE) {
+                FailXlsx("element or text too long");
+            }
+            m_buffer.resize(m_buffer.size() * 2);
+        }
+        size_t read = m_source.Read(reinterpret_cast<uint8_t*>(m_buffer.data() + m_end), m_buffer.size() - m_end);
+        if (read == 0) {
+            m_sourceDone = true;
+            return false;
+        }
+        m_end += read;
+        return true;
+    }
+
+    bool StartsWith(const char* prefix) {
+        size_t length = std::strlen(prefix);
+        Available(length - 1);
+        return m_end - m_begin >= length && std::memcmp(&m_buffer[m_begin], prefix, length) == 0;
+    }
+
+    void Skip(size_t length) {
+        m_begin += length;
+    }
+
+    // Offset from m_begin of the next c; for text, the end of the part
+    // also ends the run
+    size_t FindCharacter(char c) {
+        size_t offset = 0;
+        while (true) {
+            const void* found = std::memchr(&m_buffer[m_begin + offset], c, m_end - m_begin - offset);
+            if (found) {
+                return static_cast<size_t>(static_cast<const char*>(found) - &m_buffer[m_begin]);
+            }
+            offset = m_end - m_begin;
+            if (!Available(offset)) {
+                if (c == '<') {
+                    return offset;
+                }
+                FailXlsx("unterminated markup");
+            }
+        }
+    }
+
+    size_t FindSequence(const char* sequence) {
+        size_t length = std::strlen(sequence);
+        size_t offset = 0;
+        while (true) {
+            std::string_view window(&m_buffer[m_begin], m_end - m_begin);
+            size_t found = window.find(sequence, offset);
+            if (found != std::string_view::npos) {
+                return found;
+            }
+            offset = window.size() >= length ? window.size() - length + 1 : 0;
+            if (!Available(window.size())) {
+                FailXlsx("unterminated markup");
+            }
+        }
+    }
+
+    Event ParseStartTag() {
+        // Find the closing '>', which may also appear inside attribute values
+        size_t end = 1;
+        char quote = 0;
+        while (true) {
+            if (!Available(end)) {
+                FailXlsx("unterminated tag");
+            }
+            char c = m_buffer[m_begin + end];
+            if (quote) {
+                if (c == quote) {
+                    quote = 0;
+                }
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '>') {
+                break;
+            }
+            ++end;
+        }
+
+        const char* tag = &m_buffer[m_begin];
+        size_t position = 1;
+        size_t nameStart = position;
+        while (position < end && !IsSpace(tag[position]) && tag[position] != '/') {
+            ++position;
+        }
+        if (position == nameStart) {
+            FailXlsx("malformed tag");
+        }
+        m_name = LocalName(std::string_view(tag + nameStart, position - nameStart));
+        m_attributes.clear();
+        bool selfClosing = false;
+        while (true) {
+            while (position < end && IsSpace(tag[position])) {
+                ++position;
+            }
+            if (position == end) {
+                break;
+            }
+            if (tag[position] == '/' && position + 1 == end) {
+                selfClosing = true;
+                break;
+            }
+            size_t attributeStart = position;
+            while (position < end && tag[position] != '=' && !IsSpace(tag[position])) {
+                ++position;
+            }
+            std::string_view attributeName(tag + attributeStart, position - attributeStart);
+            while (position < end && IsSpace(tag[position])) {
+                ++position;
+            }
+            if (attributeName.empty() || position == end || tag[position] != '=') {
+                FailXlsx("malformed attribute");
+            }
+            ++position;
+            while (position < end && IsSpace(tag[position])) {
+                ++position;
+            }
+            if (position == end || (tag[position] != '"' && tag[position] != '\'')) {
+                FailXlsx("malformed attribute");
+            }
+            char delimiter = tag[position++];
+            size_t valueStart = position;
+            while (position < end && tag[position] != delimiter) {
+                ++position;
+            }
+            if (position == end) {
+                FailXlsx("malformed attribute");
+            }
+            // Namespace declarations are not attributes of the element
+            if (attributeName != "xmlns" && attributeName.substr(0, 6) != "xmlns:") {
+                m_attributes.emplace_back(LocalName(attributeName), std::string_view(tag + valueStart, position - valueStart));
+            }
+            ++position;
+        }
+        m_begin += end + 1;
+        m_closePending = selfClosing;
+        return Event::StartElement;
+    }
+};
+
+// Reads the text of the element just started up to its end tag, e.g. of
+// <v> or <f>
+static void ReadElementText(XmlPullParser& parser, std::string& text) {
+    text.clear();
+    for (int depth = 1; depth > 0;) {
+        switch (parser.Next()) {
+            case XmlPullParser::Event::StartElement:
+                ++depth;
+                break;
+            case XmlPullParser::Event::EndElement:
+                --depth;
+                break;
+            case XmlPullParser::Event::Text:
+                text.append(parser.GetText());
+                break;
+            case XmlPullParser::Event::EndDocument:
+                FailXlsx("unexpected end of part");
+        }
+    }
+}
+
+// Replaces the _xHHHH_ escapes SpreadsheetML uses for characters XML
+// cannot carry, such as control characters, in string values
+static void DecodeEscapedCharacters(std::string& text) {
+    size_t position = text.find("_x");
+    if (position == std::string::npos) {
+        return;
+    }
+    auto escapeAt = [&](size_t at, uint32_t& codePoint) {
+        if (at + 7 > text.size() || text[at] != '_' || text[at + 1] != 'x' || text[at + 6] != '_') {
+            return false;
+        }
+        const char* first = text.data() + at + 2;
+        auto result = std::from_chars(first, first + 4, codePoint, 16);
+        return result.ec == std::errc() && result.ptr == first + 4;
+    };
+    std::string decoded(text, 0, position);
+    while (position < text.size()) {
+        uint32_t codePoint = 0;
+        if (!escapeAt(position, codePoint)) {
+            decoded += text[position++];
+            continue;
+        }
+        position += 7;
+        uint32_t low = 0;
+        if (codePoint >= 0xD800 && codePoint < 0xDC00 && escapeAt(position, low) && low >= 0xDC00 && low < 0xE000) {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+            position += 7;
+        } else if (codePoint >= 0xD800 && codePoint < 0xE000) {
+            codePoint = 0xFFFD;
+        }
+        AppendUtf8(decoded, codePoint);
+    }
+    text.swap(decoded);
+}
+
+// Reads a rich text string, <si> or <is>, just started: the text of its <t>
+// elements, leaving out phonetic runs
+static void ReadRichText(XmlPullParser& parser, std::string& text) {
+    text.clear();
+    int depth = 1;
+    int textDepth = 0;          // depth of the open <t>, or 0
+    while (depth > 0) {
+        switch (parser.Next()) {
+            case XmlPullParser::Event::StartElement:
+                ++depth;
+                if (parser.GetName() == "rPh") {
+                    parser.SkipElement();
+                    --depth;
+                } else if (parser.GetName() == "t") {
+                    textDepth = depth;
+                }
+                break;
+            case XmlPullParser::Event::EndElement:
+                if (depth == textDepth) {
+                    textDepth = 0;
+                }
+                --depth;
+                break;
+            case XmlPullParser::Event::Text:
+                if (textDepth != 0) {
+                    text.append(parser.GetText());
+                }
+                break;
+            case XmlPullParser::Event::EndDocument:
+                FailXlsx("unexpected end of part");
+        }
+    }
+    DecodeEscapedCharacters(text);
+}
+
+// Appends text escaped for XML character data or, with attribute set, an
+// attribute value. Characters XML 1.0 cannot carry, and underscores that
+// would read as such an escape, become _xHHHH_ as SpreadsheetML specifies.
+static void AppendEscapedText(std::string& out, std::string_view text, bool attribute) {
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        switch (c) {
+            case '&':
+                out += "&amp;";
+                break;
+            case '<':
+                out += "&lt;";
+                break;
+            case '>':
+                out += "&gt;";
+                break;
+            case '"':
+                out += attribute ? "&quot;" : "\"";
+                break;
+            case '_':
+                if (i + 6 < text.size() && text[i + 1] == 'x' && text[i + 6] == '_' &&
+                    std::all_of(text.begin() + i + 2, text.begin() + i + 6, [](char h) { return std::isxdigit(static_cast<unsigned char>(h)); })) {
+                    out += "_x005F_";
+                } else {
+                    out += c;
+                }
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20 && (attribute || (c != '\t' && c != '\n'))) {
+                    static const char digits[] = "0123456789ABCDEF";
+                    out += "_x00";
+                    out += digits[(c >> 4) & 0xF];
+                    out += digits[c & 0xF];
+                    out += '_';
+                } else {
+                    out += c;
+                }
+                break;
+        }
+    }
+}
+
+// Appends an A1 reference such as "AB12"
+static void AppendCellReference(std::string& out, int32_t row, int32_t column) {
+    char label[4];
+    int length = 0;
+    for (; column > 0; column = (column - 1) / 26) {
+        label[length++] = static_cast<char>('A' + (column - 1) % 26);
+    }
+    while (length > 0) {
+        out += label[--length];
+    }
+    out += std::to_string(row);
+}
+
+// Parses an A1 reference without $ markers, as cell elements carry
+static bool ParseCellName(std::string_view text, int32_t& row, int32_t& column) {
+    size_t position = 0;
+    int32_t parsedColumn = 0;
+    while (position < text.size() && position < 3 && text[position] >= 'A' && text[position] <= 'Z') {
+        parsedColumn = parsedColumn * 26 + (text[position++] - 'A' + 1);
+    }
+    int32_t parsedRow = 0;
+    auto result = std::from_chars(text.data() + position, text.data() + text.size(), parsedRow);
+    if (position == 0 || result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+        return false;
+    }
+    row = parsedRow;
+    column = parsedColumn;
+    return true;
+}
+
+static const char* ErrorText(CellErrorType error) {
+    switch (error) {
+        case CellErrorType::DivisionByZero: return "#DIV/0!";
+        case CellErrorType::Reference: return "#REF!";
+        case CellErrorType::Name: return "#NAME?";
+        case CellErrorType::Number: return "#NUM!";
+        case CellErrorType::NotAvailable: return "#N/A";
+        case CellErrorType::Null: return "#NULL!";
+        case CellErrorType::Spill: return "#SPILL!";
+        case CellErrorType::Calc: return "#CALC!";
+        default: return "#VALUE!";
+    }
+}
+
+static CellErrorType ParseErrorText(std::string_view text) {
+    if (text == "#DIV/0!") return CellErrorType::DivisionByZero;
+    if (text == "#REF!") return CellErrorType::Reference;
+    if (text == "#NAME?") return CellErrorType::Name;
+    if (text == "#NUM!") return CellErrorType::Number;
+    if (text == "#N/A") return CellErrorType::NotAvailable;
+    if (text == "#NULL!") return CellErrorType::Null;
+    if (text == "#SPILL!") return CellErrorType::Spill;
+    if (text == "#CALC!") return CellErrorType::Calc;
+    return CellErrorType::Value;
+}
+
+// Streams a workbook to an XLSX package (zip + SpreadsheetML). Each sheet's
+// XML is deflated into the archive as its rows are produced, so memory
+// stays bounded by a band of rows and the distinct strings however large
+// the sheet. Sheets are written cell by cell, with BeginSheet, WriteCell in
+// row order and EndSheet, or from a cell store with WriteSheet; Finish adds
+// the shared strings and the workbook parts. Formula cells carry their
+// current result as the cached value.
+class XlsxWriter {
+private:
+    struct BandCell {
+        int32_t row;
+        int32_t column;
+        CellValue value;
+    };
+
+    ZipStreamWriter m_zip;
+    std::string m_xml;          // XML not yet passed to m_zip
+    std::vector<std::string> m_sheetNames;
+    bool m_sheetOpen;
+    int32_t m_row;              // open <row>, or 0
+    int32_t m_column;           // last column written in it
+
+    // Distinct strings in shared string table order. Interned strings never
+    // move, so their addresses identify them.
+    std::vector<const std::string*> m_strings;
+    std::unordered_map<const std::string*, uint32_t> m_stringIndexes;
+    uint64_t m_stringCells;
+
+    // Scratch space of WriteSheet
+    std::vector<BandCell> m_band;
+    std::vector<BandCell> m_sortedBand;
+    std::vector<uint32_t> m_rowStarts;
+
+public:
+    explicit XlsxWriter(std::ostream& out)
+        : m_zip(out), m_sheetOpen(false), m_row(0), m_column(0), m_stringCells(0) {}
+
+    XlsxWriter(const XlsxWriter&) = delete;
+    XlsxWriter& operator=(const XlsxWriter&) = delete;
+
+    void BeginSheet(const std::string& name) {
+        EndSheet();
+        m_sheetNames.push_back(name);
+        m_zip.BeginEntry("xl/worksheets/sheet" + std::to_string(m_sheetNames.size()) + ".xml");
+        m_xml += XML_DECLARATION;
+        m_xml += "<worksheet xmlns=\"";
+        m_xml += SPREADSHEETML_NAMESPACE;
+        m_xml += "\" xmlns:r=\"";
+        m_xml += OFFICE_RELATIONSHIPS_NAMESPACE;
+        m_xml += "\"><sheetData>";
+        m_sheetOpen = true;
+        m_row = 0;
+        m_column = 0;
+    }
+
+    // Writes a cell of the open sheet. Cells must come in row order and,
+    // within a row, in column order. formula is the cell's formula as the
+    // calculation engine holds it, e.g. "=A1*2", or nullptr.
+    void WriteCell(int32_t row, int32_t column, const CellValue& value, const std::string* formula = nullptr) {
+        if (!m_sheetOpen) {
+            throw std::runtime_error("No XLSX sheet is open");
+        }
+        if (row < 1 || row > XLSX_MAX_ROWS || column < 1 || column > XLSX_MAX_COLUMNS) {
+            throw std::runtime_error("Cell outside the XLSX grid");
+        }
+        if (row < m_row || (row == m_row && column <= m_column)) {
+            throw std::runtime_error("XLSX cells must be written in row order");
+        }
+        if (value.IsEmpty() && !formula) {
+            return;
+        }
+        if (row != m_row) {
+            if (m_row != 0) {
+                m_xml += "</row>";
+            }
+            m_xml += "<row r=\"";
+            m_xml += std::to_string(row);
+            m_xml += "\">";
+            m_row = row;
+        }
+        m_column = column;
+
+        m_xml += "<c r=\"";
+        AppendCellReference(m_xml, row, column);
+        m_xml += '"';
+        if (value.IsString()) {
+            m_xml += formula ? " t=\"str\"" : " t=\"s\"";
+        } else if (value.IsBoolean()) {
+            m_xml += " t=\"b\"";
+        } else if (value.IsError() || (value.IsNumeric() && !std::isfinite(value.GetNumeric()))) {
+            m_xml += " t=\"e\"";
+        }
+        m_xml += '>';
+        if (formula) {
+            std::string_view text(*formula);
+            if (!text.empty() && text.front() == '=') {
+                text.remove_prefix(1);
+            }
+            m_xml += "<f>";
+            AppendEscapedText(m_xml, text, false);
+            m_xml += "</f>";
+        }
+        if (!value.IsEmpty()) {
+            m_xml += "<v>";
+            AppendValue(value, formula != nullptr);
+            m_xml += "</v>";
+        }
+        m_xml += "</c>";
+        if (m_xml.size() >= XLSX_STREAM_BUFFER_SIZE) {
+            FlushXml();
+        }
+    }
+
+    void EndSheet() {
+        if (!m_sheetOpen) {
+            return;
+        }
+        if (m_row != 0) {
+            m_xml += "</row>";
+        }
+        m_xml += "</sheetData></worksheet>";
+        FlushXml();
+        m_zip.EndEntry();
+        m_sheetOpen = false;
+    }
+
+    // Writes the cells of store as the next sheet. The store is read in
+    // bands of XLSX_WRITE_BAND_ROWS rows, each reordered from the store's
+    // column order into row order. formulas, if given, are the sheet's
+    // formula cells; each is written with the formula text as it reads at
+    // that cell.
+    void WriteSheet(const std::string& name, const CellStore& store, const FormulaTable* formulas = nullptr) {
+        BeginSheet(name);
+        std::vector<uint32_t> formulaOrder;
+        if (formulas) {
+            formulaOrder.resize(formulas->cells.size());
+            for (uint32_t i = 0; i < formulaOrder.size(); ++i) {
+                formulaOrder[i] = i;
+            }
+            std::sort(formulaOrder.begin(), formulaOrder.end(), [&](uint32_t a, uint32_t b) {
+                const CellReference& first = formulas->cells[a].first;
+                const CellReference& second = formulas->cells[b].first;
+                return first.GetRow() != second.GetRow() ? first.GetRow() < second.GetRow()
+                                                         : first.GetColumn() < second.GetColumn();
+            });
+        }
+        size_t nextFormula = 0;
+        std::string formulaText;
+        const CellValue empty;
+
+        for (int32_t firstRow = 1; firstRow <= XLSX_MAX_ROWS; firstRow += XLSX_WRITE_BAND_ROWS) {
+            int32_t lastRow = firstRow + XLSX_WRITE_BAND_ROWS - 1;
+            ReadBand(store, firstRow, lastRow);
+
+            // Merge the band's values with the formula cells in it
+            size_t cell = 0;
+            while (true) {
+                bool hasFormula = nextFormula < formulaOrder.size() &&
+                                  formulas->cells[formulaOrder[nextFormula]].first.GetRow() <= lastRow;
+                if (cell == m_sortedBand.size() && !hasFormula) {
+                    break;
+                }
+                int32_t row = 0;
+                int32_t column = 0;
+                if (hasFormula) {
+                    const CellReference& reference = formulas->cells[formulaOrder[nextFormula]].first;
+                    row = reference.GetRow();
+                    column = reference.GetColumn();
+                }
+                bool takeValue = cell < m_sortedBand.size() &&
+                                 (!hasFormula || m_sortedBand[cell].row < row ||
+                                  (m_sortedBand[cell].row == row && m_sortedBand[cell].column <= column));
+                if (takeValue && (!hasFormula || m_sortedBand[cell].row != row || m_sortedBand[cell].column != column)) {
+                    WriteCell(m_sortedBand[cell].row, m_sortedBand[cell].column, m_sortedBand[cell].value);
+                    ++cell;
+                    continue;
+                }
+                const auto& formulaCell = formulas->cells[formulaOrder[nextFormula]];
+                const FormulaTemplateSource& source = formulas->templates.at(formulaCell.second);
+                formulaText = source.context == formulaCell.first ? source.formula
+                                                                  : TranslateFormula(source.formula, source.context, formulaCell.first);
+                WriteCell(row, column, takeValue ? m_sortedBand[cell].value : empty, &formulaText);
+                cell += takeValue ? 1 : 0;
+                ++nextFormula;
+            }
+        }
+        EndSheet();
+    }
+
+    // Writes the shared strings and workbook parts and completes the
+    // archive; activeSheet is the sheet shown when the file is opened
+    void Finish(uint32_t activeSheet = 0) {
+        EndSheet();
+        if (m_sheetNames.empty()) {
+            BeginSheet("Sheet1");
+            EndSheet();
+        }
+
+        m_zip.BeginEntry("xl/sharedStrings.xml");
+        m_xml += XML_DECLARATION;
+        m_xml += "<sst xmlns=\"";
+        m_xml += SPREADSHEETML_NAMESPACE;
+        m_xml += "\" count=\"" + std::to_string(m_stringCells) + "\" uniqueCount=\"" + std::to_string(m_strings.size()) + "\">";
+        for (const std::string* text : m_strings) {
+            bool preserve = !text->empty() && (IsXmlSpace(text->front()) || IsXmlSpace(text->back()) ||
+                                               text->find_first_of("\t\n") != std::string::npos);
+            m_xml += preserve ? "<si><t xml:space=\"preserve\">" : "<si><t>";
+            AppendEscapedText(m_xml, *text, false);
+            m_xml += "</t></si>";
+            if (m_xml.size() >= XLSX_STREAM_BUFFER_SIZE) {
+                FlushXml();
+            }
+        }
+        m_xml += "</sst>";
+        WritePart();
+
+        m_zip.BeginEntry("xl/styles.xml");
+        m_xml += XML_DECLARATION;
+        m_xml += "<styleSheet xmlns=\"";
+        m_xml += SPREADSHEETML_NAMESPACE;
+        m_xml += "\"><fonts count=\"1\"><font><sz val=\"11\"/><name val=\"Calibri\"/></font></fonts>"
+                 "<fills count=\"2\"><fill><patternFill patternType=\"none\"/></fill>"
+                 "<fill><patternFill patternType=\"gray125\"/></fill></fills>"
+                 "<borders count=\"1\"><border><left/><right/><top/><bottom/><diagonal/></border></borders>"
+                 "<cellStyleXfs count=\"1\"><xf numFmtId=\"0\" fontId=\"0\" fillId=\"0\" borderId=\"0\"/></cellStyleXfs>"
+                 "<cellXfs count=\"1\"><xf numFmtId=\"0\" fontId=\"0\" fillId=\"0\" borderId=\"0\" xfId=\"0\"/></cellXfs>"
+                 "<cellStyles count=\"1\"><cellStyle name=\"Normal\" xfId=\"0\" builtinId=\"0\"/></cellStyles></styleSheet>";
+        WritePart();
+
+        m_zip.BeginEntry("xl/workbook.xml");
+        m_xml += XML_DECLARATION;
+        m_xml += "<workbook xmlns=\"";
+        m_xml += SPREADSHEETML_NAMESPACE;
+        m_xml += "\" xmlns:r=\"";
+        m_xml += OFFICE_RELATIONSHIPS_NAMESPACE;
+        m_xml += "\"><bookViews><workbookView activeTab=\"" +
+                 std::to_string(activeSheet < m_sheetNames.size() ? activeSheet : 0) + "\"/></bookViews><sheets>";
+        for (size_t i = 0; i < m_sheetNames.size(); ++i) {
+            m_xml += "<sheet name=\"";
+            AppendEscapedText(m_xml, m_sheetNames[i], true);
+            m_xml += "\" sheetId=\"" + std::to_string(i + 1) + "\" r:id=\"rId" + std::to_string(i + 1) + "\"/>";
+        }
+        m_xml += "</sheets></workbook>";
+        WritePart();
+
+        m_zip.BeginEntry("xl/_rels/workbook.xml.rels");
+        m_xml += XML_DECLARATION;
+        m_xml += "<Relationships xmlns=\"";
+        m_xml += PACKAGE_RELATIONSHIPS_NAMESPACE;
+        m_xml += "\">";
+        for (size_t i = 0; i < m_sheetNames.size(); ++i) {
+            AppendRelationship("rId" + std::to_string(i + 1), "worksheet", "worksheets/sheet" + std::to_string(i + 1) + ".xml");
+        }
+        AppendRelationship("rId" + std::to_string(m_sheetNames.size() + 1), "sharedStrings", "sharedStrings.xml");
+        AppendRelationship("rId" + std::to_string(m_sheetNames.size() + 2), "styles", "styles.xml");
+        m_xml += "</Relationships>";
+        WritePart();
+
+        m_zip.BeginEntry("_rels/.rels");
+        m_xml += XML_DECLARATION;
+        m_xml += "<Relationships xmlns=\"";
+        m_xml += PACKAGE_RELATIONSHIPS_NAMESPACE;
+        m_xml += "\">";
+        AppendRelationship("rId1", "officeDocument", "xl/workbook.xml");
+        m_xml += "</Relationships>";
+        WritePart();
+
+        m_zip.BeginEntry("[Content_Types].xml");
+        m_xml += XML_DECLARATION;
+        m_xml += "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+                 "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+                 "<Default Extension=\"xml\" ContentType=\"application/xml\"/>"
+                 "<Override PartName=\"/xl/workbook.xml\" "
+                 "ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.sheet.main+xml\"/>";
+        for (size_t i = 0; i < m_sheetNames.size(); ++i) {
+            m_xml += "<Override PartName=\"/xl/worksheets/sheet" + std::to_string(i + 1) +
+                     ".xml\" ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.worksheet+xml\"/>";
+        }
+        m_xml += "<Override PartName=\"/xl/sharedStrings.xml\" "
+                 "ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.sharedStrings+xml\"/>"
+                 "<Override PartName=\"/xl/styles.xml\" "
+                 "ContentType=\"application/vnd.openxmlformats-officedocument.spreadsheetml.styles+xml\"/></Types>";
+        WritePart();
+
+        m_zip.Finish();
+    }
+
+private:
+    static bool IsXmlSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    void AppendValue(const CellValue& value, bool formulaResult) {
+        if (value.IsString()) {
+            if (formulaResult) {
+                AppendEscapedText(m_xml, value.GetString(), false);
+                return;
+            }
+            const std::string* text = &value.GetString();
+            auto inserted = m_stringIndexes.emplace(text, static_cast<uint32_t>(m_strings.size()));
+            if (inserted.second) {
+                m_strings.push_back(text);
+            }
+            ++m_stringCells;
+            m_xml += std::to_string(inserted.first->second);
+        } else if (value.IsBoolean()) {
+            m_xml += value.GetBoolean() ? '1' : '0';
+        } else if (value.IsError()) {
+            m_xml += ErrorText(value.GetError());
+        } else if (!std::isfinite(value.GetNumeric())) {
+            m_xml += ErrorText(CellErrorType::Number);
+        } else {
+            // Shortest text that reads back as the same double
+            char digits[32];
+            auto result = std::to_chars(digits, digits + sizeof(digits), value.GetNumeric());
+            m_xml.append(digits, result.ptr);
+        }
+    }
+
+    void AppendRelationship(const std::string& id, const char* type, const std::string& target) {
+        m_xml += "<Relationship Id=\"" + id + "\" Type=\"" + OFFICE_RELATIONSHIPS_NAMESPACE + "/" + type + "\" Target=\"" +
+                 target + "\"/>";
+    }
+
+    // Gathers the cells of rows firstRow to lastRow into m_sortedBand in row
+    // order. The store visits them column by column, top to bottom, so a
+    // counting sort by row keeps each row's columns in order.
+    void ReadBand(const CellStore& store, int32_t firstRow, int32_t lastRow) {
+        m_band.clear();
+        store.ForEachInRange({firstRow, 1, lastRow, XLSX_MAX_COLUMNS}, [&](int32_t row, int32_t column, const CellValue& value) {
+            m_band.push_back({row, column, value});
+        });
+        m_rowStarts.assign(static_cast<size_t>(lastRow - firstRow) + 2, 0);
+        for (const auto& cell : m_band) {
+            ++m_rowStarts[cell.row - firstRow + 1];
+        }
+        for (size_t i = 1; i < m_rowStarts.size(); ++i) {
+            m_rowStarts[i] += m_rowStarts[i - 1];
+        }
+        m_sortedBand.resize(m_band.size());
+        for (auto& cell : m_band) {
+            m_sortedBand[m_rowStarts[cell.row - firstRow]++] = std::move(cell);
+        }
+    }
+
+    void FlushXml() {
+        if (!m_xml.empty()) {
+            m_zip.Write(m_xml.data(), m_xml.size());
+            m_xml.clear();
+        }
+    }
+
+    void WritePart() {
+        FlushXml();
+        m_zip.EndEntry();
+    }
+};
+
+// Reads an XLSX package held in memory, e.g. a mapped file. Construction
+// reads the zip directory, the package relationships and the sheet list;
+// ReadSheet streams a sheet's XML through a pull parser straight into a
+// cell store, so besides the store only a window of the part is in memory.
+// Cached results are read as the values of formula cells. Throws
+// std::runtime_error if the package is damaged.
+class XlsxReader {
+private:
+    struct Sheet {
+        std::string name;
+        std::string part;
+    };
+
+    struct Relationship {
+        std::string id;
+        std::string type;       // last segment of the type URI, e.g. "worksheet"
+        std::string target;     // resolved part name
+    };
+
+    ZipArchive m_archive;
+    std::vector<Sheet> m_sheets;
+    std::string m_sharedStringsPart;
+    uint32_t m_activeSheet;
+
+public:
+    XlsxReader(const uint8_t* data, size_t size) : m_archive(data, size), m_activeSheet(0) {
+        std::string workbookPart = "xl/workbook.xml";
+        for (const auto& relationship : ReadRelationships("")) {
+            if (relationship.type == "officeDocument") {
+                workbookPart = relationship.target;
+            }
+        }
+        std::unordered_map<std::string, std::string> targets;
+        for (const auto& relationship : ReadRelationships(workbookPart)) {
+            targets[relationship.id] = relationship.target;
+            if (relationship.type == "sharedStrings") {
+                m_sharedStringsPart = relationship.target;
+            }
+        }
+
+        const ZipArchive::Entry* entry = FindPart(workbookPart);
+        ZipEntryReader source(*entry);
+        XmlPullParser parser(source);
+        for (auto event = parser.Next(); event != XmlPullParser::Event::EndDocument; event = parser.Next()) {
+            if (event != XmlPullParser::Event::StartElement) {
+                continue;
+            }
+            if (parser.GetName() == "sheet") {
+                auto target = targets.find(parser.GetAttribute("id"));
+                if (target == targets.end()) {
+                    FailXlsx("sheet without a part");
+                }
+                m_sheets.push_back({parser.GetAttribute("name"), target->second});
+            } else if (parser.GetName() == "workbookView" && m_activeSheet == 0) {
+                std::string_view activeTab;
+                if (parser.FindAttribute("activeTab", activeTab)) {
+                    std::from_chars(activeTab.data(), activeTab.data() + activeTab.size(), m_activeSheet);
+                }
+            }
+        }
+        if (m_activeSheet >= m_sheets.size()) {
+            m_activeSheet = 0;
+        }
+    }
+
+    // Whether data starts like a zip archive, as every XLSX file does
+    static bool IsXlsxFile(const uint8_t* data, size_t size) {
+        return size >= 4 && data[0] == 'P' && data[1] == 'K' && data[2] == 3 && data[3] == 4;
+    }
+
+    // Sheet names and the active sheet; XLSX files do not store a
+    // workbook name, so name is left empty
+    WorkbookMetadata ReadMetadata() const {
+        WorkbookMetadata metadata;
+        for (const auto& sheet : m_sheets) {
+            metadata.sheetNames.push_back(sheet.name);
+        }
+        metadata.activeSheet = m_activeSheet;
+        return metadata;
+    }
+
+    size_t GetSheetCount() const {
+        return m_sheets.size();
+    }
+
+    // The shared strings, interned into the calling thread's current pool;
+    // cells refer to them by position
+    std::vector<CellValue> ReadStringTable() const {
+        std::vector<CellValue> strings;
+        if (m_sharedStringsPart.empty() || !m_archive.Find(m_sharedStringsPart)) {
+            return strings;
+        }
+        ZipEntryReader source(*FindPart(m_sharedStringsPart));
+        XmlPullParser parser(source);
+        std::string text;
+        for (auto event = parser.Next(); event != XmlPullParser::Event::EndDocument; event = parser.Next()) {
+            if (event == XmlPullParser::Event::StartElement && parser.GetName() == "si") {
+                ReadRichText(parser, text);
+                strings.emplace_back(text);
+            }
+        }
+        return strings;
+    }
+
+    // Reads the cells of a sheet into store; strings is the table returned
+    // by ReadStringTable. If formulas is given, the sheet's formulas are
+    // added to it: shared formulas become one template with the cells that
+    // use it.
+    void ReadSheet(size_t sheet, const std::vector<CellValue>& strings, CellStore& store, FormulaTable* formulas = nullptr) const {
+        if (sheet >= m_sheets.size()) {
+            throw std::runtime_error("XLSX file has no sheet " + std::to_string(sheet));
+        }
+        ZipEntryReader source(*FindPart(m_sheets[sheet].part));
+        XmlPullParser parser(source);
+        std::unordered_map<uint32_t, uint32_t> sharedFormulas;      // si to template index
+        std::string text;
+        std::string formulaText;
+        int32_t row = 0;
+        int32_t column = 0;
+        for (auto event = parser.Next(); event != XmlPullParser::Event::EndDocument; event = parser.Next()) {
+            if (event != XmlPullParser::Event::StartElement) {
+                continue;
+            }
+            std::string_view name = parser.GetName();
+            if (name == "row") {
+                std::string_view number;
+                if (parser.FindAttribute("r", number)) {
+                    auto result = std::from_chars(number.data(), number.data() + number.size(), row);
+                    if (result.ec != std::errc() || result.ptr != number.data() + number.size()) {
+                        FailXlsx("malformed row number");
+                    }
+                } else {
+                    ++row;
+                }
+                column = 0;
+                continue;
+            }
+            if (name != "c") {
+                continue;
+            }
+
+            // A cell without a reference follows the previous one
+            std::string_view reference;
+            if (parser.FindAttribute("r", reference)) {
+                if (!ParseCellName(reference, row, column)) {
+                    FailXlsx("malformed cell reference");
+                }
+            } else {
+                ++column;
+            }
+            if (row < 1 || row > XLSX_MAX_ROWS || column < 1 || column > XLSX_MAX_COLUMNS) {
+                FailXlsx("cell outside the grid");
+            }
+            std::string_view type = "n";
+            parser.FindAttribute("t", type);
+            std::string cellType(type);
+            std::string formulaType;
+            std::string sharedIndex;
+            bool hasValue = false;
+            bool hasFormula = false;
+            for (auto child = parser.Next(); child != XmlPullParser::Event::EndElement; child = parser.Next()) {
+                if (child == XmlPullParser::Event::EndDocument) {
+                    FailXlsx("unexpected end of part");
+                }
+                if (child != XmlPullParser::Event::StartElement) {
+                    continue;
+                }
+                if (parser.GetName() == "v") {
+                    ReadElementText(parser, text);
+                    hasValue = true;
+                } else if (parser.GetName() == "is") {
+                    ReadRichText(parser, text);
+                    hasValue = true;
+                } else if (parser.GetName() == "f" && formulas) {
+                    formulaType = parser.GetAttribute("t");
+                    sharedIndex = parser.GetAttribute("si");
+                    ReadElementText(parser, formulaText);
+                    hasFormula = true;
+                } else {
+                    parser.SkipElement();
+                }
+            }
+
+            CellReference cell(row, column);
+            if (hasValue) {
+                CellValue value = ParseValue(cellType, text, strings);
+                if (!value.IsEmpty()) {
+                    store.Set(cell, value);
+                }
+            }
+            if (hasFormula && formulaType != "dataTable") {
+                DecodeEscapedCharacters(formulaText);
+                AddFormula(cell, formulaType == "shared", sharedIndex, formulaText, sharedFormulas, *formulas);
+            }
+        }
+    }
+
+private:
+    const ZipArchive::Entry* FindPart(const std::string& part) const {
+        const ZipArchive::Entry* entry = m_archive.Find(part);
+        if (!entry) {
+            FailXlsx("missing part " + part);
+        }
+        return entry;
+    }
+
+    // Relationships of a part, from the .rels part next to it; part is ""
+    // for the package's own relationships. Targets are resolved to part
+    // names; external targets are left out.
+    std::vector<Relationship> ReadRelationships(const std::string& part) const {
+        size_t slash = part.rfind('/');
+        std::string directory = slash == std::string::npos ? std::string() : part.substr(0, slash + 1);
+        std::string relationshipsPart = directory + "_rels/" + part.substr(directory.size()) + ".rels";
+        std::vector<Relationship> relationships;
+        const ZipArchive::Entry* entry = m_archive.Find(relationshipsPart);
+        if (!entry) {
+            return relationships;
+        }
+        ZipEntryReader source(*entry);
+        XmlPullParser parser(source);
+        for (auto event = parser.Next(); event != XmlPullParser::Event::EndDocument; event = parser.Next()) {
+            if (event != XmlPullParser::Event::StartElement || parser.GetName() != "Relationship" ||
+                parser.GetAttribute("TargetMode") == "External") {
+                continue;
+            }
+            std::string type = parser.GetAttribute("Type");
+            relationships.push_back({parser.GetAttribute("Id"), type.substr(type.rfind('/') + 1),
+                                     ResolvePartName(directory, parser.GetAttribute("Target"))});
+        }
+        return relationships;
+    }
+
+    // Resolves a relationship target against the directory of its source
+    static std::string ResolvePartName(const std::string& directory, const std::string& target) {
+        std::string path = !target.empty() && target[0] == '/' ? target.substr(1) : directory + target;
+        std::vector<std::string> segments;
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            std::string segment = path.substr(start, end - start);
+            if (segment == "..") {
+                if (!segments.empty()) {
+                    segments.pop_back();
+                }
+            } else if (!segment.empty() && segment != ".") {
+                segments.push_back(segment);
+            }
+            start = end + 1;
+        }
+        std::string resolved;
+        for (const auto& segment : segments) {
+            resolved += (resolved.empty() ? "" : "/") + segment;
+        }
+        return resolved;
+    }
+
+    static CellValue ParseValue(const std::string& type, std::string& text, const std::vector<CellValue>& strings) {
+        if (type == "s") {
+            uint32_t index = 0;
+            auto result = std::from_chars(text.data(), text.data() + text.size(), index);
+            if (result.ec != std::errc() || result.ptr != text.data() + text.size() || index >= strings.size()) {
+                FailXlsx("shared string index out of range");
+            }
+            return strings[index];
+        }
+        if (type == "str" || type == "d") {
+            DecodeEscapedCharacters(text);
+            return CellValue(text);
+        }
+        if (type == "inlineStr") {
+            return CellValue(text);
+        }
+        if (type == "b") {
+            return CellValue(text == "1" || text == "true");
+        }
+        if (type == "e") {
+            return CellValue(ParseErrorText(text));
+        }
+
+        // Numbers; a formula without a cached result has an empty value
+        size_t first = text.find_first_not_of(" \t\n");
+        if (first == std::string::npos) {
+            return CellValue();
+        }
+        size_t last = text.find_last_not_of(" \t\n") + 1;
+        double number = 0.0;
+        auto result = std::from_chars(text.data() + first, text.data() + last, number);
+        if (result.ec != std::errc() || result.ptr != text.data() + last) {
+            FailXlsx("malformed number");
+        }
+        return CellValue(number);
+    }
+
+    static void AddFormula(const CellReference& cell, bool shared, const std::string& sharedIndex, const std::string& text,
+                           std::unordered_map<uint32_t, uint32_t>& sharedFormulas, FormulaTable& formulas) {
+        uint32_t index = 0;
+        if (shared) {
+            uint32_t si = 0;
+            auto result = std::from_chars(sharedIndex.data(), sharedIndex.data() + sharedIndex.size(), si);
+            if (result.ec != std::errc() || result.ptr != sharedIndex.data() + sharedIndex.size()) {
+                FailXlsx("malformed shared formula index");
+            }
+            // The first cell of a shared formula carries its text; the
+            // others refer to it by index
+            auto found = sharedFormulas.find(si);
+            if (!text.empty() || found == sharedFormulas.end()) {
+                if (text.empty()) {
+                    return;
+                }
+                index = static_cast<uint32_t>(formulas.templates.size());
+                formulas.templates.push_back({"=" + text, cell});
+                sharedFormulas[si] = index;
+            } else {
+                index = found->second;
+            }
+        } else {
+            if (text.empty()) {
+                return;
+            }
+            index = static_cast<uint32_t>(formulas.templates.size());
+            formulas.templates.push_back({"=" + text, cell});
+        }
+        formulas.cells.emplace_back(cell, index);
+    }
+};
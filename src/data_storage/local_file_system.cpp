@@ -3,7 +3,11 @@
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <cstdio>
 #include "excel_types.h"
+#include "cell_store.h"
+#include "mapped_file.h"
+#include "xlsx_format.h"
 #include "local_file_system.h"
 #include "file_io_manager.h"
 #include "workbook_serializer.h"
@@ -51,18 +55,27 @@ bool LocalFileSystem::SaveWorkbook(const std::shared_ptr<Workbook>& workbook, co
         return false;
     }
 
+    // Stream the sheets into a temporary file next to the target, so that
+    // memory stays bounded by a band of rows and a failed save leaves the
+    // previous file intact
+    std::string temporaryPath = filePath + ".tmp";
     try {
-        // Serialize the workbook
-        std::vector<uint8_t> serializedData = m_workbookSerializer->Serialize(workbook);
-
-        // Write the serialized data to the file
-        if (!m_fileIOManager->WriteFile(filePath, serializedData)) {
-            m_errorHandler->HandleError("Failed to write workbook to file");
-            return false;
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                m_errorHandler->HandleError("Failed to write workbook to file");
+                return false;
+            }
+            XlsxWriter writer(file);
+            for (const auto& worksheet : workbook->GetWorksheets()) {
+                writer.WriteSheet(worksheet->GetName(), *worksheet->GetCellStore());
+            }
+            writer.Finish();
         }
-
+        std::filesystem::rename(temporaryPath, filePath);
         return true;
     } catch (const std::exception& e) {
+        std::remove(temporaryPath.c_str());
         m_errorHandler->HandleError("Error saving workbook: " + std::string(e.what()));
         return false;
     }
@@ -76,10 +89,24 @@ std::shared_ptr<Workbook> LocalFileSystem::LoadWorkbook(const std::string& fileP
     }
 
     try {
-        // Read the file contents
-        std::vector<uint8_t> fileContents = m_fileIOManager->ReadFile(filePath);
+        // XLSX packages are parsed from a mapping of the file, one sheet at
+        // a time, straight into the cell stores
+        std::shared_ptr<MappedFile> mapping = MappedFile::Open(filePath);
+        if (mapping && XlsxReader::IsXlsxFile(mapping->GetData(), mapping->GetSize())) {
+            XlsxReader reader(mapping->GetData(), mapping->GetSize());
+            auto workbook = std::make_shared<Workbook>(std::filesystem::path(filePath).stem().string());
+            std::vector<CellValue> strings = reader.ReadStringTable();
+            WorkbookMetadata metadata = reader.ReadMetadata();
+            for (size_t i = 0; i < metadata.sheetNames.size(); ++i) {
+                auto store = std::make_shared<CellStore>();
+                reader.ReadSheet(i, strings, *store);
+                workbook->AddWorksheet(std::make_shared<Worksheet>(metadata.sheetNames[i], store));
+            }
+            return workbook;
+        }
 
-        // Deserialize the file contents into a Workbook object
+        // Anything else is left to the workbook serializer
+        std::vector<uint8_t> fileContents = m_fileIOManager->ReadFile(filePath);
         return m_workbookSerializer->Deserialize(fileContents);
     } catch (const std::exception& e) {
         m_errorHandler->HandleError("Error loading workbook: " + std::string(e.what()));
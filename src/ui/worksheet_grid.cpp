@@ -6,6 +6,7 @@
 #include "worksheet_grid.h"
 #include "ui_framework.h"
 #include "formatting_engine.h"
+#include "calculation_engine.h"
 
 // Global constants
 const int DEFAULT_ROW_HEIGHT = 20;
@@ -37,6 +38,12 @@ void WorksheetGrid::Initialize(std::shared_ptr<Workbook> workbook,
     // TODO: Implement event listener registration
 }
 
+void WorksheetGrid::SetCalculationEngine(std::shared_ptr<CalculationEngine> calculationEngine) {
+    // Visible formula cells are computed through the engine before display
+    m_calculationEngine = calculationEngine;
+    InitializeGridCells();
+}
+
 void WorksheetGrid::RenderGrid() {
     // Clear existing grid display
     // TODO: Implement clearing of existing grid display
@@ -69,10 +76,13 @@ void WorksheetGrid::HandleCellEdit(const CellReference& cellRef, const std::stri
     m_activeWorksheet->setCellValue(cellRef, CellValue(newValue));
     // Notify event handler
     m_eventHandler->onCellValueChanged(cellRef, newValue);
-    // Update displayed value in grid cell
-    // TODO: Implement update of displayed value in grid cell
-    // Trigger recalculations
-    // TODO: Implement triggering of recalculations
+    // Mark dependents dirty, then compute only the ones in the viewport; the
+    // engine only evaluates the sheet sharing its cell store
+    if (m_calculationEngine && m_activeWorksheet->GetCellStore() == m_calculationEngine->GetCellStore()) {
+        m_calculationEngine->UpdateCell(cellRef, CellValue(newValue));
+    }
+    // Update displayed values in the grid
+    InitializeGridCells();
 }
 
 void WorksheetGrid::ScrollGrid(int deltaRows, int deltaColumns) {
@@ -99,13 +109,24 @@ void InitializeGridCells() {
     m_gridCells.clear();
     m_gridCells.resize(MAX_VISIBLE_ROWS, std::vector<GridCell>(MAX_VISIBLE_COLUMNS));
 
+    // Only the sheet whose cell store the engine evaluates has its formula
+    // results computed through it; other sheets display their stored values
+    bool engineSheet = m_calculationEngine && m_activeWorksheet->GetCellStore() == m_calculationEngine->GetCellStore();
+
+    // Compute dirty formula cells in the viewport first; the rest of the
+    // workbook is left to the background calculation pass
+    if (engineSheet) {
+        m_calculationEngine->CalculateRange(m_topLeftCell, m_topLeftCell.offset(MAX_VISIBLE_ROWS - 1, MAX_VISIBLE_COLUMNS - 1));
+    }
+
     for (int row = 0; row < MAX_VISIBLE_ROWS; ++row) {
         for (int col = 0; col < MAX_VISIBLE_COLUMNS; ++col) {
             // Initialize each GridCell with default properties
             m_gridCells[row][col] = GridCell();
             // Set initial cell values and styles based on m_activeWorksheet
             CellReference cellRef = m_topLeftCell.offset(row, col);
-            CellValue cellValue = m_activeWorksheet->getCellValue(cellRef);
+            CellValue cellValue = engineSheet ? m_calculationEngine->GetCellValue(cellRef)
+                                              : m_activeWorksheet->getCellValue(cellRef);
             CellStyle cellStyle = m_activeWorksheet->getCellStyle(cellRef);
             m_gridCells[row][col].setValue(cellValue);
             m_gridCells[row][col].setStyle(cellStyle);
@@ -156,8 +177,6 @@ void UpdateTopLeftCell(const CellReference& newTopLeftCell) {
 // TODO: Implement clearing of existing grid display
 // TODO: Implement selection highlighting
 // TODO: Implement grid display update for selection
-// TODO: Implement update of displayed value in grid cell
-// TODO: Implement triggering of recalculations
 // TODO: Implement updating of affected grid cells with new style
 // TODO: Implement refreshing display of affected cells
 // TODO: Implement applying cell style (font, color, borders, etc.)
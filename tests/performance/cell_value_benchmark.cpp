@@ -0,0 +1,123 @@
+#include <src/core/cell_value.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <variant>
+#include <vector>
+
+// Compares the compact 16-byte CellValue against the previous variant-based
+// layout on a synthetic workbook: 70% numbers, 20% text drawn from 10,000
+// distinct labels, 5% booleans and 5% blanks.
+//
+// Usage: cell_value_benchmark [cell_count]    (default 10,000,000)
+
+namespace {
+
+// Global constants
+const size_t DEFAULT_CELL_COUNT = 10000000;
+const size_t DISTINCT_LABELS = 10000;
+const int COPY_REPETITIONS = 5;
+
+const size_t ALLOCATION_HEADER = 16;
+
+std::atomic<size_t> g_liveBytes(0);
+
+// The representation CellValue replaced: a variant with an owning std::string
+using LegacyCellValue = std::variant<std::monostate, double, bool, std::string, CellErrorType>;
+
+std::string MakeLabel(size_t i) {
+    return "Product category " + std::to_string(10000 + i % DISTINCT_LABELS);
+}
+
+template <typename Value, typename Factory>
+std::vector<Value> BuildCells(size_t count, Factory make) {
+    std::vector<Value> cells;
+    cells.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        switch (i % 20) {
+            case 0: case 1: case 2: case 3:
+                cells.push_back(make(MakeLabel(i / 20 * 4 + i % 20)));
+                break;
+            case 4:
+                cells.push_back(Value(i % 2 == 0));
+                break;
+            case 5:
+                cells.push_back(Value());
+                break;
+            default:
+                cells.push_back(Value(static_cast<double>(i) * 0.25));
+                break;
+        }
+    }
+    return cells;
+}
+
+template <typename Value, typename Factory>
+void Run(const char* name, size_t count, Factory make) {
+    using Clock = std::chrono::steady_clock;
+
+    size_t before = g_liveBytes.load();
+    auto buildStart = Clock::now();
+    std::vector<Value> cells = BuildCells<Value>(count, make);
+    double buildMs = std::chrono::duration<double, std::milli>(Clock::now() - buildStart).count();
+    size_t heapBytes = g_liveBytes.load() - before;
+
+    // Copy the whole sheet, as happens when values are handed between layers
+    double copyMs = 0.0;
+    for (int i = 0; i < COPY_REPETITIONS; ++i) {
+        auto copyStart = Clock::now();
+        std::vector<Value> copy = cells;
+        copyMs += std::chrono::duration<double, std::milli>(Clock::now() - copyStart).count();
+        if (copy.size() != cells.size()) {
+            std::abort();
+        }
+    }
+
+    std::printf("%-8s sizeof=%2zu  heap=%8.1f MB  (%5.1f B/cell)  build=%8.1f ms  copy=%8.1f ms\n",
+                name, sizeof(Value), heapBytes / 1e6, static_cast<double>(heapBytes) / count, buildMs,
+                copyMs / COPY_REPETITIONS);
+}
+
+} // namespace
+
+// Track live heap bytes so both layouts are measured the same way; each
+// block carries its size in a small header
+void* operator new(size_t size) {
+    char* block = static_cast<char*>(std::malloc(size + ALLOCATION_HEADER));
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+    g_liveBytes += size;
+    return block + ALLOCATION_HEADER;
+}
+
+void operator delete(void* p) noexcept {
+    if (p) {
+        char* block = static_cast<char*>(p) - ALLOCATION_HEADER;
+        g_liveBytes -= *reinterpret_cast<size_t*>(block);
+        std::free(block);
+    }
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+int main(int argc, char** argv) {
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : DEFAULT_CELL_COUNT;
+    std::printf("%zu cells\n", count);
+
+    Run<LegacyCellValue>("legacy", count, [](std::string text) { return LegacyCellValue(std::move(text)); });
+
+    // Interned strings are included in the compact heap figure; the pool's
+    // fixed chunk table is allocated up front and reported with the pool
+    StringPool pool;
+    StringPoolScope scope(pool);
+    Run<CellValue>("compact", count, [](const std::string& text) { return CellValue(text); });
+    std::printf("compact string pool: %zu strings, %.1f MB\n", pool.Size(), pool.GetMemoryUsage() / 1e6);
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <src/core/workbook_format.h>
+#include <src/core/cell_store.h>
+#include <src/core/cell_value.h>
+#include <src/core/mapped_file.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Measures save and load throughput of the binary workbook format on a
+// synthetic sheet. Column kinds rotate through integer ids, fractional
+// amounts, text drawn from 10,000 distinct labels and booleans; every tenth
+// fractional column is only half populated. The file is then written to the
+// temp directory and opened through a memory mapping, as DataManager opens
+// local files, to time the open, the first read of a cell and a full scan,
+// with the store's memory and the resident file pages after each.
+//
+// Usage: workbook_format_benchmark [rows] [columns]    (default 1,000,000 x 50)
+
+namespace {
+
+// Global constants
+const int DEFAULT_ROW_COUNT = 1000000;
+const int DEFAULT_COLUMN_COUNT = 50;
+const int DISTINCT_LABELS = 10000;
+const int REPETITIONS = 3;
+
+using Clock = std::chrono::steady_clock;
+
+double ElapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Resident file pages in MB, such as those of a mapping, or 0 where /proc
+// is not available
+double ResidentFileMb() {
+    double kilobytes = 0.0;
+    FILE* status = std::fopen("/proc/self/status", "r");
+    if (!status) {
+        return 0.0;
+    }
+    char line[256];
+    while (std::fgets(line, sizeof(line), status)) {
+        if (std::strncmp(line, "RssFile:", 8) == 0) {
+            kilobytes = std::atof(line + 8);
+        }
+    }
+    std::fclose(status);
+    return kilobytes / 1e3;
+}
+
+void BuildSheet(CellStore& store, int rows, int columns) {
+    std::vector<CellValue> labels;
+    for (int i = 0; i < DISTINCT_LABELS; ++i) {
+        labels.emplace_back("Product category " + std::to_string(10000 + i));
+    }
+    std::vector<CellValue> values(rows);
+    for (int column = 1; column <= columns; ++column) {
+        for (int row = 1; row <= rows; ++row) {
+            CellValue& value = values[row - 1];
+            switch (column % 4) {
+                case 0:
+                    value = CellValue(static_cast<double>(100000 + row));
+                    break;
+                case 1:
+                    value = (column % 10 == 1 && row % 2 == 0) ? CellValue() : CellValue(row * 0.37 + column);
+                    break;
+                case 2:
+                    value = labels[(row * 7 + column) % DISTINCT_LABELS];
+                    break;
+                default:
+                    value = CellValue(row % 3 == 0);
+                    break;
+            }
+        }
+        store.SetColumn(column, 1, values.data(), values.size());
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int rows = argc > 1 ? std::atoi(argv[1]) : DEFAULT_ROW_COUNT;
+    int columns = argc > 2 ? std::atoi(argv[2]) : DEFAULT_COLUMN_COUNT;
+
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    BuildSheet(store, rows, columns);
+    size_t cells = store.GetCellCount();
+    std::printf("%d rows x %d columns, %zu cells, store %.1f MB\n", rows, columns, cells, store.GetMemoryUsage() / 1e6);
+
+    double bestSaveMs = 0.0;
+    double bestLoadMs = 0.0;
+    std::vector<uint8_t> file;
+    for (int i = 0; i < REPETITIONS; ++i) {
+        auto saveStart = Clock::now();
+        WorkbookWriter writer;
+        writer.WriteMetadata({"Benchmark", {"Sheet1"}, 0});
+        writer.WriteSheet(store);
+        file = writer.Finish();
+        double saveMs = ElapsedMs(saveStart);
+        bestSaveMs = i == 0 ? saveMs : std::min(bestSaveMs, saveMs);
+
+        // Load into a fresh pool and store, as opening a workbook does
+        StringPool loadPool;
+        StringPoolScope loadScope(loadPool);
+        CellStore loaded;
+        auto loadStart = Clock::now();
+        WorkbookReader reader(file.data(), file.size());
+        reader.ReadSheet(0, reader.ReadStringTable(), loaded);
+        double loadMs = ElapsedMs(loadStart);
+        bestLoadMs = i == 0 ? loadMs : std::min(bestLoadMs, loadMs);
+        if (loaded.GetCellCount() != cells) {
+            std::fprintf(stderr, "loaded %zu cells, expected %zu\n", loaded.GetCellCount(), cells);
+            return 1;
+        }
+    }
+
+    // Open the saved file through a mapping; the first read of a cell loads
+    // one column chunk, the scan touches every chunk
+    std::string path = (std::filesystem::temp_directory_path() / "workbook_format_benchmark.xlwb").string();
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size());
+    size_t fileSize = file.size();
+    std::vector<uint8_t>().swap(file);
+    double fileBeforeOpen = ResidentFileMb();
+
+    StringPool openPool;
+    StringPoolScope openScope(openPool);
+    CellStore opened;
+    auto openStart = Clock::now();
+    std::shared_ptr<MappedFile> mapping = MappedFile::Open(path);
+    if (!mapping) {
+        std::fprintf(stderr, "cannot map %s\n", path.c_str());
+        return 1;
+    }
+    WorkbookReader reader(mapping->GetData(), mapping->GetSize());
+    reader.AttachSheet(0, mapping, reader.AttachStringTable(mapping, openPool), opened);
+    double openMs = ElapsedMs(openStart);
+    double storeAfterOpen = opened.GetMemoryUsage() / 1e6;
+    double fileAfterOpen = ResidentFileMb() - fileBeforeOpen;
+
+    auto touchStart = Clock::now();
+    double probe = opened.Get(rows / 2 + 1, 1).GetNumeric();
+    double touchMs = ElapsedMs(touchStart);
+
+    auto scanStart = Clock::now();
+    size_t scanned = 0;
+    opened.ForEachInRange({1, 1, rows, columns}, [&](int32_t, int32_t, const CellValue&) { ++scanned; });
+    double scanMs = ElapsedMs(scanStart);
+    double storeAfterScan = opened.GetMemoryUsage() / 1e6;
+    double fileAfterScan = ResidentFileMb() - fileBeforeOpen;
+    mapping.reset();
+    std::remove(path.c_str());
+    if (scanned != cells) {
+        std::fprintf(stderr, "scanned %zu cells, expected %zu\n", scanned, cells);
+        return 1;
+    }
+
+    std::printf("file   %8.1f MB  (%5.2f B/cell)\n", fileSize / 1e6, static_cast<double>(fileSize) / cells);
+    std::printf("save   %8.1f ms  %7.1f M cells/s  %7.1f MB/s\n", bestSaveMs, cells / bestSaveMs / 1e3, fileSize / bestSaveMs / 1e3);
+    std::printf("load   %8.1f ms  %7.1f M cells/s  %7.1f MB/s\n", bestLoadMs, cells / bestLoadMs / 1e3, fileSize / bestLoadMs / 1e3);
+    std::printf("open   %8.3f ms  (mapped; store %.1f MB, resident file pages +%.1f MB)\n", openMs, storeAfterOpen, fileAfterOpen);
+    std::printf("touch  %8.3f ms  (first read of one cell, %g)\n", touchMs, probe);
+    std::printf("scan   %8.1f ms  %7.1f M cells/s  (store %.1f MB, resident file pages +%.1f MB)\n", scanMs, cells / scanMs / 1e3,
+                storeAfterScan, fileAfterScan);
+    return 0;
+}
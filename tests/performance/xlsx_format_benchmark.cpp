@@ -0,0 +1,141 @@
+#include <src/core/xlsx_format.h>
+#include <src/core/cell_store.h>
+#include <src/core/cell_value.h>
+#include <src/core/mapped_file.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Measures XLSX export and import of a synthetic sheet and the memory each
+// needs beyond the cell store. Columns rotate through integer ids,
+// fractional amounts, text drawn from 10,000 distinct labels and booleans.
+// The sheet is streamed to a file in the temp directory and read back
+// through a memory mapping; the peak resident set is sampled after
+// building the sheet, after the export and after the import, so the
+// export's and import's own growth shows how far memory stays from the
+// file size.
+//
+// Usage: xlsx_format_benchmark [rows] [columns]    (default 1,000,000 x 10)
+
+namespace {
+
+// Global constants
+const int DEFAULT_ROW_COUNT = 1000000;
+const int DEFAULT_COLUMN_COUNT = 10;
+const int DISTINCT_LABELS = 10000;
+
+using Clock = std::chrono::steady_clock;
+
+double ElapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Peak resident set in MB, or 0 where /proc is not available
+double PeakResidentMb() {
+    double kilobytes = 0.0;
+    FILE* status = std::fopen("/proc/self/status", "r");
+    if (!status) {
+        return 0.0;
+    }
+    char line[256];
+    while (std::fgets(line, sizeof(line), status)) {
+        if (std::strncmp(line, "VmHWM:", 6) == 0) {
+            kilobytes = std::atof(line + 6);
+        }
+    }
+    std::fclose(status);
+    return kilobytes / 1e3;
+}
+
+void BuildSheet(CellStore& store, int rows, int columns) {
+    std::vector<CellValue> labels;
+    for (int i = 0; i < DISTINCT_LABELS; ++i) {
+        labels.emplace_back("Product category " + std::to_string(10000 + i));
+    }
+    std::vector<CellValue> values(rows);
+    for (int column = 1; column <= columns; ++column) {
+        for (int row = 1; row <= rows; ++row) {
+            CellValue& value = values[row - 1];
+            switch (column % 4) {
+                case 0:
+                    value = CellValue(static_cast<double>(100000 + row));
+                    break;
+                case 1:
+                    value = CellValue(row * 0.37 + column);
+                    break;
+                case 2:
+                    value = labels[(row * 7 + column) % DISTINCT_LABELS];
+                    break;
+                default:
+                    value = CellValue(row % 3 == 0);
+                    break;
+            }
+        }
+        store.SetColumn(column, 1, values.data(), values.size());
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int rows = argc > 1 ? std::atoi(argv[1]) : DEFAULT_ROW_COUNT;
+    int columns = argc > 2 ? std::atoi(argv[2]) : DEFAULT_COLUMN_COUNT;
+    std::string path = (std::filesystem::temp_directory_path() / "xlsx_format_benchmark.xlsx").string();
+
+    size_t cells = 0;
+    double exportMs = 0.0;
+    double peakAfterBuild = 0.0;
+    double peakAfterExport = 0.0;
+    {
+        StringPool pool;
+        StringPoolScope scope(pool);
+        CellStore store;
+        BuildSheet(store, rows, columns);
+        cells = store.GetCellCount();
+        peakAfterBuild = PeakResidentMb();
+        std::printf("%d rows x %d columns, %zu cells, store %.1f MB\n", rows, columns, cells, store.GetMemoryUsage() / 1e6);
+
+        auto exportStart = Clock::now();
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        XlsxWriter writer(file);
+        writer.WriteSheet("Sheet1", store);
+        writer.Finish();
+        file.close();
+        exportMs = ElapsedMs(exportStart);
+        peakAfterExport = PeakResidentMb();
+    }
+    size_t fileSize = std::filesystem::file_size(path);
+
+    // The built sheet is gone; the import's peak counts from the export's
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore loaded;
+    auto importStart = Clock::now();
+    std::shared_ptr<MappedFile> mapping = MappedFile::Open(path);
+    if (!mapping) {
+        std::fprintf(stderr, "cannot map %s\n", path.c_str());
+        return 1;
+    }
+    XlsxReader reader(mapping->GetData(), mapping->GetSize());
+    reader.ReadSheet(0, reader.ReadStringTable(), loaded);
+    double importMs = ElapsedMs(importStart);
+    double peakAfterImport = PeakResidentMb();
+    mapping.reset();
+    std::remove(path.c_str());
+    if (loaded.GetCellCount() != cells) {
+        std::fprintf(stderr, "imported %zu cells, expected %zu\n", loaded.GetCellCount(), cells);
+        return 1;
+    }
+
+    std::printf("file   %8.1f MB  (%5.2f B/cell)\n", fileSize / 1e6, static_cast<double>(fileSize) / cells);
+    std::printf("export %8.1f ms  %7.2f M cells/s  peak +%.1f MB\n", exportMs, cells / exportMs / 1e3, peakAfterExport - peakAfterBuild);
+    std::printf("import %8.1f ms  %7.2f M cells/s  peak %.1f MB (store %.1f MB, mapped file pages included)\n", importMs,
+                cells / importMs / 1e3, peakAfterImport, loaded.GetMemoryUsage() / 1e6);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/aggregate_kernels.h>
+#include <cstdint>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Test case: The runtime-selected kernels agree with the scalar kernels for every tail length
+TEST(AggregateKernelsTest, MatchesScalarKernels) {
+    const AggregateKernels& kernels = GetAggregateKernels();
+    const AggregateKernels& scalar = GetScalarAggregateKernels();
+
+    for (size_t count = 0; count < 70; ++count) {
+        // Integer-valued data keeps every summation order exact
+        std::vector<double> values(count);
+        std::vector<double> weights(count);
+        std::vector<uint8_t> valid(count);
+        for (size_t i = 0; i < count; ++i) {
+            valid[i] = (i % 3) != 1;
+            values[i] = valid[i] ? static_cast<double>(static_cast<int>(i * 37 % 101) - 50) : 0.0;
+            weights[i] = static_cast<double>(i % 7);
+        }
+
+        EXPECT_EQ(kernels.sum(values.data(), count), scalar.sum(values.data(), count));
+        EXPECT_EQ(kernels.count(valid.data(), count), scalar.count(valid.data(), count));
+        EXPECT_EQ(kernels.min(values.data(), valid.data(), count), scalar.min(values.data(), valid.data(), count));
+        EXPECT_EQ(kernels.max(values.data(), valid.data(), count), scalar.max(values.data(), valid.data(), count));
+        EXPECT_EQ(kernels.dot(values.data(), weights.data(), count), scalar.dot(values.data(), weights.data(), count));
+    }
+}
+
+// Test case: Invalid lanes never win MIN or MAX even though they hold 0.0
+TEST(AggregateKernelsTest, MinMaxIgnoreInvalidLanes) {
+    const AggregateKernels& kernels = GetAggregateKernels();
+    std::vector<double> values = {5, 0, 7, 0, 6, 9, 0, 8};
+    std::vector<uint8_t> valid = {1, 0, 1, 0, 1, 1, 0, 1};
+
+    EXPECT_EQ(kernels.min(values.data(), valid.data(), values.size()), 5.0);
+    EXPECT_EQ(kernels.max(values.data(), valid.data(), values.size()), 9.0);
+    EXPECT_EQ(kernels.count(valid.data(), valid.size()), 5u);
+}
+
+} // namespace test
+} // namespace excel
@@ -5,6 +5,11 @@
 #include <src/core/workbook.h>
 #include <src/core/worksheet.h>
 #include <memory>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace excel {
 namespace test {
@@ -28,6 +33,22 @@ CellValue EvaluateFormula(CalculationEngine& engine, Cell& cell) {
     return engine.Evaluate(cell);
 }
 
+// Helper function to build 2,000 rows of formulas that all depend on F1,
+// including thread-unsafe RAND and RANDBETWEEN calls and their dependents
+void BuildParallelRecalcSheet(CalculationEngine& engine) {
+    engine.UpdateCell(CellReference("F1"), CellValue(1.0));
+    for (int row = 1; row <= 2000; ++row) {
+        std::string n = std::to_string(row);
+        engine.UpdateCell(CellReference(row, 1), CellValue(static_cast<double>(row)));
+        engine.EvaluateFormula(Formula("=A" + n + "*2+$F$1"), CellReference(row, 2));
+        engine.EvaluateFormula(Formula("=B" + n + "+SUM(A" + n + ",$F$1)"), CellReference(row, 3));
+        if (row % 100 == 0) {
+            engine.EvaluateFormula(Formula("=RAND()*0+C" + n), CellReference(row, 4));
+            engine.EvaluateFormula(Formula("=RANDBETWEEN(1,1)+D" + n), CellReference(row, 5));
+        }
+    }
+}
+
 // Test fixture for CalculationEngine tests
 class CalculationEngineTest : public ::testing::Test {
 protected:
@@ -113,5 +134,528 @@ TEST_F(CalculationEngineTest, DivisionByZero) {
     EXPECT_EQ(result.GetError(), CellErrorType::DivisionByZero);
 }
 
+// Test case: Each dependent of a diamond is computed once per edit
+TEST_F(CalculationEngineTest, DiamondDependentsEvaluateOnce) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(1.0));
+    calculation_engine_->EvaluateFormula(Formula("=A1+1"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1*2"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=B1+C1"), CellReference("D1"));
+    calculation_engine_->EvaluateFormula(Formula("=D1+B1"), CellReference("E1"));
+
+    auto profiler = std::make_shared<RecalcProfiler>();
+    calculation_engine_->EnableProfiling(profiler, "Sheet1");
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(5.0));
+    calculation_engine_->DisableProfiling();
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E1")), CellValue(22.0));
+
+    ASSERT_EQ(profiler->GetProfiles().size(), 1u);
+    const auto& cells = profiler->GetProfiles()[0].cells;
+    ASSERT_EQ(cells.size(), 4u);
+    for (const auto& cell : cells) {
+        EXPECT_EQ(cell.evaluations, 1u) << cell.cell.ToString();
+    }
+}
+
+// Test case: A 50,000-cell dependency chain recalculates without recursion, eagerly and on demand
+TEST_F(CalculationEngineTest, DeepChainRecalculates) {
+    const int chainLength = 50000;
+    calculation_engine_->UpdateCell(CellReference(1, 1), CellValue(1.0));
+    for (int row = 2; row <= chainLength; ++row) {
+        calculation_engine_->EvaluateFormula(Formula("=A" + std::to_string(row - 1) + "+1"), CellReference(row, 1));
+    }
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference(chainLength, 1)), CellValue(static_cast<double>(chainLength)));
+
+    calculation_engine_->UpdateCell(CellReference(1, 1), CellValue(2.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference(chainLength, 1)), CellValue(chainLength + 1.0));
+
+    // Reading the end of the chain computes every dirty precedent first
+    calculation_engine_->SetCalculationMode(CalculationMode::Lazy);
+    calculation_engine_->UpdateCell(CellReference(1, 1), CellValue(3.0));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), static_cast<size_t>(chainLength - 1));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference(chainLength, 1)), CellValue(chainLength + 2.0));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), 0u);
+}
+
+// Test case: A recalculation above the parallel threshold matches a single-threaded engine
+TEST_F(CalculationEngineTest, ParallelRecalcMatchesSingleThreaded) {
+    CalculationEngine singleThreaded(1);
+    BuildParallelRecalcSheet(*calculation_engine_);
+    BuildParallelRecalcSheet(singleThreaded);
+
+    // Editing F1 recalculates over 4,000 cells; RAND and RANDBETWEEN run on the calling thread
+    calculation_engine_->UpdateCell(CellReference("F1"), CellValue(3.0));
+    singleThreaded.UpdateCell(CellReference("F1"), CellValue(3.0));
+    for (int row = 1; row <= 2000; ++row) {
+        for (int column = 2; column <= 5; ++column) {
+            CellReference cell(row, column);
+            ASSERT_EQ(calculation_engine_->GetCellValue(cell), singleThreaded.GetCellValue(cell)) << cell.ToString();
+        }
+    }
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C2000")), CellValue(6006.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E2000")), CellValue(6007.0));
+}
+
+// Test case: Compiled formula cache
+TEST_F(CalculationEngineTest, FormulaCacheReusesCompiledProgram) {
+    // Evaluate the same absolute formula from two different cells
+    calculation_engine_->EvaluateFormula(Formula("=$A$1*2+1"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=$A$1*2+1"), CellReference("B2"));
+
+    // Assert that the formula was compiled once and reused once
+    FormulaCacheStatistics stats = calculation_engine_->GetFormulaCacheStatistics();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 1u);
+
+    // Re-evaluating a relative formula in the same cell hits its template
+    calculation_engine_->EvaluateFormula(Formula("=A1+1"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1+1"), CellReference("C1"));
+    stats = calculation_engine_->GetFormulaCacheStatistics();
+    EXPECT_EQ(stats.misses, 2u);
+    EXPECT_EQ(stats.hits, 2u);
+}
+
+// Test case: A large-range call repeated across formulas is computed once per pass
+TEST_F(CalculationEngineTest, SubexpressionMemoSharesCallsWithinPass) {
+    for (int row = 1; row <= 300; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(1.0));
+    }
+    // The same SUM written absolutely and relatively resolves to one range
+    calculation_engine_->EvaluateFormula(Formula("=SUM($A$1:$A$300)*2"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=SUM(A1:A300)+1"), CellReference("D1"));
+    calculation_engine_->EvaluateFormula(Formula("=SUM($A$1:$A$300)-1"), CellReference("E1"));
+
+    // The edit recalculates all three in one pass: one miss, two hits
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(2.0));
+    SubexpressionMemoStatistics stats = calculation_engine_->GetSubexpressionMemoStatistics();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("D1")), CellValue(302.0));
+
+    // The memo does not outlive the pass
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(3.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C1")), CellValue(606.0));
+    EXPECT_EQ(calculation_engine_->GetSubexpressionMemoStatistics().misses, 2u);
+}
+
+// Test case: Filled-down formulas share one compiled template
+TEST_F(CalculationEngineTest, FilledDownFormulasShareTemplate) {
+    // C1:C3 = A<n>+B<n>, as produced by fill-down
+    calculation_engine_->EvaluateFormula(Formula("=A1+B1"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=A2+B2"), CellReference("C2"));
+    calculation_engine_->EvaluateFormula(Formula("=A3+B3"), CellReference("C3"));
+
+    // Assert that one template serves all three cells
+    FormulaCacheStatistics stats = calculation_engine_->GetFormulaCacheStatistics();
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 2u);
+
+    // The same text in a different relative position is a different template
+    calculation_engine_->EvaluateFormula(Formula("=A1+B1"), CellReference("C2"));
+    EXPECT_EQ(calculation_engine_->GetFormulaCacheStatistics().entries, 2u);
+}
+
+// Test case: A zero divisor inside a filled-down block reports #DIV/0! even when the result would be finite
+TEST_F(CalculationEngineTest, FilledDownBlockReportsHiddenDivisionByZero) {
+    for (int row = 1; row <= 16; ++row) {
+        std::string a = "A" + std::to_string(row);
+        calculation_engine_->EvaluateFormula(Formula("=1/(1/" + a + ")"), CellReference(row, 2));
+        calculation_engine_->EvaluateFormula(Formula("=2^(-1/" + a + ")"), CellReference(row, 3));
+    }
+
+    // One batch makes both columns dirty together, so each is evaluated as a vector block
+    calculation_engine_->BeginBatch();
+    for (int row = 1; row <= 16; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(row == 5 ? 0.0 : 1.0));
+    }
+    calculation_engine_->CommitBatch();
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B4")), CellValue(1.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C4")), CellValue(0.5));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B5")), CellValue(CellErrorType::DivisionByZero));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C5")), CellValue(CellErrorType::DivisionByZero));
+}
+
+// Test case: References beyond the last row or column do not compile to cell references
+TEST_F(CalculationEngineTest, OutOfRangeReferencesAreRejected) {
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=XFD1048576+1"), CellReference("A1")), CellValue(1.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=XFE1"), CellReference("A2")), CellValue(CellErrorType::Name));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=ZZZ1"), CellReference("A3")), CellValue(CellErrorType::Name));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=A1048577"), CellReference("A4")), CellValue(CellErrorType::Name));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=A99999999999"), CellReference("A5")),
+              CellValue(CellErrorType::Name));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(B1:B1048577)"), CellReference("A6")),
+              CellValue(CellErrorType::Reference));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(B:XFE)"), CellReference("A7")),
+              CellValue(CellErrorType::Reference));
+
+    // The calc chain holds only references a saved workbook can be reopened with
+    std::vector<uint8_t> calcChain;
+    calculation_engine_->SerializeCalcChain(calcChain);
+    CalculationEngine restored(1, calculation_engine_->GetCellStore());
+    EXPECT_TRUE(restored.RestoreCalcChain(calcChain.data(), calcChain.size()));
+}
+
+// Test case: Lookups share one index per lookup column, rebuilt after the column changes
+TEST_F(CalculationEngineTest, LookupIndexIsSharedAndInvalidated) {
+    // A1:B3 holds a small keyed table
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(10.0));
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(20.0));
+    calculation_engine_->UpdateCell(CellReference("A3"), CellValue(30.0));
+    calculation_engine_->UpdateCell(CellReference("B1"), CellValue(std::string("ten")));
+    calculation_engine_->UpdateCell(CellReference("B2"), CellValue(std::string("twenty")));
+    calculation_engine_->UpdateCell(CellReference("B3"), CellValue(std::string("thirty")));
+
+    // Two lookups into the same table build a single index
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=VLOOKUP(20,$A$1:$B$3,2,FALSE)"), CellReference("D1")),
+              CellValue(std::string("twenty")));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=MATCH(25,$A$1:$A$3)"), CellReference("D2")), CellValue(2.0));
+    EXPECT_EQ(calculation_engine_->GetLookupIndexCount(), 1u);
+
+    // Changing a key drops the index, and dependent lookups see the new value
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(40.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=VLOOKUP(20,$A$1:$B$3,2,FALSE)"), CellReference("D1")),
+              CellValue(CellErrorType::NotAvailable));
+}
+
+// Test case: Conditional aggregates share a criteria index that follows edits
+TEST_F(CalculationEngineTest, CriteriaIndexAnswersConditionalAggregates) {
+    // A1:C4 holds region, product and amount
+    const char* regions[] = {"East", "West", "East", "East"};
+    const char* products[] = {"Pens", "Pens", "Ink", "pens"};
+    for (int row = 1; row <= 4; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(std::string(regions[row - 1])));
+        calculation_engine_->UpdateCell(CellReference(row, 2), CellValue(std::string(products[row - 1])));
+        calculation_engine_->UpdateCell(CellReference(row, 3), CellValue(static_cast<double>(row * 10)));
+    }
+
+    // Equality criteria in either order use one index; text matches case-insensitively
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUMIFS($C$1:$C$4,$A$1:$A$4,\"East\",$B$1:$B$4,\"pens\")"),
+                                                   CellReference("E1")),
+              CellValue(50.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=COUNTIFS($B$1:$B$4,\"Pens\",$A$1:$A$4,\"east\")"),
+                                                   CellReference("E2")),
+              CellValue(2.0));
+    EXPECT_EQ(calculation_engine_->GetCriteriaIndexCount(), 1u);
+
+    // Comparison criteria filter the positions an equality criterion selected
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=AVERAGEIFS($C$1:$C$4,$A$1:$A$4,\"East\",$C$1:$C$4,\">15\")"),
+                                                   CellReference("E3")),
+              CellValue(35.0));
+
+    // An edit to a criteria cell is filed into the existing index
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(std::string("East")));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E1")), CellValue(70.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E2")), CellValue(3.0));
+    EXPECT_EQ(calculation_engine_->GetCriteriaIndexCount(), 2u);
+}
+
+// Test case: Lazy mode marks dependents dirty and computes them when read
+TEST_F(CalculationEngineTest, LazyModeComputesOnDemand) {
+    calculation_engine_->SetCalculationMode(CalculationMode::Lazy);
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(1.0));
+    calculation_engine_->EvaluateFormula(Formula("=A1*2"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=B1+1"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1+100"), CellReference("Z1000"));
+
+    // An edit only marks the three dependents dirty
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), 3u);
+
+    // Computing the viewport A1:C10 leaves the off-screen cell pending
+    calculation_engine_->CalculateRange(CellReference("A1"), CellReference("C10"));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), 1u);
+
+    // An explicit read computes the off-screen cell, leaving nothing for the background pass
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("Z1000")), CellValue(105.0));
+    EXPECT_TRUE(calculation_engine_->RecalculatePending(std::chrono::milliseconds(1)));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C1")), CellValue(11.0));
+}
+
+// Test case: A batch defers recalculation to a single pass at commit
+TEST_F(CalculationEngineTest, BatchRecalculatesOnceAtCommit) {
+    calculation_engine_->EvaluateFormula(Formula("=SUM(A1:A3)"), CellReference("B1"));
+
+    calculation_engine_->BeginBatch();
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(1.0));
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(2.0));
+    calculation_engine_->UpdateCell(CellReference("A3"), CellValue(3.0));
+
+    // Assert that dependents are untouched until the batch commits
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B1")), CellValue(0.0));
+
+    calculation_engine_->CommitBatch();
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B1")), CellValue(6.0));
+}
+
+// Test case: A cycle reports every cell on it
+TEST_F(CalculationEngineTest, CircularReferenceListsCycleCells) {
+    calculation_engine_->EvaluateFormula(Formula("=B1+1"), CellReference("A1"));
+    calculation_engine_->EvaluateFormula(Formula("=C1"), CellReference("B1"));
+
+    try {
+        calculation_engine_->EvaluateFormula(Formula("=A1"), CellReference("C1"));
+        FAIL() << "Expected CircularReferenceException";
+    } catch (const CircularReferenceException& e) {
+        EXPECT_THAT(e.GetCells(), ::testing::ElementsAre(CellReference("A1"), CellReference("B1"), CellReference("C1")));
+    }
+}
+
+// Test case: Iterative calculation converges a cycle and recalculates its dependents
+TEST_F(CalculationEngineTest, IterativeCalculationConvergesCycle) {
+    calculation_engine_->SetIterativeCalculation(true);
+    calculation_engine_->EvaluateFormula(Formula("=B1/2+C1"), CellReference("A1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1*10"), CellReference("D1"));
+
+    // A1 = A1/2 + 1 converges to 2
+    calculation_engine_->UpdateCell(CellReference("C1"), CellValue(1.0));
+    EXPECT_NEAR(calculation_engine_->GetCellValue(CellReference("A1")).GetNumeric(), 2.0, 1e-8);
+    EXPECT_NEAR(calculation_engine_->GetCellValue(CellReference("D1")).GetNumeric(), 20.0, 1e-7);
+}
+
+// Test case: Volatile cells and their dependents recalculate without any precedent changing
+TEST_F(CalculationEngineTest, VolatileCellsRecalculateEachPass) {
+    calculation_engine_->EvaluateFormula(Formula("=NOW()"), CellReference("A1"));
+    calculation_engine_->EvaluateFormula(Formula("=A1*0+1"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=C1+1"), CellReference("D1"));
+    EXPECT_EQ(calculation_engine_->GetVolatileCellCount(), 1u);
+
+    calculation_engine_->RecalculateVolatileCells();
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B1")), CellValue(1.0));
+
+    // Replacing the formula with a constant removes the volatile root
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->GetVolatileCellCount(), 0u);
+}
+
+// Test case: A recalculation out of time leaves its cells pending, and a newer edit joins them
+TEST_F(CalculationEngineTest, InterruptedRecalculationResumes) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(1.0));
+    calculation_engine_->EvaluateFormula(Formula("=A1+1"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=B1+1"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=A2*10"), CellReference("D1"));
+
+    // A zero time slice stops the recalculation before its first unit of work
+    calculation_engine_->SetRecalculationTimeSlice(std::chrono::steady_clock::duration::zero());
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), 2u);
+
+    // Pending cells are computed on demand, and an unrelated edit resumes the rest
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B1")), CellValue(6.0));
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(2.0));
+    EXPECT_TRUE(calculation_engine_->RecalculatePending(std::chrono::steady_clock::duration::max()));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C1")), CellValue(7.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("D1")), CellValue(20.0));
+
+    // A cancellation requested while idle does not stop the next edit's recalculation
+    calculation_engine_->SetRecalculationTimeSlice(std::chrono::steady_clock::duration::max());
+    calculation_engine_->CancelCalculation();
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(0.0));
+    EXPECT_EQ(calculation_engine_->GetPendingCellCount(), 0u);
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C1")), CellValue(2.0));
+}
+
+// Test case: A restored calc chain links formulas without evaluating them, and damage is rejected
+TEST_F(CalculationEngineTest, CalcChainRestoresDependencies) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(2.0));
+    calculation_engine_->EvaluateFormula(Formula("=A1*3"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=SUM(B1:B3)"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=SEQUENCE(2)"), CellReference("D1"));
+    std::vector<uint8_t> chain;
+    calculation_engine_->SerializeCalcChain(chain);
+
+    // A second engine over the same values picks up where the first left off
+    CalculationEngine restored(1, calculation_engine_->GetCellStore());
+    ASSERT_TRUE(restored.RestoreCalcChain(chain.data(), chain.size()));
+    EXPECT_TRUE(restored.IsFormulaCell(CellReference("C1")));
+    EXPECT_EQ(restored.GetPendingCellCount(), 0u);
+    CellRect spill;
+    EXPECT_TRUE(restored.GetSpillRange(CellReference("D1"), spill));
+
+    restored.UpdateCell(CellReference("A1"), CellValue(5.0));
+    EXPECT_EQ(restored.GetCellValue(CellReference("C1")), CellValue(15.0));
+
+    // A flipped byte fails the checksum and a truncated chain fails to parse
+    std::vector<uint8_t> damaged = chain;
+    damaged.back() ^= 0x01;
+    CalculationEngine rejected(1, calculation_engine_->GetCellStore());
+    EXPECT_FALSE(rejected.RestoreCalcChain(damaged.data(), damaged.size()));
+    EXPECT_FALSE(rejected.RestoreCalcChain(chain.data(), chain.size() - 1));
+    EXPECT_FALSE(rejected.IsFormulaCell(CellReference("B1")));
+}
+
+// Test case: Array arithmetic spills its result and readers of the spill range recalculate
+TEST_F(CalculationEngineTest, DynamicArraySpillsAndRecalculates) {
+    for (int row = 1; row <= 3; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(static_cast<double>(row)));
+    }
+    calculation_engine_->EvaluateFormula(Formula("=A1:A3*10"), CellReference("C1"));
+    calculation_engine_->EvaluateFormula(Formula("=SUM(C1:C3)"), CellReference("E1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C3")), CellValue(30.0));
+
+    CellRect spill;
+    ASSERT_TRUE(calculation_engine_->GetSpillRange(CellReference("C1"), spill));
+    EXPECT_EQ(spill, (CellRect{1, 3, 3, 3}));
+
+    // Editing a precedent rewrites the spill and updates its reader
+    calculation_engine_->UpdateCell(CellReference("A3"), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C3")), CellValue(50.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E1")), CellValue(80.0));
+
+    // A value typed into the spill range blocks it until it is cleared
+    calculation_engine_->UpdateCell(CellReference("C2"), CellValue(1.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C1")), CellValue(CellErrorType::Spill));
+    EXPECT_TRUE(calculation_engine_->GetCellValue(CellReference("C3")).IsEmpty());
+    calculation_engine_->UpdateCell(CellReference("C2"), CellValue());
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C2")), CellValue(20.0));
+}
+
+// Test case: FILTER, SORT, UNIQUE and SEQUENCE
+TEST_F(CalculationEngineTest, DynamicArrayFunctions) {
+    const double values[] = {3, 1, 3, 2};
+    for (int row = 1; row <= 4; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(values[row - 1]));
+    }
+
+    calculation_engine_->EvaluateFormula(Formula("=SORT(A1:A4)"), CellReference("B1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B4")), CellValue(3.0));
+
+    calculation_engine_->EvaluateFormula(Formula("=UNIQUE(A1:A4)"), CellReference("C1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("C3")), CellValue(2.0));
+    EXPECT_TRUE(calculation_engine_->GetCellValue(CellReference("C4")).IsEmpty());
+
+    calculation_engine_->EvaluateFormula(Formula("=FILTER(A1:A4,A1:A4>2)"), CellReference("D1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("D2")), CellValue(3.0));
+    EXPECT_TRUE(calculation_engine_->GetCellValue(CellReference("D3")).IsEmpty());
+    calculation_engine_->EvaluateFormula(Formula("=FILTER(A1:A4,A1:A4>5)"), CellReference("E1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("E1")), CellValue(CellErrorType::Calc));
+
+    calculation_engine_->EvaluateFormula(Formula("=SEQUENCE(2,3)"), CellReference("F1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("H2")), CellValue(6.0));
+}
+
+// Test case: Profiling attributes recalculation time to cells and functions
+TEST_F(CalculationEngineTest, ProfilerAttributesTimeToCellsAndFunctions) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(1.0));
+    calculation_engine_->EvaluateFormula(Formula("=SUM(A1,2)"), CellReference("B1"));
+
+    auto profiler = std::make_shared<RecalcProfiler>();
+    calculation_engine_->EnableProfiling(profiler, "Sheet1");
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(5.0));
+    calculation_engine_->DisableProfiling();
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(6.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("B1")), CellValue(8.0));
+
+    // Only the edit made while profiling is recorded
+    const auto& profiles = profiler->GetProfiles();
+    ASSERT_EQ(profiles.size(), 1u);
+    EXPECT_EQ(profiles[0].sheet, "Sheet1");
+    ASSERT_EQ(profiles[0].cells.size(), 1u);
+    EXPECT_EQ(profiles[0].cells[0].cell, CellReference("B1"));
+    ASSERT_EQ(profiles[0].functions.size(), 1u);
+    EXPECT_EQ(profiles[0].functions[0].name, "SUM");
+    EXPECT_EQ(profiles[0].functions[0].calls, 1u);
+
+    EXPECT_NE(profiler->ExportJson().find("\"functions\":[{\"name\":\"SUM\""), std::string::npos);
+    EXPECT_NE(profiler->ExportFoldedStacks().find("Sheet1;evaluate;B1"), std::string::npos);
+}
+
+// Test case: Formulas saved as templates are reinstalled and recalculated without a calc chain
+TEST_F(CalculationEngineTest, FormulasRestoreFromTemplates) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(2.0));
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(3.0));
+    calculation_engine_->EvaluateFormula(Formula("=A1*10"), CellReference("B1"));
+    calculation_engine_->EvaluateFormula(Formula("=A2*10"), CellReference("B2"));
+
+    std::vector<FormulaTemplateSource> templates;
+    std::vector<std::pair<CellReference, uint32_t>> cells;
+    calculation_engine_->ForEachFormulaCell([&](const CellReference& cell, const FormulaTemplateSource& source) {
+        if (templates.empty()) {
+            templates.push_back(source);
+        }
+        EXPECT_EQ(source.formula, templates[0].formula);
+        cells.emplace_back(cell, 0);
+    });
+    ASSERT_EQ(cells.size(), 2u);
+
+    CalculationEngine restored;
+    restored.UpdateCell(CellReference("A1"), CellValue(2.0));
+    restored.UpdateCell(CellReference("A2"), CellValue(4.0));
+    restored.RestoreFormulas(templates, cells);
+    EXPECT_EQ(restored.GetPendingCellCount(), 2u);
+    EXPECT_TRUE(restored.RecalculatePending(std::chrono::steady_clock::duration::max()));
+    EXPECT_EQ(restored.GetCellValue(CellReference("B2")), CellValue(40.0));
+
+    // The restored formulas track their precedents
+    restored.UpdateCell(CellReference("A1"), CellValue(5.0));
+    EXPECT_EQ(restored.GetCellValue(CellReference("B1")), CellValue(50.0));
+}
+
+// Test case: String constants of formulas are kept with the compiled programs, not in the workbook's pool
+TEST_F(CalculationEngineTest, FormulaConstantsStayOutOfWorkbookPool) {
+    StringPool workbookPool;
+    StringPoolScope scope(workbookPool);
+    calculation_engine_->EvaluateFormula(Formula("=\"Quarterly total\""), CellReference("A1"));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("A1")).GetString(), "Quarterly total");
+    EXPECT_EQ(workbookPool.Size(), 0u);
+
+    // Releasing the workbook releases the constants with the programs
+    CellValue released = calculation_engine_->GetCellValue(CellReference("A1"));
+    calculation_engine_->ReleaseWorkbook();
+    EXPECT_THROW(released.GetString(), std::runtime_error);
+}
+
+// Test case: A range written end first, e.g. A3:A1, reads the same cells as A1:A3
+TEST_F(CalculationEngineTest, ReversedRangesAggregate) {
+    for (int row = 1; row <= 3; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(static_cast<double>(row)));
+        calculation_engine_->UpdateCell(CellReference(row, 2), CellValue(static_cast<double>(row * 10)));
+    }
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(A3:A1)"), CellReference("D1")), CellValue(6.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUMPRODUCT(A3:A1,B3:B1)"), CellReference("D2")),
+              CellValue(140.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUMPRODUCT(B1:A3)"), CellReference("D3")), CellValue(66.0));
+
+    // The reversed range is also tracked as a dependency
+    calculation_engine_->UpdateCell(CellReference(2, 1), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("D1")), CellValue(9.0));
+    EXPECT_EQ(calculation_engine_->GetCellValue(CellReference("D2")), CellValue(200.0));
+}
+
+// Test case: Aggregates skip text and booleans in a single referenced cell, as in a range
+TEST_F(CalculationEngineTest, AggregatesReadSingleReferencesAsRanges) {
+    calculation_engine_->UpdateCell(CellReference("A1"), CellValue(std::string("abc")));
+    calculation_engine_->UpdateCell(CellReference("A2"), CellValue(true));
+    calculation_engine_->UpdateCell(CellReference("A3"), CellValue(5.0));
+    calculation_engine_->EvaluateFormula(Formula("=1/0"), CellReference("A4"));
+
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(A1)"), CellReference("C1")), CellValue(0.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(A1:A1)"), CellReference("C2")), CellValue(0.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(A1,A2,A3)"), CellReference("C3")), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=COUNT(A1,A2,A3)"), CellReference("C4")), CellValue(1.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=AVERAGE(A1,A3)"), CellReference("C5")), CellValue(5.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(A4)"), CellReference("C6")),
+              CellValue(CellErrorType::DivisionByZero));
+
+    // Values typed as arguments, or computed from a reference, are still converted
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(\"3\",TRUE,A3)"), CellReference("C7")), CellValue(9.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUM(-A2)"), CellReference("C8")), CellValue(-1.0));
+}
+
+// Test case: Lookups and conditional aggregates over ranges written end first
+TEST_F(CalculationEngineTest, ReversedRangesLookUp) {
+    for (int row = 1; row <= 3; ++row) {
+        calculation_engine_->UpdateCell(CellReference(row, 1), CellValue(static_cast<double>(row * 10)));
+        calculation_engine_->UpdateCell(CellReference(row, 2), CellValue(static_cast<double>(row)));
+    }
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=VLOOKUP(20,$B$3:$A$1,2,FALSE)"), CellReference("D1")),
+              CellValue(2.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=MATCH(30,$A$3:$A$1,0)"), CellReference("D2")), CellValue(3.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=XLOOKUP(10,$A$3:$A$1,$B$3:$B$1)"), CellReference("D3")),
+              CellValue(1.0));
+    EXPECT_EQ(calculation_engine_->EvaluateFormula(Formula("=SUMIFS($B$3:$B$1,$A$3:$A$1,\">15\")"), CellReference("D4")),
+              CellValue(5.0));
+}
+
 } // namespace test
 } // namespace excel
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/cell_store.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Helper function to collect the populated cells of a range in visiting order
+std::vector<std::pair<int, int>> CollectCells(const CellStore& store, const CellRect& rect) {
+    std::vector<std::pair<int, int>> cells;
+    store.ForEachInRange(rect, [&](int32_t row, int32_t column, const CellValue&) { cells.emplace_back(row, column); });
+    return cells;
+}
+
+// Test case: Values survive the sparse-to-dense transition and back
+TEST(CellStoreTest, BlocksSwitchBetweenSparseAndDense) {
+    CellStore store;
+    for (int row = 1; row <= 500; ++row) {
+        store.Set(CellReference(row, 2), CellValue(static_cast<double>(row)));
+    }
+    EXPECT_EQ(store.GetCellCount(), 500u);
+    EXPECT_EQ(store.Get(250, 2), CellValue(250.0));
+
+    // Clearing most of the block returns it to sparse form without losing the rest
+    for (int row = 1; row <= 495; ++row) {
+        store.Set(CellReference(row, 2), CellValue());
+    }
+    EXPECT_EQ(store.GetCellCount(), 5u);
+    EXPECT_TRUE(store.Get(10, 2).IsEmpty());
+    EXPECT_EQ(store.Get(500, 2), CellValue(500.0));
+}
+
+// Test case: Range iteration visits only populated cells, column by column
+TEST(CellStoreTest, RangeIterationIsColumnMajor) {
+    CellStore store;
+    store.Set(CellReference("B2"), CellValue(1.0));
+    store.Set(CellReference("A3"), CellValue(2.0));
+    store.Set(CellReference("A2000"), CellValue(3.0));
+    store.Set(CellReference("C1"), CellValue(4.0));
+
+    EXPECT_THAT(CollectCells(store, {1, 1, 2000, 2}),
+                ::testing::ElementsAre(std::make_pair(3, 1), std::make_pair(2000, 1), std::make_pair(2, 2)));
+    EXPECT_TRUE(CollectCells(store, {4, 1, 1999, 3}).empty());
+}
+
+// Loader that fills chunk n with the row numbers of rows n * 1024 + 1 onwards and counts its calls
+class CountingLoader : public CellChunkLoader {
+public:
+    std::atomic<int> loads{0};
+
+    void LoadChunk(uint32_t chunk, CellStore& store) override {
+        ++loads;
+        std::vector<CellValue> values;
+        for (int row = static_cast<int>(chunk) * 1024 + 1; row <= static_cast<int>(chunk + 1) * 1024; ++row) {
+            values.emplace_back(static_cast<double>(row));
+        }
+        store.FillChunk(static_cast<int32_t>(chunk) * 1024 + 1, values.data(), values.size());
+    }
+};
+
+// Test case: A deferred chunk loads once, on first touch, even with concurrent readers
+TEST(CellStoreTest, DeferredChunksLoadOnceOnFirstTouch) {
+    CellStore store;
+    auto loader = std::make_shared<CountingLoader>();
+    store.AddDeferredChunk(1, 1, 1024, 1024, loader, 0);
+    store.AddDeferredChunk(1, 1025, 1024, 1024, loader, 1);
+    EXPECT_EQ(store.GetCellCount(), 2048u);
+    EXPECT_EQ(loader->loads, 0);
+
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&]() {
+            for (int row = 1; row <= 1024; ++row) {
+                if (store.Get(row, 1) != CellValue(static_cast<double>(row))) {
+                    ++mismatches;
+                }
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_EQ(loader->loads, 1);
+
+    // Writing into a deferred chunk loads it first
+    store.Set(CellReference(2000, 1), CellValue(-1.0));
+    EXPECT_EQ(loader->loads, 2);
+    EXPECT_EQ(store.Get(1999, 1), CellValue(1999.0));
+    EXPECT_EQ(store.GetCellCount(), 2048u);
+}
+
+} // namespace test
+} // namespace excel
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/cell_value.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Test case: Every kind of value fits in 16 bytes and round-trips
+TEST(CellValueTest, StoresAllTypesInline) {
+    EXPECT_EQ(sizeof(CellValue), 16u);
+
+    EXPECT_TRUE(CellValue().IsEmpty());
+    EXPECT_EQ(CellValue(2.5).GetNumeric(), 2.5);
+    EXPECT_TRUE(CellValue(true).GetBoolean());
+    EXPECT_EQ(CellValue(CellErrorType::NotAvailable).GetError(), CellErrorType::NotAvailable);
+    EXPECT_EQ(CellValue(std::string("Revenue")).GetString(), "Revenue");
+}
+
+// Test case: Equal strings share one pool entry and compare equal across pools
+TEST(CellValueTest, InternsStringsPerPool) {
+    StringPool first;
+    StringPool second;
+
+    CellValue a(std::string("North"), first);
+    CellValue b(std::string("North"), first);
+    CellValue c(std::string("South"), first);
+    EXPECT_EQ(first.Size(), 2u);
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+
+    // The same text interned into another workbook's pool is still equal
+    CellValue d(std::string("North"), second);
+    EXPECT_EQ(a, d);
+
+    // Values created inside a scope use that scope's pool
+    {
+        StringPoolScope scope(second);
+        CellValue e(std::string("East"));
+        EXPECT_EQ(second.Size(), 2u);
+        EXPECT_EQ(e.GetString(), "East");
+    }
+}
+
+// Test case: A value whose pool was destroyed is detected, even after another pool takes its place
+TEST(CellValueTest, ReleasedPoolIdsAreNotReused) {
+    CellValue stale;
+    uint32_t releasedId;
+    {
+        StringPool pool;
+        stale = CellValue(std::string("Closed"), pool);
+        releasedId = pool.GetId();
+    }
+    StringPool successor;
+    CellValue live(std::string("Open"), successor);
+    EXPECT_NE(successor.GetId(), releasedId);
+    EXPECT_EQ(StringPool::FromId(releasedId), nullptr);
+    EXPECT_THROW(stale.GetString(), std::runtime_error);
+    EXPECT_EQ(live.GetString(), "Open");
+}
+
+// Test case: An empty pool reserves no chunk storage, and strings across chunks stay readable
+TEST(CellValueTest, PoolGrowsOnDemand) {
+    StringPool pool;
+    EXPECT_LT(pool.GetMemoryUsage(), 8192u);
+
+    std::vector<CellValue> values;
+    for (int i = 0; i < 10000; ++i) {
+        values.emplace_back(std::to_string(i), pool);
+    }
+    EXPECT_EQ(pool.Size(), 10000u);
+    EXPECT_EQ(values[0].GetString(), "0");
+    EXPECT_EQ(values[4096].GetString(), "4096");
+    EXPECT_EQ(values[9999].GetString(), "9999");
+}
+
+} // namespace test
+} // namespace excel
@@ -5,6 +5,9 @@
 #include <src/core/worksheet.h>
 #include <src/core/cell.h>
 #include <src/core/file_system.h>
+#include <src/core/cloud_storage.h>
+#include <src/core/calculation_engine.h>
+#include <string>
 
 namespace excel {
 namespace test {
@@ -157,5 +160,116 @@ TEST_F(DataManagementTest, SetCellValue) {
     EXPECT_EQ(std::get<std::string>(value), "New Value");
 }
 
+// Helper function to save a new workbook whose first sheet holds values in
+// column A, their sum in B1 and a label in C1. The values are typed in
+// after the formula, so the sum is recalculated from the edits.
+void SaveSumWorkbook(DataManager& dataManager, const std::string& name, const std::vector<double>& values,
+                     const std::string& label, const std::string& path) {
+    auto workbook = dataManager.CreateWorkbook(name);
+    double sum = 0.0;
+    dataManager.GetCalculationEngine(workbook)->EvaluateFormula(
+        Formula("=SUM(A1:A" + std::to_string(values.size()) + ")"), CellReference(1, 2));
+    for (size_t i = 0; i < values.size(); ++i) {
+        dataManager.SetCellValue(workbook, "Sheet1", CellReference(static_cast<int>(i) + 1, 1), CellValue(values[i]));
+        sum += values[i];
+    }
+    dataManager.SetCellValue(workbook, "Sheet1", CellReference(1, 3), CellValue(label));
+    ASSERT_EQ(dataManager.GetCellValue(workbook, "Sheet1", CellReference(1, 2)), CellValue(sum));
+    ASSERT_TRUE(dataManager.SaveWorkbook(workbook, path));
+}
+
+// Test case: Workbooks opened one after the other keep their own cells and formulas
+TEST(DataManagementWorkbooksTest, OpenTwoWorkbooksKeepsBothIntact) {
+    std::string firstPath = ::testing::TempDir() + "first_workbook.xlsx";
+    std::string secondPath = ::testing::TempDir() + "second_workbook.xlsx";
+    auto fileSystem = std::make_shared<FileSystem>();
+    auto cloudStorage = std::make_shared<CloudStorage>();
+    {
+        DataManager writer(std::make_shared<CalculationEngine>(), fileSystem, cloudStorage);
+        SaveSumWorkbook(writer, "First", {1, 2, 3}, "first", firstPath);
+        SaveSumWorkbook(writer, "Second", {10, 20}, "second", secondPath);
+    }
+
+    DataManager dataManager(std::make_shared<CalculationEngine>(), fileSystem, cloudStorage);
+    auto first = dataManager.OpenWorkbook(firstPath);
+    auto second = dataManager.OpenWorkbook(secondPath);
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    EXPECT_NE(dataManager.GetCalculationEngine(first), dataManager.GetCalculationEngine(second));
+
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(1, 2)), CellValue(6.0));
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(3, 1)), CellValue(3.0));
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(1, 3)).GetString(), "first");
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(1, 2)), CellValue(30.0));
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(3, 1)), CellValue());
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(1, 3)).GetString(), "second");
+
+    // An edit recalculates its own workbook only
+    dataManager.SetCellValue(first, "Sheet1", CellReference(1, 1), CellValue(5.0));
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(1, 2)), CellValue(10.0));
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(1, 2)), CellValue(30.0));
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(1, 1)), CellValue(10.0));
+
+    dataManager.SetCellValue(second, "Sheet1", CellReference(2, 1), CellValue(25.0));
+    EXPECT_EQ(dataManager.GetCellValue(second, "Sheet1", CellReference(1, 2)), CellValue(35.0));
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(1, 2)), CellValue(10.0));
+    EXPECT_EQ(dataManager.GetCellValue(first, "Sheet1", CellReference(2, 1)), CellValue(2.0));
+}
+
+// Test case: GetCellValue reads a sheet other than the active one from its own cell store
+TEST(DataManagementWorkbooksTest, GetCellValueReadsInactiveSheet) {
+    DataManager dataManager(std::make_shared<CalculationEngine>(), std::make_shared<FileSystem>(),
+                            std::make_shared<CloudStorage>());
+    auto workbook = dataManager.CreateWorkbook("Sheets");
+    auto otherStore = std::make_shared<CellStore>();
+    workbook->AddWorksheet(std::make_shared<Worksheet>("Other", otherStore));
+    dataManager.SetCellValue(workbook, "Sheet1", CellReference(1, 1), CellValue(1.0));
+    otherStore->Set(CellReference(1, 1), CellValue(2.0));
+
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Sheet1", CellReference(1, 1)), CellValue(1.0));
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Other", CellReference(1, 1)), CellValue(2.0));
+}
+
+// Test case: SetCellValue on a sheet other than the active one leaves the engine's cells alone
+TEST(DataManagementWorkbooksTest, SetCellValueOnInactiveSheet) {
+    DataManager dataManager(std::make_shared<CalculationEngine>(), std::make_shared<FileSystem>(),
+                            std::make_shared<CloudStorage>());
+    auto workbook = dataManager.CreateWorkbook("Sheets");
+    workbook->AddWorksheet(std::make_shared<Worksheet>("Other", std::make_shared<CellStore>()));
+    dataManager.SetCellValue(workbook, "Sheet1", CellReference(1, 1), CellValue(1.0));
+    dataManager.GetCalculationEngine(workbook)->EvaluateFormula(Formula("=A1*2"), CellReference(1, 2));
+
+    dataManager.SetCellValue(workbook, "Other", CellReference(1, 1), CellValue(5.0));
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Other", CellReference(1, 1)), CellValue(5.0));
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Sheet1", CellReference(1, 1)), CellValue(1.0));
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Sheet1", CellReference(1, 2)), CellValue(2.0));
+
+    dataManager.SetCellValue(workbook, "Sheet1", CellReference(1, 1), CellValue(4.0));
+    EXPECT_EQ(dataManager.GetCellValue(workbook, "Sheet1", CellReference(1, 2)), CellValue(8.0));
+}
+
+// Test case: Closing a workbook releases its calculation state and frees its engine for the next workbook
+TEST(DataManagementWorkbooksTest, CloseWorkbookReleasesCalculationState) {
+    auto calculationEngine = std::make_shared<CalculationEngine>();
+    DataManager dataManager(calculationEngine, std::make_shared<FileSystem>(), std::make_shared<CloudStorage>());
+    auto workbook = dataManager.CreateWorkbook("Closed");
+    ASSERT_EQ(dataManager.GetCalculationEngine(workbook), calculationEngine);
+    dataManager.SetCellValue(workbook, "Sheet1", CellReference(1, 1), CellValue(1.0));
+    calculationEngine->EvaluateFormula(Formula("=A1+1"), CellReference(1, 2));
+
+    EXPECT_TRUE(dataManager.CloseWorkbook(workbook));
+    EXPECT_FALSE(dataManager.CloseWorkbook(workbook));
+    EXPECT_EQ(dataManager.GetCalculationEngine(workbook), nullptr);
+    size_t formulaCells = 0;
+    calculationEngine->ForEachFormulaCell([&](const CellReference&, const FormulaTemplateSource&) { ++formulaCells; });
+    EXPECT_EQ(formulaCells, 0u);
+    EXPECT_EQ(calculationEngine->GetCellValue(CellReference(1, 1)), CellValue());
+
+    // The same name can be used again, and the new workbook gets the released engine
+    auto reopened = dataManager.CreateWorkbook("Closed");
+    ASSERT_NE(reopened, nullptr);
+    EXPECT_EQ(dataManager.GetCalculationEngine(reopened), calculationEngine);
+}
+
 } // namespace test
 } // namespace excel
\ No newline at end of file
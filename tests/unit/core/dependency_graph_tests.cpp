@@ -0,0 +1,76 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/dependency_graph.h>
+#include <algorithm>
+
+namespace excel {
+namespace test {
+
+// Helper function to build the dependencies of a formula reading one range
+FormulaDependencies RangeDependencies(int firstRow, int firstColumn, int lastRow, int lastColumn) {
+    FormulaDependencies dependencies;
+    dependencies.ranges.push_back({firstRow, firstColumn, lastRow, lastColumn});
+    return dependencies;
+}
+
+// Test fixture for DependencyGraph tests
+class DependencyGraphTest : public ::testing::Test {
+protected:
+    DependencyGraph graph_;
+};
+
+// Test case: Whole-column reference is a single range node
+TEST_F(DependencyGraphTest, WholeColumnReferenceUsesOneRangeNode) {
+    // B1 = SUM(A:A)
+    graph_.UpdateDependencies(CellReference("B1"), RangeDependencies(1, 1, 1048576, 1));
+
+    // Assert that only one range node was created
+    EXPECT_EQ(graph_.GetRangeNodeCount(), 1u);
+
+    // Assert that any cell in column A reports B1 as a dependent
+    EXPECT_THAT(graph_.GetDependentCells(CellReference("A1")), ::testing::ElementsAre(CellReference("B1")));
+    EXPECT_THAT(graph_.GetDependentCells(CellReference("A1000000")), ::testing::ElementsAre(CellReference("B1")));
+
+    // Assert that cells outside the range have no dependents
+    EXPECT_TRUE(graph_.GetDependentCells(CellReference("C5")).empty());
+}
+
+// Test case: Identical ranges share a node, which is released with its last reader
+TEST_F(DependencyGraphTest, SharedRangeNodeIsReleased) {
+    graph_.UpdateDependencies(CellReference("C1"), RangeDependencies(1, 1, 100, 2));
+    graph_.UpdateDependencies(CellReference("C2"), RangeDependencies(1, 1, 100, 2));
+    EXPECT_EQ(graph_.GetRangeNodeCount(), 1u);
+
+    auto dependents = graph_.GetDependentCells(CellReference("B50"));
+    std::sort(dependents.begin(), dependents.end());
+    EXPECT_THAT(dependents, ::testing::ElementsAre(CellReference("C1"), CellReference("C2")));
+
+    // Remove both readers
+    graph_.UpdateDependencies(CellReference("C1"), FormulaDependencies());
+    graph_.UpdateDependencies(CellReference("C2"), FormulaDependencies());
+
+    // Assert that the range node is gone
+    EXPECT_EQ(graph_.GetRangeNodeCount(), 0u);
+    EXPECT_TRUE(graph_.GetDependentCells(CellReference("B50")).empty());
+}
+
+// Test case: Formulas reading a spill range depend on the anchor through one spill node
+TEST_F(DependencyGraphTest, SpillRangeReadersDependOnAnchor) {
+    // D1 = SUM(B1:B10), D2 = B5, with A1 spilling into A1:B5
+    graph_.UpdateDependencies(CellReference("D1"), RangeDependencies(1, 2, 10, 2));
+    FormulaDependencies single;
+    single.cells.push_back(CellReference("B5"));
+    graph_.UpdateDependencies(CellReference("D2"), single);
+    graph_.SetSpillRange(CellReference("A1"), {1, 1, 5, 2});
+
+    auto dependents = graph_.GetDependentCells(CellReference("A1"));
+    std::sort(dependents.begin(), dependents.end());
+    EXPECT_THAT(dependents, ::testing::ElementsAre(CellReference("D1"), CellReference("D2")));
+
+    // Without the spill node the anchor has no readers
+    graph_.ClearSpillRange(CellReference("A1"));
+    EXPECT_TRUE(graph_.GetDependentCells(CellReference("A1")).empty());
+}
+
+} // namespace test
+} // namespace excel
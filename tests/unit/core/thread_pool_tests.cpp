@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/thread_pool.h>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Test case: Every index is visited exactly once, in chunks no larger than the grain size
+TEST(ThreadPoolTest, ParallelForCoversEveryIndexOnce) {
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> visits(10007);
+    std::atomic<size_t> largestChunk(0);
+    pool.ParallelFor(visits.size(), 64, [&](size_t begin, size_t end) {
+        size_t chunk = end - begin;
+        size_t largest = largestChunk.load();
+        while (chunk > largest && !largestChunk.compare_exchange_weak(largest, chunk)) {
+        }
+        for (size_t i = begin; i < end; ++i) {
+            ++visits[i];
+        }
+    });
+    for (const auto& count : visits) {
+        ASSERT_EQ(count.load(), 1);
+    }
+    EXPECT_EQ(largestChunk.load(), 64u);
+}
+
+// Test case: ParallelFor called from inside a worker completes instead of deadlocking
+TEST(ThreadPoolTest, NestedParallelForCompletes) {
+    // More outer chunks than workers, so every worker blocks in an inner call
+    ThreadPool pool(2);
+    std::vector<std::atomic<int>> visits(16 * 100);
+    pool.ParallelFor(16, 1, [&](size_t outerBegin, size_t outerEnd) {
+        for (size_t outer = outerBegin; outer < outerEnd; ++outer) {
+            pool.ParallelFor(100, 7, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    ++visits[outer * 100 + i];
+                }
+            });
+        }
+    });
+    for (const auto& count : visits) {
+        ASSERT_EQ(count.load(), 1);
+    }
+}
+
+// Test case: An exception in one chunk reaches the caller after the other chunks have run
+TEST(ThreadPoolTest, ParallelForRethrowsFirstError) {
+    ThreadPool pool(3);
+    std::atomic<size_t> finished(0);
+    EXPECT_THROW(pool.ParallelFor(40, 1, [&](size_t begin, size_t) {
+        if (begin == 17) {
+            throw std::runtime_error("chunk failed");
+        }
+        ++finished;
+    }), std::runtime_error);
+    EXPECT_EQ(finished.load(), 39u);
+
+    // The pool stays usable
+    std::atomic<size_t> total(0);
+    pool.ParallelFor(10, 1, [&](size_t begin, size_t end) { total += end - begin; });
+    EXPECT_EQ(total.load(), 10u);
+}
+
+} // namespace test
+} // namespace excel
@@ -0,0 +1,332 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/workbook_format.h>
+#include <src/core/cell_store.h>
+#include <src/core/cell_value.h>
+#include <src/core/mapped_file.h>
+#include <src/core/thread_pool.h>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Helper function to collect every populated cell of a store in visiting order
+std::vector<std::pair<CellReference, CellValue>> CollectCells(const CellStore& store) {
+    std::vector<std::pair<CellReference, CellValue>> cells;
+    store.ForEachInRange({1, 1, 1048576, 16384}, [&](int32_t row, int32_t column, const CellValue& value) {
+        cells.emplace_back(CellReference(row, column), value);
+    });
+    return cells;
+}
+
+// Helper function to write one sheet with metadata and read it back into a new store
+std::vector<uint8_t> WriteSheet(const CellStore& store) {
+    WorkbookWriter writer;
+    WorkbookMetadata metadata;
+    metadata.name = "Book1";
+    metadata.sheetNames = {"Sheet1"};
+    writer.WriteMetadata(metadata);
+    writer.WriteSheet(store);
+    return writer.Finish();
+}
+
+// Helper function to attach sheet 0 of a file to a store, as opening a workbook does
+void AttachSheet(const std::shared_ptr<const void>& owner, const uint8_t* data, size_t size, CellStore& store) {
+    WorkbookReader reader(data, size);
+    reader.AttachSheet(0, owner, reader.AttachStringTable(owner, StringPool::Current()), store);
+}
+
+// Helper function to build a sheet with a fractional, an integer and a mixed column
+void BuildMixedSheet(CellStore& store) {
+    for (int row = 1; row <= 70000; ++row) {
+        store.Set(CellReference(row, 1), CellValue(row * 0.25 + 0.1));
+        store.Set(CellReference(row, 2), CellValue(static_cast<double>(row)));
+    }
+    store.Set(CellReference(5, 3), CellValue("apple"));
+    store.Set(CellReference(6, 3), CellValue(true));
+    store.Set(CellReference(7, 3), CellValue(2.5));
+}
+
+// Test case: Every cell type survives a round trip, in sparse and dense columns and across chunks
+TEST(WorkbookFormatTest, CellsRoundTrip) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    for (int row = 1; row <= 70000; ++row) {
+        store.Set(CellReference(row, 1), CellValue(static_cast<double>(row * 3 - 5000)));
+    }
+    store.Set(CellReference(2, 2), CellValue(0.1));
+    store.Set(CellReference(3, 2), CellValue(-0.0));
+    store.Set(CellReference(4, 2), CellValue(1e300));
+    store.Set(CellReference(10, 3), CellValue("apple"));
+    store.Set(CellReference(11, 3), CellValue(true));
+    store.Set(CellReference(12, 3), CellValue("apple"));
+    store.Set(CellReference(13, 3), CellValue(CellErrorType::NotAvailable));
+    store.Set(CellReference(1048576, 16384), CellValue(false));
+
+    std::vector<uint8_t> file = WriteSheet(store);
+    WorkbookReader reader(file.data(), file.size());
+    ASSERT_EQ(reader.GetSheetCount(), 1u);
+    EXPECT_EQ(reader.ReadMetadata().sheetNames, std::vector<std::string>{"Sheet1"});
+
+    CellStore loaded;
+    reader.ReadSheet(0, reader.ReadStringTable(), loaded);
+    EXPECT_EQ(loaded.GetCellCount(), store.GetCellCount());
+    EXPECT_EQ(CollectCells(loaded), CollectCells(store));
+    EXPECT_TRUE(std::signbit(loaded.Get(3, 2).GetNumeric()));
+}
+
+// Test case: Integer columns are delta-encoded into far fewer bytes than raw doubles
+TEST(WorkbookFormatTest, IntegerColumnsAreCompact) {
+    CellStore store;
+    for (int row = 1; row <= 10000; ++row) {
+        store.Set(CellReference(row, 1), CellValue(static_cast<double>(1000000 + row)));
+    }
+    EXPECT_LT(WriteSheet(store).size(), 10000u * 2);
+}
+
+// Test case: Formulas and styles round-trip with their templates and ranges
+TEST(WorkbookFormatTest, FormulasAndStylesRoundTrip) {
+    FormulaTable formulas;
+    formulas.templates.push_back({"=A1*2", CellReference("B1")});
+    formulas.templates.push_back({"=SUM(A:A)", CellReference("C1")});
+    formulas.cells = {{CellReference("B1"), 0}, {CellReference("B2"), 0}, {CellReference("C1"), 1}, {CellReference("B900"), 0}};
+    StyleTable styles;
+    styles.records = {"bold", "currency"};
+    styles.ranges.push_back({0, {1, 1, 10, 3}, 1});
+
+    WorkbookWriter writer;
+    writer.WriteMetadata({"Book1", {"Sheet1", "Sheet2"}, 1});
+    writer.WriteStyles(styles);
+    writer.WriteFormulas(1, formulas);
+    std::vector<uint8_t> file = writer.Finish();
+
+    WorkbookReader reader(file.data(), file.size());
+    EXPECT_EQ(reader.ReadMetadata().activeSheet, 1u);
+    FormulaTable loaded = reader.ReadFormulas(1);
+    ASSERT_EQ(loaded.templates.size(), 2u);
+    EXPECT_EQ(loaded.templates[1].formula, "=SUM(A:A)");
+    EXPECT_EQ(loaded.templates[1].context, CellReference("C1"));
+    EXPECT_THAT(loaded.cells, ::testing::UnorderedElementsAreArray(formulas.cells));
+    EXPECT_TRUE(reader.ReadFormulas(0).cells.empty());
+
+    StyleTable loadedStyles = reader.ReadStyles();
+    EXPECT_EQ(loadedStyles.records, styles.records);
+    ASSERT_EQ(loadedStyles.ranges.size(), 1u);
+    EXPECT_EQ(loadedStyles.ranges[0].rect, (CellRect{1, 1, 10, 3}));
+}
+
+// Test case: A damaged chunk or a truncated file is rejected
+TEST(WorkbookFormatTest, CorruptionIsDetected) {
+    CellStore store;
+    for (int row = 1; row <= 100; ++row) {
+        store.Set(CellReference(row, 1), CellValue(row * 0.5));
+    }
+    std::vector<uint8_t> file = WriteSheet(store);
+
+    std::vector<uint8_t> damaged = file;
+    damaged[damaged.size() - 100] ^= 0x01;
+    WorkbookReader reader(damaged.data(), damaged.size());
+    CellStore loaded;
+    EXPECT_THROW(reader.ReadSheet(0, reader.ReadStringTable(), loaded), std::runtime_error);
+
+    EXPECT_THROW(WorkbookReader(file.data(), file.size() - 9), std::runtime_error);
+    EXPECT_FALSE(WorkbookReader::IsWorkbookFile(file.data() + 1, file.size() - 1));
+}
+
+// Test case: An attached sheet decodes nothing until its cells are touched and then matches the original
+TEST(WorkbookFormatTest, AttachedSheetLoadsOnFirstTouch) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    BuildMixedSheet(store);
+    auto file = std::make_shared<std::vector<uint8_t>>(WriteSheet(store));
+
+    StringPool loadPool;
+    StringPoolScope loadScope(loadPool);
+    CellStore attached;
+    AttachSheet(file, file->data(), file->size(), attached);
+    EXPECT_EQ(attached.GetCellCount(), store.GetCellCount());
+    EXPECT_LT(attached.GetMemoryUsage(), store.GetMemoryUsage() / 10);
+
+    // Numbers load without decoding the string table
+    EXPECT_EQ(attached.Get(70000, 1), CellValue(70000 * 0.25 + 0.1));
+    EXPECT_EQ(attached.Get(3, 2), CellValue(3.0));
+    EXPECT_EQ(loadPool.Size(), 0u);
+    EXPECT_EQ(attached.Get(5, 3).GetString(), "apple");
+    EXPECT_EQ(CollectCells(attached), CollectCells(store));
+    EXPECT_EQ(attached.GetCellCount(), store.GetCellCount());
+
+    // Writing into numbers read in place keeps their neighbours
+    attached.Set(CellReference(2, 1), CellValue("edited"));
+    attached.Set(CellReference(3, 1), CellValue());
+    EXPECT_EQ(attached.Get(1, 1), CellValue(1 * 0.25 + 0.1));
+    EXPECT_EQ(attached.Get(2, 1).GetString(), "edited");
+    EXPECT_TRUE(attached.Get(3, 1).IsEmpty());
+    EXPECT_EQ(attached.GetCellCount(), store.GetCellCount() - 1);
+}
+
+// Test case: A memory-mapped file serves an attached sheet, which outlives the mapping handle
+TEST(WorkbookFormatTest, MappedFileBacksAttachedSheet) {
+    CellStore store;
+    BuildMixedSheet(store);
+    std::vector<uint8_t> file = WriteSheet(store);
+    std::string path = (std::filesystem::temp_directory_path() / "workbook_format_tests.xlwb").string();
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(file.data()), file.size());
+
+    CellStore attached;
+    {
+        std::shared_ptr<MappedFile> mapping = MappedFile::Open(path);
+        ASSERT_NE(mapping, nullptr);
+        ASSERT_EQ(mapping->GetSize(), file.size());
+        AttachSheet(mapping, mapping->GetData(), mapping->GetSize(), attached);
+    }
+    EXPECT_EQ(CollectCells(attached), CollectCells(store));
+
+    // Loading everything detaches the store from the file
+    attached.LoadDeferredChunks();
+    std::remove(path.c_str());
+    EXPECT_EQ(attached.Get(69999, 1), CellValue(69999 * 0.25 + 0.1));
+    EXPECT_EQ(MappedFile::Open(path), nullptr);
+}
+
+// Test case: A damaged chunk of an attached sheet throws when touched and leaves the other chunks readable
+TEST(WorkbookFormatTest, AttachedChunkCorruptionIsDetectedOnTouch) {
+    CellStore store;
+    for (int row = 1; row <= 100; ++row) {
+        store.Set(CellReference(row, 1), CellValue(row * 0.5));
+        store.Set(CellReference(row, 2), CellValue(row * 1.5));
+    }
+    auto file = std::make_shared<std::vector<uint8_t>>(WriteSheet(store));
+    (*file)[file->size() - 100] ^= 0x01;
+
+    CellStore attached;
+    AttachSheet(file, file->data(), file->size(), attached);
+    EXPECT_EQ(attached.Get(50, 1), CellValue(25.0));
+    EXPECT_THROW(attached.Get(50, 2), std::runtime_error);
+    EXPECT_THROW(attached.Get(51, 2), std::runtime_error);
+    EXPECT_EQ(attached.GetCellCount(), 200u);
+}
+
+// Test case: A deferred sheet reads nothing until touched, reports its cell count from the directory and can be released
+TEST(WorkbookFormatTest, DeferredSheetAttachesOnFirstTouch) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    BuildMixedSheet(store);
+    auto file = std::make_shared<std::vector<uint8_t>>(WriteSheet(store));
+
+    StringPool loadPool;
+    StringPoolScope loadScope(loadPool);
+    WorkbookReader reader(file->data(), file->size());
+    EXPECT_EQ(reader.GetSheetCellCount(0), store.GetCellCount());
+    CellStore deferred;
+    reader.DeferSheet(0, file, reader.AttachStringTable(file, loadPool), deferred);
+    EXPECT_FALSE(deferred.IsSheetAttached());
+    EXPECT_EQ(deferred.GetCellCount(), store.GetCellCount());
+
+    EXPECT_EQ(deferred.Get(70000, 1), CellValue(70000 * 0.25 + 0.1));
+    EXPECT_TRUE(deferred.IsSheetAttached());
+    EXPECT_EQ(CollectCells(deferred), CollectCells(store));
+
+    // Unmodified, it can be returned to its untouched state and attached again
+    EXPECT_TRUE(deferred.ReleaseSheet());
+    EXPECT_FALSE(deferred.IsSheetAttached());
+    EXPECT_EQ(deferred.GetCellCount(), store.GetCellCount());
+    EXPECT_EQ(deferred.Get(5, 3).GetString(), "apple");
+
+    // Once written to, it holds the only copy of its cells
+    deferred.Set(CellReference(1, 4), CellValue(1.0));
+    EXPECT_FALSE(deferred.ReleaseSheet());
+    EXPECT_EQ(deferred.Get(1, 4), CellValue(1.0));
+    EXPECT_EQ(deferred.GetCellCount(), store.GetCellCount() + 1);
+}
+
+// Test case: Sheets and their column chunks load concurrently on a thread pool, strings included
+TEST(WorkbookFormatTest, SheetsLoadConcurrently) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    std::vector<CellStore> sheets(3);
+    for (size_t i = 0; i < sheets.size(); ++i) {
+        BuildMixedSheet(sheets[i]);
+        for (int row = 1; row <= 40000; ++row) {
+            sheets[i].Set(CellReference(row, 4), CellValue("label " + std::to_string(i * 40000 + row)));
+        }
+    }
+    WorkbookWriter writer;
+    WorkbookMetadata metadata;
+    metadata.name = "Book1";
+    metadata.sheetNames = {"Sheet1", "Sheet2", "Sheet3"};
+    writer.WriteMetadata(metadata);
+    for (const auto& sheet : sheets) {
+        writer.WriteSheet(sheet);
+    }
+    auto file = std::make_shared<std::vector<uint8_t>>(writer.Finish());
+
+    StringPool loadPool;
+    StringPoolScope loadScope(loadPool);
+    ThreadPool threads(4);
+    WorkbookReader reader(file->data(), file->size());
+    auto strings = reader.AttachStringTable(file, loadPool);
+    std::vector<CellStore> loaded(sheets.size());
+    std::vector<CellStore*> stores;
+    for (size_t i = 0; i < loaded.size(); ++i) {
+        if (i == 0) {
+            reader.AttachSheet(i, file, strings, loaded[i]);
+        } else {
+            reader.DeferSheet(i, file, strings, loaded[i]);
+        }
+        stores.push_back(&loaded[i]);
+    }
+    strings->Decode(threads);
+    CellStore::LoadDeferredChunks(stores, &threads, true);
+
+    // Detached, the stores no longer read from the file
+    file.reset();
+    for (size_t i = 0; i < sheets.size(); ++i) {
+        EXPECT_TRUE(loaded[i].IsSheetAttached());
+        EXPECT_EQ(loaded[i].GetCellCount(), sheets[i].GetCellCount());
+        EXPECT_EQ(CollectCells(loaded[i]), CollectCells(sheets[i]));
+    }
+}
+
+// Test case: A damaged chunk fails a concurrent load after every other chunk has loaded
+TEST(WorkbookFormatTest, ConcurrentLoadReportsDamagedChunk) {
+    CellStore store;
+    for (int row = 1; row <= 100; ++row) {
+        store.Set(CellReference(row, 1), CellValue(row * 0.5));
+        store.Set(CellReference(row, 2), CellValue(row * 1.5));
+    }
+    auto file = std::make_shared<std::vector<uint8_t>>(WriteSheet(store));
+    (*file)[file->size() - 100] ^= 0x01;
+
+    ThreadPool threads(2);
+    CellStore attached;
+    AttachSheet(file, file->data(), file->size(), attached);
+    EXPECT_THROW(CellStore::LoadDeferredChunks({&attached}, &threads, false), std::runtime_error);
+    EXPECT_EQ(attached.GetCellCount(), 200u);
+    EXPECT_EQ(attached.Get(100, 1), CellValue(50.0));
+    EXPECT_THROW(attached.Get(1, 2), std::runtime_error);
+}
+
+// Test case: A file whose section directory points outside it is rejected on open
+TEST(WorkbookFormatTest, DamagedDirectoryIsRejected) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    store.Set(CellReference(1, 1), CellValue(1.0));
+    std::vector<uint8_t> file = WriteSheet(store);
+    EXPECT_NO_THROW(WorkbookReader(file.data(), file.size()));
+
+    std::vector<uint8_t> truncated(file.begin(), file.end() - 64);
+    EXPECT_THROW(WorkbookReader(truncated.data(), truncated.size()), std::runtime_error);
+}
+
+} // namespace test
+} // namespace excel
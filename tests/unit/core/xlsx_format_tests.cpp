@@ -0,0 +1,210 @@
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <src/core/xlsx_format.h>
+#include <src/core/workbook_format.h>
+#include <src/core/formula_compiler.h>
+#include <src/core/cell_store.h>
+#include <src/core/cell_value.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace excel {
+namespace test {
+
+// Helper function to collect every populated cell of a store in visiting order
+std::vector<std::pair<CellReference, CellValue>> CollectXlsxCells(const CellStore& store) {
+    std::vector<std::pair<CellReference, CellValue>> cells;
+    store.ForEachInRange({1, 1, 1048576, 16384}, [&](int32_t row, int32_t column, const CellValue& value) {
+        cells.emplace_back(CellReference(row, column), value);
+    });
+    return cells;
+}
+
+// Helper function to write one sheet as an XLSX package in memory
+std::string WriteXlsxSheet(const CellStore& store, const FormulaTable* formulas = nullptr) {
+    std::ostringstream out;
+    XlsxWriter writer(out);
+    writer.WriteSheet("Sheet1", store, formulas);
+    writer.Finish();
+    return out.str();
+}
+
+// Helper function to build a package from parts, as another application might write it
+std::string WritePackage(const std::vector<std::pair<std::string, std::string>>& parts) {
+    std::ostringstream out;
+    ZipStreamWriter zip(out);
+    for (const auto& part : parts) {
+        zip.BeginEntry(part.first);
+        zip.Write(part.second.data(), part.second.size());
+    }
+    zip.Finish();
+    return out.str();
+}
+
+const uint8_t* Bytes(const std::string& file) {
+    return reinterpret_cast<const uint8_t*>(file.data());
+}
+
+// Test case: Every cell type survives a round trip, including text XML cannot carry as is
+TEST(XlsxFormatTest, CellsRoundTrip) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    for (int row = 1; row <= 3000; ++row) {
+        store.Set(CellReference(row, 1), CellValue(row * 0.1));
+    }
+    store.Set(CellReference(2, 2), CellValue(-0.0));
+    store.Set(CellReference(3, 2), CellValue(1e300));
+    store.Set(CellReference(4, 2), CellValue(123456789.0));
+    store.Set(CellReference(10, 3), CellValue("Fish & <chips> \"to go\""));
+    store.Set(CellReference(11, 3), CellValue(" padded\tand\nsplit "));
+    store.Set(CellReference(12, 3), CellValue(std::string("bell\x01 and _x0041_")));
+    store.Set(CellReference(13, 3), CellValue("Fish & <chips> \"to go\""));
+    store.Set(CellReference(14, 3), CellValue("\xC3\xA9t\xC3\xA9 \xF0\x9F\x93\x88"));
+    store.Set(CellReference(15, 3), CellValue(true));
+    store.Set(CellReference(16, 3), CellValue(CellErrorType::NotAvailable));
+    store.Set(CellReference(17, 3), CellValue(CellErrorType::DivisionByZero));
+    store.Set(CellReference(1048576, 16384), CellValue(false));
+
+    std::string file = WriteXlsxSheet(store);
+    ASSERT_TRUE(XlsxReader::IsXlsxFile(Bytes(file), file.size()));
+    XlsxReader reader(Bytes(file), file.size());
+    ASSERT_EQ(reader.GetSheetCount(), 1u);
+    EXPECT_EQ(reader.ReadMetadata().sheetNames, std::vector<std::string>{"Sheet1"});
+
+    CellStore loaded;
+    reader.ReadSheet(0, reader.ReadStringTable(), loaded);
+    EXPECT_EQ(loaded.GetCellCount(), store.GetCellCount());
+    EXPECT_EQ(CollectXlsxCells(loaded), CollectXlsxCells(store));
+    EXPECT_TRUE(std::signbit(loaded.Get(2, 2).GetNumeric()));
+}
+
+// Test case: Formulas are written as they read at each cell and read back with their cached results
+TEST(XlsxFormatTest, FormulasRoundTrip) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    FormulaTable formulas;
+    formulas.templates.push_back({"=A1*2+$A$1", CellReference(1, 2)});
+    formulas.templates.push_back({"=SUM(A:A)&\"<\"", CellReference(1, 3)});
+    for (int row = 1; row <= 3; ++row) {
+        store.Set(CellReference(row, 1), CellValue(static_cast<double>(row)));
+        store.Set(CellReference(row, 2), CellValue(row * 2.0 + 1.0));
+        formulas.cells.emplace_back(CellReference(row, 2), 0);
+    }
+    store.Set(CellReference(1, 3), CellValue("6<"));
+    formulas.cells.emplace_back(CellReference(1, 3), 1);
+
+    std::string file = WriteXlsxSheet(store, &formulas);
+    XlsxReader reader(Bytes(file), file.size());
+    CellStore loaded;
+    FormulaTable loadedFormulas;
+    reader.ReadSheet(0, reader.ReadStringTable(), loaded, &loadedFormulas);
+    EXPECT_EQ(CollectXlsxCells(loaded), CollectXlsxCells(store));
+
+    ASSERT_EQ(loadedFormulas.cells.size(), 4u);
+    std::vector<std::string> texts;
+    for (const auto& cell : loadedFormulas.cells) {
+        const FormulaTemplateSource& source = loadedFormulas.templates.at(cell.second);
+        EXPECT_EQ(source.context, cell.first);
+        texts.push_back(source.formula);
+    }
+    EXPECT_EQ(texts, (std::vector<std::string>{"=A1*2+$A$1", "=SUM(A:A)&\"<\"", "=A2*2+$A$1", "=A3*2+$A$1"}));
+}
+
+// Test case: Shared formulas, inline strings, rich text and implied cell positions are read
+TEST(XlsxFormatTest, ForeignPackageIsRead) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    std::string file = WritePackage({
+        {"_rels/.rels",
+         "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+         "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument\" "
+         "Target=\"/xl/workbook.xml\"/></Relationships>"},
+        {"xl/workbook.xml",
+         "<?xml version=\"1.0\"?><x:workbook xmlns:x=\"http://schemas.openxmlformats.org/spreadsheetml/2006/main\" "
+         "xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\">"
+         "<x:bookViews><x:workbookView activeTab=\"1\"/></x:bookViews><x:sheets>"
+         "<x:sheet name=\"Notes\" sheetId=\"1\" r:id=\"rId2\"/><x:sheet name=\"Q1 &amp; Q2\" sheetId=\"2\" r:id=\"rId1\"/>"
+         "</x:sheets></x:workbook>"},
+        {"xl/_rels/workbook.xml.rels",
+         "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+         "<Relationship Id=\"rId1\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/worksheet\" "
+         "Target=\"worksheets/data.xml\"/>"
+         "<Relationship Id=\"rId2\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/worksheet\" "
+         "Target=\"./worksheets/../worksheets/notes.xml\"/>"
+         "<Relationship Id=\"rId3\" Type=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships/sharedStrings\" "
+         "Target=\"sharedStrings.xml\"/></Relationships>"},
+        {"xl/sharedStrings.xml",
+         "<sst xmlns=\"http://schemas.openxmlformats.org/spreadsheetml/2006/main\">"
+         "<si><r><t>Re</t></r><r><rPr><b/></rPr><t xml:space=\"preserve\">gion </t></r><rPh><t>x</t></rPh></si>"
+         "<si><t>&#x41;&#66;&lt;</t></si></sst>"},
+        {"xl/worksheets/notes.xml", "<worksheet><sheetData/></worksheet>"},
+        {"xl/worksheets/data.xml",
+         "<worksheet xmlns=\"http://schemas.openxmlformats.org/spreadsheetml/2006/main\"><!-- exported --><sheetData>"
+         "<row r=\"1\"><c r=\"A1\" t=\"s\"><v>0</v></c><c t=\"s\"><v>1</v></c>"
+         "<c t=\"inlineStr\"><is><t><![CDATA[a<b]]></t></is></c></row>"
+         "<row><c><v> 1.5 </v></c><c r=\"B2\"><f t=\"shared\" ref=\"B2:B4\" si=\"0\">A2*2</f><v>3</v></c></row>"
+         "<row r=\"3\"><c r=\"A3\"><v>2</v></c><c r=\"B3\"><f t=\"shared\" si=\"0\"/><v>4</v></c></row>"
+         "<row r=\"4\"><c r=\"B4\"><f t=\"shared\" si=\"0\"/></c><c r=\"C4\" t=\"e\"><f>1/0</f><v>#DIV/0!</v></c></row>"
+         "</sheetData></worksheet>"},
+    });
+
+    XlsxReader reader(Bytes(file), file.size());
+    WorkbookMetadata metadata = reader.ReadMetadata();
+    EXPECT_EQ(metadata.sheetNames, (std::vector<std::string>{"Notes", "Q1 & Q2"}));
+    EXPECT_EQ(metadata.activeSheet, 1u);
+
+    std::vector<CellValue> strings = reader.ReadStringTable();
+    CellStore notes;
+    reader.ReadSheet(0, strings, notes);
+    EXPECT_EQ(notes.GetCellCount(), 0u);
+
+    CellStore store;
+    FormulaTable formulas;
+    reader.ReadSheet(1, strings, store, &formulas);
+    EXPECT_EQ(store.Get(1, 1).GetString(), "Region ");
+    EXPECT_EQ(store.Get(1, 2).GetString(), "AB<");
+    EXPECT_EQ(store.Get(1, 3).GetString(), "a<b");
+    EXPECT_EQ(store.Get(2, 1).GetNumeric(), 1.5);
+    EXPECT_EQ(store.Get(3, 2).GetNumeric(), 4.0);
+    EXPECT_TRUE(store.Get(4, 2).IsEmpty());
+    EXPECT_EQ(store.Get(4, 3).GetError(), CellErrorType::DivisionByZero);
+
+    // One template for the shared formula, used by all three of its cells
+    ASSERT_EQ(formulas.templates.size(), 2u);
+    EXPECT_EQ(formulas.templates[0].formula, "=A2*2");
+    EXPECT_EQ(formulas.templates[0].context, CellReference(2, 2));
+    EXPECT_EQ(formulas.templates[1].formula, "=1/0");
+    ASSERT_EQ(formulas.cells.size(), 4u);
+    EXPECT_EQ(formulas.cells[2], std::make_pair(CellReference(4, 2), 0u));
+    EXPECT_EQ(TranslateFormula(formulas.templates[0].formula, formulas.templates[0].context, CellReference(4, 2)), "=A4*2");
+}
+
+// Test case: Damaged packages are rejected instead of yielding wrong cells
+TEST(XlsxFormatTest, CorruptionIsDetected) {
+    StringPool pool;
+    StringPoolScope scope(pool);
+    CellStore store;
+    for (int row = 1; row <= 500; ++row) {
+        store.Set(CellReference(row, 1), CellValue(static_cast<double>(row)));
+    }
+    std::string file = WriteXlsxSheet(store);
+
+    // A flipped bit in the sheet's compressed data fails its checksum or inflation
+    std::string damaged = file;
+    damaged[damaged.find("xl/worksheets/sheet1.xml") + 40] ^= 0x10;
+    XlsxReader reader(Bytes(damaged), damaged.size());
+    CellStore loaded;
+    EXPECT_THROW(reader.ReadSheet(0, reader.ReadStringTable(), loaded), std::runtime_error);
+
+    // A truncated file has no central directory
+    EXPECT_THROW(XlsxReader(Bytes(file), file.size() - 30), std::runtime_error);
+    std::string notZip = "PK\x03\x04 but nothing else";
+    EXPECT_THROW(XlsxReader(Bytes(notZip), notZip.size()), std::runtime_error);
+}
+
+} // namespace test
+} // namespace excel